@@ -37,12 +37,86 @@
 
 int btree_create(struct btree *bt);
 int btree_read_metadata(struct btree *bt);
-struct btree_node *btree_create_node(void);
+int btree_read_freelists(struct btree *bt);
+int btree_walk_freelists(struct btree *bt);
+int btree_read_fldir(struct btree *bt);
+int btree_write_fldir(struct btree *bt);
+int btree_drop_fldir(struct btree *bt);
+int btree_create_classes(struct btree *bt);
+int btree_read_class_table(struct btree *bt, uint64_t *first);
+int btree_write_class_table(struct btree *bt);
+int btree_clear_class_table(struct btree *bt, uint64_t table);
+uint32_t btree_chunk_size(struct btree *bt, uint32_t size);
+int btree_freelist_index(uint32_t realsize);
+struct btree_node *btree_create_node(uint32_t maxkeys, uint32_t inlinelen,
+                                     uint32_t keylen);
+struct btree_node *btree_new_node(struct btree *bt);
+void btree_copy_node(struct btree_node *dst, struct btree_node *src);
 void btree_free_node(struct btree_node *n);
 int btree_write_node(struct btree *bt, struct btree_node *n, uint64_t offset);
+int btree_decode_node(struct btree *bt, struct btree_node *n,
+                      unsigned char *buf);
+int btree_fetch_node(struct btree *bt, struct btree_node *n, uint64_t offset);
+void btree_grower_adopt(struct btree *bt, int wait);
+void btree_grower_stop(struct btree *bt);
 int btree_freelist_index_by_exp(int exponent);
-int btree_split_child(struct btree *bt, uint64_t pointedby, uint64_t parentoff,
-                      int i, uint64_t childoff, uint64_t *newparent);
+uint32_t btree_alloc_realsize(uint32_t size);
+int btree_txn_is_fresh(struct btree *bt, uint64_t ptr);
+int btree_txn_add_fresh(struct btree *bt, uint64_t ptr);
+int btree_txn_defer_free(struct btree *bt, uint64_t ptr);
+int btree_write_free_space(struct btree *bt);
+int btree_txn_implicit(struct btree *bt);
+int btree_compact_track(struct btree_compact *c, unsigned char *key);
+int btree_snapshot_defer_free(struct btree *bt, uint64_t ptr);
+int btree_snapshot_reclaim(struct btree *bt);
+void btree_publish_root(struct btree *bt);
+uint64_t btree_read_root(struct btree *bt);
+uint64_t btree_reader_enter(struct btree *bt);
+void btree_reader_exit(struct btree *bt, uint64_t epoch);
+void btree_reader_advance(struct btree *bt);
+unsigned char *btree_thread_buf(uint32_t size);
+int btree_find_root(struct btree *bt, uint64_t nptr, unsigned char *key,
+                    uint64_t *voff);
+int btree_get_root(struct btree *bt, uint64_t nptr, unsigned char *key,
+                   unsigned char **val, uint32_t *vlen);
+struct btree_cache *btree_cache_create(uint32_t size, uint32_t numshards,
+                                       int locking);
+void btree_cache_release(struct btree_cache *c);
+void btree_cache_del(struct btree_cache *c, uint64_t offset);
+void btree_cache_clear(struct btree_cache *c);
+struct btree_vcache *btree_vcache_create(uint64_t size, uint32_t numshards,
+                                         int locking, uint32_t keylen);
+void btree_vcache_release(struct btree_vcache *v);
+void btree_vcache_clear(struct btree_vcache *v);
+void btree_vcache_commit(struct btree *bt);
+int btree_reopen(struct btree *bt);
+void btree_offset_set_clear(struct btree_offset_set *set);
+struct btree_reader_slot *btree_stats_slot(struct btree *bt);
+uint64_t btree_bloom_hash(const unsigned char *key, uint32_t len);
+void btree_bloom_release(struct btree_bloom *f);
+void btree_bloom_add(struct btree *bt, const unsigned char *key);
+int btree_bloom_may_contain(struct btree *bt, const unsigned char *key);
+int btree_bloom_rebuild(struct btree *bt, uint64_t keys);
+void btree_bloom_fit(struct btree *bt);
+int btree_write_bloom(struct btree *bt);
+int btree_drop_bloom(struct btree *bt);
+int btree_load_bloom(struct btree *bt);
+
+/* Debugging output of the allocator and of the btree internals, written on
+ * standard error. Compile with -DBTREE_TRACE=1 to enable it, or with 2 to
+ * also trace every write to the freelist blocks. By default every trace
+ * statement compiles to nothing. */
+#ifndef BTREE_TRACE
+#define BTREE_TRACE 0
+#endif
+#define btree_trace(level,...) do { \
+    if ((level) <= BTREE_TRACE) fprintf(stderr,__VA_ARGS__); \
+} while(0)
+
+/* Add 'val' to the read counter 'field' of the calling thread, see
+ * btree_get_stats(). */
+#define btree_stat_read(bt,field,val) \
+    __atomic_add_fetch(&btree_stats_slot(bt)->field,(val),__ATOMIC_RELAXED)
 
 /* ------------------------ UNIX standard VFS Layer ------------------------- */
 #include <fcntl.h>
@@ -89,6 +163,23 @@ int bvfs_unistd_resize(void *handle, uint64_t length) {
     return ftruncate(*fd,length);
 }
 
+/* Reserve the blocks of the new space with posix_fallocate(), that also
+ * enlarges the file. Where it is not available, or not supported by the
+ * file system, the file is just truncated to the new length. */
+int bvfs_unistd_allocate(void *handle, uint64_t offset, uint64_t len) {
+    int *fd = handle;
+#if defined(__linux__) || defined(__FreeBSD__)
+    int err = posix_fallocate(*fd,offset,len);
+
+    if (err == 0) return 0;
+    if (err != EINVAL && err != EOPNOTSUPP) {
+        errno = err;
+        return -1;
+    }
+#endif
+    return ftruncate(*fd,offset+len);
+}
+
 int bvfs_unistd_getsize(void *handle, uint64_t *size) {
     int *fd = handle;
     struct stat sb;
@@ -104,6 +195,18 @@ void bvfs_unistd_sync(void *handle) {
     fsync(*fd);
 }
 
+void bvfs_unistd_prefetch(void *handle, uint64_t offset, uint64_t len) {
+#ifdef POSIX_FADV_WILLNEED
+    int *fd = handle;
+
+    posix_fadvise(*fd,offset,len,POSIX_FADV_WILLNEED);
+#else
+    (void) handle;
+    (void) offset;
+    (void) len;
+#endif
+}
+
 struct btree_vfs bvfs_unistd = {
     bvfs_unistd_open,
     bvfs_unistd_close,
@@ -111,7 +214,521 @@ struct btree_vfs bvfs_unistd = {
     bvfs_unistd_pwrite,
     bvfs_unistd_resize,
     bvfs_unistd_getsize,
-    bvfs_unistd_sync
+    bvfs_unistd_sync,
+    NULL,
+    bvfs_unistd_prefetch,
+    NULL,
+    NULL,
+    bvfs_unistd_allocate
+};
+
+/* ------------------------- Memory mapped VFS Layer ------------------------ */
+#include <sys/mman.h>
+
+/* The whole file is mapped in memory with a shared mapping, so reads and
+ * writes are just memory copies, and nodes and values can be accessed in
+ * place using the mapptr() method.
+ *
+ * The mapping is created larger than the file, and remapped doubling its
+ * size only when the file grows over the mapped length, so most resizes
+ * don't need a remap. Accesses over the end of file are never performed
+ * inside the mapping. Every time the mapping can't be created we fall back
+ * to pread() and pwrite(). */
+#define BVFS_MMAP_MIN_LEN (1024*1024*16)
+
+struct bvfs_mmap_handle {
+    int fd;
+    unsigned char *map;     /* Mapping of the file, NULL if not mapped */
+    uint64_t maplen;        /* Length of the mapping */
+    uint64_t size;          /* Current size of the file */
+    int resized;            /* File size changed since last sync */
+};
+
+/* Make sure the mapping covers the whole file. Returns 0 on success,
+ * -1 if the file can't be mapped. */
+int bvfs_mmap_remap(struct bvfs_mmap_handle *h) {
+    uint64_t len = BVFS_MMAP_MIN_LEN;
+    void *map;
+
+    if (h->map && h->size <= h->maplen) return 0;
+    if (h->size == 0) return 0;
+    while (len < h->size) len *= 2;
+    if (h->map) munmap(h->map,h->maplen);
+    h->map = NULL;
+    h->maplen = 0;
+    map = mmap(NULL,len,PROT_READ|PROT_WRITE,MAP_SHARED,h->fd,0);
+    if (map == MAP_FAILED) return -1;
+    h->map = map;
+    h->maplen = len;
+    return 0;
+}
+
+void *bvfs_mmap_open(char* path, int flags) {
+    struct bvfs_mmap_handle *h;
+    struct stat sb;
+    int fd;
+
+    fd = open(path,((flags & BTREE_CREAT) ? O_CREAT : 0)|O_RDWR,0644);
+    if (fd == -1) return NULL;
+    if (fstat(fd,&sb) == -1 || (h = malloc(sizeof(*h))) == NULL) {
+        close(fd);
+        return NULL;
+    }
+    h->fd = fd;
+    h->map = NULL;
+    h->maplen = 0;
+    h->size = sb.st_size;
+    h->resized = 0;
+    bvfs_mmap_remap(h);
+    return h;
+}
+
+void bvfs_mmap_close(void *handle) {
+    struct bvfs_mmap_handle *h = handle;
+
+    if (h->map) munmap(h->map,h->maplen);
+    close(h->fd);
+    free(h);
+}
+
+void *bvfs_mmap_mapptr(void *handle, uint64_t offset, uint32_t nbytes) {
+    struct bvfs_mmap_handle *h = handle;
+
+    if (h->map == NULL || offset > h->size || nbytes > h->size-offset)
+        return NULL;
+    return h->map+offset;
+}
+
+ssize_t bvfs_mmap_pread(void *handle, void *buf, uint32_t nbytes,
+                        uint64_t offset)
+{
+    struct bvfs_mmap_handle *h = handle;
+    void *p = bvfs_mmap_mapptr(handle,offset,nbytes);
+
+    if (p == NULL) return pread(h->fd,buf,nbytes,offset);
+    memcpy(buf,p,nbytes);
+    return nbytes;
+}
+
+ssize_t bvfs_mmap_pwrite(void *handle, const void *buf, uint32_t nbytes,
+                         uint64_t offset)
+{
+    struct bvfs_mmap_handle *h = handle;
+    void *p = bvfs_mmap_mapptr(handle,offset,nbytes);
+
+    if (p == NULL) return pwrite(h->fd,buf,nbytes,offset);
+    memcpy(p,buf,nbytes);
+    return nbytes;
+}
+
+int bvfs_mmap_resize(void *handle, uint64_t length) {
+    struct bvfs_mmap_handle *h = handle;
+
+    if (ftruncate(h->fd,length) == -1) return -1;
+    h->size = length;
+    h->resized = 1;
+    /* If we can't remap there is no need to fail, we'll just use the
+     * slower pread()/pwrite() path for the part not mapped. */
+    bvfs_mmap_remap(h);
+    return 0;
+}
+
+int bvfs_mmap_allocate(void *handle, uint64_t offset, uint64_t len) {
+    struct bvfs_mmap_handle *h = handle;
+
+    if (bvfs_unistd_allocate(&h->fd,offset,len) == -1) return -1;
+    h->size = offset+len;
+    h->resized = 1;
+    bvfs_mmap_remap(h);
+    return 0;
+}
+
+int bvfs_mmap_getsize(void *handle, uint64_t *size) {
+    struct bvfs_mmap_handle *h = handle;
+
+    *size = h->size;
+    return 0;
+}
+
+void bvfs_mmap_sync(void *handle) {
+    struct bvfs_mmap_handle *h = handle;
+
+    if (h->map) msync(h->map,h->size,MS_SYNC);
+    /* msync() does not flush the file metadata, so when the file was
+     * resized we need a real fsync(). */
+    if (h->resized || h->map == NULL) {
+        fsync(h->fd);
+        h->resized = 0;
+    }
+}
+
+void bvfs_mmap_prefetch(void *handle, uint64_t offset, uint64_t len) {
+    struct bvfs_mmap_handle *h = handle;
+    uint64_t pagesize = sysconf(_SC_PAGESIZE);
+    uint64_t start = offset & ~(pagesize-1);
+
+    if (h->map == NULL || offset >= h->size) return;
+    if (len > h->size-offset) len = h->size-offset;
+    madvise(h->map+start,len+(offset-start),MADV_WILLNEED);
+}
+
+struct btree_vfs bvfs_mmap = {
+    bvfs_mmap_open,
+    bvfs_mmap_close,
+    bvfs_mmap_pread,
+    bvfs_mmap_pwrite,
+    bvfs_mmap_resize,
+    bvfs_mmap_getsize,
+    bvfs_mmap_sync,
+    bvfs_mmap_mapptr,
+    bvfs_mmap_prefetch,
+    NULL,
+    NULL,
+    bvfs_mmap_allocate
+};
+
+/* ---------------------------- io_uring VFS Layer -------------------------- */
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+#if defined(__linux__) && defined(__NR_io_uring_setup)
+#include <linux/io_uring.h>
+#define BVFS_HAVE_URING
+#endif
+
+/* Like the UNIX standard VFS, but batches of reads are submitted to the
+ * kernel at once using io_uring, so that all the reads are in flight at
+ * the same time, keeping the device queue deep. We talk to the kernel
+ * directly with the io_uring system calls, so no library is required.
+ *
+ * There is a single ring per handle, used by one batch at a time. If
+ * io_uring is not available (old kernels, or kernels where it is disabled)
+ * the batch is performed with pread() calls, one after the other. */
+#define BVFS_URING_ENTRIES 256
+
+struct bvfs_uring_handle {
+    int fd;
+    int ringfd;             /* -1 if io_uring is not available */
+    pthread_mutex_t lock;   /* Serializes the batches */
+#ifdef BVFS_HAVE_URING
+    void *sqmap, *cqmap;    /* Mappings of the rings, may be the same */
+    size_t sqmaplen, cqmaplen;
+    struct io_uring_sqe *sqes;
+    unsigned *sqtail, *sqmask, *sqarray;
+    unsigned *cqhead, *cqtail, *cqmask;
+    struct io_uring_cqe *cqes;
+    unsigned entries;       /* Submission queue entries */
+#endif
+};
+
+#ifdef BVFS_HAVE_URING
+/* Create the ring. Returns 0 on success, -1 if io_uring can't be used. */
+int bvfs_uring_setup(struct bvfs_uring_handle *h) {
+    struct io_uring_params p;
+    unsigned char *sq, *cq;
+    int fd;
+
+    memset(&p,0,sizeof(p));
+    fd = syscall(__NR_io_uring_setup,BVFS_URING_ENTRIES,&p);
+    if (fd == -1) return -1;
+    h->sqmaplen = p.sq_off.array+p.sq_entries*sizeof(unsigned);
+    h->cqmaplen = p.cq_off.cqes+p.cq_entries*sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (h->cqmaplen > h->sqmaplen) h->sqmaplen = h->cqmaplen;
+        h->cqmaplen = h->sqmaplen;
+    }
+    h->sqmap = mmap(NULL,h->sqmaplen,PROT_READ|PROT_WRITE,
+                    MAP_SHARED|MAP_POPULATE,fd,IORING_OFF_SQ_RING);
+    if (h->sqmap == MAP_FAILED) goto err;
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        h->cqmap = h->sqmap;
+    } else {
+        h->cqmap = mmap(NULL,h->cqmaplen,PROT_READ|PROT_WRITE,
+                        MAP_SHARED|MAP_POPULATE,fd,IORING_OFF_CQ_RING);
+        if (h->cqmap == MAP_FAILED) goto err_sq;
+    }
+    h->sqes = mmap(NULL,p.sq_entries*sizeof(struct io_uring_sqe),
+                   PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,fd,
+                   IORING_OFF_SQES);
+    if (h->sqes == MAP_FAILED) goto err_cq;
+
+    sq = h->sqmap;
+    cq = h->cqmap;
+    h->sqtail = (unsigned*)(sq+p.sq_off.tail);
+    h->sqmask = (unsigned*)(sq+p.sq_off.ring_mask);
+    h->sqarray = (unsigned*)(sq+p.sq_off.array);
+    h->cqhead = (unsigned*)(cq+p.cq_off.head);
+    h->cqtail = (unsigned*)(cq+p.cq_off.tail);
+    h->cqmask = (unsigned*)(cq+p.cq_off.ring_mask);
+    h->cqes = (struct io_uring_cqe*)(cq+p.cq_off.cqes);
+    h->entries = p.sq_entries;
+    h->ringfd = fd;
+    return 0;
+
+err_cq:
+    if (h->cqmap != h->sqmap) munmap(h->cqmap,h->cqmaplen);
+err_sq:
+    munmap(h->sqmap,h->sqmaplen);
+err:
+    close(fd);
+    return -1;
+}
+
+/* Submit up to h->entries reads, or writes if 'opcode' is IORING_OP_WRITE,
+ * and wait for all of them. Writes use the same structure of reads, with
+ * 'nread' set to the bytes written. Operations that the ring could not
+ * perform, for instance because the kernel does not support them, fail
+ * with EINVAL, so that the caller can retry them with pread() / pwrite(). */
+void bvfs_uring_submit(struct bvfs_uring_handle *h, int opcode,
+                       struct btree_vfs_read *reads, int count)
+{
+    unsigned tail = *h->sqtail, head;
+    int j, done = 0, submit = count;
+
+    for (j = 0; j < count; j++) {
+        unsigned idx = (tail+j) & *h->sqmask;
+        struct io_uring_sqe *sqe = &h->sqes[idx];
+
+        memset(sqe,0,sizeof(*sqe));
+        sqe->opcode = opcode;
+        sqe->fd = h->fd;
+        sqe->off = reads[j].offset;
+        sqe->addr = (uint64_t)(uintptr_t)reads[j].buf;
+        sqe->len = reads[j].nbytes;
+        sqe->user_data = j;
+        h->sqarray[idx] = idx;
+    }
+    /* The kernel must see the entries before the new tail. */
+    __atomic_store_n(h->sqtail,tail+count,__ATOMIC_RELEASE);
+
+    while (done < count) {
+        unsigned cqtail;
+        long ret;
+
+        ret = syscall(__NR_io_uring_enter,h->ringfd,submit,count-done,
+                      IORING_ENTER_GETEVENTS,NULL,0);
+        if (ret == -1) {
+            /* If nothing was submitted we can just take the entries back,
+             * otherwise the kernel owns our buffers: we must wait. */
+            if (errno != EINTR && submit == count) {
+                __atomic_store_n(h->sqtail,tail,__ATOMIC_RELEASE);
+                return;
+            }
+            continue;
+        }
+        submit -= submit < ret ? submit : ret;
+        head = *h->cqhead;
+        cqtail = __atomic_load_n(h->cqtail,__ATOMIC_ACQUIRE);
+        while (head != cqtail) {
+            struct io_uring_cqe *cqe = &h->cqes[head & *h->cqmask];
+            struct btree_vfs_read *r = &reads[cqe->user_data];
+
+            if (cqe->res < 0) {
+                r->nread = -1;
+                r->error = -cqe->res;
+            } else {
+                r->nread = cqe->res;
+            }
+            head++;
+            done++;
+        }
+        __atomic_store_n(h->cqhead,head,__ATOMIC_RELEASE);
+    }
+}
+#endif
+
+void *bvfs_uring_open(char* path, int flags) {
+    struct bvfs_uring_handle *h;
+    int fd;
+
+    fd = open(path,((flags & BTREE_CREAT) ? O_CREAT : 0)|O_RDWR,0644);
+    if (fd == -1) return NULL;
+    if ((h = malloc(sizeof(*h))) == NULL) {
+        close(fd);
+        return NULL;
+    }
+    h->fd = fd;
+    h->ringfd = -1;
+    pthread_mutex_init(&h->lock,NULL);
+#ifdef BVFS_HAVE_URING
+    bvfs_uring_setup(h);
+#endif
+    return h;
+}
+
+void bvfs_uring_close(void *handle) {
+    struct bvfs_uring_handle *h = handle;
+
+#ifdef BVFS_HAVE_URING
+    if (h->ringfd != -1) {
+        munmap(h->sqes,h->entries*sizeof(struct io_uring_sqe));
+        if (h->cqmap != h->sqmap) munmap(h->cqmap,h->cqmaplen);
+        munmap(h->sqmap,h->sqmaplen);
+        close(h->ringfd);
+    }
+#endif
+    pthread_mutex_destroy(&h->lock);
+    close(h->fd);
+    free(h);
+}
+
+ssize_t bvfs_uring_pread(void *handle, void *buf, uint32_t nbytes,
+                         uint64_t offset)
+{
+    struct bvfs_uring_handle *h = handle;
+
+    return pread(h->fd,buf,nbytes,offset);
+}
+
+ssize_t bvfs_uring_pwrite(void *handle, const void *buf, uint32_t nbytes,
+                          uint64_t offset)
+{
+    struct bvfs_uring_handle *h = handle;
+
+    return pwrite(h->fd,buf,nbytes,offset);
+}
+
+int bvfs_uring_resize(void *handle, uint64_t length) {
+    struct bvfs_uring_handle *h = handle;
+
+    return bvfs_unistd_resize(&h->fd,length);
+}
+
+int bvfs_uring_allocate(void *handle, uint64_t offset, uint64_t len) {
+    struct bvfs_uring_handle *h = handle;
+
+    return bvfs_unistd_allocate(&h->fd,offset,len);
+}
+
+int bvfs_uring_getsize(void *handle, uint64_t *size) {
+    struct bvfs_uring_handle *h = handle;
+
+    return bvfs_unistd_getsize(&h->fd,size);
+}
+
+void bvfs_uring_sync(void *handle) {
+    struct bvfs_uring_handle *h = handle;
+
+    bvfs_unistd_sync(&h->fd);
+}
+
+void bvfs_uring_prefetch(void *handle, uint64_t offset, uint64_t len) {
+    struct bvfs_uring_handle *h = handle;
+
+    bvfs_unistd_prefetch(&h->fd,offset,len);
+}
+
+void bvfs_uring_readv(void *handle, struct btree_vfs_read *reads, int count) {
+    struct bvfs_uring_handle *h = handle;
+    int j;
+
+    for (j = 0; j < count; j++) {
+        reads[j].nread = -1;
+        reads[j].error = EINVAL;
+    }
+#ifdef BVFS_HAVE_URING
+    if (h->ringfd != -1) {
+        pthread_mutex_lock(&h->lock);
+        for (j = 0; j < count; j += h->entries) {
+            int batch = count-j;
+
+            if (batch > (int)h->entries) batch = h->entries;
+            bvfs_uring_submit(h,IORING_OP_READ,reads+j,batch);
+        }
+        pthread_mutex_unlock(&h->lock);
+    }
+#endif
+    /* Retry what the ring could not do, and complete short reads. */
+    for (j = 0; j < count; j++) {
+        struct btree_vfs_read *r = &reads[j];
+        ssize_t nread;
+
+        if (r->nread == -1 && r->error != EINVAL) continue;
+        if (r->nread == -1) r->nread = 0;
+        while (r->nread < (ssize_t)r->nbytes) {
+            nread = pread(h->fd,(char*)r->buf+r->nread,r->nbytes-r->nread,
+                          r->offset+r->nread);
+            if (nread == -1) {
+                r->nread = -1;
+                r->error = errno;
+                break;
+            }
+            if (nread == 0) break; /* End of file */
+            r->nread += nread;
+        }
+    }
+}
+
+/* Perform a batch of writes submitting them at once, like reads. */
+void bvfs_uring_writev(void *handle, struct btree_vfs_write *writes,
+                       int count)
+{
+    struct bvfs_uring_handle *h = handle;
+    int j;
+
+    for (j = 0; j < count; j++) {
+        writes[j].nwritten = -1;
+        writes[j].error = EINVAL;
+    }
+#ifdef BVFS_HAVE_URING
+    if (h->ringfd != -1) {
+        struct btree_vfs_read ops[BVFS_URING_ENTRIES];
+
+        pthread_mutex_lock(&h->lock);
+        for (j = 0; j < count; j += h->entries) {
+            int batch = count-j, k;
+
+            if (batch > (int)h->entries) batch = h->entries;
+            if (batch > BVFS_URING_ENTRIES) batch = BVFS_URING_ENTRIES;
+            for (k = 0; k < batch; k++) {
+                ops[k].buf = (void*)writes[j+k].buf;
+                ops[k].nbytes = writes[j+k].nbytes;
+                ops[k].offset = writes[j+k].offset;
+                ops[k].nread = -1;
+                ops[k].error = EINVAL;
+            }
+            bvfs_uring_submit(h,IORING_OP_WRITE,ops,batch);
+            for (k = 0; k < batch; k++) {
+                writes[j+k].nwritten = ops[k].nread;
+                writes[j+k].error = ops[k].error;
+            }
+        }
+        pthread_mutex_unlock(&h->lock);
+    }
+#endif
+    /* Retry what the ring could not do, and complete short writes. */
+    for (j = 0; j < count; j++) {
+        struct btree_vfs_write *w = &writes[j];
+        ssize_t nwritten;
+
+        if (w->nwritten == -1 && w->error != EINVAL) continue;
+        if (w->nwritten == -1) w->nwritten = 0;
+        while (w->nwritten < (ssize_t)w->nbytes) {
+            nwritten = pwrite(h->fd,(const char*)w->buf+w->nwritten,
+                              w->nbytes-w->nwritten,w->offset+w->nwritten);
+            if (nwritten == -1) {
+                w->nwritten = -1;
+                w->error = errno;
+                break;
+            }
+            w->nwritten += nwritten;
+        }
+    }
+}
+
+struct btree_vfs bvfs_uring = {
+    bvfs_uring_open,
+    bvfs_uring_close,
+    bvfs_uring_pread,
+    bvfs_uring_pwrite,
+    bvfs_uring_resize,
+    bvfs_uring_getsize,
+    bvfs_uring_sync,
+    NULL,
+    bvfs_uring_prefetch,
+    bvfs_uring_readv,
+    bvfs_uring_writev,
+    bvfs_uring_allocate
 };
 
 /* ------------------------- From/To Big endian ----------------------------- */
@@ -158,20 +775,365 @@ uint64_t btree_u64_from_big(unsigned char *buf) {
     return val;
 }
 
+/* ------------------------ From/To Little endian --------------------------- */
+
+/* Version 2 nodes are little endian: on little endian hosts the conversions
+ * are plain copies, and nodes can be used in place, see btree_view_node(). */
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define BTREE_LITTLE_ENDIAN 1
+#else
+#define BTREE_LITTLE_ENDIAN 0
+#endif
+
+void btree_u32_to_little(unsigned char *buf, uint32_t val) {
+#if BTREE_LITTLE_ENDIAN
+    memcpy(buf,&val,sizeof(val));
+#else
+    buf[0] = val & 0xff;
+    buf[1] = (val >> 8) & 0xff;
+    buf[2] = (val >> 16) & 0xff;
+    buf[3] = (val >> 24) & 0xff;
+#endif
+}
+
+uint32_t btree_u32_from_little(const unsigned char *buf) {
+    uint32_t val;
+
+#if BTREE_LITTLE_ENDIAN
+    memcpy(&val,buf,sizeof(val));
+#else
+    val = buf[0] | (buf[1] << 8) | (buf[2] << 16) | ((uint32_t)buf[3] << 24);
+#endif
+    return val;
+}
+
+/* Convert an array of 'count' integers. On big endian hosts the loops are
+ * simple enough for the compiler to turn them into byte swaps. */
+void btree_u64s_to_little(unsigned char *buf, const uint64_t *vals,
+                          uint32_t count)
+{
+#if BTREE_LITTLE_ENDIAN
+    memcpy(buf,vals,sizeof(uint64_t)*count);
+#else
+    uint32_t j, k;
+
+    for (j = 0; j < count; j++)
+        for (k = 0; k < 8; k++) buf[j*8+k] = (vals[j] >> (k*8)) & 0xff;
+#endif
+}
+
+void btree_u64s_from_little(uint64_t *vals, const unsigned char *buf,
+                            uint32_t count)
+{
+#if BTREE_LITTLE_ENDIAN
+    memcpy(vals,buf,sizeof(uint64_t)*count);
+#else
+    uint32_t j, k;
+
+    for (j = 0; j < count; j++) {
+        vals[j] = 0;
+        for (k = 0; k < 8; k++) vals[j] |= (uint64_t)buf[j*8+k] << (k*8);
+    }
+#endif
+}
+
 /* -------------------------- Utility functions ----------------------------- */
 
+/* Write 'nbytes' at 'offset' with the VFS, bypassing the write buffer. */
+ssize_t btree_vfs_pwrite(struct btree *bt, const void *buf, uint32_t nbytes,
+                         uint64_t offset)
+{
+    ssize_t nwritten = bt->vfs->pwrite(bt->vfs_handle,buf,nbytes,offset);
+
+    bt->stats.writes++;
+    if (nwritten > 0) bt->stats.bytes_written += nwritten;
+    return nwritten;
+}
+
+ssize_t btree_vfs_pread(struct btree *bt, void *buf, uint32_t nbytes,
+                        uint64_t offset)
+{
+    ssize_t nread = bt->vfs->pread(bt->vfs_handle,buf,nbytes,offset);
+
+    if (nread > 0) btree_stat_read(bt,bytes_read,nread);
+    return nread;
+}
+
+/* Perform all the writes of the write buffer, and empty it. Returns 0 on
+ * success, otherwise -1 with errno set accordingly: the buffer is emptied
+ * anyway, as the writes that failed may have been performed partially.
+ *
+ * The writes are performed in the order of the barriers deferred while they
+ * were buffered (see btree_sync()), so that a process killed in the middle
+ * of the flush never leaves in the file data that should follow a barrier
+ * without the data that should precede it. */
+int btree_wbuf_flush(struct btree *bt) {
+    struct btree_wbuf *wb = &bt->wbuf;
+    struct btree_vfs_write writes[BTREE_WBUF_RANGES];
+    uint32_t epochs[BTREE_WBUF_RANGES];
+    int count = wb->numranges, j, k, retval = 0;
+
+    if (count == 0) return 0;
+    for (j = 0; j < count; j++) {
+        struct btree_wbuf_range *r = &wb->ranges[j];
+
+        /* Insertion sort by epoch, the ranges of the same epoch stay in
+         * offset order. */
+        for (k = j; k > 0 && epochs[k-1] > r->epoch; k--) {
+            writes[k] = writes[k-1];
+            epochs[k] = epochs[k-1];
+        }
+        writes[k].buf = wb->buf+r->pos;
+        writes[k].nbytes = r->len;
+        writes[k].offset = r->offset;
+        epochs[k] = r->epoch;
+    }
+    if (bt->vfs->writev) {
+        /* The writes of a batch may be performed in any order, so every
+         * epoch is written with its own batch. */
+        for (j = 0; j < count; j = k) {
+            for (k = j+1; k < count && epochs[k] == epochs[j]; k++);
+            bt->vfs->writev(bt->vfs_handle,writes+j,k-j);
+        }
+        bt->stats.writes += count;
+        for (j = 0; j < count; j++)
+            if (writes[j].nwritten > 0)
+                bt->stats.bytes_written += writes[j].nwritten;
+    } else {
+        for (j = 0; j < count; j++) {
+            writes[j].nwritten = btree_vfs_pwrite(bt,writes[j].buf,
+                                    writes[j].nbytes,writes[j].offset);
+            writes[j].error = writes[j].nwritten == -1 ? errno : 0;
+        }
+    }
+    for (j = 0; j < count; j++) {
+        if (writes[j].nwritten == -1) {
+            errno = writes[j].error;
+            retval = -1;
+        }
+    }
+    wb->numranges = 0;
+    wb->used = 0;
+    wb->epoch = 0;
+    return retval;
+}
+
+/* Flush the write buffer remembering the error, if any, so that it is
+ * reported by the next write. Used where errors can't be returned. */
+void btree_wbuf_flush_or_defer(struct btree *bt) {
+    if (btree_wbuf_flush(bt) == -1 && bt->wbuf.error == 0)
+        bt->wbuf.error = errno;
+}
+
+/* Return the index of the first range of the write buffer that ends at
+ * 'offset' or after it. */
+uint32_t btree_wbuf_first(struct btree_wbuf *wb, uint64_t offset) {
+    uint32_t lo = 0, hi = wb->numranges;
+
+    while (lo < hi) {
+        uint32_t mid = (lo+hi)/2;
+        struct btree_wbuf_range *r = &wb->ranges[mid];
+
+        if (r->offset+r->len < offset) lo = mid+1; else hi = mid;
+    }
+    return lo;
+}
+
+/* Add a write to the write buffer, merging it with the ranges it overlaps
+ * or touches. If the buffer is full it is flushed first. Returns 'nbytes'
+ * on success, -1 on error. */
+ssize_t btree_wbuf_write(struct btree *bt, const void *buf, uint32_t nbytes,
+                         uint64_t offset)
+{
+    struct btree_wbuf *wb = &bt->wbuf;
+    struct btree_wbuf_range *r;
+    uint64_t start = offset, end = offset+nbytes;
+    uint32_t lo, hi, j;
+    unsigned char *p;
+
+    if (wb->buf == NULL && (wb->buf = malloc(BTREE_WBUF_SIZE)) == NULL)
+        return btree_vfs_pwrite(bt,buf,nbytes,offset);
+
+    /* Find the ranges from 'lo' to 'hi' (excluded) overlapping or touching
+     * the write. */
+    lo = btree_wbuf_first(wb,offset);
+    for (hi = lo; hi < wb->numranges && wb->ranges[hi].offset <= end; hi++);
+
+    /* Ranges of previous epochs just touching the write are not merged
+     * with it, as they must be written before it. The ones the write
+     * replaces entirely are merged, and written with the current epoch:
+     * data rewritten after a barrier is only needed in its last version.
+     * But a range of a previous epoch the write covers only in part has
+     * data that must reach the file before the barrier, so in this case
+     * the buffered writes are performed first. */
+    if (lo < hi && wb->ranges[lo].epoch != wb->epoch &&
+        wb->ranges[lo].offset+wb->ranges[lo].len == start) lo++;
+    if (lo < hi && wb->ranges[hi-1].epoch != wb->epoch &&
+        wb->ranges[hi-1].offset == end) hi--;
+    for (j = lo; j < hi; j++) {
+        r = &wb->ranges[j];
+        if (r->epoch != wb->epoch &&
+            (r->offset < start || r->offset+r->len > end))
+        {
+            if (btree_wbuf_flush(bt) == -1) return -1;
+            return btree_wbuf_write(bt,buf,nbytes,offset);
+        }
+    }
+
+    /* Overwriting data already in the buffer, that is common as the same
+     * node is often written many times inside a transaction. */
+    r = &wb->ranges[lo];
+    if (hi == lo+1 && r->offset <= offset && r->offset+r->len >= end) {
+        memcpy(wb->buf+r->pos+(offset-r->offset),buf,nbytes);
+        r->epoch = wb->epoch;
+        return nbytes;
+    }
+    if (lo < hi) {
+        if (wb->ranges[lo].offset < start) start = wb->ranges[lo].offset;
+        r = &wb->ranges[hi-1];
+        if (r->offset+r->len > end) end = r->offset+r->len;
+    }
+    if (end-start > BTREE_WBUF_SIZE) {
+        /* Too big to be buffered: the write must happen after the buffered
+         * writes it overlaps. */
+        if (btree_wbuf_flush(bt) == -1) return -1;
+        return btree_vfs_pwrite(bt,buf,nbytes,offset);
+    }
+    if (wb->used+(end-start) > BTREE_WBUF_SIZE ||
+        wb->numranges-(hi-lo)+1 > BTREE_WBUF_RANGES)
+    {
+        if (btree_wbuf_flush(bt) == -1) return -1;
+        return btree_wbuf_write(bt,buf,nbytes,offset);
+    }
+
+    /* Copy the merged ranges and then the new data in a new range. */
+    p = wb->buf+wb->used;
+    for (j = lo; j < hi; j++) {
+        r = &wb->ranges[j];
+        memcpy(p+(r->offset-start),wb->buf+r->pos,r->len);
+    }
+    memcpy(p+(offset-start),buf,nbytes);
+    if (hi != lo+1)
+        memmove(wb->ranges+lo+1,wb->ranges+hi,
+                sizeof(wb->ranges[0])*(wb->numranges-hi));
+    wb->numranges = wb->numranges-(hi-lo)+1;
+    r = &wb->ranges[lo];
+    r->offset = start;
+    r->len = end-start;
+    r->pos = wb->used;
+    r->epoch = wb->epoch;
+    wb->used += r->len;
+    return nbytes;
+}
+
+/* Copy over 'buf', holding the 'nbytes' bytes read at 'offset', the data
+ * of the write buffer in the same range. Returns 0, or 1 if the buffer has
+ * data past the 'nread' bytes actually read (that is, past the end of
+ * file) and the read should be retried after flushing the buffer. */
+int btree_wbuf_overlay(struct btree *bt, void *buf, uint32_t nbytes,
+                       uint64_t offset, ssize_t nread)
+{
+    struct btree_wbuf *wb = &bt->wbuf;
+    uint64_t end = offset+nbytes;
+    uint32_t j;
+
+    for (j = btree_wbuf_first(wb,offset); j < wb->numranges; j++) {
+        struct btree_wbuf_range *r = &wb->ranges[j];
+        uint64_t s, e;
+
+        if (r->offset >= end) break;
+        if (r->offset+r->len <= offset) continue;
+        s = r->offset > offset ? r->offset : offset;
+        e = r->offset+r->len < end ? r->offset+r->len : end;
+        if (e > offset+nread) return 1;
+        memcpy((unsigned char*)buf+(s-offset),wb->buf+r->pos+(s-r->offset),
+               e-s);
+    }
+    return 0;
+}
+
 /* We read and write too often to write bt->vfs->...(bt->vfs_handle...) all the
- * times, so we use this two help functions. */
+ * times, so we use this two help functions. Writes go to the write buffer
+ * when enabled, and reads see its data. */
 ssize_t btree_pwrite(struct btree *bt, const void *buf, uint32_t nbytes,
                      uint64_t offset)
 {
-    return bt->vfs->pwrite(bt->vfs_handle,buf,nbytes,offset);
+    if (bt->wbuf.error) {
+        /* Report the failure of a flush performed by btree_sync(). */
+        errno = bt->wbuf.error;
+        bt->wbuf.error = 0;
+        return -1;
+    }
+    if (bt->wbuf.enabled) return btree_wbuf_write(bt,buf,nbytes,offset);
+    return btree_vfs_pwrite(bt,buf,nbytes,offset);
 }
 
 ssize_t btree_pread(struct btree *bt, void *buf, uint32_t nbytes,
                     uint64_t offset)
 {
-    return bt->vfs->pread(bt->vfs_handle,buf,nbytes,offset);
+    struct btree_wbuf *wb = &bt->wbuf;
+    struct btree_wbuf_range *r;
+    ssize_t nread;
+    uint32_t j;
+
+    if (wb->numranges == 0) return btree_vfs_pread(bt,buf,nbytes,offset);
+
+    /* No need to read data that is all in the buffer. */
+    j = btree_wbuf_first(wb,offset);
+    r = &wb->ranges[j];
+    if (j < wb->numranges && r->offset <= offset &&
+        r->offset+r->len >= offset+nbytes)
+    {
+        memcpy(buf,wb->buf+r->pos+(offset-r->offset),nbytes);
+        return nbytes;
+    }
+    if ((nread = btree_vfs_pread(bt,buf,nbytes,offset)) == -1) return -1;
+    if (btree_wbuf_overlay(bt,buf,nbytes,offset,nread)) {
+        if (btree_wbuf_flush(bt) == -1) return -1;
+        return btree_vfs_pread(bt,buf,nbytes,offset);
+    }
+    return nread;
+}
+
+/* Perform a batch of reads, all at once if the VFS supports it. The result
+ * of every read is set in the btree_vfs_read structure. */
+void btree_pread_batch(struct btree *bt, struct btree_vfs_read *reads,
+                       int count)
+{
+    uint64_t nbytes = 0;
+    int j;
+
+    /* Batches are used to read many nodes, rarely just written: it is
+     * simpler to perform the buffered writes first. */
+    if (bt->wbuf.numranges) btree_wbuf_flush_or_defer(bt);
+    if (bt->vfs->readv) {
+        bt->vfs->readv(bt->vfs_handle,reads,count);
+        for (j = 0; j < count; j++)
+            if (reads[j].nread > 0) nbytes += reads[j].nread;
+        btree_stat_read(bt,bytes_read,nbytes);
+        return;
+    }
+    for (j = 0; j < count; j++) {
+        reads[j].nread = btree_pread(bt,reads[j].buf,reads[j].nbytes,
+                                     reads[j].offset);
+        reads[j].error = reads[j].nread == -1 ? errno : 0;
+    }
+}
+
+/* Return a pointer to 'nbytes' bytes at 'offset' that can be read in place
+ * without copying, if the VFS supports it (for instance bvfs_mmap), otherwise
+ * NULL is returned and the caller should use btree_pread().
+ *
+ * The pointer is only valid until the next operation modifying the btree,
+ * as the VFS may need to remap the file when it grows. */
+const void *btree_map(struct btree *bt, uint64_t offset, uint32_t nbytes) {
+    if (bt->vfs->mapptr == NULL) return NULL;
+    return bt->vfs->mapptr(bt->vfs_handle,offset,nbytes);
+}
+
+/* Hint the VFS that we are going to read the specified range soon. */
+void btree_prefetch(struct btree *bt, uint64_t offset, uint64_t len) {
+    if (bt->vfs->prefetch) bt->vfs->prefetch(bt->vfs_handle,offset,len);
 }
 
 /* We want to be able to write and read 32 and 64 integers easily and in a
@@ -200,15 +1162,80 @@ int btree_pread_u32(struct btree *bt, uint32_t *val, uint64_t offset) {
 
 int btree_pread_u64(struct btree *bt, uint64_t *val, uint64_t offset) {
     unsigned char buf[8];
+    const unsigned char *p;
 
+    if ((p = btree_map(bt,offset,sizeof(buf))) != NULL) {
+        *val = btree_u64_from_big((unsigned char*)p);
+        return 0;
+    }
     if (btree_pread(bt,buf,sizeof(buf),offset) == -1) return -1;
     *val = btree_u64_from_big(buf);
     return 0;
 }
 
+/* Flush the file to disk, unconditionally. */
+void btree_fsync(struct btree *bt) {
+    btree_wbuf_flush_or_defer(bt);
+    bt->vfs->sync(bt->vfs_handle);
+    bt->stats.fsyncs++;
+}
+
+/* Write barrier. Inside a transaction this is a no-op, as the transaction
+ * uses its own barriers on commit.
+ *
+ * When write barriers are disabled the buffered writes of btree_add(),
+ * btree_delete(), btree_alloc(), btree_free() and btree_flush() are not
+ * performed here, but kept until the operation returns, see
+ * btree_op_exit(). The barrier just starts a new epoch of the buffer: the
+ * writes that follow are performed after the ones that precede it. The
+ * other operations still perform the buffered writes at every barrier. */
 void btree_sync(struct btree *bt) {
+    if (bt->txn != BTREE_TXN_NONE) return;
     if (bt->flags & BTREE_FLAG_USE_WRITE_BARRIER)
-        bt->vfs->sync(bt->vfs_handle);
+        btree_fsync(bt);
+    else if (bt->wbuf.depth == 0)
+        btree_wbuf_flush_or_defer(bt);
+    else if (bt->wbuf.numranges)
+        bt->wbuf.epoch++;
+}
+
+/* Called when an operation modifying the btree starts. Operations may call
+ * others, like btree_add() calling btree_alloc(): only the outermost one
+ * performs the buffered writes when it returns. */
+void btree_op_enter(struct btree *bt) {
+    bt->wbuf.depth++;
+}
+
+/* Called when an operation started with btree_op_enter() returns 'retval'.
+ * Outside transactions the buffered writes are performed, so that once an
+ * operation returned its changes are in the file, and survive a crash of
+ * the process. Returns 'retval', or -1 if the writes failed. */
+int btree_op_exit(struct btree *bt, int retval) {
+    if (--bt->wbuf.depth || bt->txn != BTREE_TXN_NONE) return retval;
+    if (btree_wbuf_flush(bt) == -1) return -1;
+    if (bt->wbuf.error) {
+        errno = bt->wbuf.error;
+        bt->wbuf.error = 0;
+        return -1;
+    }
+    return retval;
+}
+
+/* 64 bit FNV-1a hash of 'len' bytes, used to checksum records on disk.
+ * btree_fnv64_update() continues the hash 'h' of the previous bytes, the
+ * hash of zero bytes being BTREE_FNV64_BASIS. */
+#define BTREE_FNV64_BASIS 0xcbf29ce484222325ULL
+
+uint64_t btree_fnv64_update(uint64_t h, const unsigned char *p, size_t len) {
+    while (len--) {
+        h ^= *p++;
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+uint64_t btree_fnv64(const unsigned char *p, size_t len) {
+    return btree_fnv64_update(BTREE_FNV64_BASIS,p,len);
 }
 
 /* ---------------------------- BTREE operations ---------------------------- */
@@ -221,29 +1248,267 @@ void btree_clear_flags(struct btree *bt, int flags) {
     bt->flags &= ~flags;
 }
 
-/* Open a btree. On error NULL is returned, and errno is set accordingly.
- * Flags modify the behavior of the call:
- *
- * BTREE_CREAT: create the btree if it does not exist. */
-struct btree *btree_open(struct btree_vfs *vfs, char *path, int flags) {
-    struct btree *bt = NULL;
-    struct timeval tv;
-    int j, mkroot = 0;
+/* Populate a configuration structure with the default options. */
+void btree_config_init(struct btree_config *cfg) {
+    cfg->cache_nodes = BTREE_CACHE_DEFAULT_NODES;
+    cfg->value_cache_size = 0;
+    cfg->node_size = BTREE_DEFAULT_NODE_SIZE;
+    cfg->inline_values = 0;
+    cfg->value_read_size = BTREE_VALUE_SPECULATIVE_READ;
+    cfg->size_classes = 0;
+    cfg->key_size = 0;
+    cfg->key_type = BTREE_KEY_BINARY;
+    cfg->version = BTREE_VERSION_2;
+    cfg->grow_background = 0;
+    cfg->bloom_bits = 0;
+}
 
-    /* Initialize a new btree structure */
-    if ((bt = malloc(sizeof(*bt))) == NULL) {
-        errno = ENOMEM;
-        return NULL;
+/* Fill 'cfg' with the configuration of 'bt', so that a btree created with
+ * it has the same nodes. */
+void btree_get_config(struct btree *bt, struct btree_config *cfg) {
+    btree_config_init(cfg);
+    cfg->value_read_size = bt->readsize;
+    /* Btrees with legacy nodes have no node size in the header. */
+    if (bt->maxkeys != BTREE_LEGACY_MAX_KEYS || bt->inlinelen ||
+        bt->prefixed)
+        cfg->node_size = btree_alloc_realsize(bt->nodesize);
+    else
+        cfg->node_size = 0;
+    cfg->inline_values = bt->inlinelen;
+    cfg->size_classes = bt->classes != 0;
+    cfg->key_size = bt->prefixed ? bt->keylen : 0;
+    cfg->key_type = bt->keytype;
+    cfg->version = bt->version;
+    cfg->grow_background = bt->grower.enabled;
+    cfg->bloom_bits = bt->bloombits;
+}
+
+/* Fill 'stats' with the counters of 'bt' since it was opened. While other
+ * threads are reading the read counters may miss their last reads. */
+void btree_get_stats(struct btree *bt, struct btree_stats *stats) {
+    struct btree_cache *c = bt->cache;
+    struct btree_vcache *v = bt->vcache;
+    uint32_t j;
+
+    *stats = bt->stats;
+    for (j = 0; j < BTREE_READER_SLOTS; j++) {
+        struct btree_reader_slot *rs = &bt->readers[j];
+
+        stats->node_reads += __atomic_load_n(&rs->node_reads,__ATOMIC_RELAXED);
+        stats->bytes_read += __atomic_load_n(&rs->bytes_read,__ATOMIC_RELAXED);
+        stats->bloom_negatives += __atomic_load_n(&rs->bloom_negatives,
+                                                  __ATOMIC_RELAXED);
     }
-    bt->vfs = vfs ? vfs : &bvfs_unistd;
-    bt->vfs_handle = NULL;
-    bt->flags = BTREE_FLAG_USE_WRITE_BARRIER;
-    for (j = 0; j < BTREE_FREELIST_COUNT; j++) {
+    for (j = 0; c && j < c->numshards; j++) {
+        struct btree_cache_shard *s = &c->shards[j];
+
+        if (c->locking) pthread_mutex_lock(&s->lock);
+        stats->cache_hits += s->hits;
+        stats->cache_misses += s->misses;
+        if (c->locking) pthread_mutex_unlock(&s->lock);
+    }
+    for (j = 0; v && j < v->numshards; j++) {
+        struct btree_vcache_shard *s = &v->shards[j];
+
+        if (v->locking) pthread_mutex_lock(&s->lock);
+        stats->value_cache_hits += s->hits;
+        stats->value_cache_misses += s->misses;
+        if (v->locking) pthread_mutex_unlock(&s->lock);
+    }
+}
+
+/* Set the max keys per node given the node size (zero for legacy btrees),
+ * the max size of inline values (zero if not used), and the key size (zero
+ * for BTREE_HASHED_KEY_LEN keys in nodes that are not prefix compressed).
+ * Every key has an inline area of 'inlinelen' bytes (rounded to a multiple
+ * of 8) plus its size header, so inline values reduce the number of keys
+ * per node. Returns 0 on success, or -1 if the parameters are not valid.
+ *
+ * Prefix compressed nodes take the whole allocation, and the max number of
+ * keys is only the capacity of the nodes in memory: one more than the keys
+ * fitting a node if they were all equal to the prefix, so that a node can
+ * be split after an insertion makes it too big for the disk. The key size
+ * must be small enough for BTREE_PNODE_MIN_KEYS keys to fit a node, that
+ * is needed for both the halves of a split node to fit. */
+int btree_set_node_size(struct btree *bt, uint32_t node_size,
+                        uint32_t inlinelen, uint32_t keylen)
+{
+    uint32_t maxkeys;
+
+    inlinelen = (inlinelen+7) & ~7;
+    bt->keylen = keylen ? keylen : BTREE_HASHED_KEY_LEN;
+    bt->prefixed = keylen != 0;
+    if (node_size == 0) {
+        if (inlinelen || keylen) return -1;
+        maxkeys = BTREE_LEGACY_MAX_KEYS;
+    } else if (keylen) {
+        uint32_t nodesize = node_size-sizeof(uint64_t);
+
+        if (node_size < BTREE_MIN_NODE_SIZE ||
+            node_size > BTREE_MAX_NODE_SIZE ||
+            (node_size & (node_size-1)) ||
+            inlinelen > BTREE_MAX_INLINE ||
+            keylen > BTREE_MAX_KEY_LEN ||
+            (keylen+BTREE_PNODE_KEY_SIZE(inlinelen))*BTREE_PNODE_MIN_KEYS >
+            nodesize) return -1;
+        bt->maxkeys = (nodesize-BTREE_PNODE_FIXED)/
+                      BTREE_PNODE_KEY_SIZE(inlinelen)+1;
+        bt->inlinelen = inlinelen;
+        bt->nodesize = nodesize;
+        return 0;
+    } else {
+        if (node_size < BTREE_MIN_NODE_SIZE ||
+            node_size > BTREE_MAX_NODE_SIZE ||
+            (node_size & (node_size-1)) ||
+            inlinelen > BTREE_MAX_INLINE) return -1;
+        maxkeys = (node_size-sizeof(uint64_t)-BTREE_NODE_SIZE(0)) /
+                  (BTREE_HASHED_KEY_LEN+16+(inlinelen ? inlinelen+8 : 0));
+        if ((maxkeys & 1) == 0) maxkeys--;
+        if (maxkeys < 3) return -1;
+    }
+    bt->maxkeys = maxkeys;
+    bt->inlinelen = inlinelen;
+    bt->nodesize = BTREE_NODE_SIZE(maxkeys);
+    if (inlinelen) bt->nodesize += (inlinelen+8)*maxkeys;
+    return 0;
+}
+
+/* Open a btree using the default configuration.
+ * See btree_open_with_config() for more information. */
+struct btree *btree_open(struct btree_vfs *vfs, char *path, int flags) {
+    return btree_open_with_config(vfs,path,flags,NULL);
+}
+
+/* Open a btree. On error NULL is returned, and errno is set accordingly.
+ * Flags modify the behavior of the call:
+ *
+ * BTREE_CREAT: create the btree if it does not exist.
+ * BTREE_MEMORY_FREELIST: take the freelists in memory. Allocations and
+ *                        frees don't perform any disk access, and the
+ *                        freelists are written on disk only by
+ *                        btree_checkpoint() and btree_close(). If the
+ *                        btree is not closed correctly the free space is
+ *                        leaked, but the btree remains consistent.
+ * BTREE_CONCURRENT: allow lookups, cursors and snapshots from multiple
+ *                   threads while a single thread modifies the btree.
+ *                   Lookups see the last committed (flushed) state, even
+ *                   inside a transaction, and every modification is a
+ *                   transaction. Not supported
+ *                   by the mmap VFS.
+ * BTREE_APPEND_ONLY: never reuse space. All the allocations are taken at
+ *                    the end of the file and the freed space is just
+ *                    counted as garbage, so writes are sequential, and
+ *                    a crash can't damage the data reachable from the
+ *                    last root written. Every modification is a
+ *                    transaction. Use btree_compact() to reclaim space.
+ *
+ * If 'cfg' is NULL the default configuration is used. */
+struct btree *btree_open_with_config(struct btree_vfs *vfs, char *path, int flags, struct btree_config *cfg) {
+    struct btree *bt = NULL;
+    struct btree_config defcfg;
+    struct timeval tv;
+    int j, mkroot = 0;
+
+    if (cfg == NULL) {
+        btree_config_init(&defcfg);
+        cfg = &defcfg;
+    }
+
+    /* Initialize a new btree structure */
+    if ((bt = malloc(sizeof(*bt))) == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    bt->vfs = vfs ? vfs : &bvfs_unistd;
+    if ((flags & BTREE_CONCURRENT) && bt->vfs == &bvfs_mmap) {
+        /* The mapping is replaced when the file grows. */
+        free(bt);
+        errno = EINVAL;
+        return NULL;
+    }
+    bt->vfs_handle = NULL;
+    bt->path = NULL;
+    bt->garbage = 0;
+    bt->compact = NULL;
+    bt->flags = BTREE_FLAG_USE_WRITE_BARRIER;
+    bt->openflags = flags;
+    bt->dirty = 0;
+    bt->fldir = 0;
+    bt->loaded = 0;
+    bt->cache = NULL;
+    bt->vcache = NULL;
+    bt->txn = BTREE_TXN_NONE;
+    bt->txn_user = 0;
+    bt->txn_fresh.table = NULL;
+    bt->txn_fresh.size = 0;
+    bt->txn_fresh.used = 0;
+    bt->txn_frees = NULL;
+    bt->txn_numfrees = 0;
+    bt->txn_maxfrees = 0;
+    bt->gc_maxops = 0;
+    bt->gc_maxusec = 0;
+    bt->nodebuf = NULL;
+    bt->minkeys = BTREE_MIN_KEYS;
+    bt->snap_head = bt->snap_tail = NULL;
+    bt->snap_epoch = 0;
+    bt->snap_frees = NULL;
+    bt->snap_numfrees = 0;
+    bt->snap_maxfrees = 0;
+    bt->snap_releasing = 0;
+    bt->pubroot = 0;
+    bt->read_epoch = 2;
+    bt->read_safe = 0;
+    memset(bt->readers,0,sizeof(bt->readers));
+    memset(&bt->stats,0,sizeof(bt->stats));
+    bt->wbuf.enabled = bt->vfs->mapptr == NULL && !(flags & BTREE_CONCURRENT);
+    bt->wbuf.buf = NULL;
+    bt->wbuf.used = 0;
+    bt->wbuf.numranges = 0;
+    bt->wbuf.error = 0;
+    bt->wbuf.depth = 0;
+    bt->wbuf.epoch = 0;
+    bt->grower.enabled = cfg->grow_background && bt->vfs->mapptr == NULL;
+    bt->grower.started = 0;
+    bt->grower.requested = 0;
+    bt->bloom = NULL;
+    bt->bloombits = cfg->bloom_bits;
+    bt->bloomoff = 0;
+    bt->readsize = cfg->value_read_size;
+    bt->keytype = cfg->key_type;
+    bt->version = cfg->version;
+    if (btree_set_node_size(bt,cfg->node_size,cfg->inline_values,
+                            cfg->key_size) == -1 ||
+        cfg->key_type > BTREE_KEY_I128 ||
+        (cfg->version != BTREE_VERSION_1 && cfg->version != BTREE_VERSION_2) ||
+        cfg->bloom_bits > BTREE_BLOOM_MAX_BITS ||
+        (cfg->key_type != BTREE_KEY_BINARY && cfg->key_size))
+    {
+        free(bt);
+        errno = EINVAL;
+        return NULL;
+    }
+    pthread_mutex_init(&bt->snap_lock,NULL);
+    bt->numfreelists = BTREE_FREELIST_COUNT;
+    bt->classes = 0;
+    for (j = 0; j < BTREE_MAX_FREELISTS; j++) {
         bt->freelist[j].numblocks = 0;
         bt->freelist[j].blocks = NULL;
         bt->freelist[j].last_items = 0;
+        bt->freelist[j].items = NULL;
+        bt->freelist[j].numitems = 0;
+        bt->freelist[j].maxitems = 0;
+    }
+    if (cfg->cache_nodes &&
+        (bt->cache = btree_cache_create(cfg->cache_nodes,
+            (flags & BTREE_CONCURRENT) ? BTREE_CACHE_SHARDS : 1,
+            flags & BTREE_CONCURRENT)) == NULL)
+    {
+        errno = ENOMEM;
+        goto err;
     }
 
+    if ((bt->path = strdup(path)) == NULL) goto err;
+
     /* Try opening the specified btree */
     bt->vfs_handle = bt->vfs->open(path,0);
     if (bt->vfs_handle == NULL) {
@@ -258,6 +1523,7 @@ struct btree *btree_open(struct btree_vfs *vfs, char *path, int flags) {
      * like all the free list block pointers and so forth.
      * Once we open the btree, we need to load this data into memory. */
     if (btree_read_metadata(bt) == -1) goto err;
+    if ((bt->nodebuf = malloc(bt->nodesize)) == NULL) goto err;
     gettimeofday(&tv,NULL);
     bt->mark = (uint32_t) random() ^ tv.tv_sec ^ tv.tv_usec;
 
@@ -266,17 +1532,21 @@ struct btree *btree_open(struct btree_vfs *vfs, char *path, int flags) {
         struct btree_node *root;
         uint64_t rootptr;
 
+        if (cfg->size_classes && btree_create_classes(bt) == -1) goto err;
+
         /* Allocate space for the root */
-        if ((rootptr = btree_alloc(bt,BTREE_NODE_SIZE)) == 0) goto err;
+        if ((rootptr = btree_alloc(bt,bt->nodesize)) == 0) goto err;
 
         /* Create a fresh root node and write it on disk */
-        if ((root = btree_create_node()) == NULL) goto err;
+        if ((root = btree_new_node(bt)) == NULL) goto err;
         root->isleaf = 1; /* Our first node is a leaf */
         if (btree_write_node(bt,root,rootptr) == -1) {
             btree_free_node(root);
             goto err;
         }
         btree_free_node(root);
+        if ((flags & BTREE_APPEND_ONLY) && btree_write_free_space(bt) == -1)
+            goto err;
         btree_sync(bt);
 
         /* Write the root node pointer. */
@@ -284,6 +1554,16 @@ struct btree *btree_open(struct btree_vfs *vfs, char *path, int flags) {
         bt->rootptr = rootptr;
         btree_sync(bt);
     }
+    if (cfg->value_cache_size &&
+        (bt->vcache = btree_vcache_create(cfg->value_cache_size,
+            (flags & BTREE_CONCURRENT) ? BTREE_CACHE_SHARDS : 1,
+            flags & BTREE_CONCURRENT, bt->keylen)) == NULL)
+    {
+        errno = ENOMEM;
+        goto err;
+    }
+    if (btree_load_bloom(bt) == -1) goto err;
+    btree_publish_root(bt);
     return bt;
 
 err:
@@ -292,17 +1572,81 @@ err:
 }
 
 /* Close a btree, even one that was unsuccesfull opened, so that
- * btree_open() can use this function for cleanup on error. */
+ * btree_open() can use this function for cleanup on error.
+ * A transaction in progress is committed, snapshots are released, and when
+ * in memory freelists are used they are written on disk. */
 void btree_close(struct btree *bt) {
     int j;
 
     if (!bt) return;
+    btree_compact_abort(bt->compact);
+    if (bt->txn != BTREE_TXN_NONE) {
+        bt->txn_user = 0;
+        btree_flush(bt);
+    }
+    btree_write_bloom(bt);
+    while (bt->snap_head) btree_snapshot_release(bt->snap_head);
+    btree_snapshot_reclaim(bt); /* Needed if readers were concurrent. */
+    if (bt->dirty) btree_checkpoint(bt);
+    btree_write_fldir(bt);
+    btree_wbuf_flush(bt);
+    btree_grower_stop(bt);
     if (bt->vfs_handle) bt->vfs->close(bt->vfs_handle);
-    for (j = 0; j < BTREE_FREELIST_COUNT; j++)
+    for (j = 0; j < BTREE_MAX_FREELISTS; j++) {
         free(bt->freelist[j].blocks);
+        free(bt->freelist[j].items);
+    }
+    btree_cache_release(bt->cache);
+    btree_vcache_release(bt->vcache);
+    btree_bloom_release(bt->bloom);
+    free(bt->txn_fresh.table);
+    free(bt->txn_frees);
+    free(bt->nodebuf);
+    free(bt->wbuf.buf);
+    free(bt->snap_frees);
+    pthread_mutex_destroy(&bt->snap_lock);
+    free(bt->path);
     free(bt);
 }
 
+/* Replace the file of the btree with the one now at bt->path, that must
+ * have the same node size, dropping all the state referencing the old
+ * file. Used by compaction. Returns 0 on success, otherwise -1 with errno
+ * set accordingly, and the btree can only be closed. */
+int btree_reopen(struct btree *bt) {
+    void *handle;
+    int j;
+
+    if (btree_wbuf_flush(bt) == -1) return -1;
+    btree_grower_stop(bt);
+    if ((handle = bt->vfs->open(bt->path,0)) == NULL) return -1;
+    bt->vfs->close(bt->vfs_handle);
+    bt->vfs_handle = handle;
+    for (j = 0; j < BTREE_MAX_FREELISTS; j++) {
+        struct btree_freelist *fl = &bt->freelist[j];
+
+        free(fl->blocks);
+        fl->numblocks = 0;
+        fl->blocks = NULL;
+        fl->last_items = 0;
+        fl->numitems = 0;
+    }
+    btree_cache_clear(bt->cache);
+    btree_vcache_clear(bt->vcache);
+    btree_offset_set_clear(&bt->txn_fresh);
+    bt->txn_numfrees = 0;
+    bt->snap_numfrees = 0;
+    bt->dirty = 0;
+    bt->garbage = 0;
+    btree_bloom_release(bt->bloom);
+    bt->bloom = NULL;
+    if (btree_read_metadata(bt) == -1 || btree_load_bloom(bt) == -1)
+        return -1;
+    bt->txn_rootptr = bt->rootptr;
+    btree_publish_root(bt);
+    return 0;
+}
+
 #include <stdio.h>
 
 /* Create a new btree, populating the header, free lists.
@@ -320,22 +1664,42 @@ int btree_create(struct btree *bt) {
     size = 8*4;
     /* Then we have our root free lists */
     size += BTREE_FREELIST_COUNT * BTREE_FREELIST_BLOCK_SIZE;
-    /* And finally our root node pointer and actual node */
-    size += 8; /* root pointer */
-    size += BTREE_NODE_SIZE; /* root node */
+    /* And finally our root node pointer and the other header fields */
+    size += BTREE_HDR_SIZE-BTREE_HDR_ROOTPTR_POS;
     if (bt->vfs->resize(bt->vfs_handle,size) == -1) return -1;
 
-    /* Now we have enough space to actually build the btree header,
-     * free lists, and root node. */
+    /* Now we have enough space to actually build the btree header and
+     * free lists. Fields we don't write are zero, that is the right
+     * default for all of them. */
 
     /* Magic and version */
-    if (btree_pwrite(bt,"REDBTREE00000000",16,0) == -1) return -1;
+    if (btree_pwrite(bt,bt->version == BTREE_VERSION_2 ? "REDBTREE00000002" :
+                                                         "REDBTREE00000000",
+                     16,0) == -1) return -1;
 
     /* Free and Freeoff */
     if (btree_pwrite_u64(bt,0,BTREE_HDR_FREE_POS) == -1) return -1;
-    freeoff = 32+BTREE_FREELIST_BLOCK_SIZE*BTREE_FREELIST_COUNT+8+BTREE_NODE_SIZE;
+    freeoff = BTREE_HDR_SIZE;
     if (btree_pwrite_u64(bt,freeoff,BTREE_HDR_FREEOFF_POS) == -1) return -1;
 
+    /* Node size. Legacy btrees have zero in both the fields. */
+    if (bt->maxkeys != BTREE_LEGACY_MAX_KEYS || bt->inlinelen ||
+        bt->prefixed)
+    {
+        if (btree_pwrite_u64(bt,bt->maxkeys,BTREE_HDR_NODEKEYS_POS) == -1 ||
+            btree_pwrite_u64(bt,btree_alloc_realsize(bt->nodesize),
+                             BTREE_HDR_NODESIZE_POS) == -1) return -1;
+    }
+    if (bt->inlinelen &&
+        btree_pwrite_u64(bt,bt->inlinelen,BTREE_HDR_INLINE_POS) == -1)
+        return -1;
+    if (bt->prefixed &&
+        btree_pwrite_u64(bt,bt->keylen,BTREE_HDR_KEYLEN_POS) == -1)
+        return -1;
+    if (bt->keytype &&
+        btree_pwrite_u64(bt,bt->keytype,BTREE_HDR_KEYTYPE_POS) == -1)
+        return -1;
+
     /* Free lists */
     for (j = 0; j < BTREE_FREELIST_COUNT; j++) {
         uint64_t off = 32+BTREE_FREELIST_BLOCK_SIZE*j;
@@ -350,641 +1714,7214 @@ int btree_create(struct btree *bt) {
     return 0;
 }
 
-int btree_read_metadata(struct btree *bt) {
+/* Enable size classes in a btree that was just created, allocating the
+ * class table: for every class the offset of the first block of its free
+ * list, or zero if the free list has no block yet. */
+int btree_create_classes(struct btree *bt) {
+    uint64_t table;
+
+    bt->numfreelists = BTREE_MAX_FREELISTS;
+    if ((table = btree_alloc(bt,sizeof(uint64_t)*BTREE_CLASS_COUNT)) == 0 ||
+        btree_clear_class_table(bt,table) == -1) return -1;
+    btree_sync(bt);
+    if (btree_pwrite_u64(bt,table,BTREE_HDR_CLASSES_POS) == -1) return -1;
+    bt->classes = table;
+    return 0;
+}
+
+/* Read the first block of the free list of every class into 'first'. */
+int btree_read_class_table(struct btree *bt, uint64_t *first) {
+    unsigned char buf[sizeof(uint64_t)*BTREE_CLASS_COUNT];
+    int j;
+
+    if (btree_pread(bt,buf,sizeof(buf),bt->classes) != sizeof(buf)) {
+        errno = EFAULT;
+        return -1;
+    }
+    for (j = 0; j < BTREE_CLASS_COUNT; j++)
+        first[j] = btree_u64_from_big(buf+sizeof(uint64_t)*j);
+    return 0;
+}
+
+/* Write the class table from the in memory free lists. */
+int btree_write_class_table(struct btree *bt) {
+    unsigned char buf[sizeof(uint64_t)*BTREE_CLASS_COUNT];
+    int j;
+
+    for (j = 0; j < BTREE_CLASS_COUNT; j++) {
+        struct btree_freelist *fl = &bt->freelist[BTREE_FREELIST_COUNT+j];
+
+        btree_u64_to_big(buf+sizeof(uint64_t)*j,
+                         fl->numblocks ? fl->blocks[0] : 0);
+    }
+    return btree_pwrite(bt,buf,sizeof(buf),bt->classes) == -1 ? -1 : 0;
+}
+
+/* Set all the entries of the class table at 'table' to zero. */
+int btree_clear_class_table(struct btree *bt, uint64_t table) {
+    unsigned char buf[sizeof(uint64_t)*BTREE_CLASS_COUNT];
+
+    memset(buf,0,sizeof(buf));
+    return btree_pwrite(bt,buf,sizeof(buf),table) == -1 ? -1 : 0;
+}
+
+/* Called when opening a btree that was using in memory freelists and was not
+ * closed correctly: the freelists on disk, and the free space information,
+ * don't reflect allocations performed after the last checkpoint, so we
+ * can't trust them. We just reset all the freelists and consider the whole
+ * file as used, leaking all the space that was free. */
+int btree_reset_freelists(struct btree *bt) {
+    uint64_t filesize, classes;
     int j;
 
-    /* TODO: Check signature and version. */
+    if (bt->vfs->getsize(bt->vfs_handle,&filesize) == -1) return -1;
+    for (j = 0; j < BTREE_FREELIST_COUNT; j++) {
+        uint64_t off = 32+BTREE_FREELIST_BLOCK_SIZE*j;
+
+        if (btree_pwrite_u64(bt,0,off+sizeof(uint64_t)) == -1) return -1;
+        if (btree_pwrite_u64(bt,0,off+sizeof(uint64_t)*2) == -1) return -1;
+    }
+    if (btree_pread_u64(bt,&classes,BTREE_HDR_CLASSES_POS) == -1 ||
+        (classes && btree_clear_class_table(bt,classes) == -1)) return -1;
+    if (btree_pwrite_u64(bt,0,BTREE_HDR_FREE_POS) == -1) return -1;
+    if (btree_pwrite_u64(bt,filesize,BTREE_HDR_FREEOFF_POS) == -1) return -1;
+    if (btree_pwrite_u64(bt,0,BTREE_HDR_FLDIR_POS) == -1) return -1;
+    btree_sync(bt);
+    if (btree_pwrite_u64(bt,BTREE_STATE_CLEAN,BTREE_HDR_STATE_POS) == -1)
+        return -1;
+    btree_sync(bt);
+    return 0;
+}
+
+/* Load all the items of the freelist blocks in memory, for the
+ * BTREE_MEMORY_FREELIST mode. Every block is loaded with a single read. */
+int btree_load_freelist_items(struct btree *bt, struct btree_freelist *fl) {
+    unsigned char buf[BTREE_FREELIST_BLOCK_SIZE];
+    uint32_t j, k;
+
+    for (j = 0; j < fl->numblocks; j++) {
+        uint64_t numitems;
+
+        if (btree_pread(bt,buf,sizeof(buf),fl->blocks[j]) == -1) return -1;
+        numitems = btree_u64_from_big(buf+sizeof(uint64_t)*2);
+        if (numitems > BTREE_FREELIST_BLOCK_ITEMS) {
+            errno = EFAULT;
+            return -1;
+        }
+        if (fl->numitems+numitems > fl->maxitems) {
+            uint32_t maxitems = fl->maxitems ? fl->maxitems : 16;
+            uint64_t *items;
+
+            while (maxitems < fl->numitems+numitems) maxitems *= 2;
+            items = realloc(fl->items,sizeof(uint64_t)*maxitems);
+            if (items == NULL) return -1;
+            fl->items = items;
+            fl->maxitems = maxitems;
+        }
+        for (k = 0; k < numitems; k++)
+            fl->items[fl->numitems++] =
+                btree_u64_from_big(buf+sizeof(uint64_t)*(3+k));
+    }
+    return 0;
+}
+
+int btree_read_metadata(struct btree *bt) {
+    uint64_t state, maxkeys, nodesize, inlinelen, keylen, keytype;
+    unsigned char magic[16];
+
+    bt->loaded = 0;
+    /* Check signature and version: nodes are encoded according to
+     * the version of the file, not to the one of the configuration. */
+    if (btree_pread(bt,magic,sizeof(magic),0) != sizeof(magic)) {
+        if (errno == 0) errno = EFAULT;
+        return -1;
+    }
+    if (memcmp(magic,"REDBTREE0000000",15) ||
+        (magic[15] != '0' && magic[15] != '2'))
+    {
+        errno = EFAULT;
+        return -1;
+    }
+    bt->version = magic[15]-'0';
+    /* If the btree was not closed correctly while using in memory
+     * freelists we need to fix the header before reading it. */
+    if (btree_pread_u64(bt,&state,BTREE_HDR_STATE_POS) == -1) return -1;
+    if (state != BTREE_STATE_CLEAN && btree_reset_freelists(bt) == -1)
+        return -1;
+
     /* Read free space and offset information */
     if (btree_pread_u64(bt,&bt->free,BTREE_HDR_FREE_POS) == -1) return -1;
     if (btree_pread_u64(bt,&bt->freeoff,BTREE_HDR_FREEOFF_POS) == -1) return -1;
+    if (btree_pread_u64(bt,&bt->fldir,BTREE_HDR_FLDIR_POS) == -1) return -1;
+    if (btree_pread_u64(bt,&bt->bloomoff,BTREE_HDR_BLOOM_POS) == -1) return -1;
+    if (btree_pread_u64(bt,&bt->classes,BTREE_HDR_CLASSES_POS) == -1)
+        return -1;
+    bt->numfreelists = bt->classes ? BTREE_MAX_FREELISTS :
+                                     BTREE_FREELIST_COUNT;
     /* TODO: check that they makes sense considered the file size. */
+    /* Read the node size, that overrides the one of the configuration. */
+    if (btree_pread_u64(bt,&maxkeys,BTREE_HDR_NODEKEYS_POS) == -1 ||
+        btree_pread_u64(bt,&nodesize,BTREE_HDR_NODESIZE_POS) == -1 ||
+        btree_pread_u64(bt,&inlinelen,BTREE_HDR_INLINE_POS) == -1 ||
+        btree_pread_u64(bt,&keylen,BTREE_HDR_KEYLEN_POS) == -1 ||
+        btree_pread_u64(bt,&keytype,BTREE_HDR_KEYTYPE_POS) == -1) return -1;
+    if (maxkeys == 0 && nodesize == 0 && inlinelen == 0 && keylen == 0) {
+        btree_set_node_size(bt,0,0,0);
+    } else if (nodesize > BTREE_MAX_NODE_SIZE ||
+               inlinelen > BTREE_MAX_INLINE ||
+               keylen > BTREE_MAX_KEY_LEN ||
+               btree_set_node_size(bt,nodesize,inlinelen,keylen) == -1 ||
+               bt->inlinelen != inlinelen ||
+               bt->maxkeys != maxkeys)
+    {
+        errno = EFAULT;
+        return -1;
+    }
+    if (keytype > BTREE_KEY_I128 || (keytype && bt->prefixed)) {
+        errno = EFAULT;
+        return -1;
+    }
+    bt->keytype = keytype;
     /* Read root node pointer */
     if (btree_pread_u64(bt,&bt->rootptr,BTREE_HDR_ROOTPTR_POS) == -1) return -1;
-    printf("Root node is at %llu\n", bt->rootptr);
-    /* Read free lists information */
-    for (j = 0; j < BTREE_FREELIST_COUNT; j++) {
-        uint64_t ptr = 32+BTREE_FREELIST_BLOCK_SIZE*j;
+    btree_trace(1,"Root node is at %llu\n",(unsigned long long)bt->rootptr);
+    if (btree_read_freelists(bt) == -1) return -1;
+    bt->loaded = 1;
+    return 0;
+}
+
+/* Read the free lists blocks from disk, and with in memory freelists also
+ * their items. The in memory freelists must be empty. The blocks are taken
+ * from the freelist directory if there is a valid one, otherwise we walk
+ * the chain of blocks of every freelist. */
+int btree_read_freelists(struct btree *bt) {
+    int j;
+
+    if ((bt->fldir == 0 || btree_read_fldir(bt) == -1) &&
+        btree_walk_freelists(bt) == -1) return -1;
+    if (!(bt->openflags & BTREE_MEMORY_FREELIST)) return 0;
+    for (j = 0; j < bt->numfreelists; j++)
+        if (btree_load_freelist_items(bt,&bt->freelist[j]) == -1) return -1;
+    return 0;
+}
+
+/* Read the blocks of the free lists following the next pointers of the
+ * blocks, starting from the first block of every freelist, that is in the
+ * header, or in the class table for the free lists of the size classes. */
+int btree_walk_freelists(struct btree *bt) {
+    uint64_t first[BTREE_MAX_FREELISTS];
+    int j;
+
+    for (j = 0; j < BTREE_FREELIST_COUNT; j++)
+        first[j] = 32+BTREE_FREELIST_BLOCK_SIZE*j;
+    if (bt->classes &&
+        btree_read_class_table(bt,first+BTREE_FREELIST_COUNT) == -1)
+        return -1;
+    for (j = 0; j < bt->numfreelists; j++) {
+        uint64_t ptr = first[j];
         uint64_t nextptr, numitems;
 
-        // printf("Load metadata for freelist %d\n", j);
-        do {
+        btree_trace(2,"Load metadata for freelist %d\n",j);
+        while (ptr) {
             struct btree_freelist *fl = &bt->freelist[j];
 
             if (btree_pread_u64(bt,&nextptr,ptr+sizeof(uint64_t)) == -1)
                 return -1;
             if (btree_pread_u64(bt,&numitems,ptr+sizeof(uint64_t)*2) == -1)
                 return -1;
-            // printf("  block %lld: %lld items (next: %lld)\n", ptr, numitems,
-            //    nextptr);
+            btree_trace(2,"  block %llu: %llu items (next: %llu)\n",
+                (unsigned long long)ptr,(unsigned long long)numitems,
+                (unsigned long long)nextptr);
             fl->blocks = realloc(fl->blocks,sizeof(uint64_t)*(fl->numblocks+1));
             if (fl->blocks == NULL) return -1;
             fl->blocks[fl->numblocks] = ptr;
             fl->numblocks++;
             fl->last_items = numitems;
             ptr = nextptr;
-        } while(ptr);
+        }
     }
     return 0;
 }
 
-/* Create a new node in memory */
-struct btree_node *btree_create_node(void) {
-    struct btree_node *n = calloc(1,sizeof(*n));
-
-    return n;
-}
+/* The freelist directory is everything btree_walk_freelists() would learn
+ * walking the chains of blocks, written as a single record, so that opening
+ * a btree with many freelist blocks takes two reads instead of two reads
+ * per block, one after the other. It is written when the btree is closed,
+ * and on checkpoints with in memory freelists, in the free space at the end
+ * of the file, and the header field BTREE_HDR_FLDIR_POS points to it:
+ *
+ * checksum | length | numblocks, last items of every freelist | blocks
+ *
+ * Blocks are the offsets of all the blocks of every freelist, but the first
+ * block of the power of two freelists, that is always in the header. The
+ * checksum covers the rest of the record.
+ *
+ * Before the first change to the freelists or to the free space the header
+ * field is set to zero (see btree_drop_fldir()), so a directory referenced
+ * by the header is always up to date with the blocks on disk, and after a
+ * crash there is simply no directory and the chains are walked. */
+#define BTREE_FLDIR_FIXED_SIZE(numfl) (16+16*(numfl))
+#define BTREE_FLDIR_IMPLICIT(j) ((j) < BTREE_FREELIST_COUNT)
+
+/* Return the size of the freelist directory for the freelists in memory. */
+uint64_t btree_fldir_size(struct btree *bt) {
+    uint64_t size = BTREE_FLDIR_FIXED_SIZE(bt->numfreelists);
+    int j;
 
-void btree_free_node(struct btree_node *n) {
-    free(n);
+    for (j = 0; j < bt->numfreelists; j++)
+        size += sizeof(uint64_t)*(bt->freelist[j].numblocks-
+                                  BTREE_FLDIR_IMPLICIT(j));
+    return size;
 }
 
-/* Write a node on disk at the specified offset. Returns 0 on success.
- * On error -1 is returne and errno set accordingly. */
-int btree_write_node(struct btree *bt, struct btree_node *n, uint64_t offset) {
-    unsigned char buf[BTREE_NODE_SIZE];
-    unsigned char *p = buf;
+/* Load the freelists blocks from the directory. Returns 0 on success,
+ * otherwise -1 with errno set to EFAULT if the directory is not valid, and
+ * the in memory freelists are left empty. */
+int btree_read_fldir(struct btree *bt) {
+    unsigned char fixed[BTREE_FLDIR_FIXED_SIZE(BTREE_MAX_FREELISTS)];
+    unsigned char *buf = NULL, *p;
+    uint64_t fixedlen = BTREE_FLDIR_FIXED_SIZE(bt->numfreelists);
+    uint64_t len, numblocks, lastitems, sum, maxblocks;
+    uint32_t b;
     int j;
 
-    bt->mark++;
-    btree_u32_to_big(p,bt->mark); p += 4; /* start mark */
-    btree_u32_to_big(p,n->numkeys); p += 4; /* number of keys */
-    btree_u32_to_big(p,n->isleaf); p += 4; /* is a leaf? */
-    btree_u32_to_big(p,0); p += 4; /* unused field, needed for alignment */
-    memcpy(p,n->keys,sizeof(n->keys)); p += sizeof(n->keys); /* keys */
-    /* values */
-    for (j = 0; j < BTREE_MAX_KEYS; j++) {
-        btree_u64_to_big(p,n->values[j]);
-        p += 8;
+    /* The directory is in the free space, and is only valid as long as
+     * the free space didn't change. */
+    if (bt->fldir != bt->freeoff) goto invalid;
+    if (btree_pread(bt,fixed,fixedlen,bt->fldir) != (ssize_t)fixedlen)
+        goto invalid;
+    len = btree_u64_from_big(fixed+8);
+    if (len < fixedlen || len > bt->free || len > UINT32_MAX || (len & 7))
+        goto invalid;
+
+    /* Check the counts before trusting the length. */
+    maxblocks = bt->freeoff/BTREE_FREELIST_BLOCK_SIZE+1;
+    sum = fixedlen;
+    for (j = 0; j < bt->numfreelists; j++) {
+        numblocks = btree_u64_from_big(fixed+16+16*j);
+        lastitems = btree_u64_from_big(fixed+24+16*j);
+        if (numblocks < (uint64_t)BTREE_FLDIR_IMPLICIT(j) ||
+            numblocks > maxblocks ||
+            lastitems > (numblocks ? BTREE_FREELIST_BLOCK_ITEMS : 0))
+            goto invalid;
+        sum += sizeof(uint64_t)*(numblocks-BTREE_FLDIR_IMPLICIT(j));
     }
-    /* children */
-    for (j = 0; j <= BTREE_MAX_KEYS; j++) {
-        btree_u64_to_big(p,n->children[j]);
-        p += 8;
+    if (sum != len) goto invalid;
+    if ((buf = malloc(len)) == NULL) return -1;
+    memcpy(buf,fixed,fixedlen);
+    if (len > fixedlen &&
+        btree_pread(bt,buf+fixedlen,len-fixedlen,bt->fldir+fixedlen) !=
+        (ssize_t)(len-fixedlen)) goto invalid;
+    if (btree_fnv64(buf+8,len-8) != btree_u64_from_big(buf)) goto invalid;
+
+    p = buf+fixedlen;
+    for (j = 0; j < bt->numfreelists; j++) {
+        struct btree_freelist *fl = &bt->freelist[j];
+
+        numblocks = btree_u64_from_big(buf+16+16*j);
+        if (numblocks == 0) continue;
+        if ((fl->blocks = malloc(sizeof(uint64_t)*numblocks)) == NULL)
+            goto oom;
+        fl->numblocks = numblocks;
+        fl->last_items = btree_u64_from_big(buf+24+16*j);
+        b = 0;
+        if (BTREE_FLDIR_IMPLICIT(j))
+            fl->blocks[b++] = 32+BTREE_FREELIST_BLOCK_SIZE*j;
+        for (; b < numblocks; b++) {
+            uint64_t block = btree_u64_from_big(p);
+
+            if (block < BTREE_HDR_SIZE || (block & 7) ||
+                block+BTREE_FREELIST_BLOCK_SIZE > bt->freeoff) goto invalid;
+            fl->blocks[b] = block;
+            p += sizeof(uint64_t);
+        }
     }
-    btree_u32_to_big(p,bt->mark); p += 4; /* end mark */
-    return btree_pwrite(bt,buf,sizeof(buf),offset);
+    free(buf);
+    return 0;
+
+invalid:
+    errno = EFAULT;
+oom:
+    free(buf);
+    for (j = 0; j < bt->numfreelists; j++) {
+        free(bt->freelist[j].blocks);
+        bt->freelist[j].blocks = NULL;
+        bt->freelist[j].numblocks = 0;
+        bt->freelist[j].last_items = 0;
+    }
+    return -1;
 }
 
-/* Read a node from the specified offset.
- * On success the in memory representation of the node is returned as a
- * btree_node structure (to be freed with btree_free_node). On error
- * NULL is returned and errno set accordingly.
- *
- * If data on disk is corrupted errno is set to EFAULT. */
-struct btree_node *btree_read_node(struct btree *bt, uint64_t offset) {
-    unsigned char buf[BTREE_NODE_SIZE], *p;
-    struct btree_node *n;
+/* Write the freelist directory, unless the header already references an
+ * up to date one. Returns 0 on success, -1 on error with errno set, in which
+ * case there is no directory and the next open will walk the freelists. */
+int btree_write_fldir(struct btree *bt) {
+    uint64_t len = btree_fldir_size(bt);
+    unsigned char *buf, *p;
+    uint32_t b;
     int j;
 
-    if (btree_pread(bt,buf,sizeof(buf),offset) == -1) return NULL;
-    /* Verify start/end marks */
-    if (memcmp(buf,buf+BTREE_NODE_SIZE-4,4)) {
-        errno = EFAULT;
-        return NULL;
+    /* With in memory freelists the blocks on disk are only valid after
+     * a checkpoint. */
+    if (bt->fldir || bt->dirty || !bt->loaded) return 0;
+    if (len > UINT32_MAX) {
+        errno = EFBIG;
+        return -1;
     }
-    if ((n = btree_create_node()) == NULL) return NULL;
-
-    p = buf+4;
-    n->numkeys = btree_u32_from_big(p); p += 4; /* number of keys */
-    n->isleaf = btree_u32_from_big(p); p += 4; /* is a leaf? */
-    p += 4; /* unused field, needed for alignment */
-    memcpy(n->keys,p,sizeof(n->keys)); p += sizeof(n->keys); /* keys */
-    /* values */
-    for (j = 0; j < BTREE_MAX_KEYS; j++) {
-        n->values[j] = btree_u64_from_big(p);
-        p += 8;
+    /* Make room for the directory without preallocating more space, so
+     * that a compacted file remains as small as possible. */
+    btree_grower_adopt(bt,1);
+    if (bt->free < len) {
+        if (bt->vfs->resize(bt->vfs_handle,bt->freeoff+len) == -1) return -1;
+        bt->stats.file_grows++;
+        bt->stats.file_grow_bytes += len-bt->free;
+        bt->free = len;
     }
-    /* children */
-    for (j = 0; j <= BTREE_MAX_KEYS; j++) {
-        n->children[j] = btree_u64_from_big(p);
-        p += 8;
+    if ((buf = malloc(len)) == NULL) return -1;
+    p = buf+BTREE_FLDIR_FIXED_SIZE(bt->numfreelists);
+    for (j = 0; j < bt->numfreelists; j++) {
+        struct btree_freelist *fl = &bt->freelist[j];
+
+        btree_u64_to_big(buf+16+16*j,fl->numblocks);
+        btree_u64_to_big(buf+24+16*j,fl->last_items);
+        for (b = BTREE_FLDIR_IMPLICIT(j); b < fl->numblocks; b++) {
+            btree_u64_to_big(p,fl->blocks[b]);
+            p += sizeof(uint64_t);
+        }
+    }
+    btree_u64_to_big(buf+8,len);
+    btree_u64_to_big(buf,btree_fnv64(buf+8,len-8));
+    if (btree_pwrite(bt,buf,len,bt->freeoff) == -1 ||
+        btree_write_free_space(bt) == -1)
+    {
+        free(buf);
+        return -1;
     }
+    free(buf);
+    btree_sync(bt);
+    if (btree_pwrite_u64(bt,bt->freeoff,BTREE_HDR_FLDIR_POS) == -1) return -1;
+    btree_sync(bt);
+    bt->fldir = bt->freeoff;
+    return 0;
+}
+
+/* Called before every change to the freelists or the free space: if the
+ * header references a freelist directory, it is no longer valid. */
+int btree_drop_fldir(struct btree *bt) {
+    if (bt->fldir == 0) return 0;
+    if (btree_pwrite_u64(bt,0,BTREE_HDR_FLDIR_POS) == -1) return -1;
+    /* This happens once after every open or checkpoint, so we always use
+     * a real write barrier, even inside transactions: the header must be
+     * on disk before the freelists are modified. */
+    if (bt->flags & BTREE_FLAG_USE_WRITE_BARRIER) btree_fsync(bt);
+    bt->fldir = 0;
+    return 0;
+}
+
+/* Create a new node in memory, able to hold 'maxkeys' keys of 'keylen'
+ * bytes, with an inline area of 'inlinelen' bytes for every key. The node
+ * and its arrays are a single allocation. In memory keys always take
+ * 'keylen' bytes, even in prefix compressed btrees, so that they are
+ * accessed and compared like in the other btrees. */
+struct btree_node *btree_create_node(uint32_t maxkeys, uint32_t inlinelen,
+                                     uint32_t keylen)
+{
+    struct btree_node *n;
+
+    n = calloc(1,sizeof(*n)+(sizeof(uint64_t)*2+keylen+inlinelen)*maxkeys+
+                 sizeof(uint64_t));
+    if (n == NULL) return NULL;
+    n->maxkeys = maxkeys;
+    n->inlinelen = inlinelen;
+    n->keylen = keylen;
+    n->values = (uint64_t*) (n+1);
+    n->children = n->values+maxkeys;
+    n->keys = (char*) (n->children+maxkeys+1);
+    n->inl = (unsigned char*) n->keys+keylen*maxkeys;
     return n;
 }
 
-/* ------------------------- disk space allocator --------------------------- */
+/* Create a new node in memory with the capacity of the nodes of 'bt'. */
+struct btree_node *btree_new_node(struct btree *bt) {
+    struct btree_node *n;
 
-/* Compute logarithm in base two of 'n', with 'n' being a power of two.
- * Probably you can just check the latest 1 bit set, but here it's not
- * a matter of speed as we are dealing with the disk every time we call
- * this function. */
-int btree_log_two(uint32_t n) {
-    int log = -1;
+    n = btree_create_node(bt->maxkeys,bt->inlinelen,bt->keylen);
+    if (n) n->keytype = bt->keytype;
+    return n;
+}
 
-    while(n) {
-        log++;
-        n /= 2;
+/* Copy the content of the node 'src' into 'dst', that must be able to hold
+ * its keys. Only the used part of the arrays is copied. */
+void btree_copy_node(struct btree_node *dst, struct btree_node *src) {
+    uint32_t j;
+
+    assert(dst->maxkeys >= src->numkeys && dst->inlinelen == src->inlinelen &&
+           dst->keylen == src->keylen);
+    dst->numkeys = src->numkeys;
+    dst->isleaf = src->isleaf;
+    memcpy(dst->keys,src->keys,src->keylen*src->numkeys);
+    memcpy(dst->values,src->values,sizeof(uint64_t)*src->numkeys);
+    memcpy(dst->children,src->children,sizeof(uint64_t)*(src->numkeys+1));
+    for (j = 0; j < src->numkeys; j++) {
+        if (!BTREE_VALUE_IS_INLINE(src->values[j])) continue;
+        memcpy(dst->inl+j*src->inlinelen,src->inl+j*src->inlinelen,
+               BTREE_VALUE_INLINE_LEN(src->values[j]));
     }
-    return log;
 }
 
-int btree_alloc_freelist(struct btree *bt, uint32_t realsize, uint64_t *ptr) {
-    int exp = btree_log_two(realsize);
-    int fli = btree_freelist_index_by_exp(exp);
-    struct btree_freelist *fl = &bt->freelist[fli];
-    uint64_t block, lastblock = 0, p;
+/* Move 'count' keys, with their values, from position 'si' of 'src' to
+ * position 'di' of 'dst', that can be the same node: overlapping ranges
+ * are handled like memmove(). Children pointers are not touched. */
+void btree_node_move(struct btree_node *dst, int di, struct btree_node *src,
+                     int si, int count)
+{
+    if (count <= 0) return;
+    memmove(dst->keys+di*src->keylen,src->keys+si*src->keylen,
+            count*src->keylen);
+    memmove(dst->values+di,src->values+si,count*sizeof(uint64_t));
+    if (src->inlinelen)
+        memmove(dst->inl+di*src->inlinelen,src->inl+si*src->inlinelen,
+                count*src->inlinelen);
+}
 
-    if (fl->last_items == 0 && fl->numblocks == 1) {
-        *ptr = 0;
-        return 0;
-    }
+void btree_free_node(struct btree_node *n) {
+    free(n);
+}
 
-    /* Last block is empty? Remove it */
-    if (fl->last_items == 0) {
-        uint64_t prevblock, *oldptr;
+/* ------------------------------- Node cache ------------------------------- */
 
-        assert(fl->numblocks > 1);
-        /* Set prevblock next pointer to NULL */
-        prevblock = fl->blocks[fl->numblocks-2];
-        if (btree_pwrite_u64(bt,0,prevblock+sizeof(uint64_t)) == -1) return -1;
-        btree_sync(bt);
-        /* Fix our memory representaiton of freelist */
-        lastblock = fl->blocks[fl->numblocks-1];
-        fl->numblocks--;
-        /* The previous item must be full, so we set the new number
-         * of items to the max. */
-        fl->last_items = BTREE_FREELIST_BLOCK_ITEMS;
-        /* Realloc the block as we have one element less. */
-        oldptr = fl->blocks;
-        fl->blocks = realloc(fl->blocks,sizeof(uint64_t)*fl->numblocks);
-        if (fl->blocks == NULL) {
-            /* Out of memory. The realloc failed, but note that while this
-             * is a leak as the block remains larger than needed we still
-             * have a valid in memory representation. */
-            fl->blocks = oldptr;
-            return -1;
+/* Nodes are cached in decoded form, so that the nodes we access more often,
+ * like the root and the first levels of the tree, don't require a pread()
+ * and a full decoding every time.
+ *
+ * The cache is write-through: btree_write_node() populates it, while
+ * btree_free() and every in place update of a node on disk must evict the
+ * node, so that we never serve stale data.
+ *
+ * The cache is partitioned into shards by offset, every shard with its own
+ * CLOCK hand and, when concurrent readers are enabled, its own lock, so
+ * that readers running in different threads rarely contend. */
+
+/* Create a cache able to hold 'size' nodes, split into 'numshards' shards
+ * (a power of two). If 'locking' is true the shards are protected by
+ * mutexes. Returns NULL on out of memory. */
+struct btree_cache *btree_cache_create(uint32_t size, uint32_t numshards,
+                                       int locking)
+{
+    struct btree_cache *c;
+    uint32_t buckets = 1, j, k;
+
+    if ((c = calloc(1,sizeof(*c))) == NULL) return NULL;
+    if ((c->shards = calloc(numshards,sizeof(*c->shards))) == NULL) {
+        free(c);
+        return NULL;
+    }
+    c->numshards = numshards;
+    c->locking = locking;
+    size = (size+numshards-1)/numshards;
+    while (buckets < size) buckets *= 2;
+    for (k = 0; k < numshards; k++) {
+        struct btree_cache_shard *s = &c->shards[k];
+
+        s->size = size;
+        s->hand = 0;
+        s->mask = buckets-1;
+        s->buckets = malloc(sizeof(int)*buckets);
+        s->entries = calloc(size,sizeof(struct btree_cache_entry));
+        if (s->buckets == NULL || s->entries == NULL) {
+            btree_cache_release(c);
+            return NULL;
         }
+        if (locking) pthread_mutex_init(&s->lock,NULL);
+        for (j = 0; j < buckets; j++) s->buckets[j] = -1;
+        for (j = 0; j < size; j++) s->entries[j].next = -1;
     }
+    return c;
+}
 
-    /* There was a block to remove, but this block is the same size
-     * of the allocation required? Just return it. */
-    if (lastblock && exp == BTREE_FREELIST_SIZE_EXP) {
-        *ptr = lastblock;
-        return 0;
-    } else {
-        btree_free(bt,lastblock);
+void btree_cache_release(struct btree_cache *c) {
+    uint32_t j, k;
+
+    if (!c) return;
+    for (k = 0; k < c->numshards; k++) {
+        struct btree_cache_shard *s = &c->shards[k];
+
+        if (s->entries == NULL) continue;
+        for (j = 0; j < s->size; j++) btree_free_node(s->entries[j].node);
+        free(s->entries);
+        free(s->buckets);
+        if (c->locking) pthread_mutex_destroy(&s->lock);
     }
+    free(c->shards);
+    free(c);
+}
 
-    /* Get an element from the current block, and return it to the
-     * caller. */
-    block = fl->blocks[fl->numblocks-1];
-    if (btree_pread_u64(bt,&p,block+((2+fl->last_items)*sizeof(uint64_t))) == -1) return -1;
-    fl->last_items--;
-    if (btree_pwrite_u64(bt,fl->last_items,block+(2*sizeof(uint64_t))) == -1) return -1;
-    btree_sync(bt);
-    *ptr = p+sizeof(uint64_t);
-    return 0;
+/* Evict all the nodes. */
+void btree_cache_clear(struct btree_cache *c) {
+    uint32_t j, k;
+
+    if (!c) return;
+    for (k = 0; k < c->numshards; k++) {
+        struct btree_cache_shard *s = &c->shards[k];
+
+        for (j = 0; j <= s->mask; j++) s->buckets[j] = -1;
+        for (j = 0; j < s->size; j++) {
+            s->entries[j].offset = 0;
+            s->entries[j].next = -1;
+            s->entries[j].referenced = 0;
+        }
+        s->hand = 0;
+    }
 }
 
-/* Return the next power of two that is able to hold size+1 bytes.
- * The byte we add is used to save the exponent of two as the first byte
- * so that for btree_free() can check the block size. */
-uint32_t btree_alloc_realsize(uint32_t size) {
-    uint32_t realsize;
+uint64_t btree_cache_hash(uint64_t offset) {
+    /* Offsets are multiple of 8, so we drop the low bits before mixing. */
+    return (offset >> 3) * 0x9E3779B97F4A7C15ULL;
+}
 
-    realsize = 16; /* We don't allocate nothing that is smaller than 16 bytes */
-    while (realsize < (size+sizeof(uint64_t))) realsize *= 2;
-    return realsize;
+/* Return the shard holding 'offset', locked if the cache is shared among
+ * threads. The shard and the bucket inside the shard are taken from
+ * different bits of the same hash. */
+struct btree_cache_shard *btree_cache_lock(struct btree_cache *c,
+                                           uint64_t offset)
+{
+    uint64_t h = btree_cache_hash(offset);
+    struct btree_cache_shard *s = &c->shards[(h >> 16) & (c->numshards-1)];
+
+    if (c->locking) pthread_mutex_lock(&s->lock);
+    return s;
 }
 
-/* Allocate some piece of data on disk. Returns the offset to the newly
- * allocated space. If the allocation can't be performed, 0 is returned. */
-uint64_t btree_alloc(struct btree *bt, uint32_t size) {
-    uint64_t ptr;
-    uint32_t realsize;
+void btree_cache_unlock(struct btree_cache *c, struct btree_cache_shard *s) {
+    if (c->locking) pthread_mutex_unlock(&s->lock);
+}
 
-    printf("ALLOCATIING %lu\n", (unsigned long) size);
+uint32_t btree_cache_bucket(struct btree_cache_shard *s, uint64_t offset) {
+    return (uint32_t) (btree_cache_hash(offset) >> 32) & s->mask;
+}
 
-    /* Don't allow allocations bigger than 2GB */
-    if (size > (unsigned)(1<<31)) {
-        errno = EINVAL;
-        return 0;
-    }
-    realsize = btree_alloc_realsize(size);
+/* Return the entry of the cached node at 'offset', or -1 if it is not in
+ * cache. */
+int btree_cache_lookup(struct btree_cache_shard *s, uint64_t offset) {
+    int e = s->buckets[btree_cache_bucket(s,offset)];
 
-    /* Search for free space in the free lists */
-    if (btree_alloc_freelist(bt,realsize,&ptr) == -1) return 0;
-    if (ptr) {
-        uint64_t oldsize;
-        /* Got an element from the free list. Fix the size header if needed. */
-        if (btree_pread_u64(bt,&oldsize,ptr-sizeof(uint64_t)) == -1) return 0;
-        if (oldsize != size) {
-            if (btree_pwrite_u64(bt,size,ptr-sizeof(uint64_t)) == -1)
-                return 0;
-            btree_sync(bt);
+    while (e != -1) {
+        if (s->entries[e].offset == offset) {
+            s->entries[e].referenced = 1;
+            return e;
         }
-        return ptr;
+        e = s->entries[e].next;
     }
+    return -1;
+}
 
-    /* We have to perform a real allocation.
-     * If we don't have room at the end of the file, create some space. */
-    if (bt->free < realsize) {
-        uint64_t currsize = bt->freeoff + bt->free;
-        if (bt->vfs->resize(bt->vfs_handle,currsize+BTREE_PREALLOC_SIZE) == -1)
-            return 0;
-        bt->free += BTREE_PREALLOC_SIZE;
+/* Copy the cached node at 'offset' into 'n'. The copy is performed while
+ * holding the shard lock, so that another thread can't evict or replace
+ * the node meanwhile. Returns 1 on hit, 0 if the node is not in cache. */
+int btree_cache_get(struct btree_cache *c, uint64_t offset,
+                    struct btree_node *n)
+{
+    struct btree_cache_shard *s = btree_cache_lock(c,offset);
+    int e;
+
+    if ((e = btree_cache_lookup(s,offset)) != -1) {
+        btree_copy_node(n,s->entries[e].node);
+        s->hits++;
+    } else {
+        s->misses++;
     }
+    btree_cache_unlock(c,s);
+    return e != -1;
+}
 
-    /* Allocate it moving the header pointers and free space count */
-    ptr = bt->freeoff;
-    bt->free -= realsize;
-    bt->freeoff += realsize;
+/* Unlink the entry 'e' from its hash chain and mark it as free. */
+void btree_cache_unlink(struct btree_cache_shard *s, int e) {
+    int *p = &s->buckets[btree_cache_bucket(s,s->entries[e].offset)];
 
-    if (btree_pwrite_u64(bt,bt->free,BTREE_HDR_FREE_POS) == -1) return -1;
-    if (btree_pwrite_u64(bt,bt->freeoff,BTREE_HDR_FREEOFF_POS) == -1) return -1;
+    while (*p != e) p = &s->entries[*p].next;
+    *p = s->entries[e].next;
+    s->entries[e].next = -1;
+    s->entries[e].offset = 0;
+    s->entries[e].referenced = 0;
+}
 
-    /* Write the size header in the new allocated space */
-    if (btree_pwrite_u64(bt,size,ptr) == -1) return -1;
+/* Evict the node at 'offset' if cached. */
+void btree_cache_del(struct btree_cache *c, uint64_t offset) {
+    struct btree_cache_shard *s;
+    int e;
 
-    /* A final fsync() as a write barrier */
-    btree_sync(bt);
-    return ptr+sizeof(uint64_t);
+    if (!c) return;
+    s = btree_cache_lock(c,offset);
+    if ((e = btree_cache_lookup(s,offset)) != -1) btree_cache_unlink(s,e);
+    btree_cache_unlock(c,s);
 }
 
-/* Given an on disk pointer returns the length of the original allocation
- * (not the size of teh chunk itself as power of two, but the original
- * argument passed to btree_alloc function).
+/* Make sure the node of the cache entry 'ce' can hold the keys of 'n'.
+ * Cached nodes only have room for the keys they hold, rounded up to
+ * BTREE_CACHE_KEYS_STEP, as nodes with many small keys, and prefix
+ * compressed nodes, have a capacity much bigger than the keys they usually
+ * hold. Returns 0 on success, -1 if out of memory. */
+int btree_cache_fit(struct btree_cache_entry *ce, struct btree_node *n) {
+    uint32_t maxkeys;
+
+    if (ce->node && ce->node->maxkeys >= n->numkeys) return 0;
+    maxkeys = (n->numkeys+BTREE_CACHE_KEYS_STEP) & ~(BTREE_CACHE_KEYS_STEP-1);
+    if (maxkeys > n->maxkeys) maxkeys = n->maxkeys;
+    btree_free_node(ce->node);
+    ce->node = btree_create_node(maxkeys,n->inlinelen,n->keylen);
+    return ce->node ? 0 : -1;
+}
+
+/* Store a copy of node 'n' in the cache as the node at 'offset', replacing
+ * the old cached version if any. If we are out of memory the node is just
+ * not cached. */
+void btree_cache_add(struct btree_cache *c, uint64_t offset,
+                     struct btree_node *n)
+{
+    struct btree_cache_shard *s;
+    struct btree_cache_entry *ce;
+    uint32_t b;
+    int e;
+
+    if (!c) return;
+    s = btree_cache_lock(c,offset);
+    if ((e = btree_cache_lookup(s,offset)) != -1) {
+        if (btree_cache_fit(&s->entries[e],n) == -1) {
+            btree_cache_unlink(s,e);
+            goto done;
+        }
+        btree_copy_node(s->entries[e].node,n);
+        goto done;
+    }
+
+    /* Run the CLOCK hand until we find a free or not referenced entry. */
+    while(1) {
+        ce = &s->entries[s->hand];
+        if (ce->offset == 0 || !ce->referenced) break;
+        ce->referenced = 0;
+        s->hand = (s->hand+1) % s->size;
+    }
+    if (ce->offset) btree_cache_unlink(s,s->hand);
+    if (btree_cache_fit(ce,n) == -1) goto done;
+    s->hand = (s->hand+1) % s->size;
+
+    btree_copy_node(ce->node,n);
+    ce->offset = offset;
+    ce->referenced = 1;
+    b = btree_cache_bucket(s,offset);
+    ce->next = s->buckets[b];
+    s->buckets[b] = ce - s->entries;
+
+done:
+    btree_cache_unlock(c,s);
+}
+
+/* ------------------------------ Value cache ------------------------------- */
+
+/* With the value_cache_size option the values read by btree_get() are
+ * cached by key, so that hot keys are served without descending the tree
+ * and reading their value, that is, with no I/O at all even when their
+ * nodes are not in the node cache.
  *
- * On success 0 is returned and the size parameter populated, otherwise
- * -1 is returned and errno set accordingly. */
-int btree_alloc_size(struct btree *bt, uint32_t *size, uint64_t ptr) {
-    uint64_t s;
+ * The cache has a budget of bytes, counting the keys, the values, and the
+ * entries holding them. Like the node cache it is partitioned into shards,
+ * by hash of the key, every one with its own lock when concurrent readers
+ * are enabled.
+ *
+ * Every shard evicts with S3-FIFO: entries are added to the small queue,
+ * taking BTREE_VCACHE_SMALL_PCT of the budget. When an entry reaches the
+ * end of the small queue it is moved to the main queue if it was hit
+ * meanwhile, otherwise it is evicted and its hash is remembered in the
+ * ghost table, so that if the key is added again soon it goes directly in
+ * the main queue. At the end of the main queue entries that were hit get
+ * another round, with their frequency decremented, and the others are
+ * evicted. Lookups only set the frequency, so hits don't move entries.
+ *
+ * Replaced and deleted keys are evicted by btree_add() and btree_delete().
+ * With BTREE_CONCURRENT readers see the last committed state, so keys are
+ * evicted only after the commit is visible, and readers add a value only
+ * if the root they read it from is still the current one. */
+
+/* Bytes of the budget taken by an entry. */
+#define BTREE_VCACHE_ENTRY_SIZE(keylen,vlen) \
+    (sizeof(struct btree_vcache_entry)+(keylen)+(vlen))
+
+/* Create a cache of 'size' bytes for keys of 'keylen' bytes, split into
+ * 'numshards' shards (a power of two). If 'locking' is true the shards are
+ * protected by mutexes. Returns NULL on out of memory. */
+struct btree_vcache *btree_vcache_create(uint64_t size, uint32_t numshards,
+                                         int locking, uint32_t keylen)
+{
+    struct btree_vcache *v;
+    uint32_t ghosts = 64, k;
 
-    if (btree_pread_u64(bt,&s,ptr-8) == -1) return -1;
-    *size = (uint32_t) s;
-    return 0;
+    if ((v = calloc(1,sizeof(*v))) == NULL) return NULL;
+    if ((v->shards = calloc(numshards,sizeof(*v->shards))) == NULL) {
+        free(v);
+        return NULL;
+    }
+    v->numshards = numshards;
+    v->locking = locking;
+    v->keylen = keylen;
+    size /= numshards;
+    /* About as many ghosts as small entries of a few hundred bytes. */
+    while (ghosts < size/512 && ghosts < (1U<<30)) ghosts *= 2;
+    for (k = 0; k < numshards; k++) {
+        struct btree_vcache_shard *s = &v->shards[k];
+
+        s->budget = size;
+        s->mask = 63;
+        s->buckets = calloc(s->mask+1,sizeof(*s->buckets));
+        s->ghostmask = ghosts-1;
+        s->ghosts = calloc(ghosts,sizeof(uint64_t));
+        if (s->buckets == NULL || s->ghosts == NULL) {
+            btree_vcache_release(v);
+            return NULL;
+        }
+        if (locking) pthread_mutex_init(&s->lock,NULL);
+    }
+    return v;
 }
 
-/* Return the free list slot index given the power of two exponent representing
- * the size of the free list allocations. */
-int btree_freelist_index_by_exp(int exponent) {
-    assert(exponent > 1 && exponent < 32);
-    return exponent-4;
+/* Free all the entries of the shard. */
+void btree_vcache_empty(struct btree_vcache_shard *s) {
+    int q;
+
+    for (q = BTREE_VCACHE_SMALL; q <= BTREE_VCACHE_MAIN; q++) {
+        struct btree_vcache_entry *e = s->queue[q].head, *next;
+
+        for (; e; e = next) {
+            next = e->next;
+            free(e);
+        }
+        s->queue[q].head = s->queue[q].tail = NULL;
+        s->queue[q].bytes = 0;
+    }
+    memset(s->buckets,0,sizeof(*s->buckets)*(s->mask+1));
+    s->count = 0;
 }
 
-/* Release allocated memory, putting the pointer in the right free list.
- * On success 0 is returned. On error -1. */
-int btree_free(struct btree *bt, uint64_t ptr) {
-    uint64_t size;
-    uint32_t realsize;
-    int fli, exp;
-    struct btree_freelist *fl;
+void btree_vcache_release(struct btree_vcache *v) {
+    uint32_t k;
 
-    if (btree_pread_u64(bt,&size,ptr-sizeof(uint64_t)) == -1) return -1;
-    realsize = btree_alloc_realsize(size);
-    exp = btree_log_two(realsize);
-    printf("Free %llu bytes (realsize: %llu)\n", size, (uint64_t) realsize);
+    if (!v) return;
+    for (k = 0; k < v->numshards; k++) {
+        struct btree_vcache_shard *s = &v->shards[k];
 
-    fli = btree_freelist_index_by_exp(exp);
-    fl = &bt->freelist[fli];
+        if (s->buckets) btree_vcache_empty(s);
+        free(s->buckets);
+        free(s->ghosts);
+        if (v->locking && s->buckets && s->ghosts)
+            pthread_mutex_destroy(&s->lock);
+    }
+    free(v->shards);
+    free(v->pending);
+    free(v);
+}
 
-    /* We need special handling when freeing an allocation that is the same
-     * size of the freelist block, and the latest free list block for that size
-     * is full. Without this special handling what happens is that we need
-     * to allocate a new block of the same size to make space, but doing so
-     * would result in an element removed from the latest block, so after we
-     * link the new block we have the previous block that is not full.
-     *
-     * Check BTREE.txt in this source distribution for more information. */
-    if (fl->last_items == BTREE_FREELIST_BLOCK_ITEMS &&
-        exp == BTREE_FREELIST_SIZE_EXP)
-    {
-        /* Just use the freed allocation as the next free block */
-        fl->blocks = realloc(fl->blocks,sizeof(uint64_t)*(fl->numblocks+1));
-        if (fl->blocks == NULL) return -1;
-        fl->blocks[fl->numblocks] = ptr;
-        fl->numblocks++;
-        fl->last_items = 0;
-        /* Init block setting items count, next pointer, prev pointer. */
-        btree_pwrite_u64(bt,0,ptr+sizeof(uint64_t)); /* next */
-        btree_pwrite_u64(bt,fl->blocks[fl->numblocks-2],ptr); /* prev */
-        btree_pwrite_u64(bt,0,ptr+sizeof(uint64_t)*2); /* numitems */
-        btree_sync(bt); /* Make sure it's ok before linking it to prev block */
-        /* Link this new block to the free list blocks updating next pointer
-         * of the previous block. */
-        btree_pwrite_u64(bt,ptr,fl->blocks[fl->numblocks-2]+sizeof(uint64_t));
-        btree_sync(bt);
-    } else {
-        /* Allocate a new block if needed */
-        if (fl->last_items == BTREE_FREELIST_BLOCK_ITEMS) {
-            uint64_t newblock;
+/* Evict all the values. */
+void btree_vcache_clear(struct btree_vcache *v) {
+    uint32_t k;
 
-            newblock = btree_alloc(bt,BTREE_FREELIST_BLOCK_SIZE);
-            if (newblock == 0) return -1;
+    if (!v) return;
+    for (k = 0; k < v->numshards; k++) {
+        struct btree_vcache_shard *s = &v->shards[k];
 
-            fl->blocks = realloc(fl->blocks,sizeof(uint64_t)*(fl->numblocks+1));
-            if (fl->blocks == NULL) return -1;
-            fl->blocks[fl->numblocks] = newblock;
-            fl->numblocks++;
-            fl->last_items = 0;
-            /* Init block setting items count, next pointer, prev pointer. */
-            btree_pwrite_u64(bt,0,newblock+sizeof(uint64_t)); /* next */
-            btree_pwrite_u64(bt,fl->blocks[fl->numblocks-2],newblock);/* prev */
-            btree_pwrite_u64(bt,0,newblock+sizeof(uint64_t)*2); /* numitems */
-            btree_sync(bt); /* Make sure it's ok before linking it. */
-            /* Link this new block to the free list blocks updating next pointer
-             * of the previous block. */
-            btree_pwrite_u64(bt,newblock,fl->blocks[fl->numblocks-2]+sizeof(uint64_t));
-            btree_sync(bt);
-        }
-        /* Add the item */
-        fl->last_block[fl->last_items] = ptr-sizeof(uint64_t);
-        fl->last_items++;
-        /* Write the pointer in the block first */
-        printf("Write freelist item about ptr %llu at %llu\n",
-            ptr, fl->blocks[fl->numblocks-1]+(sizeof(uint64_t)*3)
-            +(sizeof(uint64_t)*(fl->last_items-1)));
-        btree_pwrite_u64(bt,ptr-sizeof(uint64_t),fl->blocks[fl->numblocks-1]+(sizeof(uint64_t)*3)+(sizeof(uint64_t)*(fl->last_items-1)));
-        btree_sync(bt);
-        /* Then write the items count. */
-        printf("Write the new count for block %lld: %lld at %lld\n",
-            fl->blocks[fl->numblocks-1],
-            (uint64_t) fl->last_items,
-            fl->blocks[fl->numblocks-1]+sizeof(uint64_t)*2);
-        btree_pwrite_u64(bt,fl->last_items,fl->blocks[fl->numblocks-1]+sizeof(uint64_t)*2);
-        btree_sync(bt);
+        if (v->locking) pthread_mutex_lock(&s->lock);
+        btree_vcache_empty(s);
+        memset(s->ghosts,0,sizeof(uint64_t)*(s->ghostmask+1));
+        if (v->locking) pthread_mutex_unlock(&s->lock);
     }
-    return 0;
 }
 
-/* --------------------------- btree operations  ---------------------------- */
+/* Return the shard of the key with hash 'h', locked if the cache is shared
+ * among threads. The high bits of the hash select the shard, the low bits
+ * the bucket. */
+struct btree_vcache_shard *btree_vcache_lock(struct btree_vcache *v,
+                                             uint64_t h)
+{
+    struct btree_vcache_shard *s = &v->shards[(h >> 48) & (v->numshards-1)];
 
-int btree_node_is_full(struct btree_node *n) {
-    return n->numkeys == BTREE_MAX_KEYS;
+    if (v->locking) pthread_mutex_lock(&s->lock);
+    return s;
 }
 
-/* Add a key at the specified position 'i' inside an in-memory node.
- * All the other keys starting from the old key at position 'i' are
- * shifted one position to the right.
- *
- * Note: this function does not change the position of the children as it
- * is intented to be used only on leafs. */
-void btree_node_insert_key_at(struct btree_node *n, int i, unsigned char *key, uint64_t valoff) {
-    void *p;
-    
-    p = n->keys + (i*BTREE_HASHED_KEY_LEN);
-    memmove(p+BTREE_HASHED_KEY_LEN,p,(n->numkeys-i)*BTREE_HASHED_KEY_LEN);
-    memmove(n->values+i+1,n->values+i,(n->numkeys-i)*8);
-    memcpy(p,key,BTREE_HASHED_KEY_LEN);
-    n->values[i] = valoff;
-    n->numkeys++;
+void btree_vcache_unlock(struct btree_vcache *v, struct btree_vcache_shard *s) {
+    if (v->locking) pthread_mutex_unlock(&s->lock);
 }
 
-/* Insert a key (and associated value) into a non full node.
- * If the node is a leaf the key can be inserted in the current node otherwise
- * we need to walk the three, possibly splitting full nodes as we descend.
- *
- * The nodeptr is the offset of the node we want to insert into.
- *
- * Pointedby is the offset on disk inside the parent of the node pointed by
- * 'nodeptr'. As we always write new full nodes instead of modifying old ones
- * in order to be more crash proof, we need to update the pointer in the
- * parent node when everything is ready.
- *
- * The function returns 0 on success, and -1 on error.
- * On error errno is set accordingly, and may also assume the following values:
- *
- * EFAULT if the btree seems corrupted.
- * EEXIST if the key already exists.
- */
-int btree_add_nonfull(struct btree *bt, uint64_t nodeptr, uint64_t pointedby, unsigned char *key, unsigned char *val, size_t vlen, int replace) {
-    struct btree_node *n = NULL;
-    int i, found = 0;
+/* Return the entry of the key, or NULL if it is not cached. */
+struct btree_vcache_entry *btree_vcache_lookup(struct btree_vcache *v,
+    struct btree_vcache_shard *s, const unsigned char *key, uint64_t h)
+{
+    struct btree_vcache_entry *e = s->buckets[h & s->mask];
 
-    if ((n = btree_read_node(bt,nodeptr)) == NULL) return -1;
-    i = n->numkeys-1;
+    while (e && (e->hash != h || memcmp(e->data,key,v->keylen)))
+        e = e->hnext;
+    return e;
+}
 
-    /* Seek to the right position in the current node */
-    while(1) {
-        int cmp;
+/* Insert the entry at the head of the queue 'q'. */
+void btree_vcache_push(struct btree_vcache *v, struct btree_vcache_shard *s,
+                       struct btree_vcache_entry *e, int q)
+{
+    struct btree_vcache_queue *qu = &s->queue[q];
+
+    e->queue = q;
+    e->prev = NULL;
+    e->next = qu->head;
+    if (qu->head) qu->head->prev = e;
+    else qu->tail = e;
+    qu->head = e;
+    qu->bytes += BTREE_VCACHE_ENTRY_SIZE(v->keylen,e->vlen);
+}
 
-        if (i < 0) break;
-        cmp = memcmp(key,n->keys+i*BTREE_HASHED_KEY_LEN,BTREE_HASHED_KEY_LEN);
-        if (cmp == 0) {
-            found = 1; /* the key is already present in the btree */
-            break;
-        }
-        if (cmp >= 0) break;
-        i--;
-    }
+/* Remove the entry from its queue. */
+void btree_vcache_pop(struct btree_vcache *v, struct btree_vcache_shard *s,
+                      struct btree_vcache_entry *e)
+{
+    struct btree_vcache_queue *qu = &s->queue[e->queue];
 
-    /* Key already present? Replace it with the new value if replace is true
-     * otherwise return an error. */
-    if (found) {
-        if (!replace) {
-            errno = EBUSY;
-            return -1;
+    if (e->prev) e->prev->next = e->next;
+    else qu->head = e->next;
+    if (e->next) e->next->prev = e->prev;
+    else qu->tail = e->prev;
+    qu->bytes -= BTREE_VCACHE_ENTRY_SIZE(v->keylen,e->vlen);
+}
+
+/* Remove the entry from the shard and free it. */
+void btree_vcache_unlink(struct btree_vcache *v, struct btree_vcache_shard *s,
+                         struct btree_vcache_entry *e)
+{
+    struct btree_vcache_entry **p = &s->buckets[e->hash & s->mask];
+
+    while (*p != e) p = &(*p)->hnext;
+    *p = e->hnext;
+    btree_vcache_pop(v,s,e);
+    s->count--;
+    free(e);
+}
+
+/* Evict entries until the shard is within its budget. */
+void btree_vcache_evict(struct btree_vcache *v, struct btree_vcache_shard *s) {
+    struct btree_vcache_queue *small = &s->queue[BTREE_VCACHE_SMALL];
+    struct btree_vcache_queue *mainq = &s->queue[BTREE_VCACHE_MAIN];
+
+    while (small->bytes+mainq->bytes > s->budget) {
+        struct btree_vcache_entry *e;
+
+        if (small->bytes > s->budget/100*BTREE_VCACHE_SMALL_PCT ||
+            mainq->tail == NULL)
+        {
+            e = small->tail;
+            if (e->freq) {
+                btree_vcache_pop(v,s,e);
+                e->freq = 0;
+                btree_vcache_push(v,s,e,BTREE_VCACHE_MAIN);
+            } else {
+                s->ghosts[e->hash & s->ghostmask] = e->hash;
+                btree_vcache_unlink(v,s,e);
+            }
         } else {
-            uint64_t oldvaloff = n->values[i];
-            uint64_t newvaloff;
+            e = mainq->tail;
+            if (e->freq) {
+                btree_vcache_pop(v,s,e);
+                e->freq--;
+                btree_vcache_push(v,s,e,BTREE_VCACHE_MAIN);
+            } else {
+                btree_vcache_unlink(v,s,e);
+            }
+        }
+    }
+}
 
-            if ((newvaloff = btree_alloc(bt,vlen)) == 0) goto err;
-            if (btree_pwrite(bt,val,vlen,newvaloff) == -1) goto err;
-            btree_sync(bt);
-            /* Overwrite the pointer to the old value off with the new one. */
-            if (btree_pwrite_u64(bt,newvaloff,nodeptr+16+(BTREE_HASHED_KEY_LEN*BTREE_MAX_KEYS)+(8*i)) == -1) goto err;
-            /* Finally we can free the old value, and the in memory node. */
-            btree_free(bt,oldvaloff);
-            btree_free_node(n);
-            return 0;
+/* Double the buckets of the shard when it has more entries than buckets.
+ * If we are out of memory the chains just get longer. */
+void btree_vcache_rehash(struct btree_vcache_shard *s) {
+    struct btree_vcache_entry **buckets, *e, *next;
+    uint32_t mask = s->mask*2+1, j;
+
+    if (s->count <= s->mask || mask > (1U<<30)) return;
+    if ((buckets = calloc(mask+1,sizeof(*buckets))) == NULL) return;
+    for (j = 0; j <= s->mask; j++) {
+        for (e = s->buckets[j]; e; e = next) {
+            next = e->hnext;
+            e->hnext = buckets[e->hash & mask];
+            buckets[e->hash & mask] = e;
         }
     }
+    free(s->buckets);
+    s->buckets = buckets;
+    s->mask = mask;
+}
 
-    if (n->isleaf) {
-        uint64_t newoff; /* New node offset */
-        uint64_t valoff; /* Value offset on disk */
-
-        /* Write the value on disk */
-        if ((valoff = btree_alloc(bt,vlen)) == 0) goto err;
-        if (btree_pwrite(bt,val,vlen,valoff) == -1) goto err;
-        /* Insert the new key in place, and a pointer to the value. */
-        btree_node_insert_key_at(n,i+1,key,valoff);
-        /* Write the modified node to disk */
-        if ((newoff = btree_alloc(bt,BTREE_NODE_SIZE)) == 0) goto err;
-        if (btree_write_node(bt,n,newoff) == -1) goto err;
-        /* Update the pointer pointing to this node with the new node offset. */
-        if (btree_pwrite_u64(bt,newoff,pointedby) == -1) goto err;
-        if (pointedby == BTREE_HDR_ROOTPTR_POS) bt->rootptr = newoff;
-        /* Free the old node on disk */
-        if (btree_free(bt,nodeptr) == -1) goto err;
-        btree_free_node(n);
+/* Look up the value of the key in the cache of the btree. On hit 1 is
+ * returned, and '*val' is set to a copy of the value allocated with
+ * malloc(), like btree_get() does. Otherwise 0 is returned. */
+int btree_vcache_get(struct btree *bt, const unsigned char *key,
+                     unsigned char **val, uint32_t *vlen)
+{
+    struct btree_vcache *v = bt->vcache;
+    struct btree_vcache_shard *s;
+    struct btree_vcache_entry *e;
+    uint64_t h = btree_bloom_hash(key,v->keylen);
+
+    s = btree_vcache_lock(v,h);
+    if ((e = btree_vcache_lookup(v,s,key,h)) != NULL &&
+        (*val = malloc(e->vlen ? e->vlen : 1)) != NULL)
+    {
+        memcpy(*val,e->data+v->keylen,e->vlen);
+        *vlen = e->vlen;
+        if (e->freq < 3) e->freq++;
+        s->hits++;
     } else {
-        struct btree_node *child;
-        uint64_t newnode;
-
-        i++;
-        if ((child = btree_read_node(bt,n->children[i])) == NULL) return -1;
-        if (btree_node_is_full(child)) {
-            if (btree_split_child(bt,pointedby,nodeptr,i,n->children[i],
-                &newnode) == -1)
-            {
-                btree_free_node(child);
-                goto err;
-            }
-        } else {
-            pointedby = nodeptr+16+BTREE_HASHED_KEY_LEN*BTREE_MAX_KEYS+8*BTREE_MAX_KEYS+8*i;
-            newnode = n->children[i];
-            /* Fixme, here we can set 'n' to 'child' and tail-recurse with
-             * a goto, to avoid re-reading the same node again. */
-        }
-        btree_free_node(n);
-        btree_free_node(child);
-        return btree_add_nonfull(bt,newnode,pointedby,key,val,vlen,replace);
+        e = NULL;
+        s->misses++;
     }
-    return 0;
+    btree_vcache_unlock(v,s);
+    return e != NULL;
+}
 
-err:
-    btree_free_node(n);
-    return -1;
+/* Add the value of the key, read by btree_get() from the tree with root at
+ * 'root'. With BTREE_CONCURRENT the value is added only if 'root' is still
+ * the last committed root, otherwise the value may be already replaced,
+ * and its eviction already performed. If we are out of memory the value is
+ * just not cached. */
+void btree_vcache_add(struct btree *bt, const unsigned char *key,
+                      const unsigned char *val, uint32_t vlen, uint64_t root)
+{
+    struct btree_vcache *v = bt->vcache;
+    struct btree_vcache_shard *s;
+    struct btree_vcache_entry *e;
+    uint64_t h = btree_bloom_hash(key,v->keylen), *ghost;
+
+    if (BTREE_VCACHE_ENTRY_SIZE(v->keylen,vlen) > v->shards[0].budget/8)
+        return;
+    s = btree_vcache_lock(v,h);
+    if (btree_read_root(bt) != root || btree_vcache_lookup(v,s,key,h) ||
+        (e = malloc(BTREE_VCACHE_ENTRY_SIZE(v->keylen,vlen))) == NULL)
+        goto done;
+    e->hash = h;
+    e->vlen = vlen;
+    e->freq = 0;
+    e->data = (unsigned char*)(e+1);
+    memcpy(e->data,key,v->keylen);
+    memcpy(e->data+v->keylen,val,vlen);
+    e->hnext = s->buckets[h & s->mask];
+    s->buckets[h & s->mask] = e;
+    s->count++;
+    ghost = &s->ghosts[h & s->ghostmask];
+    if (*ghost == h) {
+        *ghost = 0;
+        btree_vcache_push(v,s,e,BTREE_VCACHE_MAIN);
+    } else {
+        btree_vcache_push(v,s,e,BTREE_VCACHE_SMALL);
+    }
+    btree_vcache_evict(v,s);
+    btree_vcache_rehash(s);
+
+done:
+    btree_vcache_unlock(v,s);
 }
 
-/* Split child, that is the i-th child of parent.
- * We'll write three new nodes, two to split the original child in two nodes
- * and one containing the updated parent.
- * Finally we'll set 'pointedby' to the offset of the new parent. So
- * pointedby must point to the offset where the parent is referenced on disk,
- * that is the root pointer heeader if it's the root node, or the right offset
- * inside its parent (that is, the parent of the parent). */
-int btree_split_child(struct btree *bt, uint64_t pointedby, uint64_t parentoff,
-                      int i, uint64_t childoff, uint64_t *newparent)
-{
-    struct btree_node *lnode = NULL, *rnode = NULL;
-    struct btree_node *child = NULL, *parent = NULL;
-    int halflen = (BTREE_MAX_KEYS-1)/2;
-    uint64_t loff, roff, poff; /* new left, right, parent nodes offets. */
-
-    /* Read parent and child from disk.
-     * Also creates new nodes in memory, lnode and rnode, that will be
-     * the nodes produced splitting the child into two nodes. */
-    if ((parent = btree_read_node(bt,parentoff)) == NULL) goto err;
-    if ((child = btree_read_node(bt,childoff)) == NULL) goto err;
-    if ((lnode = btree_create_node()) == NULL) goto err;
-    if ((rnode = btree_create_node()) == NULL) goto err;
-    /* Two fundamental conditions that must be always true */
-    assert(child->numkeys == BTREE_MAX_KEYS);
-    assert(parent->numkeys != BTREE_MAX_KEYS);
-    /* Split the child into lnode and rnode */
-    memcpy(lnode->keys,child->keys,BTREE_HASHED_KEY_LEN*halflen);
-    memcpy(lnode->values,child->values,8*halflen);
-    memcpy(lnode->children,child->children,8*(halflen+1));
-    lnode->numkeys = halflen;
-    lnode->isleaf = child->isleaf;
-    /* And the rnode */
-    memcpy(rnode->keys,child->keys+BTREE_HASHED_KEY_LEN*(halflen+1),
-                                   BTREE_HASHED_KEY_LEN*halflen);
-    memcpy(rnode->values,child->values+halflen+1,8*halflen);
-    memcpy(rnode->children,child->children+halflen+1,8*(halflen+1));
-    rnode->numkeys = halflen;
-    rnode->isleaf = child->isleaf;
-    /* Save left and right children on disk */
-    if ((loff = btree_alloc(bt,BTREE_NODE_SIZE)) == 0) goto err;
-    if ((roff = btree_alloc(bt,BTREE_NODE_SIZE)) == 0) goto err;
-    if (btree_write_node(bt,lnode,loff) == -1) goto err;
-    if (btree_write_node(bt,rnode,roff) == -1) goto err;
-
-    /* Now fix the parent node:
-     * let's move the child's median key into the parent.
-     * Shift the current keys, values, and child pointers. */
-    memmove(parent->keys+BTREE_HASHED_KEY_LEN*(i+1),
-            parent->keys+BTREE_HASHED_KEY_LEN*i,
-            (parent->numkeys-i)*BTREE_HASHED_KEY_LEN);
-    memmove(parent->values+i+1,parent->values+i,(parent->numkeys-i)*8);
-    memmove(parent->children+i+2,parent->children+i+1,(parent->numkeys-i)*8);
-    /* Set the key and left and right children */
-    memcpy(parent->keys+BTREE_HASHED_KEY_LEN*i,
-           child->keys+BTREE_HASHED_KEY_LEN*halflen,BTREE_HASHED_KEY_LEN);
-    parent->values[i] = child->values[halflen];
-    parent->children[i] = loff;
-    parent->children[i+1] = roff;
-    parent->numkeys++;
-    /* Write the parent on disk */
-    if ((poff = btree_alloc(bt,BTREE_NODE_SIZE)) == 0) goto err;
-    if (btree_write_node(bt,parent,poff) == -1) goto err;
-    if (newparent) *newparent = poff;
-    /* Now link the new nodes to the old btree */
-    btree_sync(bt); /* Make sure the nodes are flushed */
-    if (btree_pwrite_u64(bt,poff,pointedby) == -1) goto err;
-    if (pointedby == BTREE_HDR_ROOTPTR_POS) bt->rootptr = poff;
-    /* Finally reclaim the space used by the old nodes */
-    btree_free(bt,parentoff);
-    btree_free(bt,childoff);
-
-    btree_free_node(lnode);
-    btree_free_node(rnode);
-    btree_free_node(parent);
-    btree_free_node(child);
-    return 0;
+/* Evict the key now. */
+void btree_vcache_evict_key(struct btree_vcache *v, const unsigned char *key) {
+    struct btree_vcache_shard *s;
+    struct btree_vcache_entry *e;
+    uint64_t h = btree_bloom_hash(key,v->keylen);
 
-err:
-    btree_free_node(lnode);
-    btree_free_node(rnode);
-    btree_free_node(parent);
-    btree_free_node(child);
-    return -1;
+    s = btree_vcache_lock(v,h);
+    if ((e = btree_vcache_lookup(v,s,key,h)) != NULL)
+        btree_vcache_unlink(v,s,e);
+    btree_vcache_unlock(v,s);
 }
 
-int btree_add(struct btree *bt, unsigned char *key, unsigned char *val, size_t vlen, int replace) {
-    struct btree_node *root;
+/* Called by the writer before the value of the key is replaced or the key
+ * is deleted. With BTREE_CONCURRENT the key is evicted after the commit by
+ * btree_vcache_commit(), as readers would add the old value again until
+ * then. If we can't remember the key the whole cache will be cleared. */
+void btree_vcache_del(struct btree *bt, const unsigned char *key) {
+    struct btree_vcache *v = bt->vcache;
 
-    if ((root = btree_read_node(bt,bt->rootptr)) == NULL) return -1;
+    if (!v) return;
+    if (!(bt->openflags & BTREE_CONCURRENT)) {
+        btree_vcache_evict_key(v,key);
+        return;
+    }
+    if (v->pending_clear) return;
+    if (v->numpending == v->maxpending) {
+        uint32_t maxpending = v->maxpending ? v->maxpending*2 : 64;
+        unsigned char *pending = realloc(v->pending,v->keylen*maxpending);
+
+        if (pending == NULL) {
+            v->pending_clear = 1;
+            return;
+        }
+        v->pending = pending;
+        v->maxpending = maxpending;
+    }
+    memcpy(v->pending+v->keylen*v->numpending++,key,v->keylen);
+}
 
-    if (btree_node_is_full(root)) {
-        uint64_t rootptr;
+/* Called after a new root was published: evict the keys changed by the
+ * commit. */
+void btree_vcache_commit(struct btree *bt) {
+    struct btree_vcache *v = bt->vcache;
+    uint32_t j;
 
-        /* Root is full. Split it. */
-        btree_free_node(root);
-        root = NULL;
-        /* Create a fresh node on disk: will be our new root. */
-        if ((root = btree_create_node()) == NULL) return -1;
-        if ((rootptr = btree_alloc(bt,BTREE_NODE_SIZE)) == 0) goto err;
-        if (btree_write_node(bt,root,rootptr) == -1) goto err;
-        btree_free_node(root);
-        /* Split it */
-        if (btree_split_child(bt,BTREE_HDR_ROOTPTR_POS,rootptr,0,bt->rootptr,NULL) == -1) goto err;
+    if (!v) return;
+    if (v->pending_clear) {
+        btree_vcache_clear(v);
+        v->pending_clear = 0;
     } else {
-        btree_free_node(root);
+        for (j = 0; j < v->numpending; j++)
+            btree_vcache_evict_key(v,v->pending+v->keylen*j);
     }
-    return btree_add_nonfull(bt,bt->rootptr,BTREE_HDR_ROOTPTR_POS,key,val,vlen,replace);
+    v->numpending = 0;
+}
 
-err:
-    btree_free_node(root);
-    return -1;
+/* ----------------------------- Nodes on disk ------------------------------ */
+
+/* The integers of the nodes (marks, counters, value and child pointers) are
+ * big endian in version 1 files and little endian in version 2 files. The
+ * size headers of inline values are always big endian, like the ones of
+ * allocations, so that btree_alloc_size() works for both. */
+void btree_node_put_u32(struct btree *bt, unsigned char *buf, uint32_t val) {
+    if (bt->version == BTREE_VERSION_1) btree_u32_to_big(buf,val);
+    else btree_u32_to_little(buf,val);
 }
 
-/* Find a record by key.
- * The function seraches for the specified key. If the key is found
- * 0 is returned, and *voff is set to the offset of the value on disk.
- * 
- * On error -1 is returned and errno set accordingly.
- * 
- * Non existing key is considered an error with errno = ENOENT. */
-int btree_find(struct btree *bt, unsigned char *key, uint64_t *voff) {
-    struct btree_node *n;
-    uint64_t nptr = bt->rootptr;
-    unsigned int j;
+uint32_t btree_node_get_u32(struct btree *bt, const unsigned char *buf) {
+    if (bt->version == BTREE_VERSION_1)
+        return btree_u32_from_big((unsigned char*)buf);
+    return btree_u32_from_little(buf);
+}
 
-    while(1) {
-        int cmp;
+void btree_node_put_u64s(struct btree *bt, unsigned char *buf,
+                         const uint64_t *vals, uint32_t count)
+{
+    uint32_t j;
 
-        if ((n = btree_read_node(bt,nptr)) == NULL) return -1;
-        for (j = 0; j < n->numkeys; j++) {
-            cmp = memcmp(key,n->keys+BTREE_HASHED_KEY_LEN*j,
-                BTREE_HASHED_KEY_LEN);
-            if (cmp <= 0) break;
-        }
-        if (j < n->numkeys && cmp == 0) {
-            if (voff) *voff = n->values[j];
-            btree_free_node(n);
+    if (bt->version == BTREE_VERSION_1) {
+        for (j = 0; j < count; j++) btree_u64_to_big(buf+8*j,vals[j]);
+    } else {
+        btree_u64s_to_little(buf,vals,count);
+    }
+}
+
+void btree_node_get_u64s(struct btree *bt, uint64_t *vals,
+                         const unsigned char *buf, uint32_t count)
+{
+    uint32_t j;
+
+    if (bt->version == BTREE_VERSION_1) {
+        for (j = 0; j < count; j++)
+            vals[j] = btree_u64_from_big((unsigned char*)buf+8*j);
+    } else {
+        btree_u64s_from_little(vals,buf,count);
+    }
+}
+
+/* Overwrite in place the pointer at 'offset' inside a node on disk. */
+int btree_pwrite_node_u64(struct btree *bt, uint64_t val, uint64_t offset) {
+    unsigned char buf[8];
+
+    btree_node_put_u64s(bt,buf,&val,1);
+    if (btree_pwrite(bt,buf,8,offset) == -1) return -1;
+    return 0;
+}
+
+/* Return the length of the key 'k' of 'keylen' bytes without the trailing
+ * zero bytes, that prefix compressed nodes don't store. */
+uint32_t btree_key_len(const unsigned char *k, uint32_t keylen) {
+    uint64_t word;
+
+    while (keylen >= 8) {
+        memcpy(&word,k+keylen-8,8);
+        if (word) break;
+        keylen -= 8;
+    }
+    while (keylen && k[keylen-1] == 0) keylen--;
+    return keylen;
+}
+
+/* Return the length of the common prefix of the keys 'a' and 'b'. */
+uint32_t btree_key_lcp(const unsigned char *a, const unsigned char *b,
+                       uint32_t keylen)
+{
+    uint32_t i = 0;
+
+    while (i+8 <= keylen && memcmp(a+i,b+i,8) == 0) i += 8;
+    while (i < keylen && a[i] == b[i]) i++;
+    return i;
+}
+
+/* Return the length of the prefix factored out by a prefix compressed node
+ * having the keys of 'n' from 'first' to 'last' (included). As the keys
+ * are sorted, the prefix common to all the keys is the one of the first
+ * and the last key. The prefix of a single key is the whole key. */
+uint32_t btree_keys_prefix(struct btree_node *n, const unsigned char *first,
+                           const unsigned char *last)
+{
+    if (first == last) return btree_key_len(first,n->keylen);
+    return btree_key_lcp(first,last,n->keylen);
+}
+
+uint32_t btree_node_prefix(struct btree_node *n) {
+    if (n->numkeys == 0) return 0;
+    return btree_keys_prefix(n,(unsigned char*)n->keys,
+               (unsigned char*)n->keys+(n->numkeys-1)*n->keylen);
+}
+
+/* Return the bytes taken by the suffixes of 'count' keys of 'n' starting
+ * at 'i', when the first 'plen' bytes of every key are in the prefix.
+ * Only the first key of a node can be shorter than the prefix, if it is
+ * equal to the prefix padded with zeros. */
+uint32_t btree_keys_suffix_size(struct btree_node *n, int i, int count,
+                                uint32_t plen)
+{
+    uint32_t size = 0, len;
+
+    for (; count > 0; count--, i++) {
+        len = btree_key_len((unsigned char*)n->keys+i*n->keylen,n->keylen);
+        if (len > plen) size += len-plen;
+    }
+    return size;
+}
+
+/* Return the bytes needed to store the node 'n' on disk. Nodes that are not
+ * prefix compressed always take bt->nodesize bytes. */
+uint32_t btree_node_size(struct btree *bt, struct btree_node *n) {
+    uint32_t plen;
+
+    if (!bt->prefixed) return bt->nodesize;
+    plen = btree_node_prefix(n);
+    return BTREE_PNODE_FIXED+plen+
+           n->numkeys*BTREE_PNODE_KEY_SIZE(bt->inlinelen)+
+           btree_keys_suffix_size(n,0,n->numkeys,plen);
+}
+
+/* Encode the arrays of the prefix compressed node 'n' at 'p', that is
+ * after the node header in the node buffer, up to the end mark. Returns
+ * the length of the prefix, or -1 with errno set to EFBIG if the node does
+ * not fit, that should never happen as nodes too big are split. */
+int btree_encode_pnode(struct btree *bt, struct btree_node *n,
+                       unsigned char *p)
+{
+    unsigned char *end = bt->nodebuf+bt->nodesize-4, *ends, *data;
+    uint32_t plen = btree_node_prefix(n), slot = bt->inlinelen+8, len, j;
+    uint32_t suffixes = 0;
+
+    if (p+BTREE_PNODE_FIXED-16+n->numkeys*BTREE_PNODE_KEY_SIZE(bt->inlinelen)+
+        plen > end+4) goto toobig;
+    /* values and children */
+    btree_node_put_u64s(bt,p,n->values,n->numkeys);
+    p += 8*n->numkeys;
+    btree_node_put_u64s(bt,p,n->children,n->numkeys+1);
+    p += 8*(n->numkeys+1);
+    /* inline values */
+    if (bt->inlinelen) {
+        for (j = 0; j < n->numkeys; j++) {
+            len = BTREE_VALUE_IS_INLINE(n->values[j]) ?
+                  BTREE_VALUE_INLINE_LEN(n->values[j]) : 0;
+            btree_u64_to_big(p,len);
+            memcpy(p+8,n->inl+bt->inlinelen*j,len);
+            memset(p+8+len,0,bt->inlinelen-len);
+            p += slot;
+        }
+    }
+    /* suffix end offsets, prefix and suffixes */
+    ends = p;
+    data = ends+2*n->numkeys;
+    memcpy(data,n->keys,plen);
+    data += plen;
+    for (j = 0; j < n->numkeys; j++) {
+        unsigned char *k = (unsigned char*)n->keys+j*n->keylen;
+
+        len = btree_key_len(k,n->keylen);
+        if (len > plen) {
+            len -= plen;
+            if (data+suffixes+len > end) goto toobig;
+            memcpy(data+suffixes,k+plen,len);
+            suffixes += len;
+        }
+        ends[j*2] = suffixes >> 8;
+        ends[j*2+1] = suffixes & 0xff;
+    }
+    memset(data+suffixes,0,end-data-suffixes);
+    return plen;
+
+toobig:
+    errno = EFBIG;
+    return -1;
+}
+
+/* Decode the arrays of a prefix compressed node, see btree_encode_pnode().
+ * Returns 0 on success, or -1 with errno set to EFAULT if the data is
+ * corrupted. */
+int btree_decode_pnode(struct btree *bt, struct btree_node *n,
+                       unsigned char *buf, uint32_t plen)
+{
+    unsigned char *p = buf+16, *end = buf+bt->nodesize-4, *ends, *data;
+    uint32_t slot = bt->inlinelen+8, prev = 0, j;
+
+    if (n->numkeys >= bt->maxkeys || plen > n->keylen) goto corrupted;
+    btree_node_get_u64s(bt,n->values,p,n->numkeys);
+    p += 8*n->numkeys;
+    btree_node_get_u64s(bt,n->children,p,n->numkeys+1);
+    p += 8*(n->numkeys+1);
+    for (j = 0; j < n->numkeys; j++) {
+        uint64_t len;
+
+        if (!BTREE_VALUE_IS_INLINE(n->values[j])) continue;
+        if (bt->inlinelen == 0 ||
+            (len = btree_u64_from_big(p+slot*j)) > bt->inlinelen ||
+            len != BTREE_VALUE_INLINE_LEN(n->values[j])) goto corrupted;
+        memcpy(n->inl+bt->inlinelen*j,p+slot*j+8,len);
+    }
+    if (bt->inlinelen) p += slot*n->numkeys;
+    ends = p;
+    data = ends+2*n->numkeys+plen;
+    if (data > end) goto corrupted;
+    for (j = 0; j < n->numkeys; j++) {
+        unsigned char *k = (unsigned char*)n->keys+j*n->keylen;
+        uint32_t next = (ends[j*2] << 8) | ends[j*2+1];
+
+        if (next < prev || plen+next-prev > n->keylen || data+next > end)
+            goto corrupted;
+        memcpy(k,data-plen,plen);
+        memcpy(k+plen,data+prev,next-prev);
+        memset(k+plen+next-prev,0,n->keylen-plen-(next-prev));
+        prev = next;
+    }
+    return 0;
+
+corrupted:
+    errno = EFAULT;
+    return -1;
+}
+
+/* Write a node on disk at the specified offset. Returns 0 on success.
+ * On error -1 is returne and errno set accordingly.
+ *
+ * Only the used part of the keys and pointers arrays is encoded, the rest
+ * of the node is zero. */
+int btree_write_node(struct btree *bt, struct btree_node *n, uint64_t offset) {
+    unsigned char *buf = bt->nodebuf;
+    unsigned char *p = buf;
+    uint32_t j;
+
+    assert(n->maxkeys == bt->maxkeys && n->inlinelen == bt->inlinelen);
+    bt->mark++;
+    btree_node_put_u32(bt,p,bt->mark); p += 4; /* start mark */
+    btree_node_put_u32(bt,p,n->numkeys); p += 4; /* number of keys */
+    btree_node_put_u32(bt,p,n->isleaf); p += 4; /* is a leaf? */
+    if (bt->prefixed) {
+        int plen = btree_encode_pnode(bt,n,p+4);
+
+        if (plen == -1) return -1;
+        btree_node_put_u32(bt,p,plen); /* prefix length */
+        p = buf+bt->nodesize-4;
+        goto endmark;
+    }
+    btree_node_put_u32(bt,p,0); p += 4; /* unused field, for alignment */
+    /* keys */
+    memcpy(p,n->keys,BTREE_HASHED_KEY_LEN*n->numkeys);
+    memset(p+BTREE_HASHED_KEY_LEN*n->numkeys,0,
+           BTREE_HASHED_KEY_LEN*(bt->maxkeys-n->numkeys));
+    p += BTREE_HASHED_KEY_LEN*bt->maxkeys;
+    /* values */
+    btree_node_put_u64s(bt,p,n->values,n->numkeys);
+    memset(p+8*n->numkeys,0,8*(bt->maxkeys-n->numkeys));
+    p += 8*bt->maxkeys;
+    /* children */
+    btree_node_put_u64s(bt,p,n->children,n->numkeys+1);
+    memset(p+8*(n->numkeys+1),0,8*(bt->maxkeys-n->numkeys));
+    p += 8*(bt->maxkeys+1);
+    /* inline values, every one prefixed by its size like allocations. */
+    if (bt->inlinelen) {
+        uint32_t slot = bt->inlinelen+8, len;
+
+        for (j = 0; j < n->numkeys; j++) {
+            len = BTREE_VALUE_IS_INLINE(n->values[j]) ?
+                  BTREE_VALUE_INLINE_LEN(n->values[j]) : 0;
+            btree_u64_to_big(p+slot*j,len);
+            memcpy(p+slot*j+8,n->inl+bt->inlinelen*j,len);
+            memset(p+slot*j+8+len,0,bt->inlinelen-len);
+        }
+        memset(p+slot*j,0,slot*(bt->maxkeys-j));
+        p += slot*bt->maxkeys;
+    }
+endmark:
+    btree_node_put_u32(bt,p,bt->mark); p += 4; /* end mark */
+    if (btree_pwrite(bt,buf,bt->nodesize,offset) == -1) {
+        btree_cache_del(bt->cache,offset);
+        return -1;
+    }
+    bt->stats.node_writes++;
+    btree_cache_add(bt->cache,offset,n);
+    return 0;
+}
+
+/* Load the node at the specified offset into the node structure 'n'
+ * provided by the caller, from the cache if possible, otherwise reading
+ * and decoding it from disk. Returns 0 on success, otherwise -1 is returned
+ * and errno set accordingly.
+ *
+ * If data on disk is corrupted errno is set to EFAULT. */
+int btree_load_node(struct btree *bt, struct btree_node *n, uint64_t offset) {
+    assert(n->maxkeys == bt->maxkeys && n->inlinelen == bt->inlinelen);
+    if (bt->cache && btree_cache_get(bt->cache,offset,n)) return 0;
+    return btree_fetch_node(bt,n,offset);
+}
+
+/* Return the bytes of the node at 'offset' as stored on disk: directly
+ * from the mapped file if the VFS allows it, otherwise read in our node
+ * buffer, or in the buffer of the calling thread if the btree is shared
+ * among threads. The bytes are valid up to the next node read. On error
+ * NULL is returned and errno set accordingly. */
+unsigned char *btree_node_bytes(struct btree *bt, uint64_t offset) {
+    unsigned char *buf;
+    ssize_t nread;
+
+    if ((buf = (unsigned char*) btree_map(bt,offset,bt->nodesize)) == NULL) {
+        if (!(bt->openflags & BTREE_CONCURRENT)) {
+            buf = bt->nodebuf;
+        } else if ((buf = btree_thread_buf(bt->nodesize)) == NULL) {
+            return NULL;
+        }
+        if ((nread = btree_pread(bt,buf,bt->nodesize,offset)) == -1)
+            return NULL;
+        if (nread != (ssize_t) bt->nodesize) {
+            errno = EFAULT;
+            return NULL;
+        }
+    }
+    btree_stat_read(bt,node_reads,1);
+    return buf;
+}
+
+/* Like btree_load_node() without looking at the cache first: the node is
+ * always read and decoded, then cached. */
+int btree_fetch_node(struct btree *bt, struct btree_node *n, uint64_t offset) {
+    unsigned char *buf;
+
+    if ((buf = btree_node_bytes(bt,offset)) == NULL) return -1;
+    if (btree_decode_node(bt,n,buf) == -1) return -1;
+    btree_cache_add(bt->cache,offset,n);
+    return 0;
+}
+
+/* Set up 'view' so that it describes the node in 'buf', bt->nodesize bytes
+ * as read from disk, without copying anything: the keys, values and
+ * children arrays of the view point inside 'buf'. This is only possible
+ * with version 2 nodes that are not prefix compressed, on little endian
+ * hosts, and if 'buf' is aligned. The inline values are at view->inl with a
+ * stride of inlinelen+8 bytes, as every one is prefixed by its size.
+ *
+ * Returns 0 on success, 1 if the node can't be used in place and must be
+ * decoded with btree_decode_node(), or -1 with errno set to EFAULT if the
+ * data is corrupted. */
+int btree_view_node(struct btree *bt, struct btree_node *view,
+                    unsigned char *buf)
+{
+    unsigned char *p = buf+16;
+
+    if (!BTREE_LITTLE_ENDIAN || bt->version != BTREE_VERSION_2 ||
+        bt->prefixed || ((uintptr_t)buf & 7)) return 1;
+    view->numkeys = btree_u32_from_little(buf+4);
+    view->isleaf = btree_u32_from_little(buf+8);
+    if (memcmp(buf,buf+bt->nodesize-4,4) || view->numkeys > bt->maxkeys) {
+        errno = EFAULT;
+        return -1;
+    }
+    view->maxkeys = bt->maxkeys;
+    view->inlinelen = bt->inlinelen;
+    view->keylen = bt->keylen;
+    view->keytype = bt->keytype;
+    view->keys = (char*) p;
+    p += BTREE_HASHED_KEY_LEN*bt->maxkeys;
+    view->values = (uint64_t*) p;
+    p += 8*bt->maxkeys;
+    view->children = (uint64_t*) p;
+    p += 8*(bt->maxkeys+1);
+    view->inl = p+8;
+    return 0;
+}
+
+/* Decode the node in 'buf', bt->nodesize bytes as read from disk, into 'n'.
+ * Returns 0 on success, or -1 with errno set to EFAULT if the data is
+ * corrupted. */
+int btree_decode_node(struct btree *bt, struct btree_node *n,
+                      unsigned char *buf)
+{
+    unsigned char *p;
+    uint32_t j;
+
+    /* Verify start/end marks */
+    if (memcmp(buf,buf+bt->nodesize-4,4)) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    p = buf+4;
+    n->numkeys = btree_node_get_u32(bt,p); p += 4; /* number of keys */
+    n->isleaf = btree_node_get_u32(bt,p); p += 4; /* is a leaf? */
+    if (bt->prefixed)
+        return btree_decode_pnode(bt,n,buf,btree_node_get_u32(bt,p));
+    p += 4; /* unused field, needed for alignment */
+    if (n->numkeys > bt->maxkeys) {
+        errno = EFAULT;
+        return -1;
+    }
+    /* keys */
+    memcpy(n->keys,p,BTREE_HASHED_KEY_LEN*n->numkeys);
+    p += BTREE_HASHED_KEY_LEN*bt->maxkeys;
+    /* values */
+    btree_node_get_u64s(bt,n->values,p,n->numkeys);
+    p += 8*bt->maxkeys;
+    /* children */
+    btree_node_get_u64s(bt,n->children,p,n->numkeys+1);
+    p += 8*(bt->maxkeys+1);
+    /* inline values */
+    for (j = 0; j < n->numkeys; j++) {
+        uint64_t len;
+        unsigned char *slot;
+
+        if (!BTREE_VALUE_IS_INLINE(n->values[j])) continue;
+        slot = p+(bt->inlinelen+8)*j;
+        if (bt->inlinelen == 0 ||
+            (len = btree_u64_from_big(slot)) > bt->inlinelen ||
+            len != BTREE_VALUE_INLINE_LEN(n->values[j]))
+        {
+            errno = EFAULT;
+            return -1;
+        }
+        memcpy(n->inl+bt->inlinelen*j,slot+8,len);
+    }
+    return 0;
+}
+
+/* Read a node from the specified offset.
+ * On success the in memory representation of the node is returned as a
+ * btree_node structure (to be freed with btree_free_node). On error
+ * NULL is returned and errno set accordingly.
+ *
+ * If data on disk is corrupted errno is set to EFAULT. */
+struct btree_node *btree_read_node(struct btree *bt, uint64_t offset) {
+    struct btree_node *n;
+
+    if ((n = btree_new_node(bt)) == NULL) return NULL;
+    if (btree_load_node(bt,n,offset) == -1) {
+        btree_free_node(n);
+        return NULL;
+    }
+    return n;
+}
+
+/* Update the on disk pointer at 'pointedby' so that it references 'newoff'.
+ * 'pbnode' is the node containing the pointer, or zero if 'pointedby' is
+ * the root pointer in the header. As the node is modified in place it is
+ * evicted from the cache. */
+int btree_update_pointer(struct btree *bt, uint64_t pbnode, uint64_t pointedby,
+                         uint64_t newoff)
+{
+    if (bt->txn == BTREE_TXN_ACTIVE) {
+        /* The root pointer on disk is only updated on commit, and it is
+         * only safe to modify nodes created by this transaction. */
+        assert(pbnode == 0 || btree_txn_is_fresh(bt,pbnode));
+        if (pointedby == BTREE_HDR_ROOTPTR_POS) {
+            bt->rootptr = newoff;
+            return 0;
+        }
+    }
+    if (pbnode) {
+        btree_cache_del(bt->cache,pbnode);
+        if (btree_pwrite_node_u64(bt,newoff,pointedby) == -1) return -1;
+    } else {
+        if (btree_pwrite_u64(bt,newoff,pointedby) == -1) return -1;
+    }
+    if (pointedby == BTREE_HDR_ROOTPTR_POS) {
+        bt->rootptr = newoff;
+        btree_publish_root(bt);
+    }
+    return 0;
+}
+
+/* ------------------------- disk space allocator --------------------------- */
+
+/* Compute logarithm in base two of 'n', with 'n' being a power of two.
+ * Probably you can just check the latest 1 bit set, but here it's not
+ * a matter of speed as we are dealing with the disk every time we call
+ * this function. */
+int btree_log_two(uint32_t n) {
+    int log = -1;
+
+    while(n) {
+        log++;
+        n /= 2;
+    }
+    return log;
+}
+
+/* Mark the disk state as dirty before the first change to the in memory
+ * freelists or free space after a checkpoint. */
+int btree_set_dirty(struct btree *bt) {
+    if (bt->dirty) return 0;
+    if (btree_drop_fldir(bt) == -1) return -1;
+    if (btree_pwrite_u64(bt,BTREE_STATE_DIRTY,BTREE_HDR_STATE_POS) == -1)
+        return -1;
+    btree_sync(bt);
+    bt->dirty = 1;
+    return 0;
+}
+
+int btree_alloc_freelist(struct btree *bt, uint32_t realsize, uint64_t *ptr) {
+    int fli = btree_freelist_index(realsize);
+    struct btree_freelist *fl = &bt->freelist[fli];
+    uint64_t block, lastblock = 0, p;
+
+    if (bt->openflags & BTREE_MEMORY_FREELIST) {
+        if (fl->numitems == 0) {
+            *ptr = 0;
             return 0;
         }
-        if (n->isleaf || n->children[j] == 0) {
-            btree_free_node(n);
+        if (btree_set_dirty(bt) == -1) return -1;
+        *ptr = fl->items[--fl->numitems]+sizeof(uint64_t);
+        return 0;
+    }
+
+    /* The first block is never removed. The free lists of the classes
+     * may have no block at all. */
+    if (fl->last_items == 0 && fl->numblocks <= 1) {
+        *ptr = 0;
+        return 0;
+    }
+    if (btree_drop_fldir(bt) == -1) return -1;
+
+    /* Last block is empty? Remove it */
+    if (fl->last_items == 0) {
+        uint64_t prevblock, *oldptr;
+
+        assert(fl->numblocks > 1);
+        /* Set prevblock next pointer to NULL */
+        prevblock = fl->blocks[fl->numblocks-2];
+        if (btree_pwrite_u64(bt,0,prevblock+sizeof(uint64_t)) == -1) return -1;
+        btree_sync(bt);
+        /* Fix our memory representaiton of freelist */
+        lastblock = fl->blocks[fl->numblocks-1];
+        fl->numblocks--;
+        bt->stats.freelist_blocks_removed++;
+        /* The previous item must be full, so we set the new number
+         * of items to the max. */
+        fl->last_items = BTREE_FREELIST_BLOCK_ITEMS;
+        /* Realloc the block as we have one element less. */
+        oldptr = fl->blocks;
+        fl->blocks = realloc(fl->blocks,sizeof(uint64_t)*fl->numblocks);
+        if (fl->blocks == NULL) {
+            /* Out of memory. The realloc failed, but note that while this
+             * is a leak as the block remains larger than needed we still
+             * have a valid in memory representation. */
+            fl->blocks = oldptr;
+            return -1;
+        }
+    }
+
+    /* There was a block to remove, but this block is the same size
+     * of the allocation required? Just return it. */
+    if (lastblock && realsize == (1<<BTREE_FREELIST_SIZE_EXP)) {
+        *ptr = lastblock;
+        return 0;
+    } else if (lastblock) {
+        btree_free(bt,lastblock);
+    }
+
+    /* Get an element from the current block, and return it to the
+     * caller. */
+    block = fl->blocks[fl->numblocks-1];
+    if (btree_pread_u64(bt,&p,block+((2+fl->last_items)*sizeof(uint64_t))) == -1) return -1;
+    fl->last_items--;
+    if (btree_pwrite_u64(bt,fl->last_items,block+(2*sizeof(uint64_t))) == -1) return -1;
+    btree_sync(bt);
+    *ptr = p+sizeof(uint64_t);
+    return 0;
+}
+
+/* Take a chunk of the power of two following 'realsize', a size class,
+ * from the free lists, and cut a chunk of 'realsize' bytes from it. The
+ * rest of the chunk is a size class as well (or a power of two) and is put
+ * in its free list. If there is no chunk to split *ptr is set to zero. */
+int btree_alloc_split(struct btree *bt, uint32_t realsize, uint64_t *ptr) {
+    uint32_t pow = btree_alloc_realsize(realsize-sizeof(uint64_t));
+    uint32_t rest = pow-realsize;
+    uint64_t restoff;
+
+    *ptr = 0;
+    /* For instance 64 bytes can't be split into 40+24. */
+    if (btree_chunk_size(bt,rest-sizeof(uint64_t)) != rest) return 0;
+    if (btree_alloc_freelist(bt,pow,ptr) == -1) return -1;
+    if (*ptr == 0) return 0;
+    restoff = *ptr-sizeof(uint64_t)+realsize;
+    if (btree_pwrite_u64(bt,rest-sizeof(uint64_t),restoff) == -1) return -1;
+    btree_sync(bt); /* The header must be on disk before the free list item */
+    return btree_free(bt,restoff+sizeof(uint64_t));
+}
+
+/* Return the next power of two that is able to hold size+1 bytes.
+ * The byte we add is used to save the exponent of two as the first byte
+ * so that for btree_free() can check the block size. */
+uint32_t btree_alloc_realsize(uint32_t size) {
+    uint32_t realsize;
+
+    realsize = 16; /* We don't allocate nothing that is smaller than 16 bytes */
+    while (realsize < (size+sizeof(uint64_t))) realsize *= 2;
+    return realsize;
+}
+
+/* Return the size of the chunk used for an allocation of 'size' bytes:
+ * with size classes the smallest class able to hold it, otherwise the
+ * power of two returned by btree_alloc_realsize(). */
+uint32_t btree_chunk_size(struct btree *bt, uint32_t size) {
+    uint32_t realsize = btree_alloc_realsize(size), step;
+
+    if (bt->numfreelists == BTREE_FREELIST_COUNT ||
+        realsize <= (1<<BTREE_CLASS_MIN_EXP)) return realsize;
+    /* Try the classes between the previous power of two and realsize. */
+    step = realsize/2/BTREE_CLASS_STEPS;
+    while (realsize-step >= size+sizeof(uint64_t)) realsize -= step;
+    return realsize;
+}
+
+/* Enlarge the file, 'offset' bytes long, by 'len' bytes, reserving the disk
+ * blocks if the VFS is able to. */
+int btree_vfs_allocate(struct btree_vfs *vfs, void *handle, uint64_t offset,
+                       uint64_t len)
+{
+    if (vfs->allocate) return vfs->allocate(handle,offset,len);
+    return vfs->resize(handle,offset+len);
+}
+
+/* Return the bytes a file of 'size' bytes grows by: a fraction of its size,
+ * so that large files grow rarely, but at least BTREE_PREALLOC_SIZE bytes,
+ * and no more than BTREE_PREALLOC_MAX, not to reserve too much unused space.
+ * The size is a multiple of BTREE_PAGE_SIZE. */
+uint64_t btree_grow_size(uint64_t size) {
+    uint64_t grow = size/BTREE_PREALLOC_RATIO;
+
+    if (grow < BTREE_PREALLOC_SIZE) grow = BTREE_PREALLOC_SIZE;
+    if (grow > BTREE_PREALLOC_MAX) grow = BTREE_PREALLOC_MAX;
+    return grow & ~(uint64_t)(BTREE_PAGE_SIZE-1);
+}
+
+void *btree_grower_thread(void *arg) {
+    struct btree *bt = arg;
+    struct btree_grower *g = &bt->grower;
+    uint64_t offset, len;
+    void *handle;
+    int retval;
+
+    pthread_mutex_lock(&g->lock);
+    while(1) {
+        if (g->len == 0) {
+            if (g->stop) break;
+            pthread_cond_wait(&g->cond,&g->lock);
+            continue;
+        }
+        handle = g->handle;
+        offset = g->offset;
+        len = g->len;
+        pthread_mutex_unlock(&g->lock);
+        retval = btree_vfs_allocate(bt->vfs,handle,offset,len);
+        btree_trace(2,"grower: %llu bytes at %llu: %d\n",
+                    (unsigned long long)len,(unsigned long long)offset,retval);
+        pthread_mutex_lock(&g->lock);
+        g->size = retval == 0 ? offset+len : 0;
+        g->len = 0;
+        pthread_cond_broadcast(&g->cond);
+    }
+    pthread_mutex_unlock(&g->lock);
+    return NULL;
+}
+
+/* Ask the grow thread to enlarge the file, that is 'offset' bytes long, by
+ * 'len' bytes, starting the thread if needed. If the thread can't be
+ * started background growth is just disabled. */
+void btree_grower_post(struct btree *bt, uint64_t offset, uint64_t len) {
+    struct btree_grower *g = &bt->grower;
+
+    if (!g->started) {
+        pthread_mutex_init(&g->lock,NULL);
+        pthread_cond_init(&g->cond,NULL);
+        g->stop = 0;
+        g->len = 0;
+        g->size = 0;
+        if (pthread_create(&g->thread,NULL,btree_grower_thread,bt) != 0) {
+            pthread_mutex_destroy(&g->lock);
+            pthread_cond_destroy(&g->cond);
+            g->enabled = 0;
+            return;
+        }
+        g->started = 1;
+    }
+    pthread_mutex_lock(&g->lock);
+    g->handle = bt->vfs_handle;
+    g->offset = offset;
+    g->len = len;
+    pthread_cond_signal(&g->cond);
+    pthread_mutex_unlock(&g->lock);
+    g->requested = 1;
+}
+
+/* Adopt the space added by the grow thread, if its request is done, or in
+ * any case if 'wait' is true, waiting for the request to complete. Must be
+ * called before changing the file size, so that the thread and the writer
+ * never resize the file at the same time. */
+void btree_grower_adopt(struct btree *bt, int wait) {
+    struct btree_grower *g = &bt->grower;
+    uint64_t currsize = bt->freeoff+bt->free;
+
+    if (!g->requested) return;
+    pthread_mutex_lock(&g->lock);
+    while (wait && g->len) pthread_cond_wait(&g->cond,&g->lock);
+    if (g->len == 0) {
+        /* A failed request is not an error: the writer will try again to
+         * grow the file, and report the error if it fails as well. */
+        if (g->size > currsize) {
+            bt->stats.file_grows++;
+            bt->stats.file_grows_background++;
+            bt->stats.file_grow_bytes += g->size-currsize;
+            bt->free += g->size-currsize;
+        }
+        g->size = 0;
+        g->requested = 0;
+    }
+    pthread_mutex_unlock(&g->lock);
+}
+
+/* Stop the grow thread if running, dropping the space it added to the file
+ * that was never adopted. */
+void btree_grower_stop(struct btree *bt) {
+    struct btree_grower *g = &bt->grower;
+
+    if (!g->started) return;
+    pthread_mutex_lock(&g->lock);
+    g->stop = 1;
+    pthread_cond_signal(&g->cond);
+    pthread_mutex_unlock(&g->lock);
+    pthread_join(g->thread,NULL);
+    if (g->requested && g->size > bt->freeoff+bt->free)
+        bt->vfs->resize(bt->vfs_handle,bt->freeoff+bt->free);
+    pthread_mutex_destroy(&g->lock);
+    pthread_cond_destroy(&g->cond);
+    g->started = 0;
+    g->requested = 0;
+}
+
+/* Make sure there are at least 'realsize' bytes of free space at the end
+ * of the file, enlarging the file if needed. Returns 0 on success, -1 on
+ * error.
+ *
+ * With background growth the free space is enlarged ahead of time, so
+ * this function only waits for the file system if allocations consume the
+ * free space faster than the thread is able to add it. */
+int btree_grow(struct btree *bt, uint64_t realsize) {
+    uint64_t currsize, grow;
+
+    /* The caller is going to use the free space. */
+    if (btree_drop_fldir(bt) == -1) return -1;
+    btree_grower_adopt(bt,bt->free < realsize);
+    currsize = bt->freeoff + bt->free;
+    grow = btree_grow_size(currsize);
+    if (bt->free < realsize) {
+        while (bt->free+grow < realsize) grow *= 2;
+        if (btree_vfs_allocate(bt->vfs,bt->vfs_handle,currsize,grow) == -1)
+            return -1;
+        bt->stats.file_grows++;
+        bt->stats.file_grow_bytes += grow;
+        bt->free += grow;
+        currsize += grow;
+        grow = btree_grow_size(currsize);
+    }
+    if (bt->grower.enabled && !bt->grower.requested &&
+        bt->free-realsize < grow/2) btree_grower_post(bt,currsize,grow);
+    return 0;
+}
+
+/* Allocations of BTREE_PAGE_SIZE bytes or more taken from the free space
+ * at the end of the file are page aligned, so that for instance a node of
+ * 4096 bytes is never split across two pages. Return the number of bytes
+ * to skip at 'freeoff' before an allocation of 'realsize' bytes. */
+uint32_t btree_alloc_padding(uint64_t freeoff, uint32_t realsize) {
+    if (realsize < BTREE_PAGE_SIZE) return 0;
+    return (BTREE_PAGE_SIZE - (freeoff & (BTREE_PAGE_SIZE-1))) &
+           (BTREE_PAGE_SIZE-1);
+}
+
+/* Put the 'pad' bytes of padding at 'off' in the freelists, so that they
+ * are not lost. The padding is split into allocations of power of two
+ * sizes, each aligned to its size (as 'off' is a multiple of 16 and
+ * 'off'+'pad' is page aligned this is always possible). Errors are not
+ * reported, as at worst the padding is leaked. */
+void btree_free_padding(struct btree *bt, uint64_t off, uint32_t pad) {
+    uint64_t p;
+    uint32_t chunk;
+
+    if (bt->openflags & BTREE_APPEND_ONLY) {
+        bt->garbage += pad;
+        return;
+    }
+    /* Write the size headers, that must be on disk before the freelists
+     * reference the chunks, and then free the chunks. */
+    for (p = off; p < off+pad; p += chunk) {
+        chunk = (uint32_t) (p & (~p+1)); /* Lowest bit set */
+        if (btree_pwrite_u64(bt,chunk-sizeof(uint64_t),p) == -1) return;
+    }
+    btree_sync(bt);
+    for (p = off; p < off+pad; p += chunk) {
+        chunk = (uint32_t) (p & (~p+1));
+        if (btree_free(bt,p+sizeof(uint64_t)) == -1) return;
+    }
+}
+
+/* Allocate some piece of data on disk. Returns the offset to the newly
+ * allocated space. If the allocation can't be performed, 0 is returned. */
+uint64_t btree_alloc_chunk(struct btree *bt, uint32_t size) {
+    uint64_t ptr, padoff;
+    uint32_t realsize, pad;
+
+    btree_trace(1,"Alloc %lu bytes\n",(unsigned long)size);
+
+    /* Don't allow allocations bigger than 2GB */
+    if (size > (unsigned)(1<<31)) {
+        errno = EINVAL;
+        return 0;
+    }
+    realsize = btree_chunk_size(bt,size);
+
+    /* Search for free space in the free lists. A chunk of a size class can
+     * also be cut from a chunk of the next power of two. */
+    ptr = 0;
+    if (!(bt->openflags & BTREE_APPEND_ONLY)) {
+        if (btree_alloc_freelist(bt,realsize,&ptr) == -1) return 0;
+        if (ptr == 0 && (realsize & (realsize-1)) &&
+            btree_alloc_split(bt,realsize,&ptr) == -1) return 0;
+    }
+    if (ptr) {
+        uint64_t oldsize;
+        /* Got an element from the free list. Fix the size header if needed. */
+        if (btree_pread_u64(bt,&oldsize,ptr-sizeof(uint64_t)) == -1) return 0;
+        if (oldsize != size) {
+            if (btree_pwrite_u64(bt,size,ptr-sizeof(uint64_t)) == -1)
+                return 0;
+            btree_sync(bt);
+        }
+        if (btree_txn_add_fresh(bt,ptr) == -1) return 0;
+        bt->stats.allocs[btree_freelist_index(realsize)]++;
+        return ptr;
+    }
+
+    /* We have to perform a real allocation.
+     * If we don't have room at the end of the file, create some space. */
+    pad = btree_alloc_padding(bt->freeoff,realsize);
+    if (btree_grow(bt,(uint64_t)realsize+pad) == -1) return 0;
+
+    /* Allocate it moving the header pointers and free space count.
+     * With in memory freelists the header is only updated on checkpoint,
+     * and in append only mode on commit. */
+    if ((bt->openflags & BTREE_MEMORY_FREELIST) && btree_set_dirty(bt) == -1)
+        return 0;
+    padoff = bt->freeoff;
+    ptr = bt->freeoff+pad;
+    bt->free -= realsize+pad;
+    bt->freeoff += realsize+pad;
+
+    if (!(bt->openflags & (BTREE_MEMORY_FREELIST|BTREE_APPEND_ONLY)) &&
+        btree_write_free_space(bt) == -1) return 0;
+
+    /* Write the size header in the new allocated space */
+    if (btree_pwrite_u64(bt,size,ptr) == -1) return 0;
+
+    /* A final fsync() as a write barrier. Not needed with in memory
+     * freelists or in append only mode, as nothing references the
+     * allocation on disk. */
+    if (!(bt->openflags & (BTREE_MEMORY_FREELIST|BTREE_APPEND_ONLY)))
+        btree_sync(bt);
+    if (btree_txn_add_fresh(bt,ptr+sizeof(uint64_t)) == -1) return 0;
+    bt->stats.allocs[btree_freelist_index(realsize)]++;
+    if (pad) btree_free_padding(bt,padoff,pad);
+    return ptr+sizeof(uint64_t);
+}
+
+uint64_t btree_alloc(struct btree *bt, uint32_t size) {
+    uint64_t ptr;
+
+    btree_op_enter(bt);
+    ptr = btree_alloc_chunk(bt,size);
+    return btree_op_exit(bt,0) == -1 ? 0 : ptr;
+}
+
+/* Given an on disk pointer returns the length of the original allocation
+ * (not the size of teh chunk itself as power of two, but the original
+ * argument passed to btree_alloc function).
+ *
+ * On success 0 is returned and the size parameter populated, otherwise
+ * -1 is returned and errno set accordingly. */
+int btree_alloc_size(struct btree *bt, uint32_t *size, uint64_t ptr) {
+    uint64_t s;
+
+    if (btree_pread_u64(bt,&s,ptr-8) == -1) return -1;
+    *size = (uint32_t) s;
+    return 0;
+}
+
+/* Return the free list slot index given the power of two exponent representing
+ * the size of the free list allocations. */
+int btree_freelist_index_by_exp(int exponent) {
+    assert(exponent > 1 && exponent < 32);
+    return exponent-4;
+}
+
+/* Return the free list slot index for chunks of 'realsize' bytes, a power
+ * of two or a size class. */
+int btree_freelist_index(uint32_t realsize) {
+    int exp = btree_log_two(realsize);
+    uint32_t step, k;
+
+    if ((realsize & (realsize-1)) == 0) return btree_freelist_index_by_exp(exp);
+    step = (1U<<exp)/BTREE_CLASS_STEPS;
+    k = (realsize-(1U<<exp))/step;
+    assert(exp >= BTREE_CLASS_MIN_EXP && k > 0 && k < BTREE_CLASS_STEPS &&
+           realsize == (1U<<exp)+k*step);
+    return BTREE_FREELIST_COUNT+(exp-BTREE_CLASS_MIN_EXP)*
+           (BTREE_CLASS_STEPS-1)+k-1;
+}
+
+/* Write the free space information in the header. */
+int btree_write_free_space(struct btree *bt) {
+    if (btree_pwrite_u64(bt,bt->free,BTREE_HDR_FREE_POS) == -1) return -1;
+    if (btree_pwrite_u64(bt,bt->freeoff,BTREE_HDR_FREEOFF_POS) == -1)
+        return -1;
+    return 0;
+}
+
+/* Release allocated memory, putting the pointer in the right free list.
+ * In append only mode the space is never reused, and just counted.
+ * On success 0 is returned. On error -1. */
+int btree_free_chunk(struct btree *bt, uint64_t ptr) {
+    uint64_t size;
+    uint32_t realsize;
+    int fli, deferred;
+    struct btree_freelist *fl;
+
+    /* Inside a transaction the space is released on commit, and the
+     * space that snapshots may see when they are released. */
+    if (bt->txn == BTREE_TXN_ACTIVE) return btree_txn_defer_free(bt,ptr);
+    if ((deferred = btree_snapshot_defer_free(bt,ptr)) != 0)
+        return deferred == -1 ? -1 : 0;
+
+    /* If this was a node, the cached version is no longer valid. */
+    btree_cache_del(bt->cache,ptr);
+    if (btree_pread_u64(bt,&size,ptr-sizeof(uint64_t)) == -1) return -1;
+    realsize = btree_chunk_size(bt,size);
+    bt->stats.frees[btree_freelist_index(realsize)]++;
+    if (bt->openflags & BTREE_APPEND_ONLY) {
+        bt->garbage += realsize;
+        return 0;
+    }
+    btree_trace(1,"Free %llu bytes (realsize: %lu)\n",
+        (unsigned long long)size,(unsigned long)realsize);
+
+    fli = btree_freelist_index(realsize);
+    fl = &bt->freelist[fli];
+
+    if (bt->openflags & BTREE_MEMORY_FREELIST) {
+        if (fl->numitems == fl->maxitems) {
+            uint32_t maxitems = fl->maxitems ? fl->maxitems*2 : 16;
+            uint64_t *items = realloc(fl->items,sizeof(uint64_t)*maxitems);
+
+            if (items == NULL) return -1;
+            fl->items = items;
+            fl->maxitems = maxitems;
+        }
+        if (btree_set_dirty(bt) == -1) return -1;
+        fl->items[fl->numitems++] = ptr-sizeof(uint64_t);
+        return 0;
+    }
+    if (btree_drop_fldir(bt) == -1) return -1;
+
+    /* We need special handling when freeing an allocation that is the same
+     * size of the freelist block, and the latest free list block for that size
+     * is full. Without this special handling what happens is that we need
+     * to allocate a new block of the same size to make space, but doing so
+     * would result in an element removed from the latest block, so after we
+     * link the new block we have the previous block that is not full.
+     *
+     * Check BTREE.txt in this source distribution for more information. */
+    if (fl->last_items == BTREE_FREELIST_BLOCK_ITEMS &&
+        realsize == (1<<BTREE_FREELIST_SIZE_EXP))
+    {
+        /* Just use the freed allocation as the next free block */
+        fl->blocks = realloc(fl->blocks,sizeof(uint64_t)*(fl->numblocks+1));
+        if (fl->blocks == NULL) return -1;
+        fl->blocks[fl->numblocks] = ptr;
+        fl->numblocks++;
+        fl->last_items = 0;
+        bt->stats.freelist_blocks_added++;
+        /* Init block setting items count, next pointer, prev pointer. */
+        btree_pwrite_u64(bt,0,ptr+sizeof(uint64_t)); /* next */
+        btree_pwrite_u64(bt,fl->blocks[fl->numblocks-2],ptr); /* prev */
+        btree_pwrite_u64(bt,0,ptr+sizeof(uint64_t)*2); /* numitems */
+        btree_sync(bt); /* Make sure it's ok before linking it to prev block */
+        /* Link this new block to the free list blocks updating next pointer
+         * of the previous block. */
+        btree_pwrite_u64(bt,ptr,fl->blocks[fl->numblocks-2]+sizeof(uint64_t));
+        btree_sync(bt);
+    } else {
+        /* Allocate a new block if needed. The free lists of the classes
+         * start with no block at all. */
+        if (fl->numblocks == 0 ||
+            fl->last_items == BTREE_FREELIST_BLOCK_ITEMS)
+        {
+            uint64_t newblock, prevblock;
+
+            newblock = btree_alloc(bt,BTREE_FREELIST_BLOCK_SIZE);
+            if (newblock == 0) return -1;
+
+            fl->blocks = realloc(fl->blocks,sizeof(uint64_t)*(fl->numblocks+1));
+            if (fl->blocks == NULL) return -1;
+            fl->blocks[fl->numblocks] = newblock;
+            fl->numblocks++;
+            fl->last_items = 0;
+            bt->stats.freelist_blocks_added++;
+            prevblock = fl->numblocks > 1 ? fl->blocks[fl->numblocks-2] : 0;
+            /* Init block setting items count, next pointer, prev pointer. */
+            btree_pwrite_u64(bt,0,newblock+sizeof(uint64_t)); /* next */
+            btree_pwrite_u64(bt,prevblock,newblock);/* prev */
+            btree_pwrite_u64(bt,0,newblock+sizeof(uint64_t)*2); /* numitems */
+            btree_sync(bt); /* Make sure it's ok before linking it. */
+            /* Link this new block to the free list blocks updating next pointer
+             * of the previous block, or the class table. */
+            if (prevblock)
+                btree_pwrite_u64(bt,newblock,prevblock+sizeof(uint64_t));
+            else
+                btree_pwrite_u64(bt,newblock,bt->classes+sizeof(uint64_t)*
+                                 (fli-BTREE_FREELIST_COUNT));
+            btree_sync(bt);
+        }
+        /* Add the item */
+        fl->last_block[fl->last_items] = ptr-sizeof(uint64_t);
+        fl->last_items++;
+        /* Write the pointer in the block first */
+        btree_trace(2,"Write freelist item about ptr %llu at %llu\n",
+            (unsigned long long)ptr,
+            (unsigned long long)(fl->blocks[fl->numblocks-1]+
+            (sizeof(uint64_t)*3)+(sizeof(uint64_t)*(fl->last_items-1))));
+        btree_pwrite_u64(bt,ptr-sizeof(uint64_t),fl->blocks[fl->numblocks-1]+(sizeof(uint64_t)*3)+(sizeof(uint64_t)*(fl->last_items-1)));
+        btree_sync(bt);
+        /* Then write the items count. */
+        btree_trace(2,"Write the new count for block %llu: %lu at %llu\n",
+            (unsigned long long)fl->blocks[fl->numblocks-1],
+            (unsigned long)fl->last_items,
+            (unsigned long long)(fl->blocks[fl->numblocks-1]+
+            sizeof(uint64_t)*2));
+        btree_pwrite_u64(bt,fl->last_items,fl->blocks[fl->numblocks-1]+sizeof(uint64_t)*2);
+        btree_sync(bt);
+    }
+    return 0;
+}
+
+int btree_free(struct btree *bt, uint64_t ptr) {
+    btree_op_enter(bt);
+    return btree_op_exit(bt,btree_free_chunk(bt,ptr));
+}
+
+/* Check if 'numblocks' freelist blocks are the right number to hold
+ * 'numitems' items: all the blocks but the last must be full, and the last
+ * block may be empty. We always have at least the first block, that is
+ * part of the header. Returns 0 if the number is right, -1 if we need more
+ * blocks, 1 if we have too many blocks. */
+int btree_freelist_check_blocks(uint32_t numblocks, uint32_t numitems) {
+    uint32_t min, max;
+
+    min = (numitems+BTREE_FREELIST_BLOCK_ITEMS-1)/BTREE_FREELIST_BLOCK_ITEMS;
+    max = numitems/BTREE_FREELIST_BLOCK_ITEMS+1;
+    /* The first block is never released, but the free lists of the size
+     * classes may have no block at all. */
+    if (min == 0 && numblocks) min = 1;
+    if (numblocks < min) return -1;
+    if (numblocks > max) return 1;
+    return 0;
+}
+
+/* Allocate or release freelist blocks so that all the in memory items
+ * of the freelist can be written on disk. Note that this changes the items
+ * of the freelist used for the freelist blocks themselves. */
+int btree_freelist_fix_blocks(struct btree *bt, struct btree_freelist *fl) {
+    int cmp;
+
+    while ((cmp = btree_freelist_check_blocks(fl->numblocks,fl->numitems))) {
+        if (cmp < 0) {
+            uint64_t block, *blocks;
+
+            blocks = realloc(fl->blocks,sizeof(uint64_t)*(fl->numblocks+1));
+            if (blocks == NULL) return -1;
+            fl->blocks = blocks;
+            if ((block = btree_alloc(bt,BTREE_FREELIST_BLOCK_SIZE)) == 0)
+                return -1;
+            fl->blocks[fl->numblocks++] = block;
+            bt->stats.freelist_blocks_added++;
+        } else {
+            if (btree_free(bt,fl->blocks[fl->numblocks-1]) == -1) return -1;
+            fl->numblocks--;
+            bt->stats.freelist_blocks_removed++;
+        }
+    }
+    return 0;
+}
+
+/* Write the in memory freelists and the free space information on disk,
+ * when the BTREE_MEMORY_FREELIST mode is used. Every freelist block is
+ * written with a single write, and write barriers are only used to make
+ * sure everything is on disk before the header state is set as clean.
+ *
+ * Returns 0 on success, -1 on error with errno set accordingly. On error
+ * the state on disk remains dirty, so it is safe to continue. */
+int btree_checkpoint(struct btree *bt) {
+    unsigned char buf[BTREE_FREELIST_BLOCK_SIZE];
+    int blockfli = btree_freelist_index_by_exp(BTREE_FREELIST_SIZE_EXP);
+    int j;
+
+    if (!bt->dirty) return 0;
+
+    /* Fix the number of blocks of every freelist. The freelist holding
+     * blocks of the same size of freelist blocks is fixed last, as the
+     * others allocate and free blocks from it. */
+    for (j = 0; j < bt->numfreelists; j++) {
+        if (j == blockfli) continue;
+        if (btree_freelist_fix_blocks(bt,&bt->freelist[j]) == -1) return -1;
+    }
+    if (btree_freelist_fix_blocks(bt,&bt->freelist[blockfli]) == -1)
+        return -1;
+
+    /* Write the blocks, and the first block of the class free lists. */
+    for (j = 0; j < bt->numfreelists; j++) {
+        struct btree_freelist *fl = &bt->freelist[j];
+        uint32_t b, k;
+
+        for (b = 0; b < fl->numblocks; b++) {
+            uint32_t first = b*BTREE_FREELIST_BLOCK_ITEMS, count = 0;
+            unsigned char *p = buf;
+
+            if (fl->numitems > first) count = fl->numitems-first;
+            if (count > BTREE_FREELIST_BLOCK_ITEMS)
+                count = BTREE_FREELIST_BLOCK_ITEMS;
+            btree_u64_to_big(p,b ? fl->blocks[b-1] : 0); p += 8; /* prev */
+            btree_u64_to_big(p,b+1 < fl->numblocks ? fl->blocks[b+1] : 0);
+            p += 8; /* next */
+            btree_u64_to_big(p,count); p += 8; /* numitems */
+            for (k = 0; k < count; k++) {
+                btree_u64_to_big(p,fl->items[first+k]);
+                p += 8;
+            }
+            if (btree_pwrite(bt,buf,p-buf,fl->blocks[b]) == -1) return -1;
+            fl->last_items = count;
+        }
+    }
+    if (bt->classes && btree_write_class_table(bt) == -1) return -1;
+    if (btree_write_free_space(bt) == -1) return -1;
+    btree_sync(bt);
+    if (btree_pwrite_u64(bt,BTREE_STATE_CLEAN,BTREE_HDR_STATE_POS) == -1)
+        return -1;
+    btree_sync(bt);
+    bt->dirty = 0;
+    /* Errors are not fatal here, as without a directory the freelists are
+     * just read walking the blocks. */
+    btree_write_fldir(bt);
+    return 0;
+}
+
+/* ------------------------------ Offset sets ------------------------------- */
+
+uint32_t btree_offset_set_slot(struct btree_offset_set *set, uint64_t off) {
+    uint32_t j = (uint32_t)(((off >> 3) * 0x9E3779B97F4A7C15ULL) >> 32);
+
+    j &= set->size-1;
+    while (set->table[j] != 0 && set->table[j] != off)
+        j = (j+1) & (set->size-1);
+    return j;
+}
+
+/* Add 'off' (that can't be zero) to the set. Returns -1 on out of memory. */
+int btree_offset_set_add(struct btree_offset_set *set, uint64_t off) {
+    uint32_t j;
+
+    /* Keep the table at most half full, rehashing when needed. */
+    if ((set->used+1)*2 > set->size) {
+        struct btree_offset_set new;
+
+        new.size = set->size ? set->size*2 : 64;
+        new.used = set->used;
+        if ((new.table = calloc(new.size,sizeof(uint64_t))) == NULL) return -1;
+        for (j = 0; j < set->size; j++) {
+            if (set->table[j] == 0) continue;
+            new.table[btree_offset_set_slot(&new,set->table[j])] =
+                set->table[j];
+        }
+        free(set->table);
+        *set = new;
+    }
+    j = btree_offset_set_slot(set,off);
+    if (set->table[j] == 0) {
+        set->table[j] = off;
+        set->used++;
+    }
+    return 0;
+}
+
+int btree_offset_set_has(struct btree_offset_set *set, uint64_t off) {
+    if (set->used == 0) return 0;
+    return set->table[btree_offset_set_slot(set,off)] == off;
+}
+
+void btree_offset_set_clear(struct btree_offset_set *set) {
+    if (set->used) memset(set->table,0,sizeof(uint64_t)*set->size);
+    set->used = 0;
+}
+
+/* ------------------------------ Transactions ------------------------------ */
+
+/* Transactions collect a number of changes to the btree, making them
+ * durable at the same time with just two write barriers on commit.
+ *
+ * Inside a transaction nodes reachable from the last committed root are
+ * never modified: the first time one of them needs to be changed a modified
+ * copy is written instead (the copy is said to be "fresh"), and fresh nodes
+ * can then be updated in place. The root pointer on disk is not touched
+ * until commit, and no space is released before commit, so that the last
+ * committed btree is always intact on disk.
+ *
+ * On commit we flush everything, write the new root pointer, flush again,
+ * and finally release the space that the transaction deferred. */
+
+uint64_t btree_ustime(void) {
+    struct timeval tv;
+
+    gettimeofday(&tv,NULL);
+    return ((uint64_t)tv.tv_sec)*1000000+tv.tv_usec;
+}
+
+/* Return true if 'ptr' was allocated by the transaction in progress. */
+int btree_txn_is_fresh(struct btree *bt, uint64_t ptr) {
+    return bt->txn == BTREE_TXN_ACTIVE &&
+           btree_offset_set_has(&bt->txn_fresh,ptr);
+}
+
+/* Called by the allocator for every new allocation. */
+int btree_txn_add_fresh(struct btree *bt, uint64_t ptr) {
+    if (bt->txn != BTREE_TXN_ACTIVE) return 0;
+    return btree_offset_set_add(&bt->txn_fresh,ptr);
+}
+
+/* Called by btree_free() inside a transaction: the space is released
+ * only after commit. */
+int btree_txn_defer_free(struct btree *bt, uint64_t ptr) {
+    if (bt->txn_numfrees == bt->txn_maxfrees) {
+        uint32_t maxfrees = bt->txn_maxfrees ? bt->txn_maxfrees*2 : 64;
+        uint64_t *frees = realloc(bt->txn_frees,sizeof(uint64_t)*maxfrees);
+
+        if (frees == NULL) return -1;
+        bt->txn_frees = frees;
+        bt->txn_maxfrees = maxfrees;
+    }
+    bt->txn_frees[bt->txn_numfrees++] = ptr;
+    return 0;
+}
+
+/* Start a transaction. Transactions can't be nested, so if a transaction
+ * is already in progress -1 is returned and errno is set to EBUSY.
+ *
+ * All the changes performed until btree_commit() is called will be durable
+ * at the same time. Lookups performed inside the transaction already see
+ * the changes, except with BTREE_CONCURRENT: there lookups and cursors
+ * read the root published by the last commit, so the changes of the
+ * transaction become visible, to the writer too, only after
+ * btree_commit(). A btree closed with a transaction in progress commits
+ * it. */
+int btree_begin(struct btree *bt) {
+    if (bt->txn_user) {
+        errno = EBUSY;
+        return -1;
+    }
+    bt->txn_user = 1;
+    /* With group commit we may still be inside the transaction of
+     * previous commits not yet flushed. */
+    if (bt->txn == BTREE_TXN_ACTIVE) return 0;
+    bt->txn = BTREE_TXN_ACTIVE;
+    bt->txn_rootptr = bt->rootptr;
+    bt->gc_ops = 0;
+    bt->gc_start = btree_ustime();
+    return 0;
+}
+
+/* Make the changes of the commits merged by group commit durable, and
+ * release the space no longer used by snapshots and concurrent readers.
+ * Returns 0 on success, -1 on error or if called inside a transaction. */
+int btree_flush_txn(struct btree *bt) {
+    uint32_t j;
+    int legacyfl = !(bt->openflags & (BTREE_MEMORY_FREELIST|BTREE_APPEND_ONLY));
+    int retval = 0;
+
+    if (bt->txn_user) {
+        errno = EBUSY;
+        return -1;
+    }
+    if (bt->txn != BTREE_TXN_ACTIVE) return btree_snapshot_reclaim(bt);
+
+    /* With freelists on disk, releasing the deferred space one item at a
+     * time with a barrier for every write would defeat the purpose of the
+     * transaction. We release the space without barriers instead, marking
+     * the state as dirty meanwhile: if we crash before the final barrier
+     * the freelists will be reset on open. */
+    if (legacyfl && bt->txn_numfrees &&
+        btree_pwrite_u64(bt,BTREE_STATE_DIRTY,BTREE_HDR_STATE_POS) == -1)
+        return -1;
+
+    /* In append only mode the header is only updated here: the new free
+     * space offset must be on disk with the data, before the root. */
+    if ((bt->openflags & BTREE_APPEND_ONLY) &&
+        btree_write_free_space(bt) == -1) return -1;
+
+    bt->txn = BTREE_TXN_NONE;
+    btree_sync(bt);
+    if (bt->rootptr != bt->txn_rootptr) {
+        if (btree_pwrite_u64(bt,bt->rootptr,BTREE_HDR_ROOTPTR_POS) == -1) {
+            bt->txn = BTREE_TXN_ACTIVE;
+            return -1;
+        }
+        btree_sync(bt);
+    }
+    bt->txn_rootptr = bt->rootptr;
+    btree_publish_root(bt);
+
+    /* The new btree is durable, now we can release the old space. */
+    bt->txn = BTREE_TXN_COMMITTING;
+    for (j = 0; j < bt->txn_numfrees; j++)
+        if (btree_free(bt,bt->txn_frees[j]) == -1) retval = -1;
+    bt->txn = BTREE_TXN_NONE;
+    if (legacyfl && bt->txn_numfrees && retval == 0) {
+        btree_sync(bt);
+        /* The next barrier will make this durable. */
+        if (btree_pwrite_u64(bt,BTREE_STATE_CLEAN,BTREE_HDR_STATE_POS) == -1)
+            retval = -1;
+    }
+    bt->txn_numfrees = 0;
+    btree_offset_set_clear(&bt->txn_fresh);
+    if (btree_snapshot_reclaim(bt) == -1) retval = -1;
+    return retval;
+}
+
+int btree_flush(struct btree *bt) {
+    btree_op_enter(bt);
+    return btree_op_exit(bt,btree_flush_txn(bt));
+}
+
+/* Commit the transaction in progress. On success 0 is returned and the
+ * changes are durable (if write barriers are enabled), unless group commit
+ * is in use.
+ *
+ * With group commit the changes are merged into the next commits, and are
+ * only made durable when the group is complete: see btree_set_group_commit().
+ * btree_flush() can be used to make them durable ahead of time.
+ *
+ * On error -1 is returned and errno is set accordingly. */
+int btree_commit(struct btree *bt) {
+    if (!bt->txn_user) {
+        errno = EINVAL;
+        return -1;
+    }
+    bt->txn_user = 0;
+    bt->gc_ops++;
+    if (bt->gc_ops < bt->gc_maxops &&
+        btree_ustime()-bt->gc_start < bt->gc_maxusec) return 0;
+    return btree_flush(bt);
+}
+
+/* Return true if a modification performed outside a transaction should be
+ * a transaction anyway: with group commit, concurrent readers, snapshots,
+ * and in append only mode. */
+int btree_txn_implicit(struct btree *bt) {
+    if (bt->txn_user) return 0;
+    return bt->gc_maxops > 1 ||
+           (bt->openflags & (BTREE_CONCURRENT|BTREE_APPEND_ONLY)) ||
+           bt->snap_head != NULL;
+}
+
+/* Enable group commit: up to 'maxops' commits are merged into a single
+ * flush, as long as the first of them is not older than 'maxusec'
+ * microseconds. Changes that are not flushed will be lost on crash, but
+ * the btree remains consistent. Calling btree_add() outside transactions
+ * with group commit enabled works like if every call was a transaction.
+ *
+ * Use 'maxops' of 0 or 1 to disable group commit. Note that commits are
+ * only flushed when another commit happens, so callers should use
+ * btree_flush() when they are idle. */
+void btree_set_group_commit(struct btree *bt, uint32_t maxops, uint64_t maxusec) {
+    bt->gc_maxops = maxops;
+    bt->gc_maxusec = maxusec;
+}
+
+/* -------------------------------- Snapshots ------------------------------- */
+
+/* Writers never modify nodes reachable from the last committed root while
+ * a transaction is active (see the Transactions section), so a reader that
+ * remembers a committed root sees a consistent btree as long as the space
+ * it references is not reused. A snapshot is just that: a pinned root.
+ *
+ * While at least a snapshot exists, changes performed outside transactions
+ * are performed as single operation transactions, and the space released
+ * by btree_free() is not put in the freelists, but appended to a list of
+ * deferred frees together with the epoch of the newest snapshot existing
+ * at the time of the free. Every snapshot gets a new epoch, so the space
+ * can be reused once there are no snapshots with an epoch less or equal to
+ * the one of the free: the snapshots acquired later can't see it.
+ *
+ * Deferred frees are only kept in memory: if the btree is not closed the
+ * space is leaked, but the btree remains consistent. With BTREE_CONCURRENT
+ * all the frees are deferred, see the Concurrent readers section. */
+
+/* Called by btree_free(): if snapshots or concurrent readers may see 'ptr'
+ * it is added to the deferred frees and 1 is returned. If the space can be
+ * released now 0 is returned, and -1 on out of memory. */
+int btree_snapshot_defer_free(struct btree *bt, uint64_t ptr) {
+    uint64_t *f;
+
+    if (bt->snap_releasing) return 0;
+    if (!(bt->openflags & BTREE_CONCURRENT) && bt->snap_head == NULL)
+        return 0;
+    if (bt->snap_numfrees == bt->snap_maxfrees) {
+        uint32_t maxfrees = bt->snap_maxfrees ? bt->snap_maxfrees*2 : 64;
+        uint64_t *frees = realloc(bt->snap_frees,sizeof(uint64_t)*3*maxfrees);
+
+        if (frees == NULL) return -1;
+        bt->snap_frees = frees;
+        bt->snap_maxfrees = maxfrees;
+    }
+    f = bt->snap_frees+bt->snap_numfrees*3;
+    f[0] = ptr;
+    pthread_mutex_lock(&bt->snap_lock);
+    f[1] = bt->snap_epoch;
+    pthread_mutex_unlock(&bt->snap_lock);
+    f[2] = bt->read_epoch;
+    bt->snap_numfrees++;
+    return 1;
+}
+
+/* Release the deferred frees no longer visible by any snapshot or reader.
+ * As the epochs of the frees are in ascending order, this is a prefix of
+ * the list. Inside a transaction nothing is done, as frees would be
+ * deferred again: btree_flush() calls us on commit. */
+int btree_snapshot_reclaim(struct btree *bt) {
+    uint64_t oldest, safe = UINT64_MAX;
+    uint32_t j = 0;
+    int retval = 0;
+
+    if (bt->txn == BTREE_TXN_ACTIVE) return 0;
+    if (bt->openflags & BTREE_CONCURRENT) {
+        /* Two steps are needed for the frees of the current epoch. */
+        btree_reader_advance(bt);
+        btree_reader_advance(bt);
+        safe = bt->read_safe;
+    }
+    pthread_mutex_lock(&bt->snap_lock);
+    oldest = bt->snap_head ? bt->snap_head->epoch : UINT64_MAX;
+    pthread_mutex_unlock(&bt->snap_lock);
+
+    bt->snap_releasing = 1;
+    while (j < bt->snap_numfrees && bt->snap_frees[j*3+1] < oldest &&
+           bt->snap_frees[j*3+2] <= safe)
+    {
+        if (btree_free(bt,bt->snap_frees[j*3]) == -1) retval = -1;
+        j++;
+    }
+    bt->snap_releasing = 0;
+    /* Nothing to move when nothing was released: snap_frees may still
+     * be NULL, and memmove() requires valid pointers even for 0 bytes. */
+    if (j) {
+        memmove(bt->snap_frees,bt->snap_frees+j*3,
+                sizeof(uint64_t)*3*(bt->snap_numfrees-j));
+        bt->snap_numfrees -= j;
+    }
+    return retval;
+}
+
+/* Acquire a snapshot of the btree. Lookups and cursors using the snapshot
+ * see the btree as it was at this time, regardless of the following
+ * changes, until the snapshot is released with btree_snapshot_release().
+ *
+ * Inside a transaction the snapshot is the last committed state. Commits
+ * merged by group commit are flushed first, so that they are part of the
+ * snapshot. With BTREE_CONCURRENT snapshots can be acquired and released
+ * by any thread, and they are always the last committed state, without
+ * flushing. On error NULL is returned and errno set accordingly. */
+struct btree_snapshot *btree_snapshot_acquire(struct btree *bt) {
+    struct btree_snapshot *s;
+    int concurrent = bt->openflags & BTREE_CONCURRENT;
+
+    if (!concurrent && bt->txn == BTREE_TXN_ACTIVE && !bt->txn_user &&
+        btree_flush(bt) == -1) return NULL;
+    if ((s = malloc(sizeof(*s))) == NULL) return NULL;
+    s->bt = bt;
+    /* The root is taken while holding the lock: the writer takes the epoch
+     * of the space it frees with the same lock, after publishing the new
+     * root, so either this snapshot sees the new root, or its epoch is
+     * already taken into account by the free. */
+    pthread_mutex_lock(&bt->snap_lock);
+    if (concurrent)
+        s->rootptr = btree_read_root(bt);
+    else
+        s->rootptr = (bt->txn == BTREE_TXN_ACTIVE) ? bt->txn_rootptr :
+                                                     bt->rootptr;
+    s->epoch = ++bt->snap_epoch;
+    s->next = NULL;
+    s->prev = bt->snap_tail;
+    if (bt->snap_tail) bt->snap_tail->next = s; else bt->snap_head = s;
+    bt->snap_tail = s;
+    pthread_mutex_unlock(&bt->snap_lock);
+    return s;
+}
+
+/* Release a snapshot, reclaiming the space that only this snapshot could
+ * see. With BTREE_CONCURRENT the space is reclaimed by the next commit of
+ * the writer instead. Cursors using the snapshot must be closed before. */
+void btree_snapshot_release(struct btree_snapshot *s) {
+    struct btree *bt;
+
+    if (s == NULL) return;
+    bt = s->bt;
+    pthread_mutex_lock(&bt->snap_lock);
+    if (s->prev) s->prev->next = s->next; else bt->snap_head = s->next;
+    if (s->next) s->next->prev = s->prev; else bt->snap_tail = s->prev;
+    pthread_mutex_unlock(&bt->snap_lock);
+    free(s);
+    if (!(bt->openflags & BTREE_CONCURRENT)) btree_snapshot_reclaim(bt);
+}
+
+/* --------------------------- Concurrent readers --------------------------- */
+
+/* With BTREE_CONCURRENT a single thread modifies the btree, while any
+ * number of threads can perform lookups. Modifications are always
+ * transactions, so readers that start from the last committed root, that
+ * the writer publishes atomically after every commit, see a consistent
+ * btree, exactly like snapshots. What is left is to make sure the space
+ * they are reading is not reused while they are at it.
+ *
+ * Snapshots would be too costly for every lookup, so readers use epochs
+ * instead: a reader increments a counter of its slot for the parity of
+ * the current epoch, and decrements it when done. The writer tags every
+ * free with the current epoch, and moves to the next epoch when no reader
+ * is left in the previous one, that is, in the other parity. Once the
+ * writer moved from epoch E to E+1, readers that entered in epoch E-1 or
+ * before are done, so space freed up to epoch E-1 can be reused.
+ *
+ * Nodes decoded by readers are taken from the cache, that is sharded and
+ * locked in this mode, or read in a buffer owned by the calling thread. */
+
+struct btree_thread {
+    unsigned char *buf;     /* Buffer used to read nodes */
+    uint32_t buflen;
+    uint32_t slot;          /* Reader slot of this thread */
+};
+
+static pthread_key_t btree_thread_key;
+static pthread_once_t btree_thread_once = PTHREAD_ONCE_INIT;
+static uint32_t btree_thread_count;
+
+void btree_thread_destroy(void *ptr) {
+    struct btree_thread *t = ptr;
+
+    free(t->buf);
+    free(t);
+}
+
+void btree_thread_init(void) {
+    pthread_key_create(&btree_thread_key,btree_thread_destroy);
+}
+
+/* Return the state of the calling thread, creating it if needed. Returns
+ * NULL on out of memory. */
+struct btree_thread *btree_thread_get(void) {
+    struct btree_thread *t;
+
+    pthread_once(&btree_thread_once,btree_thread_init);
+    if ((t = pthread_getspecific(btree_thread_key)) != NULL) return t;
+    if ((t = malloc(sizeof(*t))) == NULL) return NULL;
+    t->buf = NULL;
+    t->buflen = 0;
+    t->slot = __atomic_fetch_add(&btree_thread_count,1,__ATOMIC_RELAXED) %
+              BTREE_READER_SLOTS;
+    if (pthread_setspecific(btree_thread_key,t) != 0) {
+        free(t);
+        return NULL;
+    }
+    return t;
+}
+
+/* Return the reader slot of the calling thread, where it counts its reads.
+ * If the thread state can't be allocated the first slot is used. */
+struct btree_reader_slot *btree_stats_slot(struct btree *bt) {
+    struct btree_thread *t = btree_thread_get();
+
+    return &bt->readers[t ? t->slot : 0];
+}
+
+/* Return a buffer of at least 'size' bytes owned by the calling thread, or
+ * NULL on out of memory. */
+unsigned char *btree_thread_buf(uint32_t size) {
+    struct btree_thread *t = btree_thread_get();
+
+    if (t == NULL) return NULL;
+    if (t->buflen < size) {
+        unsigned char *buf = realloc(t->buf,size);
+
+        if (buf == NULL) return NULL;
+        t->buf = buf;
+        t->buflen = size;
+    }
+    return t->buf;
+}
+
+/* Make the current root visible to the readers, then evict the cached
+ * values it changed. */
+void btree_publish_root(struct btree *bt) {
+    __atomic_store_n(&bt->pubroot,bt->rootptr,__ATOMIC_SEQ_CST);
+    btree_vcache_commit(bt);
+}
+
+/* Return the root lookups should start from. */
+uint64_t btree_read_root(struct btree *bt) {
+    if (!(bt->openflags & BTREE_CONCURRENT)) return bt->rootptr;
+    return __atomic_load_n(&bt->pubroot,__ATOMIC_SEQ_CST);
+}
+
+/* Enter a read: until btree_reader_exit() is called with the returned
+ * value, the space reachable from the published root is not reused. */
+uint64_t btree_reader_enter(struct btree *bt) {
+    struct btree_thread *t;
+    uint64_t *active, epoch;
+
+    if (!(bt->openflags & BTREE_CONCURRENT)) return 0;
+    t = btree_thread_get();
+    active = bt->readers[t ? t->slot : 0].active;
+    while(1) {
+        epoch = __atomic_load_n(&bt->read_epoch,__ATOMIC_SEQ_CST);
+        __atomic_add_fetch(&active[epoch&1],1,__ATOMIC_SEQ_CST);
+        /* If the epoch changed meanwhile the writer may not have seen us:
+         * retry with the new one. */
+        if (__atomic_load_n(&bt->read_epoch,__ATOMIC_SEQ_CST) == epoch) break;
+        __atomic_sub_fetch(&active[epoch&1],1,__ATOMIC_SEQ_CST);
+    }
+    return epoch;
+}
+
+void btree_reader_exit(struct btree *bt, uint64_t epoch) {
+    struct btree_thread *t;
+
+    if (!(bt->openflags & BTREE_CONCURRENT)) return;
+    t = btree_thread_get();
+    __atomic_sub_fetch(&bt->readers[t ? t->slot : 0].active[epoch&1],1,
+                       __ATOMIC_SEQ_CST);
+}
+
+/* Called by the writer: move to the next epoch if no reader is left in
+ * the previous one. */
+void btree_reader_advance(struct btree *bt) {
+    uint64_t epoch = bt->read_epoch, active = 0;
+    int j;
+
+    for (j = 0; j < BTREE_READER_SLOTS; j++)
+        active += __atomic_load_n(&bt->readers[j].active[(epoch+1)&1],
+                                  __ATOMIC_SEQ_CST);
+    if (active) return;
+    bt->read_safe = epoch-1;
+    __atomic_store_n(&bt->read_epoch,epoch+1,__ATOMIC_SEQ_CST);
+}
+
+/* ------------------------- Node search kernel ---------------------------- */
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+/* Keys are always compared with this function, or by the search kernel
+ * below that uses the same ordering: the ordering of memcmp(). */
+int btree_key_cmp(const unsigned char *a, const unsigned char *b) {
+#if defined(__SSE2__)
+    __m128i x = _mm_loadu_si128((const __m128i*)a);
+    __m128i y = _mm_loadu_si128((const __m128i*)b);
+    unsigned int diff = _mm_movemask_epi8(_mm_cmpeq_epi8(x,y)) ^ 0xffff;
+    int i;
+
+    if (diff == 0) return 0;
+    i = __builtin_ctz(diff); /* First differing byte */
+    return (int)a[i] - (int)b[i];
+#else
+    return memcmp(a,b,BTREE_HASHED_KEY_LEN);
+#endif
+}
+
+/* Compare two keys of 'keylen' bytes. */
+int btree_key_cmp_len(const unsigned char *a, const unsigned char *b,
+                      uint32_t keylen)
+{
+    if (keylen == BTREE_HASHED_KEY_LEN) return btree_key_cmp(a,b);
+    return memcmp(a,b,keylen);
+}
+
+/* Below this number of keys the search is a linear scan. */
+#define BTREE_SEARCH_LINEAR 8
+
+/* btree_node_search() for 128 bit integer keys. The key we search is
+ * loaded once as two 64 bit words, so every key of the node is compared
+ * with at most two word comparisons. As integer keys are stored big endian
+ * (see btree_key_from_u128()) this gives the same result of memcmp(). */
+int btree_node_search_u128(struct btree_node *n, const unsigned char *key,
+                           int *found)
+{
+    unsigned char *keys = (unsigned char*) n->keys;
+    uint64_t khi = btree_u64_from_big((unsigned char*)key);
+    uint64_t klo = btree_u64_from_big((unsigned char*)key+8);
+    int lo = 0, hi = n->numkeys;
+
+    *found = 0;
+    while (lo < hi) {
+        int mid = lo+(hi-lo)/2;
+        unsigned char *p = keys+mid*BTREE_HASHED_KEY_LEN;
+        uint64_t w = btree_u64_from_big(p);
+
+        if (khi == w) {
+            w = btree_u64_from_big(p+8);
+            if (klo == w) {
+                *found = 1;
+                return mid;
+            }
+            if (klo < w) hi = mid; else lo = mid+1;
+        } else if (khi < w) {
+            hi = mid;
+        } else {
+            lo = mid+1;
+        }
+    }
+    return lo;
+}
+
+/* Search 'key' in the node 'n'. Returns the index of the first key of the
+ * node that is greater or equal to 'key', that is n->numkeys if all the
+ * keys are smaller. '*found' is set to 1 if the key at the returned index
+ * is equal to 'key', otherwise to 0.
+ *
+ * A binary search reduces the range to a few keys, that are then scanned
+ * linearly. With AVX2 the scan compares the key with two keys of the node
+ * at a time. Keys of other sizes than BTREE_HASHED_KEY_LEN just use a
+ * binary search, and integer keys btree_node_search_u128(). */
+int btree_node_search(struct btree_node *n, const unsigned char *key,
+                      int *found)
+{
+    const unsigned char *keys = (unsigned char*) n->keys;
+    int lo = 0, hi = n->numkeys, cmp;
+
+    if (n->keytype != BTREE_KEY_BINARY)
+        return btree_node_search_u128(n,key,found);
+    *found = 0;
+    if (n->keylen != BTREE_HASHED_KEY_LEN) {
+        while (lo < hi) {
+            int mid = lo+(hi-lo)/2;
+
+            cmp = memcmp(key,keys+mid*n->keylen,n->keylen);
+            if (cmp == 0) {
+                *found = 1;
+                return mid;
+            }
+            if (cmp < 0) hi = mid; else lo = mid+1;
+        }
+        return lo;
+    }
+    while (hi-lo > BTREE_SEARCH_LINEAR) {
+        int mid = lo+(hi-lo)/2;
+
+        cmp = btree_key_cmp(key,keys+mid*BTREE_HASHED_KEY_LEN);
+        if (cmp == 0) {
+            *found = 1;
+            return mid;
+        }
+        if (cmp < 0) hi = mid; else lo = mid+1;
+    }
+#if defined(__AVX2__)
+    {
+        __m256i k = _mm256_broadcastsi128_si256(
+                        _mm_loadu_si128((const __m128i*)key));
+
+        for (; lo+1 < hi; lo += 2) {
+            const unsigned char *p = keys+lo*BTREE_HASHED_KEY_LEN;
+            __m256i pair = _mm256_loadu_si256((const __m256i*)p);
+            unsigned int diff = ~(unsigned int)
+                _mm256_movemask_epi8(_mm256_cmpeq_epi8(pair,k));
+            int i;
+
+            if ((diff & 0xffff) == 0) {
+                *found = 1;
+                return lo;
+            }
+            i = __builtin_ctz(diff);
+            if (key[i] < p[i]) return lo;
+            diff >>= 16;
+            if (diff == 0) {
+                *found = 1;
+                return lo+1;
+            }
+            i = __builtin_ctz(diff);
+            if (key[i] < p[BTREE_HASHED_KEY_LEN+i]) return lo+1;
+        }
+    }
+#endif
+    for (; lo < hi; lo++) {
+        cmp = btree_key_cmp(key,keys+lo*BTREE_HASHED_KEY_LEN);
+        if (cmp <= 0) {
+            *found = (cmp == 0);
+            return lo;
+        }
+    }
+    return lo;
+}
+
+/* --------------------------- btree operations  ---------------------------- */
+
+/* Nodes are split on the way down when full, so that there is always room
+ * for a key in the node we descend into. Prefix compressed nodes are never
+ * full, as how much room a key needs is only known when it is added: they
+ * are split on the way up when too big, see btree_split_path(). */
+int btree_node_is_full(struct btree *bt, struct btree_node *n) {
+    return !bt->prefixed && n->numkeys == n->maxkeys;
+}
+
+/* Return true if the node 'n' fits a node on disk. */
+int btree_node_fits(struct btree *bt, struct btree_node *n) {
+    return n->numkeys < n->maxkeys && btree_node_size(bt,n) <= bt->nodesize;
+}
+
+/* Return the offset on disk of the i-th value pointer of the node 'n'
+ * stored at 'nodeptr'. */
+uint64_t btree_node_value_pos(struct btree *bt, struct btree_node *n,
+                              uint64_t nodeptr, int i)
+{
+    if (bt->prefixed) return nodeptr+16+8*i;
+    (void) n;
+    return nodeptr+16+BTREE_HASHED_KEY_LEN*bt->maxkeys+8*i;
+}
+
+/* Return the offset on disk of the i-th child pointer of the node 'n'
+ * stored at 'nodeptr'. */
+uint64_t btree_node_child_pos(struct btree *bt, struct btree_node *n,
+                              uint64_t nodeptr, int i)
+{
+    if (bt->prefixed) return nodeptr+16+8*n->numkeys+8*i;
+    return nodeptr+16+BTREE_HASHED_KEY_LEN*bt->maxkeys+8*bt->maxkeys+8*i;
+}
+
+/* Return the offset on disk of the i-th inline value of the node 'n' stored
+ * at 'nodeptr'. Like allocations the value is prefixed by its size, so the
+ * offset can be used with btree_alloc_size() and btree_pread(). */
+uint64_t btree_node_inline_pos(struct btree *bt, struct btree_node *n,
+                               uint64_t nodeptr, int i)
+{
+    uint32_t numchildren = bt->prefixed ? n->numkeys+1 : bt->maxkeys+1;
+
+    return btree_node_child_pos(bt,n,nodeptr,numchildren)+
+           (bt->inlinelen+8)*i+8;
+}
+
+/* Return the offset on disk of the value at position 'i' of the node 'n'
+ * stored at 'nodeptr', either inline or in its own allocation. */
+uint64_t btree_node_voff(struct btree *bt, struct btree_node *n,
+                         uint64_t nodeptr, int i)
+{
+    if (BTREE_VALUE_IS_INLINE(n->values[i]))
+        return btree_node_inline_pos(bt,n,nodeptr,i);
+    return n->values[i];
+}
+
+/* Store the value 'val' inline at position 'i' of the node. */
+void btree_node_set_inline(struct btree_node *n, int i,
+                           const unsigned char *val, size_t vlen)
+{
+    memcpy(n->inl+n->inlinelen*i,val,vlen);
+    n->values[i] = BTREE_VALUE_INLINE | vlen;
+}
+
+/* Free the value pointed by the value pointer 'v', if not inline. */
+int btree_free_value(struct btree *bt, uint64_t v) {
+    if (BTREE_VALUE_IS_INLINE(v)) return 0;
+    return btree_free(bt,v);
+}
+
+/* Add a key at the specified position 'i' inside an in-memory node.
+ * All the other keys starting from the old key at position 'i' are
+ * shifted one position to the right.
+ *
+ * Note: this function does not change the position of the children as it
+ * is intented to be used only on leafs. */
+void btree_node_insert_key_at(struct btree_node *n, int i, unsigned char *key, uint64_t valoff) {
+    btree_node_move(n,i+1,n,i,n->numkeys-i);
+    memcpy(n->keys+i*n->keylen,key,n->keylen);
+    n->values[i] = valoff;
+    n->numkeys++;
+}
+
+/* Return the index of the median key used to split the node 'n': the one
+ * in the middle of a full node, or for prefix compressed nodes the one
+ * splitting the bytes of the keys in two halves of about the same size. */
+int btree_node_split_point(struct btree *bt, struct btree_node *n) {
+    uint32_t ks = BTREE_PNODE_KEY_SIZE(bt->inlinelen), plen, total, cost;
+    uint32_t left = 0, j;
+
+    if (!bt->prefixed) return (n->maxkeys-1)/2;
+    plen = btree_node_prefix(n);
+    total = n->numkeys*ks+btree_keys_suffix_size(n,0,n->numkeys,plen);
+    for (j = 0; j < n->numkeys; j++) {
+        cost = ks+btree_keys_suffix_size(n,j,1,plen);
+        if (left >= total-left-cost) {
+            /* The left half is now the biggest one: splitting at the
+             * previous key may be better. */
+            if (j > 0 && total-left < left) j--;
+            break;
+        }
+        left += cost;
+    }
+    if (j < 1) j = 1;
+    if (j > n->numkeys-2) j = n->numkeys-2;
+    return j;
+}
+
+/* Split the node 'c', that is the child at index 'i' of the non full node
+ * 'p', in memory, using the key at index 'm' as median. 'c' keeps the keys
+ * at its left, the keys at its right are moved into the empty node 'r', and
+ * the median key goes into 'p' at position 'i'. The pointer to 'r' in the
+ * parent (index i+1) is set by the caller once 'r' has an offset on disk. */
+void btree_node_split(struct btree_node *p, int i, struct btree_node *c,
+                      struct btree_node *r, int m)
+{
+    int rnum = c->numkeys-m-1;
+
+    /* Two fundamental conditions that must be always true */
+    assert(m > 0 && rnum > 0);
+    assert(p->numkeys != p->maxkeys);
+    btree_node_move(r,0,c,m+1,rnum);
+    memcpy(r->children,c->children+m+1,8*(rnum+1));
+    r->numkeys = rnum;
+    r->isleaf = c->isleaf;
+    /* Move the child's median key into the parent, shifting the current
+     * keys, values, and child pointers. */
+    btree_node_move(p,i+1,p,i,p->numkeys-i);
+    memmove(p->children+i+2,p->children+i+1,(p->numkeys-i)*8);
+    btree_node_move(p,i,c,m,1);
+    p->children[i+1] = 0;
+    p->numkeys++;
+    c->numkeys = m;
+}
+
+/* Write a modified node of the insert path. 'owner' is the offset of the
+ * node it replaces, or zero for new nodes: nodes created by the transaction
+ * in progress are rewritten in place, otherwise the node is written in a
+ * new location and the old one is appended to 'frees'. Returns the offset
+ * of the node, or zero on error. */
+uint64_t btree_write_path_node(struct btree *bt, struct btree_node *n,
+                               uint64_t owner, uint64_t *frees, int *numfrees)
+{
+    uint64_t o = owner;
+
+    if (o == 0 || !btree_txn_is_fresh(bt,o)) {
+        if ((o = btree_alloc(bt,bt->nodesize)) == 0) return 0;
+        if (owner) frees[(*numfrees)++] = owner;
+    }
+    if (btree_write_node(bt,n,o) == -1) return 0;
+    return o;
+}
+
+/* Split the nodes of a modified path that no longer fit a node on disk,
+ * from the bottom, in prefix compressed btrees. 'node', 'off' and 'idx'
+ * are the path of btree_add() or btree_delete(), 'depth' its length, and
+ * 'top' the first level modified, that is updated.
+ *
+ * The half of a split node containing the child of the path (the left
+ * half for leafs) stays in the path, while the other half is written
+ * at once, and linked to the parent, so that splitting the parent in turn
+ * moves its pointer where it belongs. The median key goes into the parent,
+ * and a root too big gets a new root on top of it, shifting the path one
+ * level down.
+ *
+ * Returns 0 on success, -1 on error. */
+int btree_split_path(struct btree *bt, struct btree_node **node,
+                     uint64_t *off, int *idx, int *depth, int *top,
+                     uint64_t *frees, int *numfrees)
+{
+    int l;
+
+    for (l = *depth-1; l >= 0; l--) {
+        struct btree_node *n = node[l], *p, *r;
+        uint64_t sibwritten;
+        int c, m, right;
+
+        if (btree_node_fits(bt,n)) continue;
+        if (l == 0) {
+            if (*depth == BTREE_MAX_DEPTH) {
+                errno = EFAULT;
+                return -1;
+            }
+            if ((p = btree_new_node(bt)) == NULL) return -1;
+            memmove(node+1,node,sizeof(*node)*(*depth));
+            memmove(off+1,off,sizeof(*off)*(*depth));
+            memmove(idx+1,idx,sizeof(*idx)*(*depth));
+            p->children[0] = off[1];
+            node[0] = p;
+            off[0] = 0;
+            idx[0] = 0;
+            (*depth)++;
+            (*top)++;
+            l = 1;
+        }
+        p = node[l-1];
+        c = idx[l-1];
+        if ((r = btree_new_node(bt)) == NULL) return -1;
+        m = btree_node_split_point(bt,n);
+        btree_node_split(p,c,n,r,m);
+        if (l-1 < *top) *top = l-1;
+        right = l < *depth-1 && idx[l] > m;
+        if (right) {
+            /* Continue with the right half: the left one takes the place
+             * of the old node as a sibling. */
+            node[l] = r;
+            idx[l] -= m+1;
+            idx[l-1] = c+1;
+            r = n;
+        }
+        sibwritten = btree_write_path_node(bt,r,right ? off[l] : 0,
+                                           frees,numfrees);
+        btree_free_node(r);
+        if (sibwritten == 0) return -1;
+        p->children[right ? c : c+1] = sibwritten;
+        if (right) off[l] = 0;
+    }
+    return 0;
+}
+
+/* Insert a key with its value, or replace the value of an existing key if
+ * 'replace' is true.
+ *
+ * The tree is descended once, keeping the path from the root in memory, so
+ * that every node is read and decoded only once. Full nodes found in the
+ * path are split in memory as we descend (a full root gets a new root on
+ * top of it), so that the leaf always has room for the new key, and the
+ * parent of a split node always has room for the median key.
+ *
+ * Nodes are never modified in place: when the descent is over, the
+ * modified nodes of the path, from the leaf up to the first node that
+ * changed, are written in new locations together with the nodes created by
+ * splits, and then the pointer to the first node is updated in its parent
+ * (or in the header for the root). Old nodes are freed only after the new
+ * path is linked. The only exception is the replacement of a value that
+ * is not inline, if no node needed a split, where the value pointer is
+ * just overwritten.
+ *
+ * The function returns 0 on success, and -1 on error.
+ * On error errno is set accordingly, and may also assume the following values:
+ *
+ * EFAULT if the btree seems corrupted.
+ * EBUSY if the key already exists and 'replace' is false.
+ */
+int btree_add_key(struct btree *bt, unsigned char *key, unsigned char *val, size_t vlen, int replace) {
+    struct btree_node *node[BTREE_MAX_DEPTH], *sib[BTREE_MAX_DEPTH], *n;
+    uint64_t off[BTREE_MAX_DEPTH], sibown[BTREE_MAX_DEPTH];
+    uint64_t frees[BTREE_MAX_DEPTH], nptr = bt->rootptr;
+    uint64_t valoff = 0, oldval = 0, written = 0, sibwritten = 0;
+    int idx[BTREE_MAX_DEPTH], sibidx[BTREE_MAX_DEPTH];
+    int depth = 0, top = BTREE_MAX_DEPTH, numfrees = 0, retval = -1;
+    int found = -1, l, i, j;
+
+    if (btree_txn_implicit(bt)) {
+        int saved;
+
+        if (btree_begin(bt) == -1) return -1;
+        retval = btree_add_key(bt,key,val,vlen,replace);
+        /* Report the error of the operation, like ENOENT or EBUSY: the
+         * commit may change errno even when it succeeds. */
+        saved = errno;
+        if (btree_commit(bt) == -1 && retval == 0) return -1;
+        if (retval == -1) errno = saved;
+        return retval;
+    }
+    if (bt->compact && btree_compact_track(bt->compact,key) == -1) return -1;
+    if (btree_drop_bloom(bt) == -1) return -1;
+
+    if ((n = btree_read_node(bt,nptr)) == NULL) return -1;
+    if (btree_node_is_full(bt,n)) {
+        struct btree_node *root;
+
+        /* Root is full: the new root is an empty node having the old root
+         * as its only child, that is split like any other full node. */
+        if ((root = btree_new_node(bt)) == NULL) {
+            btree_free_node(n);
+            return -1;
+        }
+        root->children[0] = nptr;
+        node[0] = root;
+        off[0] = 0;
+        sib[0] = NULL;
+        idx[0] = 0;
+        depth = 1;
+        top = 0;
+    }
+
+    /* Descend to the leaf, 'n' is the node read at the next level. */
+    while(1) {
+        if (depth == BTREE_MAX_DEPTH) {
+            btree_free_node(n);
+            errno = EFAULT;
+            goto cleanup;
+        }
+        node[depth] = n;
+        off[depth] = nptr;
+        sib[depth] = NULL;
+        depth++;
+        if (btree_node_is_full(bt,n)) {
+            struct btree_node *p = node[depth-2], *r;
+            int c = idx[depth-2], cmp;
+
+            /* Split the node: the half we don't descend into is remembered
+             * as the sibling of this level. The left half takes the place
+             * of the old node. */
+            if ((r = btree_new_node(bt)) == NULL) goto cleanup;
+            btree_node_split(p,c,n,r,btree_node_split_point(bt,n));
+            if (top > depth-2) top = depth-2;
+            cmp = btree_key_cmp(key,(unsigned char*)p->keys+c*p->keylen);
+            if (cmp > 0) {
+                node[depth-1] = r;
+                off[depth-1] = 0;
+                sib[depth-1] = n;
+                sibown[depth-1] = nptr;
+                sibidx[depth-1] = c;
+                idx[depth-2] = c+1;
+                n = r;
+            } else {
+                sib[depth-1] = r;
+                sibown[depth-1] = 0;
+                sibidx[depth-1] = c+1;
+            }
+            if (cmp == 0) {
+                /* The key is the median that moved into the parent. */
+                found = depth-2;
+                break;
+            }
+        }
+        idx[depth-1] = btree_node_search(n,key,&j);
+        if (j) {
+            found = depth-1;
+            break;
+        }
+        if (n->isleaf) break;
+        nptr = n->children[idx[depth-1]];
+        if ((n = btree_read_node(bt,nptr)) == NULL) goto cleanup;
+    }
+
+    if (found != -1) {
+        l = found;
+        if (!replace) {
+            errno = EBUSY;
+            goto cleanup;
+        }
+        btree_vcache_del(bt,key);
+        n = node[l];
+        i = idx[l];
+        oldval = n->values[i];
+        if (bt->inlinelen && vlen <= bt->inlinelen) {
+            btree_node_set_inline(n,i,val,vlen);
+        } else {
+            if ((valoff = btree_alloc(bt,vlen)) == 0) goto cleanup;
+            if (btree_pwrite(bt,val,vlen,valoff) == -1) goto cleanup;
+            n->values[i] = valoff;
+        }
+        if (l < top) top = l;
+        if (valoff && top == depth-1 &&
+            (bt->txn != BTREE_TXN_ACTIVE || btree_txn_is_fresh(bt,off[l])))
+        {
+            /* Nothing else changed: overwrite the pointer to the old value
+             * with the new one. */
+            btree_sync(bt);
+            btree_cache_del(bt->cache,off[l]);
+            if (btree_pwrite_node_u64(bt,valoff,
+                btree_node_value_pos(bt,n,off[l],i)) == -1) goto cleanup;
+            btree_free_value(bt,oldval);
+            retval = 0;
+            goto cleanup;
+        }
+    } else {
+        /* Write the value on disk, unless it is small enough to be stored
+         * inline in the node, and insert the key in the leaf. */
+        n = node[depth-1];
+        i = idx[depth-1];
+        btree_bloom_add(bt,key);
+        if (bt->inlinelen && vlen <= bt->inlinelen) {
+            btree_node_insert_key_at(n,i,key,0);
+            btree_node_set_inline(n,i,val,vlen);
+        } else {
+            if ((valoff = btree_alloc(bt,vlen)) == 0) goto cleanup;
+            if (btree_pwrite(bt,val,vlen,valoff) == -1) goto cleanup;
+            btree_node_insert_key_at(n,i,key,valoff);
+        }
+        if (depth-1 < top) top = depth-1;
+        if (bt->prefixed) {
+            /* The level added if the root is split has no sibling. */
+            if (depth < BTREE_MAX_DEPTH) sib[depth] = NULL;
+            if (btree_split_path(bt,node,off,idx,&depth,&top,frees,
+                                 &numfrees) == -1) goto cleanup;
+        }
+    }
+
+    /* Inside a transaction we can modify in place only the nodes created
+     * by the transaction itself, so the rewritten path must start at a
+     * node whose parent is fresh. */
+    if (bt->txn == BTREE_TXN_ACTIVE) {
+        while (top > 0 && !btree_txn_is_fresh(bt,off[top]) &&
+               !btree_txn_is_fresh(bt,off[top-1])) top--;
+    }
+
+    /* Write the modified path and the split siblings, from the bottom. */
+    for (l = depth-1; l >= top; l--) {
+        if (l < depth-1) {
+            node[l]->children[idx[l]] = written;
+            if (sib[l+1]) node[l]->children[sibidx[l+1]] = sibwritten;
+        }
+        if (sib[l] && (sibwritten = btree_write_path_node(bt,sib[l],
+            sibown[l],frees,&numfrees)) == 0) goto cleanup;
+        if ((written = btree_write_path_node(bt,node[l],off[l],frees,
+            &numfrees)) == 0) goto cleanup;
+    }
+
+    /* Link the new path, and finally release the old nodes and value. */
+    if (written != off[top]) {
+        btree_sync(bt); /* Make sure the nodes are flushed before linking. */
+        if (top == 0) {
+            if (btree_update_pointer(bt,0,BTREE_HDR_ROOTPTR_POS,written) == -1)
+                goto cleanup;
+        } else {
+            if (btree_update_pointer(bt,off[top-1],btree_node_child_pos(bt,
+                node[top-1],off[top-1],idx[top-1]),written) == -1)
+                goto cleanup;
+        }
+    }
+    for (j = 0; j < numfrees; j++) btree_free(bt,frees[j]);
+    if (oldval) btree_free_value(bt,oldval);
+    if (found == -1) btree_bloom_fit(bt);
+    retval = 0;
+
+cleanup:
+    for (j = 0; j < depth; j++) {
+        btree_free_node(node[j]);
+        btree_free_node(sib[j]);
+    }
+    return retval;
+}
+
+int btree_add(struct btree *bt, unsigned char *key, unsigned char *val, size_t vlen, int replace) {
+    btree_op_enter(bt);
+    return btree_op_exit(bt,btree_add_key(bt,key,val,vlen,replace));
+}
+
+/* Set the number of keys under which a node is considered underfull by
+ * btree_delete(). The default is BTREE_MIN_KEYS. */
+void btree_set_min_keys(struct btree *bt, uint32_t minkeys) {
+    if (minkeys > bt->maxkeys/2) minkeys = bt->maxkeys/2;
+    bt->minkeys = minkeys;
+}
+
+/* Remove the key (and value pointer) at position 'i' from an in-memory
+ * node, together with the child pointer at position 'child'. Leafs don't
+ * have children so 'child' is ignored. */
+void btree_node_remove_key_at(struct btree_node *n, int i, int child) {
+    btree_node_move(n,i,n,i+1,n->numkeys-i-1);
+    if (!n->isleaf)
+        memmove(n->children+child,n->children+child+1,(n->numkeys-child)*8);
+    n->numkeys--;
+}
+
+/* Return true if the keys of 'a', the separator at index 'sep' of 'p', and
+ * the keys of 'b' fit a single node. */
+int btree_node_merge_fits(struct btree *bt, struct btree_node *a,
+                          struct btree_node *p, int sep, struct btree_node *b)
+{
+    uint32_t numkeys = a->numkeys+b->numkeys+1, plen, size;
+    unsigned char *sepkey = (unsigned char*)p->keys+sep*p->keylen;
+    unsigned char *first, *last;
+
+    if (!bt->prefixed) return numkeys <= bt->maxkeys;
+    if (numkeys >= bt->maxkeys) return 0;
+    first = a->numkeys ? (unsigned char*)a->keys : sepkey;
+    last = b->numkeys ? (unsigned char*)b->keys+(b->numkeys-1)*b->keylen :
+                        sepkey;
+    plen = btree_keys_prefix(a,first,last);
+    size = BTREE_PNODE_FIXED+plen+numkeys*BTREE_PNODE_KEY_SIZE(bt->inlinelen)+
+           btree_keys_suffix_size(a,0,a->numkeys,plen)+
+           btree_keys_suffix_size(p,sep,1,plen)+
+           btree_keys_suffix_size(b,0,b->numkeys,plen);
+    return size <= bt->nodesize;
+}
+
+/* Fix the underfull node at level 'l' of the path used by btree_delete().
+ * If the node and one of its siblings fit a single node they are merged,
+ * otherwise if the node is empty it borrows a key from the sibling through
+ * the parent. Otherwise nothing is done: underfull nodes are fine as long
+ * as they are not empty, and we don't want to rewrite a sibling and the
+ * parent on every delete.
+ *
+ * The node and its parent are modified in memory, and will be written by
+ * the caller. The sibling is written by this function if modified, and
+ * its old offset (or its offset if merged) is appended to 'frees'.
+ *
+ * Returns 1 if the node and the parent were modified, 0 if not, and -1 on
+ * error. */
+int btree_delete_fix(struct btree *bt, struct btree_node **node, int *idx,
+                     int l, uint64_t *frees, int *numfrees)
+{
+    struct btree_node *p = node[l-1], *n = node[l], *s;
+    int c = idx[l-1];
+    int left = (c == (int)p->numkeys); /* Use the left sibling? */
+    int sep = left ? c-1 : c;          /* Separator key in the parent */
+    uint64_t soff, newoff;
+
+    if (p->numkeys == 0) return 0;
+    soff = p->children[left ? c-1 : c+1];
+    if ((s = btree_read_node(bt,soff)) == NULL) return -1;
+
+    if (btree_node_merge_fits(bt,left ? s : n,p,sep,left ? n : s)) {
+        /* Merge, the resulting node is 'n'. */
+        struct btree_node *a = left ? s : n, *b = left ? n : s;
+        uint32_t anum = a->numkeys, bnum = b->numkeys;
+
+        if (left) {
+            /* Make room for the sibling keys and the separator. */
+            btree_node_move(n,anum+1,n,0,bnum);
+            memmove(n->children+anum+1,n->children,(bnum+1)*8);
+            btree_node_move(n,0,s,0,anum);
+            memcpy(n->children,s->children,(anum+1)*8);
+            idx[l] += anum+1;
+        } else {
+            btree_node_move(n,anum+1,s,0,bnum);
+            memcpy(n->children+anum+1,s->children,(bnum+1)*8);
+        }
+        btree_node_move(n,anum,p,sep,1);
+        n->numkeys = anum+1+bnum;
+        /* The parent loses the separator and the pointer to the right
+         * node of the two. */
+        btree_node_remove_key_at(p,sep,sep+1);
+        idx[l-1] = sep;
+        frees[(*numfrees)++] = soff;
+    } else if (n->numkeys == 0) {
+        /* Rotate a key of the sibling into the parent, and the separator
+         * into the node. */
+        if (left) {
+            memmove(n->children+1,n->children,(n->numkeys+1)*8);
+            btree_node_move(n,0,p,sep,1);
+            n->children[0] = s->children[s->numkeys];
+            idx[l]++;
+            btree_node_move(p,sep,s,s->numkeys-1,1);
+            s->numkeys--;
+        } else {
+            btree_node_move(n,0,p,sep,1);
+            n->children[1] = s->children[0];
+            btree_node_move(p,sep,s,0,1);
+            btree_node_remove_key_at(s,0,0);
+        }
+        n->numkeys++;
+        /* Write the modified sibling. */
+        newoff = soff;
+        if (!btree_txn_is_fresh(bt,soff) &&
+            (newoff = btree_alloc(bt,bt->nodesize)) == 0) goto err;
+        if (btree_write_node(bt,s,newoff) == -1) goto err;
+        if (newoff != soff) frees[(*numfrees)++] = soff;
+        p->children[left ? c-1 : c+1] = newoff;
+    } else {
+        btree_free_node(s);
+        return 0;
+    }
+    btree_free_node(s);
+    return 1;
+
+err:
+    btree_free_node(s);
+    return -1;
+}
+
+/* Delete a key and its value from the btree.
+ *
+ * Like btree_add() nodes are never modified in place: the modified
+ * nodes of the path, from the leaf up to the first node that changed,
+ * are written in new locations, and then the pointer to the first node is
+ * updated in its parent (or in the header for the root). The old nodes and
+ * the value are freed only after the new path is linked.
+ *
+ * A key inside an internal node is replaced by its predecessor, that is
+ * removed from its leaf. Underfull nodes are repaired lazily: only the
+ * deepest node of the path with less than the minimum number of keys (see
+ * btree_set_min_keys()) is merged with a sibling, if they fit a single
+ * node, so that deletes don't cascade into rewrites of the tree. Nodes
+ * that become empty are always repaired.
+ *
+ * Returns 0 on success, otherwise -1 is returned and errno set
+ * accordingly. If the key does not exist errno is set to ENOENT. */
+int btree_delete_key(struct btree *bt, unsigned char *key) {
+    struct btree_node *node[BTREE_MAX_DEPTH];
+    uint64_t off[BTREE_MAX_DEPTH], frees[BTREE_MAX_DEPTH*2+1];
+    uint64_t nptr = bt->rootptr, valoff, written = 0;
+    int idx[BTREE_MAX_DEPTH];
+    int depth = 0, numfrees = 0, top, base = 0, softfix = 0, retval = -1;
+    int found, l, j;
+
+    if (btree_txn_implicit(bt)) {
+        int saved;
+
+        if (btree_begin(bt) == -1) return -1;
+        retval = btree_delete_key(bt,key);
+        /* Report the error of the operation, like ENOENT or EBUSY: the
+         * commit may change errno even when it succeeds. */
+        saved = errno;
+        if (btree_commit(bt) == -1 && retval == 0) return -1;
+        if (retval == -1) errno = saved;
+        return retval;
+    }
+    if (bt->compact && btree_compact_track(bt->compact,key) == -1) return -1;
+    btree_vcache_del(bt,key);
+
+    /* Descend to the key, remembering the path. */
+    while(1) {
+        struct btree_node *n;
+
+        if (depth == BTREE_MAX_DEPTH) {
+            errno = EFAULT;
+            goto err;
+        }
+        if ((n = btree_read_node(bt,nptr)) == NULL) goto err;
+        node[depth] = n;
+        off[depth] = nptr;
+        idx[depth] = btree_node_search(n,key,&found);
+        depth++;
+        if (found) break;
+        if (n->isleaf) {
+            errno = ENOENT;
+            goto err;
+        }
+        nptr = n->children[idx[depth-1]];
+    }
+    top = depth-1;
+    valoff = node[top]->values[idx[top]];
+
+    if (node[top]->isleaf) {
+        btree_node_remove_key_at(node[top],idx[top],0);
+    } else {
+        /* Replace the key with its predecessor, the last key of the
+         * rightmost leaf of the left subtree. */
+        struct btree_node *n = node[top], *leaf;
+        int i = idx[top];
+
+        nptr = n->children[i];
+        while(1) {
+            if (depth == BTREE_MAX_DEPTH) {
+                errno = EFAULT;
+                goto err;
+            }
+            if ((leaf = btree_read_node(bt,nptr)) == NULL) goto err;
+            node[depth] = leaf;
+            off[depth] = nptr;
+            idx[depth] = leaf->numkeys;
+            depth++;
+            if (leaf->isleaf) break;
+            nptr = leaf->children[leaf->numkeys];
+        }
+        if (leaf->numkeys == 0) {
+            errno = EFAULT;
+            goto err;
+        }
+        btree_node_move(n,i,leaf,leaf->numkeys-1,1);
+        leaf->numkeys--;
+    }
+
+    /* Repair underfull nodes from the bottom. */
+    for (l = depth-1; l > 0; l--) {
+        int fixed;
+
+        if (node[l]->numkeys >= bt->minkeys) continue;
+        if (node[l]->numkeys > 0 && softfix) continue;
+        softfix = 1;
+        fixed = btree_delete_fix(bt,node,idx,l,frees,&numfrees);
+        if (fixed == -1) goto err;
+        if (fixed && l-1 < top) top = l-1;
+    }
+    /* In prefix compressed btrees the predecessor and the keys rotated
+     * from siblings may be longer than the keys they replace. */
+    if (bt->prefixed && btree_split_path(bt,node,off,idx,&depth,&top,frees,
+                                         &numfrees) == -1) goto err;
+    /* An empty root with a single child: the child is the new root. */
+    if (node[0]->numkeys == 0 && !node[0]->isleaf) {
+        base = 1;
+        if (top < base) top = base;
+        frees[numfrees++] = off[0];
+    }
+
+    /* Inside a transaction we can modify in place only the nodes created
+     * by the transaction itself, so the rewritten path must start at a
+     * node whose parent is fresh. */
+    if (bt->txn == BTREE_TXN_ACTIVE) {
+        while (top > base && !btree_txn_is_fresh(bt,off[top]) &&
+               !btree_txn_is_fresh(bt,off[top-1])) top--;
+    }
+
+    /* Write the modified path, from the bottom. */
+    for (l = depth-1; l >= top; l--) {
+        if (l < depth-1) node[l]->children[idx[l]] = written;
+        if ((written = btree_write_path_node(bt,node[l],off[l],frees,
+            &numfrees)) == 0) goto err;
+    }
+
+    /* Link the new path, and finally release the old nodes and value. */
+    if (written != off[top] || base) {
+        btree_sync(bt);
+        if (top == base) {
+            if (btree_update_pointer(bt,0,BTREE_HDR_ROOTPTR_POS,written) == -1)
+                goto err;
+        } else {
+            if (btree_update_pointer(bt,off[top-1],btree_node_child_pos(bt,
+                node[top-1],off[top-1],idx[top-1]),written) == -1)
+                goto err;
+        }
+        btree_sync(bt);
+    }
+    for (j = 0; j < numfrees; j++) btree_free(bt,frees[j]);
+    btree_free_value(bt,valoff);
+    retval = 0;
+
+err:
+    for (j = 0; j < depth; j++) btree_free_node(node[j]);
+    return retval;
+}
+
+int btree_delete(struct btree *bt, unsigned char *key) {
+    btree_op_enter(bt);
+    return btree_op_exit(bt,btree_delete_key(bt,key));
+}
+
+/* Find a record by key.
+ * The function seraches for the specified key. If the key is found
+ * 0 is returned, and *voff is set to the offset of the value on disk.
+ * 
+ * On error -1 is returned and errno set accordingly.
+ * 
+ * Non existing key is considered an error with errno = ENOENT.
+ *
+ * With BTREE_CONCURRENT the space of the value may be reused as soon as
+ * the key is replaced or deleted by the writer, so threads other than the
+ * writer should use btree_get(), or a snapshot. */
+int btree_find(struct btree *bt, unsigned char *key, uint64_t *voff) {
+    uint64_t epoch;
+    int retval;
+
+    if (!btree_bloom_may_contain(bt,key)) {
+        btree_stat_read(bt,bloom_negatives,1);
+        errno = ENOENT;
+        return -1;
+    }
+    epoch = btree_reader_enter(bt);
+    retval = btree_find_root(bt,btree_read_root(bt),key,voff);
+    btree_reader_exit(bt,epoch);
+    return retval;
+}
+
+/* Result of the search of a key along a path of the tree. If the key is
+ * found its value pointer, the offset of the value on disk, and the value
+ * itself if inline, are copied here, as the node may be a view of a buffer
+ * that is reused, or a cached node that may be replaced by another thread
+ * as soon as the shard lock is released. Otherwise 'child' is the child
+ * where the search continues, or zero at the leaves. */
+struct btree_lookup {
+    int found;
+    uint64_t value;
+    uint64_t voff;
+    uint64_t child;
+    unsigned char inl[BTREE_MAX_INLINE];
+};
+
+/* Search 'key' in the node 'n' stored at 'nptr', filling 'lk'. The inline
+ * values of the node are at 'inl' with the specified stride: that is the
+ * nodes inlinelen for decoded nodes, and inlinelen+8 for the views of
+ * btree_view_node(), where the big endian size header of every value is
+ * right before it and is checked against the value pointer. Returns 0 on
+ * success, or -1 with errno set to EFAULT if the value is corrupted. */
+int btree_lookup_node(struct btree *bt, struct btree_node *n, uint64_t nptr,
+                      const unsigned char *key, const unsigned char *inl,
+                      uint32_t stride, struct btree_lookup *lk)
+{
+    int j = btree_node_search(n,key,&lk->found);
+
+    if (!lk->found) {
+        lk->child = n->isleaf ? 0 : n->children[j];
+        return 0;
+    }
+    lk->value = n->values[j];
+    lk->voff = btree_node_voff(bt,n,nptr,j);
+    if (BTREE_VALUE_IS_INLINE(lk->value)) {
+        uint32_t len = BTREE_VALUE_INLINE_LEN(lk->value);
+
+        inl += stride*j;
+        if (bt->inlinelen == 0 || len > bt->inlinelen ||
+            (stride != bt->inlinelen &&
+             btree_u64_from_big((unsigned char*)inl-8) != len))
+        {
+            errno = EFAULT;
+            return -1;
+        }
+        memcpy(lk->inl,inl,len);
+    }
+    return 0;
+}
+
+/* Search 'key' in the cached node at 'offset' without copying the node,
+ * while holding the shard lock. Returns 1 on hit, 0 if the node is not in
+ * cache, -1 on error. */
+int btree_cache_lookup_key(struct btree *bt, uint64_t offset,
+                           const unsigned char *key, struct btree_lookup *lk)
+{
+    struct btree_cache *c = bt->cache;
+    struct btree_cache_shard *s = btree_cache_lock(c,offset);
+    struct btree_node *n;
+    int e, retval = 0;
+
+    if ((e = btree_cache_lookup(s,offset)) != -1) {
+        n = s->entries[e].node;
+        retval = btree_lookup_node(bt,n,offset,key,n->inl,n->inlinelen,lk) ?
+                 -1 : 1;
+        s->hits++;
+    } else {
+        s->misses++;
+    }
+    btree_cache_unlock(c,s);
+    return retval;
+}
+
+/* Search 'key' in the btree with root at 'nptr'. Returns 0 if the key was
+ * found, otherwise -1 with errno set to ENOENT, or to the error.
+ *
+ * Nodes are never copied if possible: cached nodes are searched in the
+ * cache, and without a cache nodes are used in place as read from disk
+ * (see btree_view_node()). Only if the btree has a cache, or the node can't
+ * be used in place, the node is decoded. */
+int btree_lookup(struct btree *bt, uint64_t nptr, const unsigned char *key,
+                 struct btree_lookup *lk)
+{
+    struct btree_node *n = NULL, view;
+    unsigned char *buf;
+    int retval = -1, r;
+
+    while(1) {
+        if (bt->cache && (r = btree_cache_lookup_key(bt,nptr,key,lk)) != 0) {
+            if (r == -1) break;
+        } else {
+            if ((buf = btree_node_bytes(bt,nptr)) == NULL) break;
+            r = bt->cache ? 1 : btree_view_node(bt,&view,buf);
+            if (r == -1) break;
+            if (r == 0) {
+                if (btree_lookup_node(bt,&view,nptr,key,view.inl,
+                                      bt->inlinelen+8,lk) == -1) break;
+            } else {
+                /* The same node is used to decode all the levels. */
+                if (n == NULL && (n = btree_new_node(bt)) == NULL) break;
+                if (btree_decode_node(bt,n,buf) == -1) break;
+                btree_cache_add(bt->cache,nptr,n);
+                if (btree_lookup_node(bt,n,nptr,key,n->inl,n->inlinelen,
+                                      lk) == -1) break;
+            }
+        }
+        if (lk->found) {
+            retval = 0;
+            break;
+        }
+        if (lk->child == 0) {
+            errno = ENOENT;
+            break;
+        }
+        nptr = lk->child;
+    }
+    btree_free_node(n);
+    return retval;
+}
+
+/* Like btree_find(), but searching the btree with root at 'nptr'. */
+int btree_find_root(struct btree *bt, uint64_t nptr, unsigned char *key,
+                    uint64_t *voff)
+{
+    struct btree_lookup lk;
+
+    if (btree_lookup(bt,nptr,key,&lk) == -1) return -1;
+    if (voff) *voff = lk.voff;
+    return 0;
+}
+
+/* Read the value at 'voff' into the buffer '*buf' of '*buflen' bytes, that
+ * is enlarged as needed, setting '*vlen' to the length of the value. The
+ * value is stored at *buf+8, after its size header.
+ *
+ * The size header and the first bytes of the value (see the
+ * value_read_size configuration option) are read with a single read, so
+ * small values only need one I/O instead of two (one for the header and
+ * one for the value).
+ *
+ * On success 0 is returned, otherwise -1 is returned and errno set
+ * accordingly. If the size header is invalid errno is set to EFAULT. */
+int btree_read_value(struct btree *bt, uint64_t voff, unsigned char **buf,
+                     size_t *buflen, uint32_t *vlen)
+{
+    size_t want = sizeof(uint64_t)+bt->readsize;
+    uint64_t size;
+    ssize_t nread;
+
+    if (*buflen < want) {
+        unsigned char *newbuf = realloc(*buf,want);
+
+        if (newbuf == NULL) return -1;
+        *buf = newbuf;
+        *buflen = want;
+    }
+    nread = btree_pread(bt,*buf,want,voff-sizeof(uint64_t));
+    if (nread == -1) return -1;
+    if (nread < (ssize_t)sizeof(uint64_t)) {
+        errno = EFAULT;
+        return -1;
+    }
+    size = btree_u64_from_big(*buf);
+    if (size > UINT32_MAX) {
+        errno = EFAULT;
+        return -1;
+    }
+    if (size+sizeof(uint64_t) > (uint64_t)nread) {
+        /* Value larger than our speculative read, read the rest. */
+        size_t total = size+sizeof(uint64_t);
+
+        if (*buflen < total) {
+            unsigned char *newbuf = realloc(*buf,total);
+
+            if (newbuf == NULL) return -1;
+            *buf = newbuf;
+            *buflen = total;
+        }
+        if (btree_pread(bt,*buf+nread,total-nread,voff-sizeof(uint64_t)+nread)
+            != (ssize_t)(total-nread))
+        {
+            if (errno == 0) errno = EFAULT;
+            return -1;
+        }
+    }
+    *vlen = (uint32_t) size;
+    return 0;
+}
+
+/* Get the value associated to 'key'. On success 0 is returned, '*val' is
+ * set to a buffer allocated with malloc() holding the value (that the
+ * caller should free), and '*vlen' to its length.
+ *
+ * This is faster than btree_find() followed by reading the value: inline
+ * values are taken from the node itself, otherwise the size header and
+ * the value are fetched with a single read unless the value is large.
+ *
+ * On error -1 is returned and errno set accordingly, ENOENT if the key
+ * does not exist. */
+int btree_get(struct btree *bt, unsigned char *key, unsigned char **val,
+              uint32_t *vlen)
+{
+    uint64_t epoch, root;
+    int retval;
+
+    if (!btree_bloom_may_contain(bt,key)) {
+        btree_stat_read(bt,bloom_negatives,1);
+        errno = ENOENT;
+        return -1;
+    }
+    if (bt->vcache && btree_vcache_get(bt,key,val,vlen)) return 0;
+    epoch = btree_reader_enter(bt);
+    root = btree_read_root(bt);
+    retval = btree_get_root(bt,root,key,val,vlen);
+    btree_reader_exit(bt,epoch);
+    if (retval == 0 && bt->vcache) btree_vcache_add(bt,key,*val,*vlen,root);
+    return retval;
+}
+
+/* Like btree_get(), but searching the btree with root at 'nptr'. */
+int btree_get_root(struct btree *bt, uint64_t nptr, unsigned char *key,
+                   unsigned char **val, uint32_t *vlen)
+{
+    struct btree_lookup lk;
+    unsigned char *buf = NULL;
+    size_t buflen = 0;
+
+    if (btree_lookup(bt,nptr,key,&lk) == -1) return -1;
+    if (BTREE_VALUE_IS_INLINE(lk.value)) {
+        *vlen = BTREE_VALUE_INLINE_LEN(lk.value);
+        if ((*val = malloc(*vlen ? *vlen : 1)) == NULL) return -1;
+        memcpy(*val,lk.inl,*vlen);
+    } else {
+        if (btree_read_value(bt,lk.value,&buf,&buflen,vlen) == -1) {
+            free(buf);
+            return -1;
+        }
+        /* Move the value at the start of the buffer. */
+        memmove(buf,buf+sizeof(uint64_t),*vlen);
+        *val = buf;
+    }
+    return 0;
+}
+
+/* Keys of btree_find_many() passing through the same node: the sorted keys
+ * from 'first' to 'last' (excluded) are searched in the node at 'offset'. */
+struct btree_find_many_item {
+    uint64_t offset;
+    uint32_t first, last;
+};
+
+/* A key of btree_find_many(), with the length qsort() comparisons need. */
+struct btree_find_many_key {
+    unsigned char *key;
+    uint32_t keylen;
+};
+
+int btree_find_many_cmp(const void *a, const void *b) {
+    const struct btree_find_many_key *x = a, *y = b;
+    return memcmp(x->key,y->key,x->keylen);
+}
+
+/* Search the sorted keys of 'item' in the node 'n', setting the results of
+ * the keys found and appending to 'next' the children to visit for the
+ * others, one for every group of keys descending into the same child.
+ * Returns the number of keys found. */
+uint32_t btree_find_many_node(struct btree *bt, struct btree_node *n,
+                              struct btree_find_many_item *item,
+                              struct btree_find_many_key *sorted,
+                              unsigned char *keys,
+                              uint64_t *voffs,
+                              struct btree_find_many_item *next,
+                              uint32_t *numnext)
+{
+    uint32_t k = item->first, found = 0;
+
+    while (k < item->last) {
+        unsigned char *key = sorted[k].key;
+        int j, match;
+
+        j = btree_node_search(n,key,&match);
+        if (match) {
+            voffs[(key-keys)/n->keylen] =
+                btree_node_voff(bt,n,item->offset,j);
+            found++;
+            k++;
+            continue;
+        }
+        if (n->isleaf || n->children[j] == 0) {
+            k++;
+            continue;
+        }
+        /* The following keys smaller than the key at 'j' descend into the
+         * same child. */
+        next[*numnext].offset = n->children[j];
+        next[*numnext].first = k++;
+        while (k < item->last && ((unsigned)j == n->numkeys ||
+               btree_key_cmp_len(sorted[k].key,
+                   (unsigned char*)n->keys+j*n->keylen,n->keylen) < 0)) k++;
+        next[*numnext].last = k;
+        (*numnext)++;
+    }
+    return found;
+}
+
+/* Find 'n' keys at once. 'keys' is an array of 'n' keys, and the offset of
+ * the value of every key is stored at the same index of 'voffs', or zero
+ * if the key does not exist. Returns the number of keys found, or -1 on
+ * error with errno set accordingly.
+ *
+ * The keys are sorted and the btree is visited one level at a time, so
+ * that keys passing through the same node only need to read it once, and
+ * all the nodes of a level not in cache are read with a single batch: see
+ * the readv method of the VFS, implemented by bvfs_uring. */
+int btree_find_many(struct btree *bt, unsigned char *keys, uint32_t n,
+                    uint64_t *voffs)
+{
+    struct btree_find_many_item *cur = NULL, *next = NULL, *tmp;
+    struct btree_vfs_read *reads = NULL;
+    struct btree_node *node = NULL;
+    struct btree_find_many_key *sorted = NULL;
+    unsigned char *buf = NULL;
+    uint32_t numcur = 1, numnext, numreads, j, m = 0, found = 0;
+    uint64_t epoch = btree_reader_enter(bt);
+    int depth = 0, retval = -1;
+
+    memset(voffs,0,sizeof(uint64_t)*n);
+    if (n == 0) {
+        retval = 0;
+        goto cleanup;
+    }
+    if ((sorted = malloc(sizeof(*sorted)*n)) == NULL ||
+        (cur = malloc(sizeof(*cur)*n)) == NULL ||
+        (next = malloc(sizeof(*next)*n)) == NULL ||
+        (reads = malloc(sizeof(*reads)*n)) == NULL ||
+        (node = btree_new_node(bt)) == NULL) goto cleanup;
+    /* Keys the Bloom filter excludes are not searched at all. */
+    for (j = 0; j < n; j++) {
+        if (!btree_bloom_may_contain(bt,keys+j*bt->keylen)) continue;
+        sorted[m].key = keys+j*bt->keylen;
+        sorted[m].keylen = bt->keylen;
+        m++;
+    }
+    if (m < n) btree_stat_read(bt,bloom_negatives,n-m);
+    qsort(sorted,m,sizeof(*sorted),btree_find_many_cmp);
+    cur[0].offset = btree_read_root(bt);
+    cur[0].first = 0;
+    cur[0].last = m;
+    if (m == 0) numcur = 0;
+
+    while (numcur) {
+        if (depth++ == BTREE_MAX_DEPTH) {
+            errno = EFAULT;
+            goto cleanup;
+        }
+        /* Visit the nodes we already have, and collect the reads. */
+        numnext = numreads = 0;
+        for (j = 0; j < numcur; j++) {
+            const unsigned char *p;
+
+            if (bt->cache && btree_cache_get(bt->cache,cur[j].offset,node)) {
+                found += btree_find_many_node(bt,node,&cur[j],sorted,keys,
+                                              voffs,next,&numnext);
+            } else if ((p = btree_map(bt,cur[j].offset,bt->nodesize))) {
+                btree_stat_read(bt,node_reads,1);
+                if (btree_decode_node(bt,node,(unsigned char*)p) == -1)
+                    goto cleanup;
+                found += btree_find_many_node(bt,node,&cur[j],sorted,keys,
+                                              voffs,next,&numnext);
+            } else {
+                cur[numreads++] = cur[j];
+            }
+        }
+
+        /* Read all the other nodes of this level at once. */
+        if (numreads) {
+            unsigned char *newbuf = realloc(buf,bt->nodesize*numreads);
+
+            if (newbuf == NULL) goto cleanup;
+            buf = newbuf;
+            for (j = 0; j < numreads; j++) {
+                reads[j].buf = buf+bt->nodesize*j;
+                reads[j].nbytes = bt->nodesize;
+                reads[j].offset = cur[j].offset;
+            }
+            btree_pread_batch(bt,reads,numreads);
+            btree_stat_read(bt,node_reads,numreads);
+            for (j = 0; j < numreads; j++) {
+                if (reads[j].nread != (ssize_t)bt->nodesize) {
+                    errno = reads[j].nread == -1 ? reads[j].error : EFAULT;
+                    goto cleanup;
+                }
+                if (btree_decode_node(bt,node,reads[j].buf) == -1)
+                    goto cleanup;
+                btree_cache_add(bt->cache,cur[j].offset,node);
+                found += btree_find_many_node(bt,node,&cur[j],sorted,keys,
+                                              voffs,next,&numnext);
+            }
+        }
+        tmp = cur;
+        cur = next;
+        next = tmp;
+        numcur = numnext;
+    }
+    retval = (int)found;
+
+cleanup:
+    btree_reader_exit(bt,epoch);
+    btree_free_node(node);
+    free(sorted);
+    free(cur);
+    free(next);
+    free(reads);
+    free(buf);
+    return retval;
+}
+
+/* Lookups in a snapshot, see btree_find() and btree_get(). */
+int btree_snapshot_find(struct btree_snapshot *s, unsigned char *key,
+                        uint64_t *voff)
+{
+    return btree_find_root(s->bt,s->rootptr,key,voff);
+}
+
+int btree_snapshot_get(struct btree_snapshot *s, unsigned char *key,
+                       unsigned char **val, uint32_t *vlen)
+{
+    return btree_get_root(s->bt,s->rootptr,key,val,vlen);
+}
+
+/* ----------------------------- Range queries ------------------------------ */
+
+/* Visit the keys between 'lo' and 'hi' of the subtree at 'nptr', see
+ * btree_range(). Only the children whose keys may be in the range are
+ * visited: the search skips the children at the left of 'lo', and we stop
+ * at the first key greater than 'hi'. Returns 1 if the callback stopped the
+ * visit, 0 if it should continue, -1 on error. */
+int btree_range_node(struct btree *bt, uint64_t nptr, const unsigned char *lo,
+                     const unsigned char *hi,
+                     int (*cb)(void *privdata, const unsigned char *key,
+                               uint64_t voff),
+                     void *privdata, int depth, uint64_t *count)
+{
+    struct btree_node *n;
+    uint32_t j;
+    int found, retval = 0;
+
+    if (depth == BTREE_MAX_DEPTH) {
+        errno = EFAULT;
+        return -1;
+    }
+    if ((n = btree_read_node(bt,nptr)) == NULL) return -1;
+    j = btree_node_search(n,lo,&found);
+    for (; j <= n->numkeys; j++) {
+        unsigned char *key = (unsigned char*)n->keys+j*n->keylen;
+
+        /* The child at the left of a key equal to 'lo' is all smaller. */
+        if (!n->isleaf && !found &&
+            (retval = btree_range_node(bt,n->children[j],lo,hi,cb,privdata,
+                                       depth+1,count)) != 0) break;
+        found = 0;
+        if (j == n->numkeys || memcmp(key,hi,n->keylen) > 0) break;
+        (*count)++;
+        if (cb(privdata,key,btree_node_voff(bt,n,nptr,j))) {
+            retval = 1;
+            break;
+        }
+    }
+    btree_free_node(n);
+    return retval;
+}
+
+/* Call 'cb' for every key from 'lo' to 'hi' (both included), in order,
+ * with the offset of its value. If the callback returns non zero the visit
+ * stops. Returns the number of keys visited, or -1 on error with errno set
+ * accordingly. The count is 64 bits since a range may have more keys than
+ * an int can represent.
+ *
+ * Unlike a cursor, that moves one key at a time, the visit descends only
+ * into the subtrees that can contain keys of the range, so it reads just
+ * the nodes having such keys, plus the path to the range. */
+int64_t btree_range(struct btree *bt, const unsigned char *lo,
+                    const unsigned char *hi,
+                    int (*cb)(void *privdata, const unsigned char *key,
+                              uint64_t voff),
+                    void *privdata)
+{
+    uint64_t epoch, count = 0;
+    int retval = 0;
+
+    if (memcmp(lo,hi,bt->keylen) > 0) return 0;
+    epoch = btree_reader_enter(bt);
+    retval = btree_range_node(bt,btree_read_root(bt),lo,hi,cb,privdata,0,
+                              &count);
+    btree_reader_exit(bt,epoch);
+    return retval == -1 ? -1 : (int64_t)count;
+}
+
+/* btree_range() for btrees with BTREE_KEY_U128 and BTREE_KEY_I128 keys,
+ * taking the range as integers. Returns -1 with errno set to EINVAL if the
+ * keys of the btree have a different type. */
+int64_t btree_range_u128(struct btree *bt, btree_u128 lo, btree_u128 hi,
+                         int (*cb)(void *privdata, const unsigned char *key,
+                                   uint64_t voff),
+                         void *privdata)
+{
+    unsigned char l[BTREE_HASHED_KEY_LEN], h[BTREE_HASHED_KEY_LEN];
+
+    if (bt->keytype != BTREE_KEY_U128) {
+        errno = EINVAL;
+        return -1;
+    }
+    btree_key_from_u128(l,lo);
+    btree_key_from_u128(h,hi);
+    return btree_range(bt,l,h,cb,privdata);
+}
+
+int64_t btree_range_i128(struct btree *bt, btree_i128 lo, btree_i128 hi,
+                         int (*cb)(void *privdata, const unsigned char *key,
+                                   uint64_t voff),
+                         void *privdata)
+{
+    unsigned char l[BTREE_HASHED_KEY_LEN], h[BTREE_HASHED_KEY_LEN];
+
+    if (bt->keytype != BTREE_KEY_I128) {
+        errno = EINVAL;
+        return -1;
+    }
+    btree_key_from_i128(l,lo);
+    btree_key_from_i128(h,hi);
+    return btree_range(bt,l,h,cb,privdata);
+}
+
+/* Convert integers to keys and back. Keys are big endian, and signed keys
+ * have the sign bit flipped, so that negative numbers sort first. */
+void btree_key_from_u128(unsigned char *key, btree_u128 val) {
+    btree_u64_to_big(key,(uint64_t)(val >> 64));
+    btree_u64_to_big(key+8,(uint64_t)val);
+}
+
+btree_u128 btree_key_to_u128(const unsigned char *key) {
+    return ((btree_u128)btree_u64_from_big((unsigned char*)key) << 64) |
+           btree_u64_from_big((unsigned char*)key+8);
+}
+
+void btree_key_from_i128(unsigned char *key, btree_i128 val) {
+    btree_key_from_u128(key,(btree_u128)val ^ ((btree_u128)1 << 127));
+}
+
+btree_i128 btree_key_to_i128(const unsigned char *key) {
+    return (btree_i128)(btree_key_to_u128(key) ^ ((btree_u128)1 << 127));
+}
+
+/* -------------------------------- Cursors --------------------------------- */
+
+/* A cursor iterates the keys in order. As keys are also stored in internal
+ * nodes, the successor of a key in an internal node is the leftmost key of
+ * the subtree at its right, while the successor of the last key of a leaf
+ * is the first key of an ancestor we did not yet visit.
+ *
+ * Every time the cursor enters a new node it hints the VFS about what is
+ * going to be read next: the values referenced by the node, and the next
+ * sibling subtrees of the parent, so that sequential scans don't pay the
+ * full latency of every read. Cursors are invalidated by modifications of
+ * the btree, except with BTREE_CONCURRENT, where every seek acquires a
+ * snapshot that is used until the next seek. */
+
+struct btree_cursor *btree_cursor_open(struct btree *bt) {
+    struct btree_cursor *c;
+
+    if ((c = calloc(1,sizeof(*c))) == NULL) return NULL;
+    c->bt = bt;
+    c->readahead = BTREE_CURSOR_READAHEAD;
+    return c;
+}
+
+/* Open a cursor reading the snapshot 's'. Unlike normal cursors, cursors
+ * on snapshots are not invalidated by modifications of the btree. */
+struct btree_cursor *btree_cursor_open_snapshot(struct btree_snapshot *s) {
+    struct btree_cursor *c;
+
+    if ((c = btree_cursor_open(s->bt)) == NULL) return NULL;
+    c->snap = s;
+    return c;
+}
+
+/* Return the root of the btree the cursor is reading. Called on seek: with
+ * BTREE_CONCURRENT cursors not using a snapshot get a new one, containing
+ * the last committed state. Returns 0 on out of memory. */
+uint64_t btree_cursor_root(struct btree_cursor *c) {
+    if (c->ownsnap) {
+        btree_snapshot_release(c->snap);
+        c->snap = NULL;
+        c->ownsnap = 0;
+    }
+    if (c->snap == NULL && (c->bt->openflags & BTREE_CONCURRENT)) {
+        if ((c->snap = btree_snapshot_acquire(c->bt)) == NULL) return 0;
+        c->ownsnap = 1;
+    }
+    return c->snap ? c->snap->rootptr : c->bt->rootptr;
+}
+
+void btree_cursor_close(struct btree_cursor *c) {
+    int j;
+
+    if (c == NULL) return;
+    if (c->ownsnap) btree_snapshot_release(c->snap);
+    for (j = 0; j < BTREE_MAX_DEPTH; j++) btree_free_node(c->path[j].node);
+    free(c->valbuf);
+    free(c);
+}
+
+/* Hint the VFS about the values of the node at 'level', and about the
+ * sibling subtrees following it in the parent. Adjacent value ranges are
+ * coalesced into a single hint, as values written in order (for instance
+ * by the bulk loader) are usually contiguous. */
+void btree_cursor_prefetch(struct btree_cursor *c, int level, int forward) {
+    struct btree *bt = c->bt;
+    struct btree_node *n = c->path[level].node;
+    uint64_t start = 0, end = 0;
+    unsigned int j;
+    int i, k;
+
+    if (bt->vfs->prefetch == NULL) return;
+    for (j = 0; j < n->numkeys; j++) {
+        uint64_t off = n->values[j]-sizeof(uint64_t);
+
+        if (BTREE_VALUE_IS_INLINE(n->values[j])) continue;
+        if (start && off >= start && off <= end) {
+            end = off+bt->readsize+sizeof(uint64_t);
+            continue;
+        }
+        if (start) btree_prefetch(bt,start,end-start);
+        start = off;
+        end = off+bt->readsize+sizeof(uint64_t);
+    }
+    if (start) btree_prefetch(bt,start,end-start);
+
+    if (level == 0) return;
+    n = c->path[level-1].node;
+    i = c->path[level-1].index;
+    for (k = 1; k <= c->readahead; k++) {
+        int child = forward ? i+k : i-k;
+
+        if (child < 0 || child > (int)n->numkeys) break;
+        btree_prefetch(bt,n->children[child],bt->nodesize);
+    }
+}
+
+/* Load the node at 'offset' at the specified level of the path. */
+int btree_cursor_load(struct btree_cursor *c, int level, uint64_t offset) {
+    if (level == BTREE_MAX_DEPTH) {
+        errno = EFAULT;
+        return -1;
+    }
+    if (c->path[level].node == NULL &&
+        (c->path[level].node = btree_new_node(c->bt)) == NULL)
+        return -1;
+    if (btree_load_node(c->bt,c->path[level].node,offset) == -1) return -1;
+    c->path[level].offset = offset;
+    c->depth = level+1;
+    return 0;
+}
+
+/* Descend from the current node, that is the last of the path, through the
+ * child with index 'child' and then always through the leftmost (or the
+ * rightmost if 'forward' is false) child, down to the leaf, that becomes the
+ * current node, positioned at its first (last) key. */
+int btree_cursor_descend(struct btree_cursor *c, int child, int forward) {
+    struct btree_cursor_level *lv = &c->path[c->depth-1];
+
+    lv->index = child;
+    while (1) {
+        if (btree_cursor_load(c,c->depth,lv->node->children[lv->index]) == -1)
+            goto err;
+        lv = &c->path[c->depth-1];
+        btree_cursor_prefetch(c,c->depth-1,forward);
+        if (lv->node->isleaf) break;
+        lv->index = forward ? 0 : lv->node->numkeys;
+    }
+    lv->index = forward ? 0 : (int)lv->node->numkeys-1;
+    return 0;
+
+err:
+    c->depth = 0;
+    return -1;
+}
+
+/* Position the cursor at the first key greater or equal to 'key', or at the
+ * first key of the btree if 'key' is NULL. Returns 0 on success. If there
+ * is no such a key -1 is returned with errno set to ENOENT, otherwise on
+ * error -1 is returned and errno set accordingly. */
+int btree_cursor_seek(struct btree_cursor *c, unsigned char *key) {
+    uint64_t nptr = btree_cursor_root(c);
+    struct btree_cursor_level *lv;
+
+    c->depth = 0;
+    if (nptr == 0) return -1;
+    while(1) {
+        unsigned int j = 0;
+        int found = 0;
+
+        if (btree_cursor_load(c,c->depth,nptr) == -1) goto err;
+        lv = &c->path[c->depth-1];
+        btree_cursor_prefetch(c,c->depth-1,1);
+        if (key) j = btree_node_search(lv->node,key,&found);
+        lv->index = j;
+        if (found) return 0;
+        if (lv->node->isleaf) break;
+        nptr = lv->node->children[j];
+    }
+    /* We are in a leaf at the first key greater than 'key', that may be
+     * past the last key: in this case the key we are looking for is the
+     * first ancestor with a key at the index of the child we came from. */
+    while (c->path[c->depth-1].index == (int)c->path[c->depth-1].node->numkeys){
+        if (--c->depth == 0) {
+            errno = ENOENT;
+            return -1;
+        }
+    }
+    return 0;
+
+err:
+    c->depth = 0;
+    return -1;
+}
+
+/* Position the cursor at the last key of the btree. Returns 0 on success,
+ * otherwise -1 with errno set to ENOENT if the btree is empty, or set
+ * accordingly on error. */
+int btree_cursor_seek_last(struct btree_cursor *c) {
+    uint64_t nptr = btree_cursor_root(c);
+
+    c->depth = 0;
+    if (nptr == 0 || btree_cursor_load(c,0,nptr) == -1) goto err;
+    if (c->path[0].node->isleaf) {
+        c->path[0].index = (int)c->path[0].node->numkeys-1;
+    } else {
+        if (btree_cursor_descend(c,c->path[0].node->numkeys,0) == -1)
+            goto err;
+    }
+    if (c->path[c->depth-1].index < 0) {
+        c->depth = 0;
+        errno = ENOENT;
+        return -1;
+    }
+    return 0;
+
+err:
+    c->depth = 0;
+    return -1;
+}
+
+/* Move the cursor to the next key. Returns 0 on success, or -1 with errno
+ * set to ENOENT if the cursor was at the last key (or not positioned at
+ * all), or set accordingly on error. */
+int btree_cursor_next(struct btree_cursor *c) {
+    struct btree_cursor_level *lv;
+
+    if (c->depth == 0) {
+        errno = ENOENT;
+        return -1;
+    }
+    lv = &c->path[c->depth-1];
+    if (!lv->node->isleaf) return btree_cursor_descend(c,lv->index+1,1);
+    if (++lv->index < (int)lv->node->numkeys) return 0;
+    /* Past the last key of the leaf: go up until there is an ancestor with
+     * a key at the index of the child we came from. */
+    do {
+        if (--c->depth == 0) {
+            errno = ENOENT;
+            return -1;
+        }
+        lv = &c->path[c->depth-1];
+    } while (lv->index == (int)lv->node->numkeys);
+    return 0;
+}
+
+/* Move the cursor to the previous key. Same return values as
+ * btree_cursor_next(). */
+int btree_cursor_prev(struct btree_cursor *c) {
+    struct btree_cursor_level *lv;
+
+    if (c->depth == 0) {
+        errno = ENOENT;
+        return -1;
+    }
+    lv = &c->path[c->depth-1];
+    if (!lv->node->isleaf) return btree_cursor_descend(c,lv->index,0);
+    if (--lv->index >= 0) return 0;
+    /* Before the first key of the leaf: go up until there is an ancestor
+     * with a key before the child we came from. */
+    do {
+        if (--c->depth == 0) {
+            errno = ENOENT;
+            return -1;
+        }
+        lv = &c->path[c->depth-1];
+    } while (lv->index == 0);
+    lv->index--;
+    return 0;
+}
+
+/* Return the key at the cursor position (BTREE_HASHED_KEY_LEN bytes, or
+ * the key_size of the btree), or NULL if the cursor is not positioned. */
+const unsigned char *btree_cursor_key(struct btree_cursor *c) {
+    struct btree_cursor_level *lv;
+
+    if (c->depth == 0) return NULL;
+    lv = &c->path[c->depth-1];
+    return (unsigned char*)lv->node->keys+lv->node->keylen*lv->index;
+}
+
+/* Return the offset of the value at the cursor position, or 0 if the
+ * cursor is not positioned. */
+uint64_t btree_cursor_voff(struct btree_cursor *c) {
+    struct btree_cursor_level *lv;
+
+    if (c->depth == 0) return 0;
+    lv = &c->path[c->depth-1];
+    return btree_node_voff(c->bt,lv->node,lv->offset,lv->index);
+}
+
+/* Read the value at the cursor position, setting '*val' and '*vlen' to the
+ * value and its length. The value is valid until the next call to this
+ * function. Returns 0 on success, otherwise -1 is returned and errno set
+ * accordingly (ENOENT if the cursor is not positioned). */
+int btree_cursor_value(struct btree_cursor *c, const unsigned char **val,
+                       uint32_t *vlen)
+{
+    struct btree_cursor_level *lv;
+    uint64_t v;
+
+    if (c->depth == 0) {
+        errno = ENOENT;
+        return -1;
+    }
+    /* Inline values are already in memory. */
+    lv = &c->path[c->depth-1];
+    v = lv->node->values[lv->index];
+    if (BTREE_VALUE_IS_INLINE(v)) {
+        *val = lv->node->inl+lv->node->inlinelen*lv->index;
+        *vlen = BTREE_VALUE_INLINE_LEN(v);
+        return 0;
+    }
+    if (btree_read_value(c->bt,v,&c->valbuf,&c->valbuflen,vlen) == -1)
+        return -1;
+    *val = c->valbuf+sizeof(uint64_t);
+    return 0;
+}
+
+/* ------------------------------ Bulk loading ------------------------------ */
+
+/* The bulk loader builds a btree bottom-up from a stream of sorted keys.
+ * Every level of the tree has a node being filled. When a node is full the
+ * next key becomes the separator between this node and the next one, and
+ * will be added to the parent level. Nodes are packed up to the requested
+ * fill factor, and nodes and values are written sequentially at the end of
+ * the file.
+ *
+ * So that the last node of every level is not left almost empty, a full
+ * node is "held" in memory (together with its separator) until the next
+ * node of the same level has at least half the keys. When we reach the end
+ * of the stream, if a level still holds a node, its keys and the keys of
+ * the last node are split evenly into two nodes.
+ *
+ * Prefix compressed nodes are filled by bytes instead of keys: a node is
+ * full when the next key would make it bigger than the fill factor allows,
+ * and the held node is written once the next one is half of that size. */
+
+struct btree_bulk_level {
+    struct btree_node *cur;     /* Node being filled */
+    uint32_t keybytes;          /* Length of the keys of 'cur' after the
+                                   first one, for prefix compressed nodes */
+    struct btree_node *held;    /* Full node waiting to be written, or NULL */
+    unsigned char heldkey[BTREE_MAX_KEY_LEN]; /* Separator after 'held' */
+    uint64_t heldval;           /* Value of the separator */
+    unsigned char heldinl[BTREE_MAX_INLINE]; /* Its data, if inline */
+};
+
+struct btree_bulk {
+    struct btree *bt;
+    uint32_t fill;              /* Keys (or bytes) per node */
+    uint32_t release;           /* Keys (or bytes) needed to write the held
+                                   node */
+    int levels;                 /* Number of levels used so far */
+    struct btree_bulk_level level[BTREE_MAX_DEPTH];
+    unsigned char *buf;         /* Buffer used to write values */
+    size_t buflen;
+    uint64_t *pads;             /* Offset and length of alignment paddings */
+    uint32_t numpads;           /* Number of paddings */
+    uint32_t maxpads;
+    unsigned char prev[BTREE_MAX_KEY_LEN]; /* Last key added */
+    uint64_t count;             /* Keys added so far */
+    uint64_t startoff;          /* End of the allocated space when the load
+                                   started, see btree_bulk_rollback(). */
+};
+
+/* Allocate 'size' bytes at the end of the file, without using the
+ * freelists and without updating the header, that the bulk loader writes
+ * only once at the end. Paddings needed to align the allocation are
+ * remembered, and put in the freelists only once the load is complete. */
+uint64_t btree_bulk_alloc(struct btree_bulk *b, uint32_t size) {
+    struct btree *bt = b->bt;
+    uint32_t realsize = btree_chunk_size(bt,size);
+    uint32_t pad = btree_alloc_padding(bt->freeoff,realsize);
+    uint64_t ptr;
+
+    if (pad && b->numpads == b->maxpads) {
+        uint32_t maxpads = b->maxpads ? b->maxpads*2 : 16;
+        uint64_t *pads = realloc(b->pads,sizeof(uint64_t)*2*maxpads);
+
+        if (pads == NULL) return 0;
+        b->pads = pads;
+        b->maxpads = maxpads;
+    }
+    if (btree_grow(bt,(uint64_t)realsize+pad) == -1) return 0;
+    if (pad) {
+        b->pads[b->numpads*2] = bt->freeoff;
+        b->pads[b->numpads*2+1] = pad;
+        b->numpads++;
+    }
+    ptr = bt->freeoff+pad;
+    bt->free -= realsize+pad;
+    bt->freeoff += realsize+pad;
+    return ptr+sizeof(uint64_t);
+}
+
+/* Write a value prefixed by its size header with a single write. */
+uint64_t btree_bulk_write_value(struct btree_bulk *b, const unsigned char *val,
+                                size_t vlen)
+{
+    uint64_t ptr;
+
+    if (vlen+sizeof(uint64_t) > b->buflen) {
+        unsigned char *buf = realloc(b->buf,vlen+sizeof(uint64_t));
+
+        if (buf == NULL) return 0;
+        b->buf = buf;
+        b->buflen = vlen+sizeof(uint64_t);
+    }
+    if ((ptr = btree_bulk_alloc(b,vlen)) == 0) return 0;
+    btree_u64_to_big(b->buf,vlen);
+    memcpy(b->buf+sizeof(uint64_t),val,vlen);
+    if (btree_pwrite(b->bt,b->buf,vlen+sizeof(uint64_t),
+        ptr-sizeof(uint64_t)) == -1) return 0;
+    return ptr;
+}
+
+uint64_t btree_bulk_write_node(struct btree_bulk *b, struct btree_node *n) {
+    uint64_t ptr;
+
+    if ((ptr = btree_bulk_alloc(b,b->bt->nodesize)) == 0) return 0;
+    if (btree_pwrite_u64(b->bt,b->bt->nodesize,ptr-sizeof(uint64_t)) == -1 ||
+        btree_write_node(b->bt,n,ptr) == -1) return 0;
+    return ptr;
+}
+
+/* Return the level 'l' creating it if needed, or NULL on error. */
+struct btree_bulk_level *btree_bulk_get_level(struct btree_bulk *b, int l) {
+    struct btree_bulk_level *lv;
+
+    if (l == BTREE_MAX_DEPTH) {
+        errno = EFBIG;
+        return NULL;
+    }
+    lv = &b->level[l];
+    if (l == b->levels) {
+        if ((lv->cur = btree_new_node(b->bt)) == NULL) return NULL;
+        lv->cur->isleaf = (l == 0);
+        lv->keybytes = 0;
+        lv->held = NULL;
+        b->levels++;
+    }
+    return lv;
+}
+
+int btree_bulk_add_key(struct btree_bulk *b, int l, unsigned char *key,
+                       uint64_t valoff, const unsigned char *inl);
+
+/* Add a child pointer to the node being filled at level 'l'. */
+int btree_bulk_add_child(struct btree_bulk *b, int l, uint64_t childoff) {
+    struct btree_bulk_level *lv = btree_bulk_get_level(b,l);
+
+    if (lv == NULL) return -1;
+    lv->cur->children[lv->cur->numkeys] = childoff;
+    return 0;
+}
+
+/* Write the node held at level 'l', linking it to the parent level. */
+int btree_bulk_release(struct btree_bulk *b, int l) {
+    struct btree_bulk_level *lv = &b->level[l];
+    uint64_t off;
+
+    if ((off = btree_bulk_write_node(b,lv->held)) == 0) return -1;
+    btree_free_node(lv->held);
+    lv->held = NULL;
+    if (btree_bulk_add_child(b,l+1,off) == -1) return -1;
+    return btree_bulk_add_key(b,l+1,lv->heldkey,lv->heldval,lv->heldinl);
+}
+
+/* Return the size on disk of the prefix compressed node being filled at
+ * 'lv' once 'key' is appended. As keys are appended in order the prefix is
+ * the one of the first key and 'key', and only the first key can be
+ * shorter than the prefix, so the size is computed without scanning the
+ * keys. */
+uint32_t btree_bulk_node_size(struct btree_bulk *b,
+                              struct btree_bulk_level *lv,
+                              const unsigned char *key)
+{
+    struct btree_node *n = lv->cur;
+    uint32_t ks = BTREE_PNODE_KEY_SIZE(b->bt->inlinelen);
+    uint32_t len = btree_key_len(key,n->keylen), plen, first;
+
+    if (n->numkeys == 0) return BTREE_PNODE_FIXED+len+ks;
+    plen = btree_key_lcp((unsigned char*)n->keys,key,n->keylen);
+    first = btree_key_len((unsigned char*)n->keys,n->keylen);
+    return BTREE_PNODE_FIXED+plen+(n->numkeys+1)*ks+
+           (first > plen ? first-plen : 0)+
+           lv->keybytes+len-n->numkeys*plen;
+}
+
+/* Set the value of the key at position 'i' of 'n' to 'valoff'. For inline
+ * values 'inl' is the data of the value. */
+void btree_bulk_set_value(struct btree_node *n, uint32_t i, uint64_t valoff,
+                          const unsigned char *inl)
+{
+    if (BTREE_VALUE_IS_INLINE(valoff))
+        btree_node_set_inline(n,i,inl,BTREE_VALUE_INLINE_LEN(valoff));
+    else
+        n->values[i] = valoff;
+}
+
+/* Add a key to the node being filled at level 'l', with the value 'valoff'
+ * and, for inline values, its data 'inl'. */
+int btree_bulk_add_key(struct btree_bulk *b, int l, unsigned char *key,
+                       uint64_t valoff, const unsigned char *inl)
+{
+    struct btree_bulk_level *lv = btree_bulk_get_level(b,l);
+    struct btree_node *n;
+    uint32_t size = 0;
+    int full;
+
+    if (lv == NULL) return -1;
+    n = lv->cur;
+    if (b->bt->prefixed) {
+        /* Two keys always fit, see btree_set_node_size(). */
+        size = btree_bulk_node_size(b,lv,key);
+        full = n->numkeys >= 2 && size > b->fill;
+    } else {
+        full = n->numkeys == b->fill;
+    }
+    if (full) {
+        /* The node is full: this key is the separator with the next node.
+         * We hold the full node until the next one has enough keys. */
+        assert(lv->held == NULL);
+        lv->held = n;
+        memcpy(lv->heldkey,key,n->keylen);
+        lv->heldval = valoff;
+        if (BTREE_VALUE_IS_INLINE(valoff))
+            memcpy(lv->heldinl,inl,BTREE_VALUE_INLINE_LEN(valoff));
+        if ((lv->cur = btree_new_node(b->bt)) == NULL) return -1;
+        lv->cur->isleaf = n->isleaf;
+        lv->keybytes = 0;
+        return 0;
+    }
+    if (n->numkeys) lv->keybytes += btree_key_len(key,n->keylen);
+    memcpy(n->keys+n->numkeys*n->keylen,key,n->keylen);
+    btree_bulk_set_value(n,n->numkeys,valoff,inl);
+    n->numkeys++;
+    if (lv->held && (b->bt->prefixed ? size >= b->release :
+                                       n->numkeys == b->release))
+        return btree_bulk_release(b,l);
+    return 0;
+}
+
+/* Called at the end of the stream: write the last nodes of every level,
+ * from the leafs to the root, and return the offset of the root. */
+uint64_t btree_bulk_finish(struct btree_bulk *b) {
+    struct btree *bt = b->bt;
+    struct btree_node *all = NULL, *left = NULL, *right = NULL;
+    uint64_t off = 0;
+    int l;
+
+    for (l = 0; l < b->levels; l++) {
+        struct btree_bulk_level *lv = &b->level[l];
+        struct btree_node *h = lv->held, *c = lv->cur;
+        uint32_t total, half, rnum;
+
+        if (h == NULL) {
+            if ((off = btree_bulk_write_node(b,c)) == 0) goto err;
+            /* The last level is the root. */
+            if (l+1 < b->levels && btree_bulk_add_child(b,l+1,off) == -1)
+                goto err;
+            continue;
+        }
+
+        /* Split the keys of the held node, the separator, and the last node
+         * into two nodes of about the same size, by bytes for prefix
+         * compressed nodes. As the held node is full the right node will
+         * never be empty. */
+        total = h->numkeys+1+c->numkeys;
+        if ((all = btree_create_node(total,bt->inlinelen,bt->keylen)) == NULL ||
+            (left = btree_new_node(bt)) == NULL ||
+            (right = btree_new_node(bt)) == NULL) goto err;
+        btree_node_move(all,0,h,0,h->numkeys);
+        memcpy(all->children,h->children,8*(h->numkeys+1));
+        memcpy(all->keys+h->numkeys*bt->keylen,lv->heldkey,bt->keylen);
+        btree_bulk_set_value(all,h->numkeys,lv->heldval,lv->heldinl);
+        btree_node_move(all,h->numkeys+1,c,0,c->numkeys);
+        memcpy(all->children+h->numkeys+1,c->children,8*(c->numkeys+1));
+        all->numkeys = total;
+        half = bt->prefixed ? (uint32_t)btree_node_split_point(bt,all) :
+                              total/2;
+        rnum = total-half-1;
+        left->isleaf = right->isleaf = h->isleaf;
+        btree_node_move(left,0,all,0,half);
+        memcpy(left->children,all->children,8*(half+1));
+        left->numkeys = half;
+        btree_node_move(right,0,all,half+1,rnum);
+        memcpy(right->children,all->children+half+1,8*(rnum+1));
+        right->numkeys = rnum;
+
+        if ((off = btree_bulk_write_node(b,left)) == 0 ||
+            btree_bulk_add_child(b,l+1,off) == -1 ||
+            btree_bulk_add_key(b,l+1,(unsigned char*)all->keys+
+                               half*bt->keylen,all->values[half],
+                               all->inl+half*bt->inlinelen) == -1 ||
+            (off = btree_bulk_write_node(b,right)) == 0 ||
+            btree_bulk_add_child(b,l+1,off) == -1) goto err;
+        btree_free_node(all);
+        btree_free_node(left);
+        btree_free_node(right);
+        all = left = right = NULL;
+    }
+    return off;
+
+err:
+    btree_free_node(all);
+    btree_free_node(left);
+    btree_free_node(right);
+    return 0;
+}
+
+/* Initialize the bulk loader 'b' to load keys into 'bt', filling nodes up
+ * to 'fill' percent. Returns 0 on success, -1 on out of memory. In both
+ * cases btree_bulk_free() should be called when done. */
+int btree_bulk_init(struct btree_bulk *b, struct btree *bt, int fill) {
+    b->bt = bt;
+    if (bt->prefixed) {
+        b->fill = bt->nodesize*fill/100;
+        b->release = b->fill/2;
+    } else {
+        b->fill = bt->maxkeys*fill/100;
+        if (b->fill < 2) b->fill = 2; /* Needed to never create empty nodes. */
+        b->release = (b->fill+1)/2;
+    }
+    b->levels = 0;
+    b->buf = NULL;
+    b->buflen = 0;
+    b->pads = NULL;
+    b->numpads = 0;
+    b->maxpads = 0;
+    b->count = 0;
+    b->startoff = bt->freeoff;
+    if (btree_drop_bloom(bt) == -1) return -1;
+    b->startoff = bt->freeoff; /* Releasing the filter may allocate. */
+    return btree_bulk_get_level(b,0) == NULL ? -1 : 0;
+}
+
+/* Called when the load fails before the new tree is linked. Nodes and
+ * values are allocated at the end of the file without using the freelists,
+ * so all the space they use is returned to the free space at the end. The
+ * filter got keys that were never linked: as the btree is still empty it
+ * is emptied. Errors are ignored, so that errno still reports the failure
+ * of the load. */
+void btree_bulk_rollback(struct btree_bulk *b) {
+    struct btree *bt = b->bt;
+    int saved = errno;
+
+    bt->free += bt->freeoff-b->startoff;
+    bt->freeoff = b->startoff;
+    if (!(bt->openflags & BTREE_MEMORY_FREELIST))
+        btree_write_free_space(bt);
+    if (bt->bloom) btree_bloom_rebuild(bt,0);
+    errno = saved;
+}
+
+void btree_bulk_free(struct btree_bulk *b) {
+    int j;
+
+    for (j = 0; j < b->levels; j++) {
+        btree_free_node(b->level[j].cur);
+        btree_free_node(b->level[j].held);
+    }
+    free(b->buf);
+    free(b->pads);
+}
+
+/* Add the next key with its value. Returns 0 on success, otherwise -1 with
+ * errno set accordingly, EINVAL if the key is not greater than the
+ * previous one. */
+int btree_bulk_add(struct btree_bulk *b, const unsigned char *key,
+                   const unsigned char *val, size_t vlen)
+{
+    uint64_t valoff;
+
+    if ((b->count && memcmp(b->prev,key,b->bt->keylen) >= 0) ||
+        vlen > (1U<<31))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    memcpy(b->prev,key,b->bt->keylen);
+    b->count++;
+    btree_bloom_add(b->bt,key);
+    /* Small values are stored inline, like btree_add() does. */
+    if (b->bt->inlinelen && vlen <= b->bt->inlinelen)
+        return btree_bulk_add_key(b,0,b->prev,BTREE_VALUE_INLINE|vlen,val);
+    if ((valoff = btree_bulk_write_value(b,val,vlen)) == 0) return -1;
+    return btree_bulk_add_key(b,0,b->prev,valoff,NULL);
+}
+
+/* Called after the last key: write the last nodes, update the header, and
+ * finally link the new tree replacing the empty root. */
+int btree_bulk_commit(struct btree_bulk *b) {
+    struct btree *bt = b->bt;
+    uint64_t oldroot = bt->rootptr, newroot;
+    uint32_t j;
+
+    if (b->count == 0) return 0;
+    if ((newroot = btree_bulk_finish(b)) == 0) return -1;
+
+    /* Everything is written: update the header, flush, and finally link
+     * the new tree. */
+    if (!(bt->openflags & BTREE_MEMORY_FREELIST) &&
+        btree_write_free_space(bt) == -1) return -1;
+    btree_sync(bt);
+    if (btree_update_pointer(bt,0,BTREE_HDR_ROOTPTR_POS,newroot) == -1)
+        return -1;
+    btree_sync(bt);
+    btree_free(bt,oldroot);
+    for (j = 0; j < b->numpads; j++)
+        btree_free_padding(bt,b->pads[j*2],b->pads[j*2+1]);
+    btree_bloom_fit(bt);
+    return 0;
+}
+
+/* Load a stream of keys with their values into an empty btree, building
+ * the tree bottom-up. This is much faster than adding the keys one after
+ * the other with btree_add(), as all the nodes and values are written
+ * sequentially only once, and the root pointer is set only at the end.
+ *
+ * The 'next' callback is called to get the next key: it should copy the
+ * key into 'key' (BTREE_HASHED_KEY_LEN bytes, or the key_size of the
+ * btree configuration) and set 'val' and 'vlen' to
+ * its value, returning 1. When there are no more keys it should return 0,
+ * and -1 on error. Keys must be provided in strictly ascending order (as
+ * compared by memcmp()), otherwise the load fails with errno set to EINVAL.
+ * Callers with unsorted data should sort it externally first.
+ *
+ * 'fill' is the percentage of the node capacity to use, from 1 to 100.
+ * Use 100 for btrees that will be mostly read, and a smaller value to
+ * leave room for future additions.
+ *
+ * Returns 0 on success, otherwise -1 with errno set accordingly. If the
+ * btree is not empty errno is set to ENOTEMPTY, and if a transaction is in
+ * progress to EBUSY. On error the btree is left unmodified: the space
+ * written so far is released, see btree_bulk_rollback(). */
+int btree_bulk_load(struct btree *bt, int (*next)(void *privdata, unsigned char *key, const unsigned char **val, size_t *vlen), void *privdata, int fill) {
+    struct btree_bulk b;
+    struct btree_node *root;
+    unsigned char key[BTREE_MAX_KEY_LEN];
+    int retval;
+
+    if (bt->txn != BTREE_TXN_NONE) {
+        errno = EBUSY;
+        return -1;
+    }
+    if (fill < 1 || fill > 100) {
+        errno = EINVAL;
+        return -1;
+    }
+    if ((root = btree_read_node(bt,bt->rootptr)) == NULL) return -1;
+    if (root->numkeys != 0) {
+        btree_free_node(root);
+        errno = ENOTEMPTY;
+        return -1;
+    }
+    btree_free_node(root);
+    if ((bt->openflags & BTREE_MEMORY_FREELIST) && btree_set_dirty(bt) == -1)
+        return -1;
+
+    if (btree_bulk_init(&b,bt,fill) == -1) goto err;
+    while(1) {
+        const unsigned char *val;
+        size_t vlen;
+
+        if ((retval = next(privdata,key,&val,&vlen)) == -1) goto err;
+        if (retval == 0) break;
+        if (btree_bulk_add(&b,key,val,vlen) == -1) goto err;
+    }
+    if (btree_bulk_commit(&b) == -1) goto err;
+    btree_bulk_free(&b);
+    return 0;
+
+err:
+    btree_bulk_rollback(&b);
+    btree_bulk_free(&b);
+    return -1;
+}
+
+/* ------------------------------- Compaction ------------------------------- */
+
+/* Compaction copies the btree into a new file, that is then renamed over
+ * the old one. The new file is written by the bulk loader, so it has no
+ * free space at all, nodes are packed, and they are sorted in key order
+ * together with their values.
+ *
+ * The copy reads a snapshot of the btree, and can be performed
+ * incrementally with btree_compact_step(), while the btree keeps being
+ * modified, for instance calling it from a timer or when the program is
+ * idle. The keys modified since the snapshot was acquired are remembered,
+ * and btree_compact_finish() copies their current value (or deletes them)
+ * in the new btree before the swap.
+ *
+ * This is especially useful in append only mode, as the space is never
+ * reused, see bt->garbage. It is not supported with BTREE_CONCURRENT, as
+ * readers would still use the old file. */
+
+#define BTREE_COMPACT_START 0   /* Cursor not yet positioned */
+#define BTREE_COMPACT_COPY 1    /* Copying the snapshot */
+#define BTREE_COMPACT_DONE 2    /* All the keys of the snapshot were copied */
+
+struct btree_compact {
+    struct btree *bt;
+    struct btree *dst;          /* The new btree */
+    char *path;                 /* Path of the new btree */
+    struct btree_snapshot *snap; /* State being copied */
+    struct btree_cursor *cursor; /* Cursor on the snapshot */
+    struct btree_bulk bulk;     /* Bulk loader writing the new btree */
+    int state;                  /* BTREE_COMPACT_* */
+    unsigned char *keys;        /* Keys modified since the snapshot */
+    uint32_t numkeys;
+    uint32_t maxkeys;
+};
+
+/* Start the compaction of 'bt' into a new btree at 'path', that must not
+ * exist. Returns the compaction handle, or NULL on error with errno set
+ * accordingly: EBUSY if a compaction is already in progress, EINVAL with
+ * BTREE_CONCURRENT. */
+struct btree_compact *btree_compact_start(struct btree *bt, char *path) {
+    struct btree_compact *c;
+    struct btree_config cfg;
+
+    if (bt->openflags & BTREE_CONCURRENT) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (bt->compact) {
+        errno = EBUSY;
+        return NULL;
+    }
+    if (access(path,F_OK) == 0) {
+        errno = EEXIST;
+        return NULL;
+    }
+    if ((c = calloc(1,sizeof(*c))) == NULL) return NULL;
+    c->bt = bt;
+    c->state = BTREE_COMPACT_START;
+    bt->compact = c;
+
+    /* The new btree has the same nodes of the old one. */
+    btree_get_config(bt,&cfg);
+    cfg.cache_nodes = 0;
+    if ((c->path = strdup(path)) == NULL ||
+        (c->dst = btree_open_with_config(bt->vfs,path,BTREE_CREAT,&cfg))
+         == NULL ||
+        (c->snap = btree_snapshot_acquire(bt)) == NULL ||
+        (c->cursor = btree_cursor_open_snapshot(c->snap)) == NULL ||
+        btree_bulk_init(&c->bulk,c->dst,100) == -1)
+    {
+        btree_compact_abort(c);
+        return NULL;
+    }
+    /* We sync only once, before the swap. */
+    btree_clear_flags(c->dst,BTREE_FLAG_USE_WRITE_BARRIER);
+    if (c->dst->bloom && bt->bloom &&
+        btree_bloom_rebuild(c->dst,bt->bloom->keys) == -1)
+    {
+        btree_compact_abort(c);
+        return NULL;
+    }
+    return c;
+}
+
+/* Called by btree_add() and btree_delete() for every modified key. */
+int btree_compact_track(struct btree_compact *c, unsigned char *key) {
+    if (c->numkeys == c->maxkeys) {
+        uint32_t maxkeys = c->maxkeys ? c->maxkeys*2 : 64;
+        unsigned char *keys = realloc(c->keys,c->bt->keylen*maxkeys);
+
+        if (keys == NULL) return -1;
+        c->keys = keys;
+        c->maxkeys = maxkeys;
+    }
+    memcpy(c->keys+c->bt->keylen*c->numkeys++,key,c->bt->keylen);
+    return 0;
+}
+
+/* Copy up to 'count' keys of the snapshot into the new btree. Returns 1 if
+ * there are more keys to copy, 0 if the copy is complete, and -1 on error
+ * with errno set accordingly. */
+int btree_compact_step(struct btree_compact *c, uint32_t count) {
+    uint32_t j;
+
+    for (j = 0; j < count && c->state != BTREE_COMPACT_DONE; j++) {
+        const unsigned char *val;
+        uint32_t vlen;
+        int retval;
+
+        if (c->state == BTREE_COMPACT_START) {
+            retval = btree_cursor_seek(c->cursor,NULL);
+            c->state = BTREE_COMPACT_COPY;
+        } else {
+            retval = btree_cursor_next(c->cursor);
+        }
+        if (retval == -1) {
+            if (errno != ENOENT) return -1;
+            c->state = BTREE_COMPACT_DONE;
+            break;
+        }
+        if (btree_cursor_value(c->cursor,&val,&vlen) == -1 ||
+            btree_bulk_add(&c->bulk,btree_cursor_key(c->cursor),val,vlen)
+            == -1) return -1;
+    }
+    return c->state != BTREE_COMPACT_DONE;
+}
+
+/* Make the rename of the file at 'path' durable, syncing its directory. */
+void btree_sync_dir(char *path) {
+    char *dir = strdup(path), *slash;
+    int fd;
+
+    if (dir == NULL) return;
+    if ((slash = strrchr(dir,'/')) != NULL) {
+        slash[slash == dir] = '\0'; /* Keep the slash of "/file". */
+    } else {
+        strcpy(dir,".");
+    }
+    if ((fd = open(dir,O_RDONLY)) != -1) {
+        fsync(fd);
+        close(fd);
+    }
+    free(dir);
+}
+
+/* Complete the compaction: copy what is left, apply the modifications
+ * performed meanwhile, and replace the btree with the new one, that is
+ * used from now on. On success 0 is returned and the compaction handle is
+ * freed.
+ *
+ * If a transaction or other snapshots are in progress -1 is returned with
+ * errno set to EBUSY, and the compaction can be finished later. On other
+ * errors -1 is returned, and the compaction is aborted. If the error is in
+ * the reopen of the new file the btree is no longer usable and should be
+ * closed. */
+int btree_compact_finish(struct btree_compact *c) {
+    struct btree *bt = c->bt;
+    unsigned char *val;
+    uint32_t vlen, j;
+    int retval;
+
+    if (bt->txn_user || bt->snap_head != c->snap || c->snap->next) {
+        errno = EBUSY;
+        return -1;
+    }
+    while ((retval = btree_compact_step(c,1024)) == 1);
+    if (retval == -1 || btree_flush(bt) == -1 ||
+        btree_bulk_commit(&c->bulk) == -1) goto err;
+
+    /* Bring the new btree up to date. */
+    for (j = 0; j < c->numkeys; j++) {
+        unsigned char *key = c->keys+bt->keylen*j;
+
+        if (btree_get(bt,key,&val,&vlen) == 0) {
+            retval = btree_add(c->dst,key,val,vlen,1);
+            free(val);
+            if (retval == -1) goto err;
+        } else if (errno != ENOENT ||
+                   (btree_delete(c->dst,key) == -1 && errno != ENOENT)) {
+            goto err;
+        }
+    }
+    btree_fsync(c->dst);
+    btree_close(c->dst);
+    c->dst = NULL;
+
+    /* Swap the files. */
+    if (rename(c->path,bt->path) == -1) goto err;
+    if (bt->flags & BTREE_FLAG_USE_WRITE_BARRIER) btree_sync_dir(bt->path);
+    free(c->path);
+    c->path = NULL;
+    btree_compact_abort(c);
+    return btree_reopen(bt);
+
+err:
+    btree_compact_abort(c);
+    return -1;
+}
+
+/* Abort the compaction, removing the new btree. */
+void btree_compact_abort(struct btree_compact *c) {
+    int saved = errno;
+
+    if (c == NULL) return;
+    btree_bulk_free(&c->bulk);
+    btree_cursor_close(c->cursor);
+    btree_snapshot_release(c->snap);
+    btree_close(c->dst);
+    if (c->path) {
+        unlink(c->path);
+        free(c->path);
+    }
+    free(c->keys);
+    c->bt->compact = NULL;
+    free(c);
+    errno = saved;
+}
+
+/* Compact the btree at once, using 'path' as the temporary file. Returns 0
+ * on success, otherwise -1 with errno set accordingly. */
+int btree_compact(struct btree *bt, char *path) {
+    struct btree_compact *c;
+
+    if ((c = btree_compact_start(bt,path)) == NULL) return -1;
+    if (btree_compact_finish(c) == -1) {
+        if (errno == EBUSY) btree_compact_abort(c);
+        return -1;
+    }
+    return 0;
+}
+
+/* -------------------------------- Rewrite --------------------------------- */
+
+/* btree_rewrite() copies a btree into a new file with the best layout for
+ * reads, and is what the btree-compact tool uses. Unlike the bulk loader,
+ * that writes nodes as they are completed, the shape of the whole tree is
+ * computed in advance from the number of keys, so every node has a known
+ * place in the file:
+ *
+ *   header | internal nodes, level by level from the root | leafs
+ *
+ * Internal nodes are in BFS order, so a cold lookup reads them from a small
+ * contiguous area. Leafs are in key order, every leaf followed by its values
+ * and by the value of the separator after it. The space of the internal
+ * nodes is reserved before copying the leafs, and an internal node is
+ * written in its place when its last child is complete, so only a node per
+ * level is in memory.
+ *
+ * The shape only depends on the number of keys 'm' of a subtree and on its
+ * height 'h': an internal node gets the minimum number of children able to
+ * hold the keys, and the keys are split evenly among the children. This way
+ * all the nodes are full or almost full, and no node but the root is less
+ * than half full.
+ *
+ * The space is allocated like the bulk loader does, at the end of the file
+ * and without using the freelists. */
+
+struct btree_rewrite {
+    struct btree_bulk bulk;     /* Allocates and writes nodes and values */
+    struct btree_cursor *cursor; /* Source keys in order */
+    uint64_t copied;            /* Keys copied so far */
+    uint32_t stride;            /* Space used by a node */
+    int height;                 /* Height of the new tree, 1 for a leaf */
+    uint64_t count[BTREE_MAX_DEPTH+1]; /* Internal nodes of every height */
+    uint64_t base[BTREE_MAX_DEPTH+1];  /* Offset of the first one */
+    uint64_t next[BTREE_MAX_DEPTH+1];  /* Nodes written so far */
+};
+
+/* Return the number of keys of a full subtree of height 'h' with 'keys'
+ * keys per node, or UINT64_MAX if it does not fit. */
+uint64_t btree_rewrite_cap(uint32_t keys, int h) {
+    uint64_t cap = 0;
+
+    while (h--) {
+        if (cap > (UINT64_MAX-keys)/(keys+1)) return UINT64_MAX;
+        cap = cap*(keys+1)+keys;
+    }
+    return cap;
+}
+
+/* Return the number of children 'c' of a node of height 'h' > 1 whose
+ * subtree has 'm' keys. The subtree of the child 'j' has (m-c+1)/c keys,
+ * plus one if 'j' < (m-c+1)%c. */
+uint32_t btree_rewrite_children(struct btree_rewrite *r, uint64_t m, int h) {
+    uint64_t c = m/(btree_rewrite_cap(r->bulk.fill,h-1)+1)+1;
+
+    return c < 2 ? 2 : (uint32_t)c;
+}
+
+/* Count the internal nodes of every height of the subtree. */
+void btree_rewrite_count(struct btree_rewrite *r, uint64_t m, int h) {
+    uint32_t c, j;
+    uint64_t rest;
+
+    if (h == 1) return;
+    r->count[h]++;
+    if (h == 2) return;
+    c = btree_rewrite_children(r,m,h);
+    rest = m-(c-1);
+    for (j = 0; j < c; j++) btree_rewrite_count(r,rest/c+(j < rest%c),h-1);
+}
+
+/* Copy the next key of the source, with its value, as the last key of 'n'.
+ * Values not stored inline are written at the end of the file. */
+int btree_rewrite_key(struct btree_rewrite *r, struct btree_node *n) {
+    const unsigned char *val;
+    uint32_t vlen, i = n->numkeys;
+    uint64_t ptr;
+
+    if ((r->copied++ ? btree_cursor_next(r->cursor) :
+                       btree_cursor_seek(r->cursor,NULL)) == -1 ||
+        btree_cursor_value(r->cursor,&val,&vlen) == -1) return -1;
+    memcpy(n->keys+i*n->keylen,btree_cursor_key(r->cursor),n->keylen);
+    btree_bloom_add(r->bulk.bt,btree_cursor_key(r->cursor));
+    if (r->bulk.bt->inlinelen && vlen <= r->bulk.bt->inlinelen) {
+        btree_node_set_inline(n,i,val,vlen);
+    } else {
+        if ((ptr = btree_bulk_write_value(&r->bulk,val,vlen)) == 0) return -1;
+        n->values[i] = ptr;
+    }
+    n->numkeys++;
+    return 0;
+}
+
+/* Copy the next 'm' keys of the source as a subtree of height 'h'. Returns
+ * the offset of its root, or 0 on error. */
+uint64_t btree_rewrite_subtree(struct btree_rewrite *r, uint64_t m, int h) {
+    struct btree *dst = r->bulk.bt;
+    struct btree_node *n;
+    uint64_t off, rest;
+    uint32_t c, j;
+
+    if ((n = btree_new_node(dst)) == NULL) return 0;
+    n->isleaf = (h == 1);
+    if (h > 1) {
+        off = r->base[h]+r->next[h]++*r->stride;
+    } else if ((off = btree_bulk_alloc(&r->bulk,dst->nodesize)) == 0) {
+        goto err;
+    }
+
+    if (h == 1) {
+        for (j = 0; j < m; j++)
+            if (btree_rewrite_key(r,n) == -1) goto err;
+    } else {
+        c = btree_rewrite_children(r,m,h);
+        rest = m-(c-1);
+        for (j = 0; j < c; j++) {
+            uint64_t child = btree_rewrite_subtree(r,rest/c+(j < rest%c),h-1);
+
+            if (child == 0) goto err;
+            n->children[j] = child;
+            if (j+1 < c && btree_rewrite_key(r,n) == -1) goto err;
+        }
+    }
+    if (btree_pwrite_u64(dst,dst->nodesize,off-sizeof(uint64_t)) == -1 ||
+        btree_write_node(dst,n,off) == -1) goto err;
+    btree_free_node(n);
+    return off;
+
+err:
+    btree_free_node(n);
+    return 0;
+}
+
+/* Add to '*count' the number of keys of the subtree at 'nptr'. */
+int btree_count_keys(struct btree *bt, uint64_t nptr, uint64_t *count) {
+    struct btree_node *n;
+    unsigned int j;
+
+    if ((n = btree_read_node(bt,nptr)) == NULL) return -1;
+    *count += n->numkeys;
+    if (!n->isleaf) {
+        for (j = 0; j <= n->numkeys; j++) {
+            if (btree_count_keys(bt,n->children[j],count) == -1) {
+                btree_free_node(n);
+                return -1;
+            }
+        }
+    }
+    btree_free_node(n);
+    return 0;
+}
+
+/* Copy all the keys of 'bt' into the empty btree 'dst', filling nodes up to
+ * 'fill' percent of their capacity, from 1 to 100. At the end the space
+ * preallocated by 'dst' is removed, so its file has the minimum size. The
+ * freelists of 'dst' only get the paddings needed to align nodes.
+ *
+ * The keys are counted with a first pass over the nodes of 'bt', and then
+ * copied with a cursor, so 'bt' must not be modified meanwhile.
+ *
+ * Returns 0 on success, otherwise -1 with errno set accordingly: EINVAL if
+ * 'fill' is out of range, ENOTEMPTY if 'dst' is not empty, EBUSY if it has a
+ * transaction in progress. On error 'dst' is left unmodified: the space
+ * written so far is released, see btree_bulk_rollback(). */
+int btree_rewrite(struct btree *bt, struct btree *dst, int fill) {
+    struct btree_rewrite r;
+    struct btree_node *root;
+    uint64_t numkeys = 0, oldroot = dst->rootptr, newroot = 0, ptr, j;
+    int h, retval = -1;
+
+    if (dst->txn != BTREE_TXN_NONE) {
+        errno = EBUSY;
+        return -1;
+    }
+    if (fill < 1 || fill > 100) {
+        errno = EINVAL;
+        return -1;
+    }
+    if ((root = btree_read_node(dst,dst->rootptr)) == NULL) return -1;
+    if (root->numkeys != 0) {
+        btree_free_node(root);
+        errno = ENOTEMPTY;
+        return -1;
+    }
+    btree_free_node(root);
+    if ((dst->openflags & BTREE_MEMORY_FREELIST) && btree_set_dirty(dst) == -1)
+        return -1;
+
+    memset(&r,0,sizeof(r));
+    if (btree_bulk_init(&r.bulk,dst,fill) == -1 ||
+        btree_count_keys(bt,bt->rootptr,&numkeys) == -1) goto err;
+    if (numkeys == 0) goto truncate;
+    /* Size the filter of the empty 'dst' for the keys we are copying. */
+    if (dst->bloom && btree_bloom_rebuild(dst,numkeys) == -1) goto err;
+    if (dst->prefixed) {
+        /* The shape is computed from the number of keys, so prefix
+         * compressed nodes get the keys that fit in the worst case, when
+         * they have the maximum length and no common prefix. */
+        r.bulk.fill = (dst->nodesize-BTREE_PNODE_FIXED-dst->keylen)/
+                      (dst->keylen+BTREE_PNODE_KEY_SIZE(dst->inlinelen))*
+                      fill/100;
+        if (r.bulk.fill < 2) r.bulk.fill = 2;
+    }
+    r.stride = btree_chunk_size(dst,dst->nodesize);
+    for (h = 1; btree_rewrite_cap(r.bulk.fill,h) < numkeys; h++) {
+        if (h == BTREE_MAX_DEPTH) {
+            errno = EFBIG;
+            goto err;
+        }
+    }
+    r.height = h;
+    btree_rewrite_count(&r,numkeys,r.height);
+
+    /* Reserve the space of the internal nodes. The end of the file is
+     * aligned after the first node, so nodes of the same size allocated
+     * one after the other are contiguous. */
+    for (h = r.height; h > 1; h--) {
+        for (j = 0; j < r.count[h]; j++) {
+            if ((ptr = btree_bulk_alloc(&r.bulk,dst->nodesize)) == 0)
+                goto err;
+            if (j == 0) r.base[h] = ptr;
+            assert(ptr == r.base[h]+j*r.stride);
+        }
+    }
+    if ((r.cursor = btree_cursor_open(bt)) == NULL ||
+        (newroot = btree_rewrite_subtree(&r,numkeys,r.height)) == 0)
+        goto err;
+
+truncate:
+    /* Drop the space preallocated at the end of the file, then link the
+     * new tree as btree_bulk_commit() does. */
+    btree_grower_adopt(dst,1);
+    if (btree_wbuf_flush(dst) == -1 ||
+        dst->vfs->resize(dst->vfs_handle,dst->freeoff) == -1) goto err;
+    dst->free = 0;
+    if (!(dst->openflags & BTREE_MEMORY_FREELIST) &&
+        btree_write_free_space(dst) == -1) goto err;
+    btree_sync(dst);
+    if (numkeys == 0) goto done;
+    if (btree_update_pointer(dst,0,BTREE_HDR_ROOTPTR_POS,newroot) == -1)
+        goto err;
+    btree_sync(dst);
+    btree_free(dst,oldroot);
+    for (j = 0; j < r.bulk.numpads; j++)
+        btree_free_padding(dst,r.bulk.pads[j*2],r.bulk.pads[j*2+1]);
+done:
+    retval = 0;
+
+err:
+    if (retval == -1) btree_bulk_rollback(&r.bulk);
+    btree_cursor_close(r.cursor);
+    btree_bulk_free(&r.bulk);
+    return retval;
+}
+
+/* --------------------------- Export and import ---------------------------- */
+
+/* btree_export() streams the keys of a snapshot, with their values, in a
+ * compact image that btree_import() loads into an empty btree with the
+ * bulk loader. Unlike copying the file, only the live data is transferred,
+ * so this is the way to back up a btree, or to bootstrap a replica, while
+ * it keeps being modified. The image is:
+ *
+ *   "BTEXPORT" | version | keylen | record 1 | ... | record N | 0 | count |
+ *   checksum
+ *
+ * 'version' and 'keylen' are 32 bit, 'count' and 'checksum' 64 bit, all
+ * little endian. Every record is the value length plus one, the length of
+ * the prefix the key has in common with the previous key, the rest of the
+ * key, and the value. The lengths are varints of 7 bits per byte, least
+ * significant first, so the zero length marks the end. 'count' is the
+ * number of records, and 'checksum' the FNV-1a hash of all the bytes
+ * before it. */
+
+#define BTREE_EXPORT_MAGIC "BTEXPORT"
+#define BTREE_EXPORT_VERSION 1
+#define BTREE_EXPORT_HDR_SIZE 16
+#define BTREE_EXPORT_BUFSIZE (1024*1024) /* Bytes passed to the sink */
+#define BTREE_EXPORT_READAHEAD 64       /* Sibling subtrees to prefetch */
+
+struct btree_export {
+    int (*sink)(void *privdata, const unsigned char *buf, size_t len);
+    void *privdata;
+    unsigned char *buf;
+    size_t len;                 /* Bytes of 'buf' not yet passed to sink */
+    uint64_t checksum;
+};
+
+/* Pass the buffered bytes to the sink. */
+int btree_export_flush(struct btree_export *e) {
+    if (e->len && e->sink(e->privdata,e->buf,e->len) == -1) return -1;
+    e->len = 0;
+    return 0;
+}
+
+/* Append 'len' bytes to the image. */
+int btree_export_write(struct btree_export *e, const unsigned char *p,
+                       size_t len)
+{
+    e->checksum = btree_fnv64_update(e->checksum,p,len);
+    while (len) {
+        size_t n = BTREE_EXPORT_BUFSIZE-e->len;
+
+        if (n > len) n = len;
+        memcpy(e->buf+e->len,p,n);
+        e->len += n;
+        p += n;
+        len -= n;
+        if (e->len == BTREE_EXPORT_BUFSIZE && btree_export_flush(e) == -1)
+            return -1;
+    }
+    return 0;
+}
+
+int btree_export_varint(struct btree_export *e, uint64_t val) {
+    unsigned char buf[10];
+    int len = 0;
+
+    do {
+        buf[len] = val & 0x7f;
+        val >>= 7;
+        if (val) buf[len] |= 0x80;
+        len++;
+    } while (val);
+    return btree_export_write(e,buf,len);
+}
+
+/* Stream a snapshot of the btree, taken when the function is called, to
+ * 'sink' in the image format described above. The sink is called with
+ * chunks of up to BTREE_EXPORT_BUFSIZE bytes, and should return 0 on
+ * success or -1 on error, setting errno.
+ *
+ * The snapshot is read with a cursor that prefetches ahead, so btrees with
+ * nodes in key order, as written by the bulk loader, are read sequentially.
+ * The writer is never blocked meanwhile: with BTREE_CONCURRENT it can keep
+ * modifying the btree from another thread, and the sink itself may modify
+ * it, as the cursor reads the snapshot. Modifications of the transaction
+ * in progress, if any, are not exported.
+ *
+ * Returns 0 on success, otherwise -1 with errno set accordingly. */
+int btree_export(struct btree *bt, int (*sink)(void *privdata, const unsigned char *buf, size_t len), void *privdata) {
+    struct btree_export e;
+    struct btree_snapshot *s = NULL;
+    struct btree_cursor *c = NULL;
+    unsigned char hdr[BTREE_EXPORT_HDR_SIZE], prev[BTREE_MAX_KEY_LEN];
+    uint64_t count = 0;
+    int retval = -1, found;
+
+    e.sink = sink;
+    e.privdata = privdata;
+    e.len = 0;
+    e.checksum = BTREE_FNV64_BASIS;
+    if ((e.buf = malloc(BTREE_EXPORT_BUFSIZE)) == NULL ||
+        (s = btree_snapshot_acquire(bt)) == NULL ||
+        (c = btree_cursor_open_snapshot(s)) == NULL) goto err;
+    c->readahead = BTREE_EXPORT_READAHEAD;
+
+    memcpy(hdr,BTREE_EXPORT_MAGIC,8);
+    btree_u32_to_little(hdr+8,BTREE_EXPORT_VERSION);
+    btree_u32_to_little(hdr+12,bt->keylen);
+    if (btree_export_write(&e,hdr,sizeof(hdr)) == -1) goto err;
+
+    found = btree_cursor_seek(c,NULL);
+    while (found == 0) {
+        const unsigned char *key = btree_cursor_key(c), *val;
+        uint32_t vlen, shared = 0;
+
+        if (btree_cursor_value(c,&val,&vlen) == -1) goto err;
+        if (count)
+            while (shared < bt->keylen && key[shared] == prev[shared])
+                shared++;
+        if (btree_export_varint(&e,(uint64_t)vlen+1) == -1 ||
+            btree_export_varint(&e,shared) == -1 ||
+            btree_export_write(&e,key+shared,bt->keylen-shared) == -1 ||
+            btree_export_write(&e,val,vlen) == -1) goto err;
+        memcpy(prev,key,bt->keylen);
+        count++;
+        found = btree_cursor_next(c);
+    }
+    if (errno != ENOENT) goto err;
+
+    btree_u64s_to_little(hdr,&count,1);
+    if (btree_export_varint(&e,0) == -1 ||
+        btree_export_write(&e,hdr,8) == -1) goto err;
+    btree_u64s_to_little(hdr,&e.checksum,1);
+    if (btree_export_write(&e,hdr,8) == -1 ||
+        btree_export_flush(&e) == -1) goto err;
+    retval = 0;
+
+err:
+    btree_cursor_close(c);
+    if (s) btree_snapshot_release(s);
+    free(e.buf);
+    return retval;
+}
+
+struct btree_import {
+    ssize_t (*source)(void *privdata, unsigned char *buf, size_t len);
+    void *privdata;
+    uint32_t keylen;
+    unsigned char *buf;
+    size_t pos, len;            /* Bytes of 'buf' consumed and read */
+    unsigned char key[BTREE_MAX_KEY_LEN]; /* Last key */
+    unsigned char *val;
+    size_t vallen;              /* Size of the 'val' buffer */
+    uint64_t count;             /* Records read */
+    uint64_t checksum;
+};
+
+/* Read the next 'len' bytes of the image into 'dst'. A truncated image is
+ * reported as EFAULT. */
+int btree_import_read(struct btree_import *im, unsigned char *dst,
+                      size_t len)
+{
+    while (len) {
+        size_t n;
+
+        if (im->pos == im->len) {
+            ssize_t nread = im->source(im->privdata,im->buf,
+                                       BTREE_EXPORT_BUFSIZE);
+
+            if (nread <= 0) {
+                if (nread == 0) errno = EFAULT;
+                return -1;
+            }
+            im->pos = 0;
+            im->len = nread;
+        }
+        n = im->len-im->pos;
+        if (n > len) n = len;
+        memcpy(dst,im->buf+im->pos,n);
+        im->checksum = btree_fnv64_update(im->checksum,dst,n);
+        im->pos += n;
+        dst += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int btree_import_varint(struct btree_import *im, uint64_t *val) {
+    unsigned char byte;
+    int shift = 0;
+
+    *val = 0;
+    do {
+        if (shift > 63) {
+            errno = EFAULT;
+            return -1;
+        }
+        if (btree_import_read(im,&byte,1) == -1) return -1;
+        *val |= (uint64_t)(byte & 0x7f) << shift;
+        shift += 7;
+    } while (byte & 0x80);
+    return 0;
+}
+
+/* The btree_bulk_load() callback of btree_import(): decode the next record
+ * of the image, or check the trailer after the last one. */
+int btree_import_next(void *privdata, unsigned char *key,
+                      const unsigned char **val, size_t *vlen)
+{
+    struct btree_import *im = privdata;
+    unsigned char buf[8], suffix[BTREE_MAX_KEY_LEN];
+    uint64_t len, shared, count, checksum, expected;
+
+    if (btree_import_varint(im,&len) == -1) return -1;
+    if (len == 0) {
+        if (btree_import_read(im,buf,8) == -1) return -1;
+        btree_u64s_from_little(&count,buf,1);
+        checksum = im->checksum;
+        if (btree_import_read(im,buf,8) == -1) return -1;
+        btree_u64s_from_little(&expected,buf,1);
+        if (count != im->count || expected != checksum) {
+            errno = EFAULT;
+            return -1;
+        }
+        return 0;
+    }
+    len--;
+    if (btree_import_varint(im,&shared) == -1) return -1;
+    if (len > (1U<<31) || shared > im->keylen ||
+        (im->count == 0 && shared))
+    {
+        errno = EFAULT;
+        return -1;
+    }
+    if (len > im->vallen) {
+        unsigned char *newval = realloc(im->val,len);
+
+        if (newval == NULL) return -1;
+        im->val = newval;
+        im->vallen = len;
+    }
+    if (btree_import_read(im,suffix,im->keylen-shared) == -1 ||
+        btree_import_read(im,im->val,len) == -1) return -1;
+    /* Keys are exported in order: a key not greater than the previous one
+     * is a corruption of the image, not an error of the caller. */
+    if (im->count && memcmp(suffix,im->key+shared,im->keylen-shared) <= 0) {
+        errno = EFAULT;
+        return -1;
+    }
+    memcpy(im->key+shared,suffix,im->keylen-shared);
+    memcpy(key,im->key,im->keylen);
+    *val = im->val;
+    *vlen = len;
+    im->count++;
+    return 1;
+}
+
+/* Load the image produced by btree_export() into the empty btree 'bt',
+ * filling nodes up to 'fill' percent, see btree_bulk_load(). The image is
+ * read calling 'source', that should copy up to 'len' bytes into 'buf',
+ * returning the number of bytes copied, 0 at the end of the input, or -1
+ * on error, setting errno.
+ *
+ * The btree must have the key size of the exported one, but the other
+ * options, like the node size, can be different.
+ *
+ * Returns 0 on success, otherwise -1 with errno set accordingly: EINVAL if
+ * the image has a different key size or an unknown version, EFAULT if it
+ * is truncated or corrupted, and the errors of btree_bulk_load(). As the
+ * trailer is checked before the new tree is linked, on error the btree is
+ * left unmodified, and the space of the records loaded so far is released
+ * by btree_bulk_load(). */
+int btree_import(struct btree *bt, ssize_t (*source)(void *privdata, unsigned char *buf, size_t len), void *privdata, int fill) {
+    struct btree_import im;
+    unsigned char hdr[BTREE_EXPORT_HDR_SIZE];
+    int retval = -1;
+
+    memset(&im,0,sizeof(im));
+    im.source = source;
+    im.privdata = privdata;
+    im.keylen = bt->keylen;
+    im.checksum = BTREE_FNV64_BASIS;
+    if ((im.buf = malloc(BTREE_EXPORT_BUFSIZE)) == NULL ||
+        btree_import_read(&im,hdr,sizeof(hdr)) == -1) goto err;
+    if (memcmp(hdr,BTREE_EXPORT_MAGIC,8)) {
+        errno = EFAULT;
+        goto err;
+    }
+    if (btree_u32_from_little(hdr+8) != BTREE_EXPORT_VERSION ||
+        btree_u32_from_little(hdr+12) != bt->keylen)
+    {
+        errno = EINVAL;
+        goto err;
+    }
+    retval = btree_bulk_load(bt,btree_import_next,&im,fill);
+
+err:
+    free(im.buf);
+    free(im.val);
+    return retval;
+}
+
+/* ------------------------------ Bloom filter ------------------------------ */
+
+/* With the bloom_bits option the btree takes in memory a Bloom filter of
+ * its keys, checked by btree_find(), btree_get() and btree_find_many()
+ * before visiting the tree, so that most lookups of keys that don't exist
+ * are answered without reading a single node.
+ *
+ * The filter is split in blocks of BTREE_BLOOM_WORDS 64 bit words: the
+ * hash of the key selects a block, and a bit in every word of the block,
+ * so the lookup is a single cache miss with no loop carried dependencies.
+ * With 10 bits per key about 1% of the missing keys pass the filter.
+ *
+ * Keys are added by btree_add(), the bulk loader and btree_rewrite(), but
+ * never removed, so after deletions the filter is just less effective.
+ * When more keys than the filter was sized for were added, it is rebuilt
+ * twice as large scanning the tree.
+ *
+ * The filter is written on disk on close, and the header field
+ * BTREE_HDR_BLOOM_POS points to it, like for the freelist directory:
+ * before the first key is added the header field is set to zero, see
+ * btree_drop_bloom(), so a filter referenced by the header always has all
+ * the keys of the tree, and after a crash the filter is rebuilt on open
+ * scanning the tree. The record is:
+ *
+ * checksum | length | numblocks | keys | capacity | bits | words
+ *
+ * The words are little endian, the other fields big endian, and the
+ * checksum covers the rest of the record. */
+#define BTREE_BLOOM_FIXED_SIZE 48
+
+/* Hash of a key, independent of the byte order of the host as the filter
+ * is persisted. Every 8 bytes of the key are mixed with the finalizer of
+ * splitmix64. */
+uint64_t btree_bloom_mix(uint64_t h) {
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+    return h;
+}
+
+uint64_t btree_bloom_hash(const unsigned char *key, uint32_t len) {
+    uint64_t h = 0x9e3779b97f4a7c15ULL*len;
+    unsigned char tail[8];
+
+    for (; len >= 8; key += 8, len -= 8)
+        h = btree_bloom_mix(h^btree_u64_from_big((unsigned char*)key));
+    if (len) {
+        memset(tail,0,sizeof(tail));
+        memcpy(tail,key,len);
+        h = btree_bloom_mix(h^btree_u64_from_big(tail));
+    }
+    return h;
+}
+
+/* Return the block of the hash 'h': the high bits select the block, while
+ * the low 48 bits are the bits to set in the words of the block. */
+uint64_t *btree_bloom_block(struct btree_bloom *f, uint64_t h) {
+    return f->words+(uint64_t)(((btree_u128)h*f->numblocks)>>64)*
+                    BTREE_BLOOM_WORDS;
+}
+
+/* Create an empty filter for 'keys' keys with 'bits' bits per key. Returns
+ * NULL on out of memory. */
+struct btree_bloom *btree_bloom_create(uint64_t keys, uint32_t bits) {
+    struct btree_bloom *f;
+    uint64_t numblocks;
+
+    if (keys < BTREE_BLOOM_MIN_KEYS) keys = BTREE_BLOOM_MIN_KEYS;
+    if (keys > (uint64_t)BTREE_BLOOM_MAX_BLOCKS*BTREE_BLOOM_WORDS*64/bits)
+        numblocks = BTREE_BLOOM_MAX_BLOCKS;
+    else
+        numblocks = (keys*bits+BTREE_BLOOM_WORDS*64-1)/(BTREE_BLOOM_WORDS*64);
+    if ((f = malloc(sizeof(*f))) == NULL) return NULL;
+    if ((f->words = calloc(numblocks*BTREE_BLOOM_WORDS,sizeof(uint64_t)))
+        == NULL)
+    {
+        free(f);
+        return NULL;
+    }
+    f->numblocks = numblocks;
+    f->keys = 0;
+    f->capacity = keys;
+    f->retired = NULL;
+    return f;
+}
+
+/* Free the filter and the filters it replaced. */
+void btree_bloom_release(struct btree_bloom *f) {
+    while (f) {
+        struct btree_bloom *next = f->retired;
+
+        free(f->words);
+        free(f);
+        f = next;
+    }
+}
+
+/* Replace the filter of the btree with 'f'. With BTREE_CONCURRENT readers
+ * may still use the old filter, that is freed only when the btree is
+ * closed. */
+void btree_bloom_replace(struct btree *bt, struct btree_bloom *f) {
+    if (bt->openflags & BTREE_CONCURRENT) {
+        f->retired = bt->bloom;
+        __atomic_store_n(&bt->bloom,f,__ATOMIC_RELEASE);
+    } else {
+        btree_bloom_release(bt->bloom);
+        bt->bloom = f;
+    }
+}
+
+/* Set the bits of the key with hash 'h'. Readers of other threads may
+ * test the filter at the same time. */
+void btree_bloom_set(struct btree_bloom *f, uint64_t h, int concurrent) {
+    uint64_t *block = btree_bloom_block(f,h);
+    int j;
+
+    for (j = 0; j < BTREE_BLOOM_WORDS; j++, h >>= 6) {
+        if (concurrent)
+            __atomic_or_fetch(&block[j],1ULL<<(h&63),__ATOMIC_RELAXED);
+        else
+            block[j] |= 1ULL<<(h&63);
+    }
+}
+
+/* Add a key to the filter of the btree, if it has one. */
+void btree_bloom_add(struct btree *bt, const unsigned char *key) {
+    if (bt->bloom == NULL) return;
+    btree_bloom_set(bt->bloom,btree_bloom_hash(key,bt->keylen),
+                    bt->openflags & BTREE_CONCURRENT);
+    bt->bloom->keys++;
+}
+
+/* Return 0 if the key is surely not in the btree, otherwise 1. Can be
+ * called by any thread. */
+int btree_bloom_may_contain(struct btree *bt, const unsigned char *key) {
+    struct btree_bloom *f = __atomic_load_n(&bt->bloom,__ATOMIC_ACQUIRE);
+    uint64_t h, *block, miss = 0;
+    int j;
+
+    if (f == NULL) return 1;
+    h = btree_bloom_hash(key,bt->keylen);
+    block = btree_bloom_block(f,h);
+    for (j = 0; j < BTREE_BLOOM_WORDS; j++, h >>= 6)
+        miss |= ~__atomic_load_n(&block[j],__ATOMIC_RELAXED) & (1ULL<<(h&63));
+    return miss == 0;
+}
+
+/* Add all the keys of the subtree at 'nptr' to the filter 'f'. */
+int btree_bloom_scan(struct btree *bt, struct btree_bloom *f, uint64_t nptr) {
+    struct btree_node *n;
+    unsigned int j;
+
+    if ((n = btree_read_node(bt,nptr)) == NULL) return -1;
+    for (j = 0; j < n->numkeys; j++) {
+        btree_bloom_set(f,btree_bloom_hash((unsigned char*)n->keys+
+                                           j*n->keylen,n->keylen),0);
+        f->keys++;
+    }
+    if (!n->isleaf) {
+        for (j = 0; j <= n->numkeys; j++) {
+            if (btree_bloom_scan(bt,f,n->children[j]) == -1) {
+                btree_free_node(n);
+                return -1;
+            }
+        }
+    }
+    btree_free_node(n);
+    return 0;
+}
+
+/* Replace the filter with a new one, sized for twice 'keys' keys, with all
+ * the keys of the tree. Returns 0 on success, otherwise -1 with errno set
+ * accordingly, and the old filter is still used. */
+int btree_bloom_rebuild(struct btree *bt, uint64_t keys) {
+    struct btree_bloom *f;
+
+    if ((f = btree_bloom_create(keys*2,bt->bloombits)) == NULL) return -1;
+    if (btree_bloom_scan(bt,f,bt->rootptr) == -1) {
+        btree_bloom_release(f);
+        return -1;
+    }
+    btree_bloom_replace(bt,f);
+    return 0;
+}
+
+/* Called after keys were added: if the filter has more keys than it was
+ * sized for it is rebuilt. Errors are not reported, as the old filter
+ * remains correct, it just has more false positives. */
+void btree_bloom_fit(struct btree *bt) {
+    struct btree_bloom *f = bt->bloom;
+
+    if (f && f->keys > f->capacity && f->numblocks < BTREE_BLOOM_MAX_BLOCKS)
+        btree_bloom_rebuild(bt,f->keys);
+}
+
+/* Load the filter referenced by the header. Returns 0 on success,
+ * otherwise -1 with errno set to EFAULT if the record is not valid, or
+ * has a different number of bits per key. */
+int btree_read_bloom(struct btree *bt) {
+    unsigned char fixed[BTREE_BLOOM_FIXED_SIZE], *buf = NULL;
+    struct btree_bloom *f = NULL;
+    uint64_t len, numblocks;
+    uint32_t size;
+
+    if (bt->bloomoff < BTREE_HDR_SIZE || bt->bloomoff >= bt->freeoff ||
+        btree_alloc_size(bt,&size,bt->bloomoff) == -1 ||
+        size < BTREE_BLOOM_FIXED_SIZE ||
+        btree_pread(bt,fixed,sizeof(fixed),bt->bloomoff) != sizeof(fixed))
+        goto invalid;
+    len = btree_u64_from_big(fixed+8);
+    numblocks = btree_u64_from_big(fixed+16);
+    if (numblocks == 0 || numblocks > BTREE_BLOOM_MAX_BLOCKS ||
+        len != size ||
+        len != BTREE_BLOOM_FIXED_SIZE+numblocks*BTREE_BLOOM_WORDS*8 ||
+        btree_u64_from_big(fixed+40) != bt->bloombits) goto invalid;
+    if ((buf = malloc(len)) == NULL) return -1;
+    memcpy(buf,fixed,sizeof(fixed));
+    if (btree_pread(bt,buf+sizeof(fixed),len-sizeof(fixed),
+                    bt->bloomoff+sizeof(fixed)) != (ssize_t)(len-sizeof(fixed)) ||
+        btree_fnv64(buf+8,len-8) != btree_u64_from_big(buf)) goto invalid;
+    if ((f = malloc(sizeof(*f))) == NULL ||
+        (f->words = malloc(numblocks*BTREE_BLOOM_WORDS*8)) == NULL)
+    {
+        free(f);
+        free(buf);
+        return -1;
+    }
+    f->numblocks = numblocks;
+    f->keys = btree_u64_from_big(buf+24);
+    f->capacity = btree_u64_from_big(buf+32);
+    f->retired = NULL;
+    btree_u64s_from_little(f->words,buf+sizeof(fixed),
+                           numblocks*BTREE_BLOOM_WORDS);
+    free(buf);
+    btree_bloom_replace(bt,f);
+    return 0;
+
+invalid:
+    free(buf);
+    errno = EFAULT;
+    return -1;
+}
+
+/* Write the filter on disk, unless the header already references an up to
+ * date one. Returns 0 on success, -1 on error with errno set, in which case
+ * the next open will rebuild the filter. */
+int btree_write_bloom(struct btree *bt) {
+    struct btree_bloom *f = bt->bloom;
+    uint64_t len, off;
+    unsigned char *buf;
+
+    if (f == NULL || bt->bloomoff || !bt->loaded) return 0;
+    len = BTREE_BLOOM_FIXED_SIZE+f->numblocks*BTREE_BLOOM_WORDS*8;
+    if ((buf = malloc(len)) == NULL) return -1;
+    btree_u64_to_big(buf+8,len);
+    btree_u64_to_big(buf+16,f->numblocks);
+    btree_u64_to_big(buf+24,f->keys);
+    btree_u64_to_big(buf+32,f->capacity);
+    btree_u64_to_big(buf+40,bt->bloombits);
+    btree_u64s_to_little(buf+BTREE_BLOOM_FIXED_SIZE,f->words,
+                         f->numblocks*BTREE_BLOOM_WORDS);
+    btree_u64_to_big(buf,btree_fnv64(buf+8,len-8));
+    if ((off = btree_alloc(bt,len)) == 0) {
+        free(buf);
+        return -1;
+    }
+    if (btree_pwrite(bt,buf,len,off) == -1) {
+        free(buf);
+        btree_free(bt,off);
+        return -1;
+    }
+    free(buf);
+    btree_sync(bt);
+    if (btree_pwrite_u64(bt,off,BTREE_HDR_BLOOM_POS) == -1) {
+        btree_free(bt,off);
+        return -1;
+    }
+    btree_sync(bt);
+    bt->bloomoff = off;
+    return 0;
+}
+
+/* Called before every change that adds keys: if the header references a
+ * filter on disk, it is no longer valid, and its space is released. This
+ * is done even if this btree was opened without filter. */
+int btree_drop_bloom(struct btree *bt) {
+    uint64_t off = bt->bloomoff;
+
+    if (off == 0) return 0;
+    if (btree_pwrite_u64(bt,0,BTREE_HDR_BLOOM_POS) == -1) return -1;
+    /* Like btree_drop_fldir(), always use a real write barrier: the header
+     * must be on disk before keys the filter lacks are added. */
+    if (bt->flags & BTREE_FLAG_USE_WRITE_BARRIER) btree_fsync(bt);
+    bt->bloomoff = 0;
+    return btree_free(bt,off);
+}
+
+/* Set up the filter of a btree just opened: the filter on disk is used if
+ * valid, otherwise the filter is built scanning the tree. Returns 0 on
+ * success, otherwise -1 with errno set accordingly. */
+int btree_load_bloom(struct btree *bt) {
+    uint64_t keys = 0;
+
+    if (bt->bloombits == 0) return 0;
+    if (bt->bloomoff) {
+        if (btree_read_bloom(bt) == 0) return 0;
+        if (errno != EFAULT || btree_drop_bloom(bt) == -1) return -1;
+        /* With BTREE_CONCURRENT the free was deferred, but there are no
+         * readers yet. */
+        btree_snapshot_reclaim(bt);
+    }
+    if (btree_count_keys(bt,bt->rootptr,&keys) == -1) return -1;
+    return btree_bloom_rebuild(bt,keys);
+}
+
+/* --------------------------------- Shards --------------------------------- */
+
+/* Sharded btrees are a set of normal btrees, every one used with its own
+ * lock, so btree_shards_add() and the other single key operations called
+ * by different threads run in parallel when the keys are in different
+ * shards. btree_shards_write() gets the same parallelism from a single
+ * thread: the operations are routed to the writer threads of the shards,
+ * and every shard performs its part of the batch in a transaction, so
+ * there is one write barrier per shard, and the shards sync in parallel. */
+
+/* Operations of a btree_shards_write() batch routed to the same shard. */
+struct btree_shard_batch {
+    struct btree_shard_op *ops;
+    uint32_t *idx;              /* Indexes of the ops of this shard */
+    uint32_t count;
+    struct btree_shards_wait *wait;
+    struct btree_shard_batch *next;
+};
+
+/* Completion of a btree_shards_write() call. */
+struct btree_shards_wait {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uint32_t pending;           /* Batches not yet done */
+};
+
+/* 64 bit FNV-1a hash of the key. */
+uint64_t btree_shards_hash(const unsigned char *key, uint32_t keylen) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    uint32_t j;
+
+    for (j = 0; j < keylen; j++) {
+        h ^= key[j];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+/* Return the shard of 'key'. With range routing the first two bytes of the
+ * key select the shard, so shard i only has keys smaller than the ones of
+ * shard i+1: the order of memcmp() is preserved, and it works for integer
+ * keys too, as they are stored big endian. */
+uint32_t btree_shards_route(struct btree_shards *s, const unsigned char *key) {
+    uint64_t h;
+
+    if (s->routing == BTREE_SHARD_RANGE) {
+        h = ((uint32_t)key[0] << 8) | key[1];
+        return (uint32_t)((h*s->count) >> 16);
+    }
+    h = btree_shards_hash(key,s->keylen);
+    return (uint32_t)(((h >> 32)*s->count) >> 32);
+}
+
+/* Return the btree of the specified shard, to be used directly only when
+ * no other thread is accessing the shards. */
+struct btree *btree_shards_btree(struct btree_shards *s, uint32_t shard) {
+    return shard < s->count ? s->shards[shard].bt : NULL;
+}
+
+/* Writer thread of a shard: perform the queued batches in order. */
+void *btree_shard_thread(void *arg) {
+    struct btree_shard *sh = arg;
+    struct btree_shard_batch *b;
+    uint32_t j;
+    int txn;
+
+    pthread_mutex_lock(&sh->qlock);
+    while(1) {
+        if ((b = sh->head) == NULL) {
+            if (sh->stop) break;
+            pthread_cond_wait(&sh->qcond,&sh->qlock);
+            continue;
+        }
+        if ((sh->head = b->next) == NULL) sh->tail = NULL;
+        pthread_mutex_unlock(&sh->qlock);
+
+        pthread_mutex_lock(&sh->lock);
+        txn = btree_begin(sh->bt) == 0;
+        for (j = 0; j < b->count; j++) {
+            struct btree_shard_op *op = &b->ops[b->idx[j]];
+
+            if (op->type == BTREE_SHARD_DELETE)
+                op->retval = btree_delete(sh->bt,op->key);
+            else
+                op->retval = btree_add(sh->bt,op->key,op->val,op->vlen,
+                                       op->type == BTREE_SHARD_REPLACE);
+            op->error = op->retval == -1 ? errno : 0;
+        }
+        if (txn && btree_commit(sh->bt) == -1) {
+            /* Nothing of the batch is known to be durable. */
+            int err = errno;
+
+            for (j = 0; j < b->count; j++) {
+                b->ops[b->idx[j]].retval = -1;
+                b->ops[b->idx[j]].error = err;
+            }
+        }
+        pthread_mutex_unlock(&sh->lock);
+
+        pthread_mutex_lock(&b->wait->lock);
+        if (--b->wait->pending == 0) pthread_cond_signal(&b->wait->cond);
+        pthread_mutex_unlock(&b->wait->lock);
+        pthread_mutex_lock(&sh->qlock);
+    }
+    pthread_mutex_unlock(&sh->qlock);
+    return NULL;
+}
+
+/* Open or create (with BTREE_CREAT) 'count' shards, the files "path.0" up
+ * to "path.<count-1>", every one opened with the specified VFS, flags and
+ * configuration (that may be NULL). Keys are routed with BTREE_SHARD_HASH
+ * or BTREE_SHARD_RANGE: existing shards must be opened with the same count
+ * and routing used to create them. On error NULL is returned and errno
+ * set, EINVAL for invalid parameters or if "path.<count>" exists, that is
+ * the shards were created with a larger count. */
+struct btree_shards *btree_shards_open(struct btree_vfs *vfs, char *path,
+                                       uint32_t count, int routing, int flags,
+                                       struct btree_config *cfg)
+{
+    struct btree_shards *s;
+    struct btree_config bcfg;
+    size_t pathlen = strlen(path)+16;
+    char *spath;
+    uint32_t j;
+
+    if (count == 0 || count > BTREE_SHARDS_MAX ||
+        (routing != BTREE_SHARD_HASH && routing != BTREE_SHARD_RANGE))
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+    if ((spath = malloc(pathlen)) == NULL) return NULL;
+    snprintf(spath,pathlen,"%s.%u",path,count);
+    if (access(spath,F_OK) == 0) {
+        free(spath);
+        errno = EINVAL;
+        return NULL;
+    }
+    if ((s = calloc(1,sizeof(*s))) == NULL ||
+        (s->shards = calloc(count,sizeof(struct btree_shard))) == NULL)
+    {
+        free(s);
+        free(spath);
+        return NULL;
+    }
+    s->count = count;
+    s->routing = routing;
+    s->concurrent = (flags & BTREE_CONCURRENT) != 0;
+    for (j = 0; j < count; j++) {
+        struct btree_shard *sh = &s->shards[j];
+
+        snprintf(spath,pathlen,"%s.%u",path,j);
+        if ((sh->bt = btree_open_with_config(vfs,spath,flags,cfg)) == NULL)
+            goto err;
+        pthread_mutex_init(&sh->lock,NULL);
+        pthread_mutex_init(&sh->qlock,NULL);
+        pthread_cond_init(&sh->qcond,NULL);
+        if (pthread_create(&sh->thread,NULL,btree_shard_thread,sh) != 0) {
+            btree_close(sh->bt);
+            sh->bt = NULL;
+            pthread_mutex_destroy(&sh->lock);
+            pthread_mutex_destroy(&sh->qlock);
+            pthread_cond_destroy(&sh->qcond);
+            errno = EAGAIN;
+            goto err;
+        }
+        s->started++;
+    }
+    btree_get_config(s->shards[0].bt,&bcfg);
+    s->keylen = bcfg.key_size ? bcfg.key_size : BTREE_HASHED_KEY_LEN;
+    free(spath);
+    return s;
+
+err:
+    free(spath);
+    btree_shards_close(s);
+    return NULL;
+}
+
+/* Stop the writer threads, and close the shards. */
+void btree_shards_close(struct btree_shards *s) {
+    uint32_t j;
+
+    if (!s) return;
+    for (j = 0; j < s->started; j++) {
+        struct btree_shard *sh = &s->shards[j];
+
+        pthread_mutex_lock(&sh->qlock);
+        sh->stop = 1;
+        pthread_cond_signal(&sh->qcond);
+        pthread_mutex_unlock(&sh->qlock);
+        pthread_join(sh->thread,NULL);
+        btree_close(sh->bt);
+        pthread_mutex_destroy(&sh->lock);
+        pthread_mutex_destroy(&sh->qlock);
+        pthread_cond_destroy(&sh->qcond);
+    }
+    free(s->shards);
+    free(s);
+}
+
+/* Like btree_add() on the shard of the key. */
+int btree_shards_add(struct btree_shards *s, unsigned char *key,
+                     unsigned char *val, size_t vlen, int replace)
+{
+    struct btree_shard *sh = &s->shards[btree_shards_route(s,key)];
+    int retval;
+
+    pthread_mutex_lock(&sh->lock);
+    retval = btree_add(sh->bt,key,val,vlen,replace);
+    pthread_mutex_unlock(&sh->lock);
+    return retval;
+}
+
+/* Like btree_delete() on the shard of the key. */
+int btree_shards_delete(struct btree_shards *s, unsigned char *key) {
+    struct btree_shard *sh = &s->shards[btree_shards_route(s,key)];
+    int retval;
+
+    pthread_mutex_lock(&sh->lock);
+    retval = btree_delete(sh->bt,key);
+    pthread_mutex_unlock(&sh->lock);
+    return retval;
+}
+
+/* Like btree_get() on the shard of the key. With BTREE_CONCURRENT lookups
+ * don't take the lock of the shard, so they never wait for the writers. */
+int btree_shards_get(struct btree_shards *s, unsigned char *key,
+                     unsigned char **val, uint32_t *vlen)
+{
+    struct btree_shard *sh = &s->shards[btree_shards_route(s,key)];
+    int retval;
+
+    if (s->concurrent) return btree_get(sh->bt,key,val,vlen);
+    pthread_mutex_lock(&sh->lock);
+    retval = btree_get(sh->bt,key,val,vlen);
+    pthread_mutex_unlock(&sh->lock);
+    return retval;
+}
+
+/* Perform the 'count' operations, in parallel in the writer threads of the
+ * shards. Operations on the same shard are performed in order, inside a
+ * transaction, so that they become durable at the same time. The result
+ * of every operation is set in its 'retval' and 'error' fields. Returns 0
+ * if all the operations succeeded, otherwise -1 with errno set to the
+ * error of the first failed operation. */
+int btree_shards_write(struct btree_shards *s, struct btree_shard_op *ops,
+                       uint32_t count)
+{
+    struct btree_shard_batch *batches;
+    struct btree_shards_wait wait;
+    uint32_t *idx, *route, j;
+
+    batches = calloc(s->count,sizeof(*batches));
+    idx = malloc(sizeof(uint32_t)*(count ? count : 1));
+    route = malloc(sizeof(uint32_t)*(count ? count : 1));
+    if (batches == NULL || idx == NULL || route == NULL) {
+        free(batches);
+        free(idx);
+        free(route);
+        return -1;
+    }
+
+    /* Group the operations by shard, keeping their order. */
+    for (j = 0; j < count; j++) {
+        route[j] = btree_shards_route(s,ops[j].key);
+        batches[route[j]].count++;
+    }
+    batches[0].idx = idx;
+    for (j = 1; j < s->count; j++)
+        batches[j].idx = batches[j-1].idx+batches[j-1].count;
+    for (j = 0; j < s->count; j++) batches[j].count = 0;
+    for (j = 0; j < count; j++) {
+        struct btree_shard_batch *b = &batches[route[j]];
+
+        b->idx[b->count++] = j;
+    }
+
+    pthread_mutex_init(&wait.lock,NULL);
+    pthread_cond_init(&wait.cond,NULL);
+    wait.pending = 0;
+    for (j = 0; j < s->count; j++) if (batches[j].count) wait.pending++;
+    for (j = 0; j < s->count; j++) {
+        struct btree_shard_batch *b = &batches[j];
+        struct btree_shard *sh = &s->shards[j];
+
+        if (b->count == 0) continue;
+        b->ops = ops;
+        b->wait = &wait;
+        pthread_mutex_lock(&sh->qlock);
+        if (sh->tail) sh->tail->next = b; else sh->head = b;
+        sh->tail = b;
+        pthread_cond_signal(&sh->qcond);
+        pthread_mutex_unlock(&sh->qlock);
+    }
+    pthread_mutex_lock(&wait.lock);
+    while (wait.pending) pthread_cond_wait(&wait.cond,&wait.lock);
+    pthread_mutex_unlock(&wait.lock);
+    pthread_mutex_destroy(&wait.lock);
+    pthread_cond_destroy(&wait.cond);
+    free(batches);
+    free(idx);
+    free(route);
+
+    for (j = 0; j < count; j++) {
+        if (ops[j].retval == -1) {
+            errno = ops[j].error;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Cursors of sharded btrees visit the keys of all the shards in order.
+ * Like btree cursors they are invalidated by modifications, except with
+ * BTREE_CONCURRENT. Every step takes the lock of the shards it reads, so
+ * cursors can't corrupt the state of shards written by other threads. */
+struct btree_shards_cursor *btree_shards_cursor_open(struct btree_shards *s) {
+    struct btree_shards_cursor *c;
+    uint32_t j;
+
+    if ((c = calloc(1,sizeof(*c))) == NULL) return NULL;
+    c->s = s;
+    if ((c->cursors = calloc(s->count,sizeof(struct btree_cursor*))) == NULL ||
+        (c->heap = malloc(sizeof(uint32_t)*s->count)) == NULL) goto err;
+    for (j = 0; j < s->count; j++)
+        if ((c->cursors[j] = btree_cursor_open(s->shards[j].bt)) == NULL)
+            goto err;
+    return c;
+
+err:
+    btree_shards_cursor_close(c);
+    return NULL;
+}
+
+void btree_shards_cursor_close(struct btree_shards_cursor *c) {
+    uint32_t j;
+
+    if (!c) return;
+    for (j = 0; c->cursors && j < c->s->count; j++)
+        btree_cursor_close(c->cursors[j]);
+    free(c->cursors);
+    free(c->heap);
+    free(c);
+}
+
+void btree_shards_lock(struct btree_shards *s, uint32_t shard) {
+    if (!s->concurrent) pthread_mutex_lock(&s->shards[shard].lock);
+}
+
+void btree_shards_unlock(struct btree_shards *s, uint32_t shard) {
+    if (!s->concurrent) pthread_mutex_unlock(&s->shards[shard].lock);
+}
+
+/* Return true if the current key of the heap entry 'a' is smaller than the
+ * one of 'b'. Keys are never equal, as every key is in a single shard. */
+int btree_shards_cursor_less(struct btree_shards_cursor *c, uint32_t a,
+                             uint32_t b)
+{
+    return btree_key_cmp_len(btree_cursor_key(c->cursors[c->heap[a]]),
+                             btree_cursor_key(c->cursors[c->heap[b]]),
+                             c->s->keylen) < 0;
+}
+
+/* Move down the heap entry 'i' to restore the heap order. */
+void btree_shards_cursor_sift(struct btree_shards_cursor *c, uint32_t i) {
+    while(1) {
+        uint32_t min = i, l = i*2+1, r = i*2+2, tmp;
+
+        if (l < c->heapsize && btree_shards_cursor_less(c,l,min)) min = l;
+        if (r < c->heapsize && btree_shards_cursor_less(c,r,min)) min = r;
+        if (min == i) break;
+        tmp = c->heap[i];
+        c->heap[i] = c->heap[min];
+        c->heap[min] = tmp;
+        i = min;
+    }
+}
+
+/* Position the cursor at the first key greater or equal to 'key', or at the
+ * first key if 'key' is NULL. Returns 0 on success, -1 with errno set to
+ * ENOENT if there is no such a key, or on error. */
+int btree_shards_cursor_seek(struct btree_shards_cursor *c,
+                             unsigned char *key)
+{
+    uint32_t j;
+    int retval;
+
+    c->heapsize = 0;
+    for (j = 0; j < c->s->count; j++) {
+        btree_shards_lock(c->s,j);
+        retval = btree_cursor_seek(c->cursors[j],key);
+        btree_shards_unlock(c->s,j);
+        if (retval == 0) {
+            c->heap[c->heapsize++] = j;
+        } else if (errno != ENOENT) {
+            c->heapsize = 0;
+            return -1;
+        }
+    }
+    if (c->heapsize == 0) {
+        errno = ENOENT;
+        return -1;
+    }
+    for (j = c->heapsize/2; j > 0; j--) btree_shards_cursor_sift(c,j-1);
+    return 0;
+}
+
+/* Move to the next key. Returns 0 on success, -1 with errno set to ENOENT
+ * at the end of the keys, or on error. */
+int btree_shards_cursor_next(struct btree_shards_cursor *c) {
+    uint32_t shard;
+    int retval;
+
+    if (c->heapsize == 0) {
+        errno = ENOENT;
+        return -1;
+    }
+    shard = c->heap[0];
+    btree_shards_lock(c->s,shard);
+    retval = btree_cursor_next(c->cursors[shard]);
+    btree_shards_unlock(c->s,shard);
+    if (retval == -1) {
+        if (errno != ENOENT) return -1;
+        c->heap[0] = c->heap[--c->heapsize];
+        if (c->heapsize == 0) {
             errno = ENOENT;
             return -1;
         }
-        nptr = n->children[j];
-        btree_free_node(n);
     }
+    btree_shards_cursor_sift(c,0);
+    return 0;
+}
+
+/* Return the key at the cursor position, or NULL if not positioned. */
+const unsigned char *btree_shards_cursor_key(struct btree_shards_cursor *c) {
+    if (c->heapsize == 0) return NULL;
+    return btree_cursor_key(c->cursors[c->heap[0]]);
+}
+
+/* Like btree_cursor_value() for the key at the cursor position. */
+int btree_shards_cursor_value(struct btree_shards_cursor *c,
+                              const unsigned char **val, uint32_t *vlen)
+{
+    uint32_t shard;
+    int retval;
+
+    if (c->heapsize == 0) {
+        errno = ENOENT;
+        return -1;
+    }
+    shard = c->heap[0];
+    btree_shards_lock(c->s,shard);
+    retval = btree_cursor_value(c->cursors[shard],val,vlen);
+    btree_shards_unlock(c->s,shard);
+    return retval;
+}
+
+/* ---------------------------------- Check --------------------------------- */
+#include <stdarg.h>
+
+/* btree_check() verifies the whole btree, and can rebuild the freelists.
+ * A bitmap with a bit for every 8 bytes block of the file (up to freeoff,
+ * 4 bytes blocks for old files, see btree_check_layout()) is set walking
+ * all the nodes and values, so we find allocations that overlap other
+ * allocations or the free chunks, and the space that is not used and not
+ * free, that is leaked. On repair the freelists are rebuilt from the blocks
+ * not set in the bitmap.
+ *
+ * The walk is performed by worker threads taking the nodes to visit from a
+ * shared queue, where the children of every node are added. A worker takes
+ * a batch of nodes, sorts them by offset, and merges nodes that are close
+ * in the file into large reads, that are all submitted at once with
+ * btree_pread_batch(). The queue is a stack, so the batch is usually made
+ * of siblings, that are often adjacent on disk (always after a bulk load
+ * or a rewrite). */
+
+#define BTREE_CHECK_BATCH 64            /* Nodes taken from the queue at once */
+#define BTREE_CHECK_GAP (64*1024)       /* Max gap between merged nodes */
+#define BTREE_CHECK_READ_SIZE (1024*1024) /* Max size of a merged read */
+#define BTREE_CHECK_MAX_CHUNK ((uint64_t)1<<31) /* Max rebuilt free chunk */
+
+#define BTREE_CHECK_LO 1                /* The item has a lower bound */
+#define BTREE_CHECK_HI 2                /* The item has an upper bound */
+
+/* A node to visit, with the range its keys must be in. */
+struct btree_check_item {
+    uint64_t offset;
+    int depth;                  /* 0 for the root */
+    int bounds;                 /* BTREE_CHECK_LO|BTREE_CHECK_HI */
+    unsigned char lo[BTREE_MAX_KEY_LEN]; /* Keys must be > lo */
+    unsigned char hi[BTREE_MAX_KEY_LEN]; /* and < hi */
+};
+
+struct btree_check {
+    struct btree *bt;
+    struct btree_check_report *report;
+    uint64_t *bitmap;           /* A bit for every block of 'align' bytes */
+    uint32_t align;             /* Alignment of the allocations */
+    uint64_t hdrsize;           /* Bytes used by the header */
+    pthread_mutex_t lock;       /* Protects all the fields below */
+    pthread_cond_t cond;
+    struct btree_check_item *queue;
+    uint32_t queuelen;
+    uint32_t queuemax;
+    int busy;                   /* Workers processing a batch */
+    int error;                  /* errno of a failure stopping the walk */
+    int leafdepth;              /* Depth of the leafs, -1 if not yet known */
+};
+
+struct btree_check_worker {
+    struct btree_check *c;
+    pthread_t thread;
+    struct btree_node *node;
+    struct btree_check_item items[BTREE_CHECK_BATCH]; /* Current batch */
+    struct btree_vfs_read reads[BTREE_CHECK_BATCH]; /* Merged node reads */
+    unsigned char *buf;         /* Buffer of the merged reads */
+    size_t buflen;
+    struct btree_check_item *children; /* Children found in the batch */
+    uint32_t numchildren;
+    uint32_t maxchildren;
+    struct btree_vfs_read *vreads; /* Reads of the values size headers */
+    unsigned char *vbuf;
+    uint32_t numvreads;
+    uint32_t maxvreads;
+    uint64_t nodes, keys, used; /* Stats, summed at the end */
+};
+
+/* Report a corruption at 'off'. Only the first one is described. */
+void btree_check_error(struct btree_check *c, uint64_t off,
+                       const char *fmt, ...)
+{
+    struct btree_check_report *r = c->report;
+    va_list ap;
+
+    pthread_mutex_lock(&c->lock);
+    if (r->errors++ == 0) {
+        r->erroff = off;
+        va_start(ap,fmt);
+        vsnprintf(r->errmsg,sizeof(r->errmsg),fmt,ap);
+        va_end(ap);
+    }
+    pthread_mutex_unlock(&c->lock);
+}
+
+/* Set the bits of the blocks from 'start' to 'end' (excluded), both block
+ * aligned. Returns 0, or -1 if some block was already set. */
+int btree_check_mark(struct btree_check *c, uint64_t start, uint64_t end) {
+    uint64_t b = start/c->align, last = end/c->align, mask;
+    uint32_t bit, n;
+    int overlap = 0;
+
+    while (b < last) {
+        bit = b%64;
+        n = (last-b < 64-bit) ? (uint32_t)(last-b) : 64-bit;
+        mask = (n == 64) ? ~(uint64_t)0 : (((uint64_t)1<<n)-1) << bit;
+        if (__atomic_fetch_or(&c->bitmap[b/64],mask,__ATOMIC_RELAXED) & mask)
+            overlap = 1;
+        b += n;
+    }
+    return overlap ? -1 : 0;
+}
+
+/* Return the first block starting from 'b' whose bit is 'set', or the
+ * number of blocks if there is none. */
+uint64_t btree_check_find(struct btree_check *c, uint64_t b, int set) {
+    uint64_t blocks = c->bt->freeoff/c->align, w;
+
+    while (b < blocks) {
+        w = set ? c->bitmap[b/64] : ~c->bitmap[b/64];
+        w &= ~(uint64_t)0 << (b%64);
+        if (w) {
+            b = (b & ~(uint64_t)63) + __builtin_ctzll(w);
+            break;
+        }
+        b = (b & ~(uint64_t)63) + 64;
+    }
+    return b < blocks ? b : blocks;
+}
+
+/* Set the alignment of the allocations and the size of the header. Files
+ * of format version 1 may have been created before the header had the
+ * fields following the root pointer. Those files reserved instead space
+ * for a legacy root node, never used, so the first allocation starts 4
+ * bytes after BTREE_HDR_SIZE, and the allocations that follow are only 4
+ * bytes aligned. They are recognized because at BTREE_HDR_SIZE there are
+ * the zeros of the reserved space and of the high bytes of the first size
+ * header, where newer files have the size header of their first root. */
+int btree_check_layout(struct btree_check *c) {
+    struct btree *bt = c->bt;
+    uint64_t first;
+
+    c->align = 8;
+    c->hdrsize = BTREE_HDR_SIZE;
+    if (bt->version != BTREE_VERSION_1) return 0;
+    c->align = 4;
+    if (bt->freeoff <= BTREE_HDR_SIZE+sizeof(uint64_t)) return 0;
+    if (btree_pread_u64(bt,&first,BTREE_HDR_SIZE) == -1) return -1;
+    if (first == 0) c->hdrsize += 4;
+    return 0;
+}
+
+/* Return true if 'ptr' (past the size header) can point to 'size' bytes. */
+int btree_check_valid_ptr(struct btree_check *c, uint64_t ptr, uint64_t size) {
+    return (ptr & (c->align-1)) == 0 &&
+           ptr >= c->hdrsize+sizeof(uint64_t) && ptr+size <= c->bt->freeoff;
+}
+
+/* Mark the allocation at 'ptr', whose size header is 'size', reporting it
+ * as 'what' if invalid. Returns the space used by the allocation, or 0 if
+ * it is invalid or overlaps with something else. */
+uint64_t btree_check_alloc(struct btree_check *c, uint64_t ptr, uint64_t size,
+                           const char *what)
+{
+    uint64_t realsize;
+
+    if (size > (1U<<31)) {
+        btree_check_error(c,ptr,"%s with invalid size %llu",what,
+                          (unsigned long long)size);
+        return 0;
+    }
+    realsize = btree_chunk_size(c->bt,size);
+    if (!btree_check_valid_ptr(c,ptr,realsize-sizeof(uint64_t))) {
+        btree_check_error(c,ptr,"%s out of range",what);
+        return 0;
+    }
+    if (btree_check_mark(c,ptr-sizeof(uint64_t),
+                         ptr-sizeof(uint64_t)+realsize) == -1)
+    {
+        btree_check_error(c,ptr,"%s overlapping other data",what);
+        return 0;
+    }
+    return realsize;
+}
+
+/* Add 'count' items to the queue. Called with the lock held. */
+int btree_check_push(struct btree_check *c, struct btree_check_item *items,
+                     uint32_t count)
+{
+    if (count == 0) return 0;
+    if (c->queuelen+count > c->queuemax) {
+        uint32_t queuemax = c->queuemax ? c->queuemax : 1024;
+        struct btree_check_item *queue;
+
+        while (queuemax < c->queuelen+count) queuemax *= 2;
+        queue = realloc(c->queue,sizeof(*queue)*queuemax);
+        if (queue == NULL) return -1;
+        c->queue = queue;
+        c->queuemax = queuemax;
+    }
+    memcpy(c->queue+c->queuelen,items,sizeof(*items)*count);
+    c->queuelen += count;
+    return 0;
+}
+
+int btree_check_item_cmp(const void *a, const void *b) {
+    const struct btree_check_item *x = a, *y = b;
+
+    return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+/* Add the children of the node of the item 'it' to the worker children,
+ * with the range of keys every child can contain. */
+int btree_check_add_children(struct btree_check_worker *w,
+                             struct btree_check_item *it)
+{
+    struct btree_check *c = w->c;
+    struct btree_node *n = w->node;
+    uint32_t j;
+
+    if (w->numchildren+n->numkeys+1 > w->maxchildren) {
+        uint32_t maxchildren = w->maxchildren ? w->maxchildren*2 : 1024;
+        struct btree_check_item *children;
+
+        while (maxchildren < w->numchildren+n->numkeys+1) maxchildren *= 2;
+        children = realloc(w->children,sizeof(*children)*maxchildren);
+        if (children == NULL) return -1;
+        w->children = children;
+        w->maxchildren = maxchildren;
+    }
+    for (j = 0; j <= n->numkeys; j++) {
+        struct btree_check_item *child = &w->children[w->numchildren];
+
+        if (!btree_check_valid_ptr(c,n->children[j],c->bt->nodesize)) {
+            btree_check_error(c,it->offset,"child %u out of range",j);
+            continue;
+        }
+        child->offset = n->children[j];
+        child->depth = it->depth+1;
+        child->bounds = 0;
+        if (j > 0) {
+            memcpy(child->lo,n->keys+(j-1)*n->keylen,n->keylen);
+            child->bounds |= BTREE_CHECK_LO;
+        } else if (it->bounds & BTREE_CHECK_LO) {
+            memcpy(child->lo,it->lo,n->keylen);
+            child->bounds |= BTREE_CHECK_LO;
+        }
+        if (j < n->numkeys) {
+            memcpy(child->hi,n->keys+j*n->keylen,n->keylen);
+            child->bounds |= BTREE_CHECK_HI;
+        } else if (it->bounds & BTREE_CHECK_HI) {
+            memcpy(child->hi,it->hi,n->keylen);
+            child->bounds |= BTREE_CHECK_HI;
+        }
+        btree_prefetch(c->bt,child->offset-sizeof(uint64_t),
+                       c->bt->nodesize+sizeof(uint64_t));
+        w->numchildren++;
+    }
+    return 0;
+}
+
+/* Check the values of the node just decoded, read from 'r'. Values whose
+ * size header is inside the read, for instance because they are stored
+ * right after the node, are marked now, the others are added to the reads
+ * performed at the end of the batch. */
+int btree_check_values(struct btree_check_worker *w, struct btree_check_item *it,
+                       struct btree_vfs_read *r)
+{
+    struct btree_check *c = w->c;
+    struct btree_node *n = w->node;
+    uint32_t j;
+
+    for (j = 0; j < n->numkeys; j++) {
+        uint64_t v = n->values[j], hdr = v-sizeof(uint64_t);
+
+        if (BTREE_VALUE_IS_INLINE(v)) continue;
+        if (!btree_check_valid_ptr(c,v,0)) {
+            btree_check_error(c,it->offset,"value %u out of range",j);
+            continue;
+        }
+        if (hdr >= r->offset && hdr+sizeof(uint64_t) <= r->offset+r->nread) {
+            w->used += btree_check_alloc(c,v,btree_u64_from_big(
+                (unsigned char*)r->buf+(hdr-r->offset)),"value");
+            continue;
+        }
+        if (w->numvreads == w->maxvreads) {
+            uint32_t maxvreads = w->maxvreads ? w->maxvreads*2 : 1024;
+            struct btree_vfs_read *vreads;
+            unsigned char *vbuf;
+
+            vreads = realloc(w->vreads,sizeof(*vreads)*maxvreads);
+            if (vreads == NULL) return -1;
+            w->vreads = vreads;
+            vbuf = realloc(w->vbuf,sizeof(uint64_t)*maxvreads);
+            if (vbuf == NULL) return -1;
+            w->vbuf = vbuf;
+            w->maxvreads = maxvreads;
+        }
+        w->vreads[w->numvreads].offset = hdr;
+        w->vreads[w->numvreads].nbytes = sizeof(uint64_t);
+        w->numvreads++;
+    }
+    return 0;
+}
+
+/* Check the node of the item 'it', whose size header and content are at
+ * 'p', read by 'r'. */
+int btree_check_node(struct btree_check_worker *w, struct btree_check_item *it,
+                     unsigned char *p, struct btree_vfs_read *r)
+{
+    struct btree_check *c = w->c;
+    struct btree *bt = c->bt;
+    struct btree_node *n = w->node;
+    unsigned char *prev = (it->bounds & BTREE_CHECK_LO) ? it->lo : NULL;
+    uint64_t used;
+    uint32_t j;
+    int expected = -1;
+
+    /* If the node is referenced twice, or by mistake overlaps with other
+     * data, we don't descend, so loops are never followed. */
+    if ((used = btree_check_alloc(c,it->offset,bt->nodesize,"node")) == 0)
+        return 0;
+    w->used += used;
+    if (btree_u64_from_big(p) != bt->nodesize) {
+        btree_check_error(c,it->offset,"node with invalid size header");
+        return 0;
+    }
+    if (btree_decode_node(bt,n,p+sizeof(uint64_t)) == -1) {
+        btree_check_error(c,it->offset,"node with invalid marks or keys count");
+        return 0;
+    }
+    w->nodes++;
+    w->keys += n->numkeys;
+    for (j = 0; j < n->numkeys; j++) {
+        unsigned char *key = (unsigned char*)n->keys+j*n->keylen;
+
+        if (prev && memcmp(prev,key,n->keylen) >= 0) {
+            btree_check_error(c,it->offset,"key %u out of order",j);
+            break;
+        }
+        prev = key;
+    }
+    if (n->numkeys && (it->bounds & BTREE_CHECK_HI) &&
+        memcmp(prev,it->hi,n->keylen) >= 0)
+        btree_check_error(c,it->offset,"key %u out of order",n->numkeys-1);
+    if (btree_check_values(w,it,r) == -1) return -1;
+
+    if (n->isleaf) {
+        if (!__atomic_compare_exchange_n(&c->leafdepth,&expected,it->depth,0,
+                __ATOMIC_RELAXED,__ATOMIC_RELAXED) && expected != it->depth)
+            btree_check_error(c,it->offset,"leaf at depth %d instead of %d",
+                              it->depth,expected);
+        return 0;
+    }
+    if (n->numkeys == 0) {
+        btree_check_error(c,it->offset,"empty internal node");
+        return 0;
+    }
+    if (it->depth+1 == BTREE_MAX_DEPTH) {
+        btree_check_error(c,it->offset,"btree too deep");
+        return 0;
+    }
+    return btree_check_add_children(w,it);
+}
+
+/* Check the 'count' nodes of the current batch. Returns -1 only on errors
+ * stopping the walk, like out of memory or I/O errors. */
+int btree_check_batch(struct btree_check_worker *w, int count) {
+    struct btree *bt = w->c->bt;
+    struct btree_vfs_read *r = NULL;
+    uint64_t start, end, total = 0;
+    int numreads = 0, j, k;
+    uint32_t v;
+
+    /* Merge the reads of nodes close to each other. Every read starts at
+     * the size header of the node. */
+    qsort(w->items,count,sizeof(w->items[0]),btree_check_item_cmp);
+    for (j = 0; j < count; j++) {
+        start = w->items[j].offset-sizeof(uint64_t);
+        end = w->items[j].offset+bt->nodesize;
+        if (r && start <= r->offset+r->nbytes+BTREE_CHECK_GAP &&
+            end-r->offset <= BTREE_CHECK_READ_SIZE)
+        {
+            if (end > r->offset+r->nbytes) {
+                total += end-(r->offset+r->nbytes);
+                r->nbytes = end-r->offset;
+            }
+            continue;
+        }
+        r = &w->reads[numreads++];
+        r->offset = start;
+        r->nbytes = end-start;
+        total += r->nbytes;
+    }
+    if (total > w->buflen) {
+        unsigned char *buf = realloc(w->buf,total);
+
+        if (buf == NULL) return -1;
+        w->buf = buf;
+        w->buflen = total;
+    }
+    for (total = 0, k = 0; k < numreads; k++) {
+        w->reads[k].buf = w->buf+total;
+        total += w->reads[k].nbytes;
+    }
+    btree_pread_batch(bt,w->reads,numreads);
+
+    w->numvreads = 0;
+    for (j = 0, k = 0; j < count; j++) {
+        struct btree_check_item *it = &w->items[j];
+
+        start = it->offset-sizeof(uint64_t);
+        while (start >= w->reads[k].offset+w->reads[k].nbytes) k++;
+        r = &w->reads[k];
+        if (r->nread == -1) {
+            errno = r->error;
+            return -1;
+        }
+        if (r->nread < (ssize_t)(start-r->offset+bt->nodesize+
+                                 sizeof(uint64_t)))
+        {
+            btree_check_error(w->c,it->offset,"node past the end of file");
+            continue;
+        }
+        if (btree_check_node(w,it,(unsigned char*)r->buf+(start-r->offset),
+                             r) == -1) return -1;
+    }
+
+    /* Now read the size headers of the other values. */
+    for (v = 0; v < w->numvreads; v++)
+        w->vreads[v].buf = w->vbuf+v*sizeof(uint64_t);
+    btree_pread_batch(bt,w->vreads,w->numvreads);
+    for (v = 0; v < w->numvreads; v++) {
+        r = &w->vreads[v];
+        if (r->nread == -1) {
+            errno = r->error;
+            return -1;
+        }
+        if (r->nread != sizeof(uint64_t)) {
+            btree_check_error(w->c,r->offset+sizeof(uint64_t),
+                              "value past the end of file");
+            continue;
+        }
+        w->used += btree_check_alloc(w->c,r->offset+sizeof(uint64_t),
+                                     btree_u64_from_big(r->buf),"value");
+    }
+    return 0;
+}
+
+/* Worker thread: check batches of nodes until the queue is empty and no
+ * other worker is adding nodes. */
+void *btree_check_thread(void *arg) {
+    struct btree_check_worker *w = arg;
+    struct btree_check *c = w->c;
+    int count, retval;
+
+    pthread_mutex_lock(&c->lock);
+    while (1) {
+        while (c->queuelen == 0 && c->busy && !c->error)
+            pthread_cond_wait(&c->cond,&c->lock);
+        if (c->queuelen == 0 || c->error) break;
+        count = c->queuelen < BTREE_CHECK_BATCH ? (int)c->queuelen :
+                                                  BTREE_CHECK_BATCH;
+        c->queuelen -= count;
+        memcpy(w->items,c->queue+c->queuelen,sizeof(w->items[0])*count);
+        c->busy++;
+        pthread_mutex_unlock(&c->lock);
+
+        w->numchildren = 0;
+        retval = btree_check_batch(w,count);
+
+        pthread_mutex_lock(&c->lock);
+        c->busy--;
+        if (retval == -1) {
+            if (!c->error) c->error = errno ? errno : EIO;
+        } else if (btree_check_push(c,w->children,w->numchildren) == -1) {
+            if (!c->error) c->error = ENOMEM;
+        }
+        pthread_cond_broadcast(&c->cond);
+    }
+    pthread_cond_broadcast(&c->cond);
+    pthread_mutex_unlock(&c->lock);
+    return NULL;
+}
+
+/* Mark the freelist blocks and the free chunks they contain. The first
+ * block of every power of two freelist is in the header. */
+int btree_check_freelists(struct btree_check *c) {
+    struct btree *bt = c->bt;
+    struct btree_check_report *r = c->report;
+    unsigned char buf[BTREE_FREELIST_BLOCK_SIZE];
+    uint64_t size, item, *items, numitems = 0;
+    uint32_t b, k;
+    int j;
+
+    for (j = 0; j < bt->numfreelists; j++) {
+        struct btree_freelist *fl = &bt->freelist[j];
+
+        for (b = 0; b < fl->numblocks; b++) {
+            if (b > 0 || j >= BTREE_FREELIST_COUNT) {
+                if (btree_pread_u64(bt,&size,fl->blocks[b]-sizeof(uint64_t))
+                    == -1) return -1;
+                r->used += btree_check_alloc(c,fl->blocks[b],size,
+                                             "freelist block");
+            }
+            if (bt->openflags & BTREE_MEMORY_FREELIST) continue;
+            if (btree_pread(bt,buf,sizeof(buf),fl->blocks[b]) == -1)
+                return -1;
+            numitems = btree_u64_from_big(buf+sizeof(uint64_t)*2);
+            if (numitems > BTREE_FREELIST_BLOCK_ITEMS) {
+                btree_check_error(c,fl->blocks[b],"freelist block with "
+                                  "invalid items count");
+                continue;
+            }
+            for (k = 0; k < numitems; k++) {
+                item = btree_u64_from_big(buf+sizeof(uint64_t)*(3+k));
+                if (btree_pread_u64(bt,&size,item) == -1) return -1;
+                r->free += btree_check_alloc(c,item+sizeof(uint64_t),size,
+                                             "free chunk");
+            }
+        }
+        if (!(bt->openflags & BTREE_MEMORY_FREELIST)) continue;
+        items = fl->items;
+        for (k = 0; k < fl->numitems; k++) {
+            if (btree_pread_u64(bt,&size,items[k]) == -1) return -1;
+            r->free += btree_check_alloc(c,items[k]+sizeof(uint64_t),size,
+                                         "free chunk");
+        }
+    }
+    return 0;
+}
+
+/* Put the space from 'start' to 'end' in the freelists, as chunks of power
+ * of two sizes aligned to their size, as btree_free_padding() does. */
+int btree_check_free_run(struct btree_check *c, uint64_t start, uint64_t end) {
+    struct btree *bt = c->bt;
+    uint64_t p, chunk;
+    int pass;
+
+    /* Write all the size headers first, then free the chunks. */
+    for (pass = 0; pass < 2; pass++) {
+        for (p = start; p < end; p += chunk) {
+            chunk = p & (~p+1);
+            if (chunk > BTREE_CHECK_MAX_CHUNK) chunk = BTREE_CHECK_MAX_CHUNK;
+            while (chunk > end-p) chunk /= 2;
+            if (chunk < 16) continue; /* Leaked, can't be allocated. */
+            if (pass == 0) {
+                if (btree_pwrite_u64(bt,chunk-sizeof(uint64_t),p) == -1)
+                    return -1;
+            } else {
+                if (btree_free(bt,p+sizeof(uint64_t)) == -1) return -1;
+                c->report->free += chunk;
+            }
+        }
+        if (pass == 0) btree_sync(bt);
+    }
+    return 0;
+}
+
+/* Replace the freelists with the space not set in the bitmap. */
+int btree_check_rebuild(struct btree_check *c) {
+    struct btree *bt = c->bt;
+    uint64_t blocks = bt->freeoff/c->align, b, end;
+    int j;
+
+    /* Empty the freelists, on disk and then in memory. */
+    if (btree_drop_fldir(bt) == -1) return -1;
+    if (bt->classes && btree_clear_class_table(bt,bt->classes) == -1)
+        return -1;
+    for (j = 0; j < bt->numfreelists; j++) {
+        struct btree_freelist *fl = &bt->freelist[j];
+        uint64_t off = 32+BTREE_FREELIST_BLOCK_SIZE*j;
+
+        if (j < BTREE_FREELIST_COUNT &&
+            (btree_pwrite_u64(bt,0,off+sizeof(uint64_t)) == -1 ||
+             btree_pwrite_u64(bt,0,off+sizeof(uint64_t)*2) == -1)) return -1;
+        free(fl->blocks);
+        fl->blocks = NULL;
+        fl->numblocks = 0;
+        fl->last_items = 0;
+        fl->numitems = 0;
+    }
+    btree_sync(bt);
+    if (btree_read_freelists(bt) == -1) return -1;
+
+    c->report->free = 0;
+    for (b = btree_check_find(c,0,0); b < blocks; b = btree_check_find(c,end,0)) {
+        end = btree_check_find(c,b,1);
+        if (btree_check_free_run(c,b*c->align,end*c->align) == -1)
+            return -1;
+    }
+    if ((bt->openflags & BTREE_MEMORY_FREELIST) && btree_checkpoint(bt) == -1)
+        return -1;
+    /* The new freelist blocks may be taken from the end of the file. */
+    c->report->used += bt->freeoff-blocks*c->align;
+    return 0;
+}
+
+/* Check the whole btree using 'threads' threads, filling 'report'. With the
+ * BTREE_CHECK_REPAIR flag the freelists are rebuilt with all the space that
+ * is not used, fixing leaks and corrupted freelists, but only if the tree
+ * itself has no errors.
+ *
+ * Returns 0 if no corruption was found. Otherwise -1 is returned with errno
+ * set to EFAULT, and report->errors is the number of corruptions found, or
+ * with errno set accordingly on other errors: EBUSY if a transaction or a
+ * snapshot is in progress. The btree must not be modified by others during
+ * the check. */
+int btree_check(struct btree *bt, int threads, int flags,
+                struct btree_check_report *report)
+{
+    struct btree_check c;
+    struct btree_check_worker *workers = NULL;
+    struct btree_check_item root;
+    uint64_t used;
+    int j, started = 0, retval = -1;
+
+    memset(report,0,sizeof(*report));
+    if (bt->txn != BTREE_TXN_NONE || bt->snap_head) {
+        errno = EBUSY;
+        return -1;
+    }
+    /* The workers read the file at the same time. */
+    if (btree_wbuf_flush(bt) == -1) return -1;
+    if (threads < 1) threads = 1;
+    memset(&c,0,sizeof(c));
+    c.bt = bt;
+    c.report = report;
+    c.leafdepth = -1;
+    pthread_mutex_init(&c.lock,NULL);
+    pthread_cond_init(&c.cond,NULL);
+    if (btree_check_layout(&c) == -1) goto cleanup;
+    if ((c.bitmap = calloc((bt->freeoff/c.align+63)/64,sizeof(uint64_t)))
+        == NULL ||
+        (workers = calloc(threads,sizeof(*workers))) == NULL) goto cleanup;
+    for (j = 0; j < threads; j++) {
+        workers[j].c = &c;
+        if ((workers[j].node = btree_new_node(bt)) == NULL) goto cleanup;
+    }
+
+    /* The header is always used. */
+    btree_check_mark(&c,0,c.hdrsize);
+    report->used = c.hdrsize;
+    memset(&root,0,sizeof(root));
+    root.offset = bt->rootptr;
+    if (!btree_check_valid_ptr(&c,bt->rootptr,bt->nodesize)) {
+        btree_check_error(&c,bt->rootptr,"root out of range");
+    } else if (btree_check_push(&c,&root,1) == -1) {
+        goto cleanup;
+    }
+
+    /* The calling thread is a worker as well. */
+    for (j = 1; j < threads; j++) {
+        if (pthread_create(&workers[j].thread,NULL,btree_check_thread,
+                           &workers[j]) != 0) break;
+        started++;
+    }
+    btree_check_thread(&workers[0]);
+    for (j = 1; j <= started; j++) pthread_join(workers[j].thread,NULL);
+    if (c.error) {
+        errno = c.error;
+        goto cleanup;
+    }
+    for (j = 0; j < threads; j++) {
+        report->nodes += workers[j].nodes;
+        report->keys += workers[j].keys;
+        report->used += workers[j].used;
+    }
+    if (bt->classes) {
+        uint64_t size;
+
+        if (btree_pread_u64(bt,&size,bt->classes-sizeof(uint64_t)) == -1)
+            goto cleanup;
+        report->used += btree_check_alloc(&c,bt->classes,size,"class table");
+    }
+    if (bt->bloomoff) {
+        uint32_t size;
+
+        if (btree_alloc_size(bt,&size,bt->bloomoff) == -1) goto cleanup;
+        report->used += btree_check_alloc(&c,bt->bloomoff,size,
+                                          "bloom filter");
+    }
+
+    if (flags & BTREE_CHECK_REPAIR) {
+        if (report->errors) {
+            errno = EFAULT;
+            goto cleanup;
+        }
+        if (btree_check_rebuild(&c) == -1) goto cleanup;
+    } else if (btree_check_freelists(&c) == -1) {
+        goto cleanup;
+    }
+    used = report->used+report->free;
+    report->leaked = bt->freeoff > used ? bt->freeoff-used : 0;
+    if (report->errors) {
+        errno = EFAULT;
+        goto cleanup;
+    }
+    retval = 0;
+
+cleanup:
+    if (workers) {
+        for (j = 0; j < threads; j++) {
+            btree_free_node(workers[j].node);
+            free(workers[j].buf);
+            free(workers[j].children);
+            free(workers[j].vreads);
+            free(workers[j].vbuf);
+        }
+    }
+    free(workers);
+    free(c.queue);
+    free(c.bitmap);
+    pthread_mutex_destroy(&c.lock);
+    pthread_cond_destroy(&c.cond);
+    return retval;
 }
 
 /* Just a debugging function to check what's inside the whole btree... */
@@ -1000,19 +8937,21 @@ void btree_walk_rec(struct btree *bt, uint64_t nodeptr, int level) {
     for (j = 0; j < n->numkeys; j++) {
         char *data;
         uint32_t datalen;
+        uint64_t voff;
         int k;
 
         if (n->children[j] != 0) {
             btree_walk_rec(bt,n->children[j],level+1);
         }
         for (k = 0; k < level; k++) printf(" ");
-        printf("(@%llu) Key %20s: ", nodeptr, n->keys+(j*BTREE_HASHED_KEY_LEN));
-        btree_alloc_size(bt,&datalen,n->values[j]);
+        printf("(@%llu) Key %20s: ", nodeptr, n->keys+(j*n->keylen));
+        voff = btree_node_voff(bt,n,nodeptr,j);
+        btree_alloc_size(bt,&datalen,voff);
         data = malloc(datalen+1);
-        btree_pread(bt,data,datalen,n->values[j]);
+        btree_pread(bt,data,datalen,voff);
         data[datalen] = '\0';
         printf("@%llu    %lu bytes: %s\n",
-            n->values[j],
+            voff,
             (unsigned long)datalen, data);
         free(data);
     }
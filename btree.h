@@ -29,15 +29,32 @@
 
 #include <stdint.h>
 #include <sys/types.h>
+#include <pthread.h>
 
 #define BTREE_CREAT 1
+#define BTREE_MEMORY_FREELIST 2
+#define BTREE_CONCURRENT 4
+#define BTREE_APPEND_ONLY 8
 
-#define BTREE_PREALLOC_SIZE (1024*512)
+#define BTREE_PREALLOC_SIZE (1024*512) /* Min bytes the file grows by */
+#define BTREE_PREALLOC_MAX (1024*1024*64) /* Max bytes the file grows by */
+#define BTREE_PREALLOC_RATIO 4 /* The file grows by 1/RATIO of its size */
 #define BTREE_FREELIST_BLOCK_ITEMS 252
 #define BTREE_MIN_KEYS 4
-//#define BTREE_MAX_KEYS 255
-#define BTREE_MAX_KEYS 7
+#define BTREE_LEGACY_MAX_KEYS 7 /* Keys per node of btrees without node size */
 #define BTREE_HASHED_KEY_LEN 16
+#define BTREE_MAX_KEY_LEN 256 /* Max key_size of prefix compressed nodes */
+#define BTREE_MAX_DEPTH 64 /* Levels, more than enough for 2^64 keys */
+
+/* Key types. Integer keys are stored big endian, with the sign bit flipped
+ * for signed keys, so that their order is the same of memcmp(): use
+ * btree_key_from_u128() and the other conversion functions. */
+#define BTREE_KEY_BINARY 0 /* BTREE_HASHED_KEY_LEN bytes compared by memcmp() */
+#define BTREE_KEY_U128 1 /* Unsigned 128 bit integers */
+#define BTREE_KEY_I128 2 /* Signed 128 bit integers */
+
+typedef unsigned __int128 btree_u128;
+typedef __int128 btree_i128;
 
 /* We have free lists for the following sizes:
  * 16 32 64 128 256 512 1024 2048 4096 8192 16k 32k 64k 128k 256k 512k 1M 2M 4M 8M 16M 32M 64M 128M 256M 512M 1G 2G */
@@ -48,23 +65,118 @@
 #define BTREE_FREELIST_BLOCK_SIZE ((8*3)+(8*BTREE_FREELIST_BLOCK_ITEMS))
 #define BTREE_FREELIST_SIZE_EXP 11   /* 2^11 = 2048 */
 
+/* Btrees created with size classes (see struct btree_config) have three
+ * more chunk sizes between every two powers of two from 64 bytes on, in
+ * steps of a quarter of the smaller power: 80 96 112 128 160 192 224 256...
+ * so that a 600 bytes value uses a 640 bytes chunk instead of 1024 bytes.
+ * Classes are multiples of 16 so that the padding before page aligned
+ * chunks can always be split into powers of two. Every class has its own
+ * free list, after the power of two ones, whose first block is allocated
+ * on demand and referenced by the class table. */
+#define BTREE_CLASS_STEPS 4     /* Steps between two powers of two */
+#define BTREE_CLASS_MIN_EXP 6   /* Classes start after 2^6 = 64 */
+#define BTREE_CLASS_COUNT ((31-BTREE_CLASS_MIN_EXP)*(BTREE_CLASS_STEPS-1))
+#define BTREE_MAX_FREELISTS (BTREE_FREELIST_COUNT+BTREE_CLASS_COUNT)
+
 /* A node is composed of:
  * one count (startmark),
  * one count (numkeys),
  * one count (isleaf),
- * BTREE_MAX_KEYS keys (16 bytes for each key, as our keys are fixed size),
- * BTREE_MAX_KEYS pointers to values,
- * BTREE_MAX_KEYS+1 child pointers,
+ * maxkeys keys (16 bytes for each key, as our keys are fixed size),
+ * maxkeys pointers to values,
+ * maxkeys+1 child pointers,
  * and a final count(endmark) */
-#define BTREE_NODE_SIZE (4*4+BTREE_MAX_KEYS*BTREE_HASHED_KEY_LEN+((BTREE_MAX_KEYS*2)+1)*8+4)
+#define BTREE_NODE_SIZE(maxkeys) (4*4+(maxkeys)*BTREE_HASHED_KEY_LEN+(((maxkeys)*2)+1)*8+4)
+
+/* Btrees created with a key size (see struct btree_config) use prefix
+ * compressed nodes, where the arrays only take the space of the keys in
+ * use, so that the number of keys of a node depends on how many bytes its
+ * keys take, and not on a fixed maximum:
+ *
+ * start mark, numkeys, isleaf, prefix length (4 bytes each),
+ * numkeys value pointers, numkeys+1 child pointers,
+ * numkeys inline slots (if inline values are used),
+ * numkeys 2 bytes end offsets of the key suffixes,
+ * the prefix shared by all the keys of the node,
+ * the suffixes of the keys, without their trailing zero bytes,
+ * and the end mark as the last 4 bytes of the node.
+ *
+ * So a node holds BTREE_PNODE_FIXED bytes, the prefix, and for every key
+ * BTREE_PNODE_KEY_SIZE(inlinelen) bytes plus its suffix. */
+#define BTREE_PNODE_FIXED (4*4+8+4)
+#define BTREE_PNODE_KEY_SIZE(inlinelen) (8+8+2+((inlinelen) ? (inlinelen)+8 : 0))
+#define BTREE_PNODE_MIN_KEYS 8 /* Worst case keys, of key_size bytes, per node */
+
+/* The number of keys per node is a property of every btree, derived from
+ * the node size specified at creation: the size of the allocation holding
+ * the node (including the allocator size header), a power of two. The max
+ * number of keys is always odd, as required to split full nodes. */
+#define BTREE_DEFAULT_NODE_SIZE 4096
+#define BTREE_MIN_NODE_SIZE 512
+#define BTREE_MAX_NODE_SIZE (1024*64)
+#define BTREE_PAGE_SIZE 4096    /* Big allocations are aligned to pages */
+
+/* Values up to a given size, selected when the btree is created, can be
+ * stored inline in the nodes: every key slot has an inline area with an 8
+ * bytes size header followed by the value bytes. The value pointer of an
+ * inline value has the BTREE_VALUE_INLINE bit set, and its length in the
+ * low bits. */
+#define BTREE_MAX_INLINE 256
+#define BTREE_VALUE_INLINE (1ULL<<63)
+#define BTREE_VALUE_IS_INLINE(v) ((v) & BTREE_VALUE_INLINE)
+#define BTREE_VALUE_INLINE_LEN(v) ((uint32_t)((v) & 0xffffffff))
+
+/* Versions of the on disk format, the number after the "REDBTREE" magic at
+ * the start of the header. In version 2 the integers of the nodes (marks,
+ * counts, value and child pointers) are little endian, so that on little
+ * endian hosts the nodes of btrees that are not prefix compressed are
+ * searched in place, in the mapped file or in the read buffer, without
+ * decoding them. Everything else, including the size headers of inline
+ * values, is big endian in both versions. */
+#define BTREE_VERSION_1 0       /* "REDBTREE00000000", big endian nodes */
+#define BTREE_VERSION_2 2       /* "REDBTREE00000002", little endian nodes */
 
 /* Offsets inside the file of the 'free' and 'freeoff' fields */
 #define BTREE_HDR_FREE_POS 16
 #define BTREE_HDR_FREEOFF_POS 24
 #define BTREE_HDR_ROOTPTR_POS (32+(BTREE_FREELIST_BLOCK_SIZE*BTREE_FREELIST_COUNT))
+/* Fields following the root pointer. The header is BTREE_HDR_SIZE bytes,
+ * and unused fields are zero. */
+#define BTREE_HDR_STATE_POS (BTREE_HDR_ROOTPTR_POS+8)
+#define BTREE_HDR_NODEKEYS_POS (BTREE_HDR_ROOTPTR_POS+16)
+#define BTREE_HDR_NODESIZE_POS (BTREE_HDR_ROOTPTR_POS+24)
+#define BTREE_HDR_INLINE_POS (BTREE_HDR_ROOTPTR_POS+32)
+#define BTREE_HDR_FLDIR_POS (BTREE_HDR_ROOTPTR_POS+40)
+#define BTREE_HDR_CLASSES_POS (BTREE_HDR_ROOTPTR_POS+48)
+#define BTREE_HDR_KEYLEN_POS (BTREE_HDR_ROOTPTR_POS+56)
+#define BTREE_HDR_KEYTYPE_POS (BTREE_HDR_ROOTPTR_POS+64)
+#define BTREE_HDR_BLOOM_POS (BTREE_HDR_ROOTPTR_POS+72)
+#define BTREE_HDR_SIZE (BTREE_HDR_ROOTPTR_POS+256)
+
+/* Values of the state field */
+#define BTREE_STATE_CLEAN 0     /* Freelists and free space info on disk are ok */
+#define BTREE_STATE_DIRTY 1     /* In memory freelists not yet checkpointed */
 
 /* ------------------------------ VFS Layer --------------------------------- */
 
+/* A read of a batch, see the readv method of the VFS. */
+struct btree_vfs_read {
+    void *buf;
+    uint32_t nbytes;
+    uint64_t offset;
+    ssize_t nread;          /* Set by the VFS: bytes read, or -1 on error */
+    int error;              /* Set by the VFS: errno of the failed read */
+};
+
+/* A write of a batch, see the writev method of the VFS. */
+struct btree_vfs_write {
+    const void *buf;
+    uint32_t nbytes;
+    uint64_t offset;
+    ssize_t nwritten;       /* Set by the VFS: bytes written, or -1 */
+    int error;              /* Set by the VFS: errno of the failed write */
+};
+
 struct btree_vfs {
     void *(*open) (char *path, int flags);
     void (*close) (void *vfs_handle);
@@ -75,9 +187,33 @@ struct btree_vfs {
     int (*resize) (void *vfs_handle, uint64_t length);
     int (*getsize) (void *vfs_handle, uint64_t *size);
     void (*sync) (void *vfs_handle);
+    /* Optional: return a pointer to 'nbytes' at 'offset' that can be
+     * accessed in place, or NULL if this is not possible. May be NULL. */
+    void *(*mapptr) (void *vfs_handle, uint64_t offset, uint32_t nbytes);
+    /* Optional: hint that the specified range will be read soon.
+     * May be NULL. */
+    void (*prefetch) (void *vfs_handle, uint64_t offset, uint64_t len);
+    /* Optional: perform all the 'count' reads, that may be in flight at
+     * the same time. Every read has its result set even if others fail.
+     * May be NULL, in this case the reads are performed one after the
+     * other with pread(). */
+    void (*readv) (void *vfs_handle, struct btree_vfs_read *reads,
+                   int count);
+    /* Optional: perform all the 'count' writes, to ranges that don't
+     * overlap, in any order. Every write has its result set even if others
+     * fail. May be NULL, in this case pwrite() is used for every write. */
+    void (*writev) (void *vfs_handle, struct btree_vfs_write *writes,
+                    int count);
+    /* Optional: enlarge the file, 'offset' bytes long, by 'len' bytes,
+     * reserving the disk blocks of the new space so that the file is not
+     * sparse. May be NULL, in this case resize() is used. May be called
+     * by the background grow thread concurrently with reads and writes. */
+    int (*allocate) (void *vfs_handle, uint64_t offset, uint64_t len);
 };
 
 extern struct btree_vfs bvfs_unistd;
+extern struct btree_vfs bvfs_mmap;
+extern struct btree_vfs bvfs_uring;
 
 /* ------------------------------ ALLOCATOR --------------------------------- */
 
@@ -86,6 +222,200 @@ struct btree_freelist {
     uint64_t *blocks;       /* blocks offsets. last is block[numblocks-1] */
     uint32_t last_items;    /* number of items in the last block */
     uint64_t last_block[BTREE_FREELIST_BLOCK_ITEMS];  /* last block cached */
+    /* When BTREE_MEMORY_FREELIST is used, all the items are taken here,
+     * and only written inside the blocks on checkpoint. */
+    uint64_t *items;        /* All the items in this freelist */
+    uint32_t numitems;      /* Number of items */
+    uint32_t maxitems;      /* Number of items we have space for */
+};
+
+/* ------------------------------ NODE CACHE -------------------------------- */
+
+#define BTREE_CACHE_DEFAULT_NODES 1024
+#define BTREE_CACHE_SHARDS 16   /* Shards of the cache with BTREE_CONCURRENT */
+#define BTREE_CACHE_KEYS_STEP 16 /* Capacity of cached nodes, see btree_cache_fit() */
+
+struct btree_node;
+
+/* The node cache is a table of decoded nodes keyed by their offset on disk.
+ * Eviction uses the CLOCK algorithm: every entry has a reference bit that is
+ * set on hit and cleared by the hand while searching for a victim. */
+struct btree_cache_entry {
+    uint64_t offset;        /* Offset of the cached node, 0 if slot is free */
+    int next;               /* Next entry in the same hash bucket, or -1 */
+    int referenced;         /* CLOCK reference bit */
+    struct btree_node *node;/* Decoded node */
+};
+
+struct btree_cache_shard {
+    pthread_mutex_t lock;   /* Only used if the cache is locking */
+    uint32_t size;          /* Number of entries */
+    uint32_t hand;          /* CLOCK hand */
+    uint32_t mask;          /* Number of buckets minus one */
+    int *buckets;           /* Heads of the hash chains, -1 if empty */
+    struct btree_cache_entry *entries;
+    uint64_t hits, misses;  /* Lookups of btree_cache_get(), see btree_stats */
+};
+
+/* Nodes are distributed among the shards by offset. */
+struct btree_cache {
+    uint32_t numshards;     /* Number of shards, a power of two */
+    int locking;            /* Shards are accessed by multiple threads */
+    struct btree_cache_shard *shards;
+};
+
+/* ------------------------------ VALUE CACHE ------------------------------- */
+
+#define BTREE_VCACHE_SMALL 0    /* Queue of the entries just added */
+#define BTREE_VCACHE_MAIN 1     /* Queue of the entries hit while small */
+#define BTREE_VCACHE_SMALL_PCT 10 /* Budget of the small queue */
+
+/* The value cache maps keys to their values, see btree_vcache_get().
+ * Eviction uses S3-FIFO: new entries go in the small queue, and only the
+ * ones hit before leaving it are moved to the main queue, so keys read a
+ * single time don't evict the hot ones. */
+struct btree_vcache_entry {
+    struct btree_vcache_entry *hnext; /* Next entry in the same bucket */
+    struct btree_vcache_entry *prev, *next; /* Queue, from the newest */
+    uint64_t hash;
+    uint32_t vlen;
+    uint8_t freq;           /* Hits in the current queue, up to 3 */
+    uint8_t queue;          /* BTREE_VCACHE_SMALL or BTREE_VCACHE_MAIN */
+    unsigned char *data;    /* Key followed by the value */
+};
+
+struct btree_vcache_queue {
+    struct btree_vcache_entry *head, *tail; /* Newest, oldest */
+    uint64_t bytes;
+};
+
+struct btree_vcache_shard {
+    pthread_mutex_t lock;   /* Only used if the cache is locking */
+    uint64_t budget;        /* Max bytes of the entries of the shard */
+    struct btree_vcache_queue queue[2];
+    struct btree_vcache_entry **buckets;
+    uint32_t mask;          /* Number of buckets minus one */
+    uint32_t count;         /* Number of entries */
+    uint64_t *ghosts;       /* Hashes of keys evicted from the small queue,
+                               zero if the slot is empty. */
+    uint32_t ghostmask;
+    uint64_t hits, misses;  /* Lookups of btree_vcache_get() */
+};
+
+/* Keys are distributed among the shards by hash. */
+struct btree_vcache {
+    uint32_t numshards;     /* Number of shards, a power of two */
+    int locking;            /* Shards are accessed by multiple threads */
+    uint32_t keylen;
+    struct btree_vcache_shard *shards;
+    /* With BTREE_CONCURRENT keys are evicted only after the change is
+     * committed, see btree_vcache_del(). */
+    unsigned char *pending; /* Keys to evict on commit */
+    uint32_t numpending;
+    uint32_t maxpending;
+    int pending_clear;      /* Evict everything on commit */
+};
+
+/* ----------------------------- WRITE BUFFER ------------------------------- */
+
+/* Writes are not performed when btree_pwrite() is called, but collected in
+ * the write buffer, merging adjacent and overlapping writes, and performed
+ * together at the next write barrier, or when the operation returns if
+ * write barriers are disabled (see btree_sync()), so that the many
+ * small writes of an operation, like the size header of an allocation and
+ * the node written into it, don't take a system call each. Reads see the
+ * data in the buffer. The buffer is not used with VFSs able to map the
+ * file, as mapped data is read in place, nor with BTREE_CONCURRENT, as
+ * readers in other threads would need to look into it. */
+#define BTREE_WBUF_SIZE (1024*256)  /* Bytes of the buffer */
+#define BTREE_WBUF_RANGES 128       /* Max writes to perform at once */
+
+/* A range of the file to write, with its data in the buffer. Ranges are
+ * sorted by offset and never overlap or touch each other. */
+struct btree_wbuf_range {
+    uint64_t offset;
+    uint32_t len;
+    uint32_t pos;           /* Offset of the data inside the buffer */
+    uint32_t epoch;         /* Barriers deferred before the write */
+};
+
+struct btree_wbuf {
+    int enabled;
+    unsigned char *buf;     /* BTREE_WBUF_SIZE bytes, allocated on demand */
+    uint32_t used;          /* Bytes used in 'buf', ranges that were merged
+                               into others may leave holes. */
+    uint32_t numranges;
+    struct btree_wbuf_range ranges[BTREE_WBUF_RANGES];
+    int error;              /* errno of a failed flush, see btree_pwrite() */
+    int depth;              /* Nesting of btree_op_enter() calls */
+    uint32_t epoch;         /* Barriers deferred since the last flush */
+};
+
+/* With the grow_background option the file is enlarged ahead of time by a
+ * thread, as soon as the free space at the end of the file drops below half
+ * of the next growth, so that allocations don't wait for the file system.
+ * The writer posts one request at a time, and adopts the new space when the
+ * request is done. The thread is only used with VFSs that can't map the
+ * file, as remapping it would race with the accesses of the writer. */
+struct btree_grower {
+    int enabled;
+    int started;            /* The thread was created */
+    int requested;          /* A request was posted and not yet adopted.
+                               Only accessed by the writer. */
+    pthread_t thread;
+    pthread_mutex_t lock;   /* Protects the fields below */
+    pthread_cond_t cond;
+    int stop;
+    void *handle;           /* VFS handle of the pending request */
+    uint64_t offset, len;   /* Pending request, 'len' is zero if none */
+    uint64_t size;          /* File size after the last request, zero if
+                               the request failed. */
+};
+
+/* Bloom filter of the keys, see btree_bloom_add(). Every key sets one bit
+ * in every word of a block of BTREE_BLOOM_WORDS words, so a lookup touches
+ * a single cache line. */
+#define BTREE_BLOOM_WORDS 8
+#define BTREE_BLOOM_MIN_KEYS 4096   /* Keys of the smallest filter */
+#define BTREE_BLOOM_MAX_BITS 64     /* Max bits per key */
+#define BTREE_BLOOM_MAX_BLOCKS ((1<<30)/(BTREE_BLOOM_WORDS*8)) /* 1GB */
+
+struct btree_bloom {
+    uint64_t numblocks;
+    uint64_t keys;          /* Keys added, deleted keys are not removed */
+    uint64_t capacity;      /* Keys the filter was sized for */
+    uint64_t *words;        /* numblocks*BTREE_BLOOM_WORDS words */
+    struct btree_bloom *retired; /* Replaced filters that concurrent readers
+                                    may still use, freed on close. */
+};
+
+/* -------------------------------- STATS ----------------------------------- */
+
+/* Counters returned by btree_get_stats(), since the btree was opened.
+ * Allocations and frees are counted by chunk size, using the index of the
+ * free list of the chunks: 16 bytes, 32 bytes, ... up to 2GB, and then the
+ * size classes if the btree uses them. */
+struct btree_stats {
+    uint64_t node_reads;    /* Nodes read from disk, that is, not cached */
+    uint64_t node_writes;
+    uint64_t bytes_read;    /* Read with pread(), mapped files are accessed
+                               in place without reads. */
+    uint64_t bytes_written;
+    uint64_t writes;        /* Writes performed, after merging them in the
+                               write buffer. */
+    uint64_t fsyncs;
+    uint64_t cache_hits;    /* Node cache lookups */
+    uint64_t cache_misses;
+    uint64_t bloom_negatives; /* Lookups answered by the Bloom filter */
+    uint64_t value_cache_hits; /* btree_get() lookups of the value cache */
+    uint64_t value_cache_misses;
+    uint64_t file_grows;    /* Times the file was enlarged */
+    uint64_t file_grow_bytes;
+    uint64_t file_grows_background; /* Done ahead of time, see btree_grower */
+    uint64_t freelist_blocks_added;
+    uint64_t freelist_blocks_removed;
+    uint64_t allocs[BTREE_MAX_FREELISTS];
+    uint64_t frees[BTREE_MAX_FREELISTS];
 };
 
 /* -------------------------------- BTREE ----------------------------------- */
@@ -93,14 +423,61 @@ struct btree_freelist {
 #define BTREE_FLAG_NOFLAG 0
 #define BTREE_FLAG_USE_WRITE_BARRIER 1
 
+/* Transaction states */
+#define BTREE_TXN_NONE 0        /* No transaction in progress */
+#define BTREE_TXN_ACTIVE 1      /* Collecting changes */
+#define BTREE_TXN_COMMITTING 2  /* Releasing space after the root pointer flip */
+
+/* A set of offsets, implemented as an open addressing hash table. */
+struct btree_offset_set {
+    uint64_t *table;        /* Slots, zero means empty */
+    uint32_t size;          /* Number of slots, a power of two */
+    uint32_t used;          /* Number of offsets in the set */
+};
+
+/* A snapshot pins the root of the btree at the time it was acquired, so
+ * that readers see a consistent state while the btree keeps changing.
+ * Snapshots are kept in a list, ordered by epoch. */
+struct btree_snapshot {
+    struct btree *bt;
+    uint64_t rootptr;       /* Root of the snapshot */
+    uint64_t epoch;         /* Sequence number of the snapshot */
+    struct btree_snapshot *prev, *next;
+};
+
+/* Readers running in other threads announce themselves in one of these
+ * slots, counting the readers that entered in even and odd epochs. Every
+ * slot takes a cache line, so that readers in different slots don't
+ * contend. See btree_reader_enter() for more information.
+ *
+ * The slots also hold the read counters of btree_stats, as reads can be
+ * performed by many threads at the same time: every thread counts in the
+ * slot it uses as a reader. */
+#define BTREE_READER_SLOTS 64
+
+struct btree_reader_slot {
+    uint64_t active[2];
+    uint64_t node_reads;
+    uint64_t bytes_read;
+    uint64_t bloom_negatives;
+    uint64_t pad[3];
+};
+
 /* This is our btree object, returned to the client when the btree is
  * opened, and used as first argument for all the btree API. */
+struct btree_compact;
+
 struct btree {
     struct btree_vfs *vfs;  /* Our VFS API */
     void *vfs_handle;       /* The open VFS resource */
-    /* Our free lists, from 4 bytes to 4 gigabytes, so freelist[0] is for
-     * size 4, and freelist[BTREE_FREELIST_COUNT-1] is for 4GB. */
-    struct btree_freelist freelist[BTREE_FREELIST_COUNT];
+    char *path;             /* Path of the btree, as passed to open */
+    /* Our free lists, from 16 bytes to 2 gigabytes, so freelist[0] is for
+     * size 16, and freelist[BTREE_FREELIST_COUNT-1] is for 2GB. With size
+     * classes the free lists of the classes follow. */
+    struct btree_freelist freelist[BTREE_MAX_FREELISTS];
+    int numfreelists;       /* Free lists used by this btree */
+    uint64_t classes;       /* Offset of the class table, 0 if size classes
+                               are not used. */
     /* We pre-allocate free space at the end of the file, as a room for
      * the allocator. Amount and location of free space is handled
      * by the following fields: */
@@ -109,7 +486,94 @@ struct btree {
     uint64_t rootptr;       /* Root node pointer */
     uint32_t mark;          /* This incremental number is used for
                                nodes start/end mark to detect corruptions. */
+    uint32_t maxkeys;       /* Max number of keys per node */
+    uint32_t nodesize;      /* Bytes of a node on disk */
+    uint32_t inlinelen;     /* Max size of inline values, 0 if disabled */
+    uint32_t keylen;        /* Bytes of a key */
+    int prefixed;           /* Nodes are prefix compressed, see
+                               BTREE_PNODE_FIXED. */
+    uint32_t keytype;       /* BTREE_KEY_* */
+    uint32_t version;       /* BTREE_VERSION_* of the file */
+    uint32_t readsize;      /* Bytes read speculatively to get a value */
+    uint32_t minkeys;       /* Nodes with less keys are merged on delete */
+    uint64_t garbage;       /* Bytes freed since open in append only mode */
+    unsigned char *nodebuf; /* Buffer used to encode / decode nodes */
     int flags;              /* BTREE_FLAG_* */
+    int openflags;          /* Flags passed to btree_open(): BTREE_CREAT, ... */
+    int dirty;              /* Disk state is BTREE_STATE_DIRTY. */
+    uint64_t fldir;         /* Freelist directory offset in the header, or
+                               0 if there is none. See btree_read_fldir(). */
+    int loaded;             /* Metadata and freelists were read. */
+    struct btree_cache *cache; /* Decoded nodes cache, NULL if disabled */
+    struct btree_vcache *vcache; /* Value cache, NULL if disabled */
+    /* Transactions. See btree_begin() for more information. */
+    int txn;                /* BTREE_TXN_* state */
+    int txn_user;           /* A btree_begin() was not yet committed */
+    uint64_t txn_rootptr;   /* Root pointer of the last committed state */
+    struct btree_offset_set txn_fresh; /* Allocations of this transaction */
+    uint64_t *txn_frees;    /* Frees deferred at commit time */
+    uint32_t txn_numfrees;
+    uint32_t txn_maxfrees;
+    /* Group commit: commits are merged into the transaction in progress
+     * until gc_maxops commits or gc_maxusec microseconds are reached. */
+    uint32_t gc_maxops;     /* 0 or 1 means group commit disabled */
+    uint64_t gc_maxusec;
+    uint32_t gc_ops;        /* Commits merged into the current transaction */
+    uint64_t gc_start;      /* Start time of the current transaction */
+    /* Snapshots. Space freed while snapshots exist is released only when
+     * all the snapshots that may see it are released. */
+    struct btree_snapshot *snap_head, *snap_tail; /* Oldest, newest */
+    uint64_t snap_epoch;    /* Epoch of the newest snapshot acquired */
+    uint64_t *snap_frees;   /* Offset, snapshot and reader epochs of frees */
+    uint32_t snap_numfrees;
+    uint32_t snap_maxfrees;
+    int snap_releasing;     /* Releasing space of old snapshots */
+    pthread_mutex_t snap_lock; /* Protects the snapshots list and epoch */
+    /* Concurrent readers. With BTREE_CONCURRENT lookups from other threads
+     * read the last committed root, and the space they may be reading is
+     * released only when they are done. */
+    uint64_t pubroot;       /* Last committed root, published atomically */
+    uint64_t read_epoch;    /* Current readers epoch */
+    uint64_t read_safe;     /* No reader is left in epochs up to this one */
+    struct btree_reader_slot readers[BTREE_READER_SLOTS];
+    struct btree_compact *compact; /* Compaction in progress, or NULL */
+    struct btree_stats stats; /* Counters of the writer. Read counters are
+                                 in the reader slots and in the cache. */
+    struct btree_wbuf wbuf; /* Writes not yet performed */
+    struct btree_grower grower; /* Background file growth */
+    struct btree_bloom *bloom; /* Filter of the keys, NULL if disabled */
+    uint32_t bloombits;     /* Bits per key of the filter, 0 if disabled */
+    uint64_t bloomoff;      /* Filter on disk referenced by the header, or 0
+                               if there is none. See btree_write_bloom(). */
+};
+
+/* Options that can only be specified when the btree is opened. Initialize
+ * the structure with btree_config_init() and then change what you need. */
+struct btree_config {
+    uint32_t cache_nodes;   /* Max nodes in the node cache, 0 to disable. */
+    uint64_t value_cache_size; /* Bytes of the cache of the values read by
+                                  btree_get(), 0 to disable. */
+    uint32_t node_size;     /* Node size of new btrees, 0 for the legacy
+                               BTREE_LEGACY_MAX_KEYS keys nodes. */
+    uint32_t inline_values; /* Values up to this size are stored inside the
+                               nodes of new btrees (up to BTREE_MAX_INLINE),
+                               0 to disable. Needs a node size. */
+    uint32_t value_read_size; /* Bytes read at once to fetch a value. */
+    uint32_t size_classes;  /* If true new btrees use finer chunk sizes, see
+                               BTREE_CLASS_STEPS, reducing the space wasted
+                               rounding values to powers of two. */
+    uint32_t key_size;      /* If not zero new btrees have keys of this size
+                               (up to BTREE_MAX_KEY_LEN), stored in prefix
+                               compressed nodes. Needs a node size. */
+    uint32_t key_type;      /* BTREE_KEY_* type of the keys of new btrees.
+                               Integer keys can't have a key size. */
+    uint32_t version;       /* BTREE_VERSION_* format of new btrees. */
+    uint32_t grow_background; /* If true the file is enlarged ahead of time
+                                 by a thread, see btree_grower. */
+    uint32_t bloom_bits;    /* Bits per key of a Bloom filter of the keys
+                               (up to BTREE_BLOOM_MAX_BITS), taken in memory
+                               so that most lookups of missing keys need no
+                               reads, 0 to disable. */
 };
 
 /* In memory representation of a btree node. We manipulate this in memory
@@ -119,25 +583,190 @@ struct btree {
 struct btree_node {
     uint32_t numkeys;
     uint32_t isleaf;
-    char keys[BTREE_HASHED_KEY_LEN*BTREE_MAX_KEYS];
-    uint64_t values[BTREE_MAX_KEYS];
-    uint64_t children[BTREE_MAX_KEYS+1];
+    uint32_t maxkeys;       /* Capacity of the arrays below */
+    uint32_t inlinelen;     /* Size of the inline area of every key */
+    uint32_t keylen;        /* Size of every key */
+    uint32_t keytype;       /* BTREE_KEY_*, selects the search kernel */
+    char *keys;             /* maxkeys keys */
+    uint64_t *values;       /* maxkeys value pointers */
+    uint64_t *children;     /* maxkeys+1 child pointers */
+    unsigned char *inl;     /* maxkeys inline values of inlinelen bytes */
+};
+
+/* -------------------------------- CURSOR ---------------------------------- */
+
+#define BTREE_CURSOR_READAHEAD 4        /* Sibling subtrees to prefetch */
+#define BTREE_VALUE_SPECULATIVE_READ 512 /* Default btree_config value_read_size */
+
+/* A cursor keeps the path from the root to the current key. Every level
+ * of the path has the node and, for the current node, the index of the
+ * current key, while for the nodes above it the index of the child we
+ * descended into. */
+struct btree_cursor_level {
+    uint64_t offset;            /* Offset of the node */
+    struct btree_node *node;    /* Decoded node */
+    int index;                  /* Key index or child index, see above. */
+};
+
+struct btree_cursor {
+    struct btree *bt;
+    struct btree_snapshot *snap; /* Snapshot to read, NULL for the btree */
+    int ownsnap;                /* 'snap' was acquired by the cursor */
+    int depth;                  /* Levels in the path, 0 if not positioned */
+    struct btree_cursor_level path[BTREE_MAX_DEPTH];
+    int readahead;              /* Sibling subtrees to prefetch */
+    unsigned char *valbuf;      /* Buffer used to read values */
+    size_t valbuflen;
+};
+
+/* --------------------------------- CHECK ---------------------------------- */
+
+#define BTREE_CHECK_REPAIR 1    /* btree_check(): rebuild the freelists */
+
+/* Result of btree_check(). Sizes are in bytes. */
+struct btree_check_report {
+    uint64_t nodes;             /* Nodes found walking the tree */
+    uint64_t keys;
+    uint64_t used;              /* Header, nodes, values, freelist blocks */
+    uint64_t free;              /* In the freelists (after the repair) */
+    uint64_t leaked;            /* Neither used nor free */
+    uint64_t errors;            /* Corruptions found */
+    uint64_t erroff;            /* Offset of the first corruption */
+    char errmsg[128];           /* Description of the first corruption */
+};
+
+/* -------------------------------- SHARDS ---------------------------------- */
+
+/* A set of btrees in different files ("path.0", "path.1", ...) seen as a
+ * single btree: every key lives in one shard, so shards are written in
+ * parallel, each with its own writer thread, and its own write barriers.
+ * The number of shards and the routing can't change once the shards are
+ * created. */
+#define BTREE_SHARDS_MAX 256
+#define BTREE_SHARD_HASH 0      /* Route keys by a hash of the whole key */
+#define BTREE_SHARD_RANGE 1     /* Shard i holds the i-th range of keys, split
+                                   by their first two bytes. */
+
+/* Operations of btree_shards_write() */
+#define BTREE_SHARD_ADD 0       /* Add the key, if not already there */
+#define BTREE_SHARD_REPLACE 1   /* Add the key, replacing its old value */
+#define BTREE_SHARD_DELETE 2
+
+struct btree_shard_op {
+    int type;                   /* BTREE_SHARD_* operation */
+    unsigned char *key;
+    unsigned char *val;
+    size_t vlen;
+    int retval;                 /* Set by btree_shards_write(): 0 or -1 */
+    int error;                  /* errno of the operation if it failed */
+};
+
+struct btree_shard_batch;
+
+struct btree_shard {
+    struct btree *bt;
+    pthread_mutex_t lock;       /* Serializes the writers of the shard, and
+                                   the readers if not BTREE_CONCURRENT. */
+    pthread_t thread;           /* Writer thread, see btree_shards_write() */
+    pthread_mutex_t qlock;      /* Protects the queue and 'stop' */
+    pthread_cond_t qcond;
+    struct btree_shard_batch *head, *tail; /* Queue of batches to write */
+    int stop;
+};
+
+struct btree_shards {
+    uint32_t count;
+    int routing;                /* BTREE_SHARD_HASH or BTREE_SHARD_RANGE */
+    uint32_t keylen;
+    int concurrent;             /* The shards are BTREE_CONCURRENT */
+    uint32_t started;           /* Shards with a running writer thread */
+    struct btree_shard *shards;
+};
+
+/* Cursor merging the cursors of all the shards: the shards positioned on
+ * a key are a min heap ordered by their current key. */
+struct btree_shards_cursor {
+    struct btree_shards *s;
+    struct btree_cursor **cursors;
+    uint32_t *heap;
+    uint32_t heapsize;
 };
 
 /* ---------------------------- EXPORTED API  ------------------------------- */
 
 /* Btree */
 struct btree *btree_open(struct btree_vfs *vfs, char *path, int flags);
+struct btree *btree_open_with_config(struct btree_vfs *vfs, char *path, int flags, struct btree_config *cfg);
+void btree_config_init(struct btree_config *cfg);
+void btree_get_config(struct btree *bt, struct btree_config *cfg);
+void btree_get_stats(struct btree *bt, struct btree_stats *stats);
 void btree_close(struct btree *bt);
+int btree_checkpoint(struct btree *bt);
+int btree_begin(struct btree *bt);
+int btree_commit(struct btree *bt);
+int btree_flush(struct btree *bt);
+void btree_set_group_commit(struct btree *bt, uint32_t maxops, uint64_t maxusec);
 void btree_set_flags(struct btree *bt, int flags);
 void btree_clear_flags(struct btree *bt, int flags);
 int btree_add(struct btree *bt, unsigned char *key, unsigned char *val, size_t vlen, int replace);
 int btree_find(struct btree *bt, unsigned char *key, uint64_t *voff);
+int btree_get(struct btree *bt, unsigned char *key, unsigned char **val, uint32_t *vlen);
+int btree_find_many(struct btree *bt, unsigned char *keys, uint32_t n, uint64_t *voffs);
+int btree_delete(struct btree *bt, unsigned char *key);
+int64_t btree_range(struct btree *bt, const unsigned char *lo, const unsigned char *hi, int (*cb)(void *privdata, const unsigned char *key, uint64_t voff), void *privdata);
+int64_t btree_range_u128(struct btree *bt, btree_u128 lo, btree_u128 hi, int (*cb)(void *privdata, const unsigned char *key, uint64_t voff), void *privdata);
+int64_t btree_range_i128(struct btree *bt, btree_i128 lo, btree_i128 hi, int (*cb)(void *privdata, const unsigned char *key, uint64_t voff), void *privdata);
+void btree_key_from_u128(unsigned char *key, btree_u128 val);
+btree_u128 btree_key_to_u128(const unsigned char *key);
+void btree_key_from_i128(unsigned char *key, btree_i128 val);
+btree_i128 btree_key_to_i128(const unsigned char *key);
+void btree_set_min_keys(struct btree *bt, uint32_t minkeys);
+struct btree_cursor *btree_cursor_open(struct btree *bt);
+void btree_cursor_close(struct btree_cursor *c);
+int btree_cursor_seek(struct btree_cursor *c, unsigned char *key);
+int btree_cursor_seek_last(struct btree_cursor *c);
+int btree_cursor_next(struct btree_cursor *c);
+int btree_cursor_prev(struct btree_cursor *c);
+const unsigned char *btree_cursor_key(struct btree_cursor *c);
+uint64_t btree_cursor_voff(struct btree_cursor *c);
+int btree_cursor_value(struct btree_cursor *c, const unsigned char **val, uint32_t *vlen);
+struct btree_cursor *btree_cursor_open_snapshot(struct btree_snapshot *s);
+struct btree_snapshot *btree_snapshot_acquire(struct btree *bt);
+void btree_snapshot_release(struct btree_snapshot *s);
+int btree_snapshot_find(struct btree_snapshot *s, unsigned char *key, uint64_t *voff);
+int btree_snapshot_get(struct btree_snapshot *s, unsigned char *key, unsigned char **val, uint32_t *vlen);
+struct btree_compact *btree_compact_start(struct btree *bt, char *path);
+int btree_compact_step(struct btree_compact *c, uint32_t count);
+int btree_compact_finish(struct btree_compact *c);
+void btree_compact_abort(struct btree_compact *c);
+int btree_compact(struct btree *bt, char *path);
+int btree_rewrite(struct btree *bt, struct btree *dst, int fill);
+int btree_check(struct btree *bt, int threads, int flags, struct btree_check_report *report);
+int btree_bulk_load(struct btree *bt, int (*next)(void *privdata, unsigned char *key, const unsigned char **val, size_t *vlen), void *privdata, int fill);
+int btree_export(struct btree *bt, int (*sink)(void *privdata, const unsigned char *buf, size_t len), void *privdata);
+int btree_import(struct btree *bt, ssize_t (*source)(void *privdata, unsigned char *buf, size_t len), void *privdata, int fill);
 void btree_walk(struct btree *bt, uint64_t nodeptr);
 
+/* Shards */
+struct btree_shards *btree_shards_open(struct btree_vfs *vfs, char *path, uint32_t count, int routing, int flags, struct btree_config *cfg);
+void btree_shards_close(struct btree_shards *s);
+uint32_t btree_shards_route(struct btree_shards *s, const unsigned char *key);
+struct btree *btree_shards_btree(struct btree_shards *s, uint32_t shard);
+int btree_shards_add(struct btree_shards *s, unsigned char *key, unsigned char *val, size_t vlen, int replace);
+int btree_shards_delete(struct btree_shards *s, unsigned char *key);
+int btree_shards_get(struct btree_shards *s, unsigned char *key, unsigned char **val, uint32_t *vlen);
+int btree_shards_write(struct btree_shards *s, struct btree_shard_op *ops, uint32_t count);
+struct btree_shards_cursor *btree_shards_cursor_open(struct btree_shards *s);
+void btree_shards_cursor_close(struct btree_shards_cursor *c);
+int btree_shards_cursor_seek(struct btree_shards_cursor *c, unsigned char *key);
+int btree_shards_cursor_next(struct btree_shards_cursor *c);
+const unsigned char *btree_shards_cursor_key(struct btree_shards_cursor *c);
+int btree_shards_cursor_value(struct btree_shards_cursor *c, const unsigned char **val, uint32_t *vlen);
+
 /* On disk allocator */
 uint64_t btree_alloc(struct btree *bt, uint32_t size);
 int btree_free(struct btree *bt, uint64_t ptr);
 int btree_alloc_size(struct btree *bt, uint32_t *size, uint64_t ptr);
 ssize_t btree_pread(struct btree *bt, void *buf, uint32_t nbytes,
                     uint64_t offset);
+const void *btree_map(struct btree *bt, uint64_t offset, uint32_t nbytes);
@@ -0,0 +1,504 @@
+/*
+ * Copyright (c) 2011, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* btree-bench: run standard workloads against a btree, reporting the
+ * throughput, the latency percentiles, and the I/O performed per operation.
+ *
+ * The I/O is counted by a VFS wrapping the one selected with -V, so reads
+ * served by the node cache or by a mapping (see the mapptr VFS method) are
+ * not counted, as they don't perform any I/O. The node cache hit rate is
+ * taken from btree_get_stats(). */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+
+#include "btree.h"
+
+/* ------------------------------ I/O accounting ---------------------------- */
+
+struct bench_io {
+    uint64_t preads, pwrites, syncs;
+};
+
+static struct btree_vfs *inner;  /* The VFS doing the real work */
+static struct btree_vfs counting; /* 'inner' with counting methods */
+static struct bench_io io;
+
+ssize_t bench_pread(void *h, void *buf, uint32_t nbytes, uint64_t offset) {
+    io.preads++;
+    return inner->pread(h,buf,nbytes,offset);
+}
+
+ssize_t bench_pwrite(void *h, const void *buf, uint32_t nbytes,
+                     uint64_t offset)
+{
+    io.pwrites++;
+    return inner->pwrite(h,buf,nbytes,offset);
+}
+
+void bench_sync(void *h) {
+    io.syncs++;
+    inner->sync(h);
+}
+
+void bench_readv(void *h, struct btree_vfs_read *reads, int count) {
+    io.preads += count;
+    inner->readv(h,reads,count);
+}
+
+void bench_writev(void *h, struct btree_vfs_write *writes, int count) {
+    io.pwrites += count;
+    inner->writev(h,writes,count);
+}
+
+void bench_vfs_init(struct btree_vfs *vfs) {
+    inner = vfs;
+    counting = *vfs;
+    counting.pread = bench_pread;
+    counting.pwrite = bench_pwrite;
+    counting.sync = bench_sync;
+    if (vfs->readv) counting.readv = bench_readv;
+    if (vfs->writev) counting.writev = bench_writev;
+}
+
+/* ----------------------------- Latency histogram -------------------------- */
+
+/* Latencies in nanoseconds are counted in buckets with 16 sub buckets for
+ * every power of two, so percentiles have an error below 1/16. */
+#define BENCH_SUB_BITS 4
+#define BENCH_SUB (1<<BENCH_SUB_BITS)
+#define BENCH_BUCKETS ((64-BENCH_SUB_BITS+1)*BENCH_SUB)
+
+struct bench_hist {
+    uint64_t count[BENCH_BUCKETS];
+    uint64_t total;
+};
+
+int bench_bucket(uint64_t ns) {
+    int msb;
+
+    if (ns < BENCH_SUB) return (int)ns;
+    msb = 63-__builtin_clzll(ns);
+    return (msb-BENCH_SUB_BITS+1)*BENCH_SUB+
+           (int)((ns >> (msb-BENCH_SUB_BITS)) & (BENCH_SUB-1));
+}
+
+/* Return the highest latency counted in the bucket 'b'. */
+uint64_t bench_bucket_max(int b) {
+    int msb = b/BENCH_SUB+BENCH_SUB_BITS-1;
+    uint64_t sub = b%BENCH_SUB;
+
+    if (b < BENCH_SUB) return b;
+    return (((uint64_t)BENCH_SUB+sub+1) << (msb-BENCH_SUB_BITS))-1;
+}
+
+/* Return the latency at percentile 'p', from 0 to 1. */
+uint64_t bench_percentile(struct bench_hist *h, double p) {
+    uint64_t want = (uint64_t)ceil(p*h->total), seen = 0;
+    int b;
+
+    if (want == 0) want = 1;
+    for (b = 0; b < BENCH_BUCKETS; b++) {
+        seen += h->count[b];
+        if (seen >= want) return bench_bucket_max(b);
+    }
+    return 0;
+}
+
+uint64_t bench_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (uint64_t)ts.tv_sec*1000000000+ts.tv_nsec;
+}
+
+/* --------------------------------- Workloads ------------------------------ */
+
+struct bench {
+    char *path;
+    struct btree_config cfg;
+    int barrier;
+    uint32_t keys;          /* Keys of the btree */
+    uint32_t ops;           /* Operations of the read and mixed workloads */
+    uint32_t vlen;          /* Value size */
+    int readpct;            /* Reads of the mixed workload, in percentage */
+    int misspct;            /* Lookups of keys not in the btree, in
+                               percentage */
+    int get;                /* Lookups read the value with btree_get() */
+    double theta;           /* Zipfian skew */
+    uint64_t seed;
+    struct btree *bt;
+    int filled;             /* The btree has all the keys */
+    unsigned char *val;
+};
+
+uint64_t bench_rand(struct bench *b) {
+    /* xorshift64* */
+    b->seed ^= b->seed >> 12;
+    b->seed ^= b->seed << 25;
+    b->seed ^= b->seed >> 27;
+    return b->seed*2685821657736338717ULL;
+}
+
+void bench_key(unsigned char *key, uint64_t i) {
+    btree_key_from_u128(key,i);
+}
+
+/* Open a new empty btree, removing the old one. */
+void bench_create(struct bench *b) {
+    if (b->bt) btree_close(b->bt);
+    unlink(b->path);
+    if ((b->bt = btree_open_with_config(&counting,b->path,BTREE_CREAT,
+                                        &b->cfg)) == NULL)
+    {
+        perror("Opening the btree");
+        exit(1);
+    }
+    if (!b->barrier) btree_clear_flags(b->bt,BTREE_FLAG_USE_WRITE_BARRIER);
+    b->filled = 0;
+}
+
+void bench_add(struct bench *b, uint64_t i) {
+    unsigned char key[BTREE_HASHED_KEY_LEN];
+
+    bench_key(key,i);
+    if (btree_add(b->bt,key,b->val,b->vlen,1) == -1) {
+        perror("Adding a key");
+        exit(1);
+    }
+}
+
+/* Find the key 'i', or with probability misspct a key that does not
+ * exist. With -g on the value is read as well. */
+void bench_find(struct bench *b, uint64_t i) {
+    unsigned char key[BTREE_HASHED_KEY_LEN];
+    uint64_t voff;
+    unsigned char *val;
+    uint32_t vlen;
+    int miss = b->misspct && (int)(bench_rand(b) % 100) < b->misspct;
+    int retval;
+
+    bench_key(key,miss ? b->keys+i : i);
+    if (b->get) {
+        retval = btree_get(b->bt,key,&val,&vlen);
+        if (retval == 0) free(val);
+    } else {
+        retval = btree_find(b->bt,key,&voff);
+    }
+    if (retval == -1 && !(miss && errno == ENOENT)) {
+        perror("Finding a key");
+        exit(1);
+    }
+}
+
+/* Zipfian generator of Gray et al. "Quickly Generating Billion-Record
+ * Synthetic Databases", as used by YCSB. Ranks are scrambled so that the
+ * popular keys are spread in the whole key space. */
+struct bench_zipf {
+    uint64_t n;
+    double theta, alpha, zetan, eta;
+};
+
+void bench_zipf_init(struct bench_zipf *z, uint64_t n, double theta) {
+    double zeta2 = 1+pow(0.5,theta);
+    uint64_t i;
+
+    z->n = n;
+    z->theta = theta;
+    z->alpha = 1/(1-theta);
+    z->zetan = 0;
+    for (i = 1; i <= n; i++) z->zetan += 1/pow((double)i,theta);
+    z->eta = (1-pow(2.0/n,1-theta))/(1-zeta2/z->zetan);
+}
+
+uint64_t bench_zipf_next(struct bench *b, struct bench_zipf *z) {
+    double u = (double)(bench_rand(b) >> 11)/(double)(1ULL << 53);
+    double uz = u*z->zetan;
+    uint64_t rank;
+
+    if (uz < 1) rank = 0;
+    else if (uz < 1+pow(0.5,z->theta)) rank = 1;
+    else rank = (uint64_t)(z->n*pow(z->eta*u-z->eta+1,z->alpha));
+    if (rank >= z->n) rank = z->n-1;
+    return (rank*0x9e3779b97f4a7c15ULL) % z->n;
+}
+
+#define W_SEQ 0
+#define W_RAND 1
+#define W_FIND 2
+#define W_ZIPF 3
+#define W_MIXED 4
+#define W_ALLOC 5
+#define W_COUNT 6
+
+char *bench_names[W_COUNT] = {"seq", "rand", "find", "zipf", "mixed", "alloc"};
+
+/* Return the keys in random order. */
+uint64_t *bench_permutation(struct bench *b) {
+    uint64_t *perm = malloc(sizeof(uint64_t)*b->keys), j;
+
+    if (perm == NULL) {
+        perror("Allocating the keys");
+        exit(1);
+    }
+    for (j = 0; j < b->keys; j++) perm[j] = j;
+    for (j = b->keys; j > 1; j--) {
+        uint64_t k = bench_rand(b) % j, t = perm[j-1];
+
+        perm[j-1] = perm[k];
+        perm[k] = t;
+    }
+    return perm;
+}
+
+/* Fill the btree with all the keys in random order, if not already. */
+void bench_fill(struct bench *b) {
+    uint64_t *perm, j;
+
+    if (b->bt && b->filled) return;
+    bench_create(b);
+    perm = bench_permutation(b);
+    for (j = 0; j < b->keys; j++) bench_add(b,perm[j]);
+    free(perm);
+    b->filled = 1;
+}
+
+void bench_run(struct bench *b, int w) {
+    struct bench_hist h;
+    struct bench_io start;
+    struct btree_stats st0, st1;
+    struct bench_zipf zipf;
+    uint64_t *perm = NULL, *pool = NULL, t0, elapsed, ops, lookups, j;
+
+    /* Setup, that is not measured. */
+    if (w == W_SEQ || w == W_RAND) {
+        bench_create(b);
+        if (w == W_RAND) perm = bench_permutation(b);
+        ops = b->keys;
+    } else {
+        bench_fill(b);
+        ops = b->ops;
+    }
+    if (w == W_ZIPF) bench_zipf_init(&zipf,b->keys,b->theta);
+    if (w == W_ALLOC && (pool = calloc(1024,sizeof(uint64_t))) == NULL) {
+        perror("Allocating the pool");
+        exit(1);
+    }
+
+    memset(&h,0,sizeof(h));
+    start = io;
+    btree_get_stats(b->bt,&st0);
+    elapsed = bench_ns();
+    for (j = 0; j < ops; j++) {
+        uint64_t ns;
+
+        t0 = bench_ns();
+        switch(w) {
+        case W_SEQ: bench_add(b,j); break;
+        case W_RAND: bench_add(b,perm[j]); break;
+        case W_FIND: bench_find(b,bench_rand(b) % b->keys); break;
+        case W_ZIPF: bench_find(b,bench_zipf_next(b,&zipf)); break;
+        case W_MIXED:
+            if ((int)(bench_rand(b) % 100) < b->readpct)
+                bench_find(b,bench_rand(b) % b->keys);
+            else
+                bench_add(b,bench_rand(b) % b->keys);
+            break;
+        case W_ALLOC: {
+            /* Free a random allocation of the pool, if any, and replace
+             * it with a new one of random size up to twice the value
+             * size. */
+            uint64_t *slot = pool+bench_rand(b) % 1024;
+
+            if (*slot) btree_free(b->bt,*slot);
+            if ((*slot = btree_alloc(b->bt,1+bench_rand(b) % (b->vlen*2)))
+                == 0)
+            {
+                perror("Allocating");
+                exit(1);
+            }
+            break;
+        }
+        }
+        ns = bench_ns()-t0;
+        h.count[bench_bucket(ns)]++;
+        h.total++;
+    }
+    elapsed = bench_ns()-elapsed;
+    btree_get_stats(b->bt,&st1);
+    if (w == W_SEQ) b->filled = 1;
+    if (w == W_RAND) b->filled = 1;
+    if (pool) {
+        for (j = 0; j < 1024; j++) if (pool[j]) btree_free(b->bt,pool[j]);
+        free(pool);
+    }
+    free(perm);
+
+    lookups = (st1.cache_hits-st0.cache_hits)+
+              (st1.cache_misses-st0.cache_misses);
+    printf("%-6s %10llu ops %11.0f ops/sec  "
+           "p50 %7.1f p99 %7.1f p999 %8.1f usec  "
+           "%6.2f preads %6.2f pwrites %6.2f fsyncs per op  "
+           "cache hits %5.1f%%\n",
+        bench_names[w], (unsigned long long)ops,
+        ops/(elapsed/1e9),
+        bench_percentile(&h,0.5)/1e3,
+        bench_percentile(&h,0.99)/1e3,
+        bench_percentile(&h,0.999)/1e3,
+        (double)(io.preads-start.preads)/ops,
+        (double)(io.pwrites-start.pwrites)/ops,
+        (double)(io.syncs-start.syncs)/ops,
+        lookups ? 100.0*(st1.cache_hits-st0.cache_hits)/lookups : 0.0);
+    lookups = (st1.value_cache_hits-st0.value_cache_hits)+
+              (st1.value_cache_misses-st0.value_cache_misses);
+    if (lookups)
+        printf("%-6s value cache hits %5.1f%%\n", bench_names[w],
+            100.0*(st1.value_cache_hits-st0.value_cache_hits)/lookups);
+}
+
+void usage(void) {
+    fprintf(stderr,
+"Usage: btree-bench [options]\n"
+"  -w <list>     Comma separated workloads (default all):\n"
+"                seq    sequential insert of all the keys\n"
+"                rand   random insert of all the keys\n"
+"                find   btree_find() of uniformly distributed keys\n"
+"                zipf   btree_find() of Zipfian distributed keys\n"
+"                mixed  finds and replacements of uniform keys, see -r\n"
+"                alloc  btree_alloc()/btree_free() churn\n"
+"  -n <keys>     Keys of the btree (default 100000)\n"
+"  -o <ops>      Operations of find, zipf, mixed, alloc (default: keys)\n"
+"  -v <bytes>    Value size (default 32)\n"
+"  -r <pct>      Reads of the mixed workload (default 90)\n"
+"  -m <pct>      Lookups of keys that don't exist (default 0)\n"
+"  -g on|off     Lookups read the value with btree_get() (default off)\n"
+"  -z <theta>    Skew of the zipf workload (default 0.99)\n"
+"  -b on|off     Write barriers, that is fsync() calls (default on)\n"
+"  -c <nodes>    Node cache size (default %d)\n"
+"  -C <bytes>    Value cache size, 0 to disable (default 0)\n"
+"  -N <bytes>    Node size (default %d)\n"
+"  -i <bytes>    Inline values size (default 0)\n"
+"  -F 1|2        On disk format version (default 2)\n"
+"  -G on|off     Grow the file in background (default off)\n"
+"  -B <bits>     Bloom filter bits per key, 0 to disable (default 0)\n"
+"  -V <vfs>      unistd, mmap or uring (default unistd)\n"
+"  -f <path>     Btree file, removed at the end (default btree-bench.db)\n"
+"  -s <seed>     Random seed\n",
+        BTREE_CACHE_DEFAULT_NODES, BTREE_DEFAULT_NODE_SIZE);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    struct bench b;
+    struct btree_vfs *vfs = &bvfs_unistd;
+    int run[W_COUNT], j, w;
+
+    memset(&b,0,sizeof(b));
+    btree_config_init(&b.cfg);
+    b.path = "btree-bench.db";
+    b.barrier = 1;
+    b.keys = 100000;
+    b.vlen = 32;
+    b.readpct = 90;
+    b.theta = 0.99;
+    b.seed = 0x2545f4914f6cdd1dULL;
+    for (w = 0; w < W_COUNT; w++) run[w] = 1;
+
+    for (j = 1; j < argc; j++) {
+        char *opt = argv[j], *arg = j+1 < argc ? argv[j+1] : NULL;
+
+        if (opt[0] != '-' || opt[1] == '\0' || opt[2] != '\0' || !arg)
+            usage();
+        j++;
+        switch(opt[1]) {
+        case 'w': {
+            char *name = strtok(arg,",");
+
+            for (w = 0; w < W_COUNT; w++) run[w] = 0;
+            for (; name; name = strtok(NULL,",")) {
+                for (w = 0; w < W_COUNT; w++)
+                    if (!strcmp(name,bench_names[w])) break;
+                if (w == W_COUNT) usage();
+                run[w] = 1;
+            }
+            break;
+        }
+        case 'n': b.keys = atoi(arg); break;
+        case 'o': b.ops = atoi(arg); break;
+        case 'v': b.vlen = atoi(arg); break;
+        case 'r': b.readpct = atoi(arg); break;
+        case 'm': b.misspct = atoi(arg); break;
+        case 'z': b.theta = atof(arg); break;
+        case 'b': b.barrier = !strcmp(arg,"on"); break;
+        case 'g': b.get = !strcmp(arg,"on"); break;
+        case 'c': b.cfg.cache_nodes = atoi(arg); break;
+        case 'C': b.cfg.value_cache_size = strtoull(arg,NULL,10); break;
+        case 'N': b.cfg.node_size = atoi(arg); break;
+        case 'i': b.cfg.inline_values = atoi(arg); break;
+        case 'G': b.cfg.grow_background = !strcmp(arg,"on"); break;
+        case 'B': b.cfg.bloom_bits = atoi(arg); break;
+        case 'F':
+            if (!strcmp(arg,"1")) b.cfg.version = BTREE_VERSION_1;
+            else if (!strcmp(arg,"2")) b.cfg.version = BTREE_VERSION_2;
+            else usage();
+            break;
+        case 'f': b.path = arg; break;
+        case 's': b.seed = strtoull(arg,NULL,10)|1; break;
+        case 'V':
+            if (!strcmp(arg,"unistd")) vfs = &bvfs_unistd;
+            else if (!strcmp(arg,"mmap")) vfs = &bvfs_mmap;
+            else if (!strcmp(arg,"uring")) vfs = &bvfs_uring;
+            else usage();
+            break;
+        default: usage();
+        }
+    }
+    if (b.keys < 2 || b.vlen == 0 || b.theta <= 0 || b.theta >= 1) usage();
+    if (b.ops == 0) b.ops = b.keys;
+    if ((b.val = malloc(b.vlen)) == NULL) {
+        perror("Allocating the value");
+        exit(1);
+    }
+    memset(b.val,'x',b.vlen);
+    bench_vfs_init(vfs);
+
+    printf("%u keys, %u bytes values, node size %u, cache %u nodes, "
+           "barriers %s\n", b.keys, b.vlen, b.cfg.node_size,
+           b.cfg.cache_nodes, b.barrier ? "on" : "off");
+    for (w = 0; w < W_COUNT; w++) if (run[w]) bench_run(&b,w);
+    if (b.bt) btree_close(b.bt);
+    unlink(b.path);
+    free(b.val);
+    return 0;
+}
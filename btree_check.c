@@ -0,0 +1,94 @@
+/*
+ * Copyright (c) 2011, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* btree-check: verify a btree, and optionally rebuild its freelists, see
+ * btree_check(). The btree must not be in use by other processes. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "btree.h"
+
+void usage(void) {
+    fprintf(stderr,"Usage: btree-check [-j <threads>] [-r] <file>\n");
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    struct btree *bt;
+    struct btree_check_report r;
+    int j, threads = sysconf(_SC_NPROCESSORS_ONLN), flags = 0, retval;
+
+    for (j = 1; j < argc-1; j++) {
+        if (!strcmp(argv[j],"-j") && j+1 < argc-1) {
+            threads = atoi(argv[++j]);
+        } else if (!strcmp(argv[j],"-r")) {
+            flags |= BTREE_CHECK_REPAIR;
+        } else {
+            usage();
+        }
+    }
+    if (j != argc-1) usage();
+
+    if ((bt = btree_open(NULL,argv[j],0)) == NULL) {
+        perror("Opening the btree");
+        exit(1);
+    }
+    /* When repairing we sync only once at the end. A crash in the middle
+     * only leaks space, that the next repair recovers. */
+    btree_clear_flags(bt,BTREE_FLAG_USE_WRITE_BARRIER);
+    retval = btree_check(bt,threads,flags,&r);
+    if (retval == -1 && errno != EFAULT) {
+        perror("Checking the btree");
+        btree_close(bt);
+        exit(1);
+    }
+    bt->vfs->sync(bt->vfs_handle);
+    btree_close(bt);
+
+    printf("%llu nodes, %llu keys\n",
+        (unsigned long long) r.nodes, (unsigned long long) r.keys);
+    printf("%llu bytes used, %llu bytes free, %llu bytes leaked\n",
+        (unsigned long long) r.used, (unsigned long long) r.free,
+        (unsigned long long) r.leaked);
+    if (r.errors) {
+        printf("%llu errors, first at offset %llu: %s\n",
+            (unsigned long long) r.errors, (unsigned long long) r.erroff,
+            r.errmsg);
+        if (flags & BTREE_CHECK_REPAIR)
+            printf("The freelists were not rebuilt.\n");
+        return 1;
+    }
+    printf("No errors found.%s\n",
+        (flags & BTREE_CHECK_REPAIR) ? " Freelists rebuilt." : "");
+    return 0;
+}
@@ -0,0 +1,95 @@
+/*
+ * Copyright (c) 2011, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* btree-compact: copy a btree into a new file with the minimum size, and a
+ * layout optimized for reads, see btree_rewrite(). The source btree must not
+ * be in use by other processes while it is copied. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "btree.h"
+
+void usage(void) {
+    fprintf(stderr,"Usage: btree-compact [-f <fill>] <source> <target>\n");
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    struct btree *src, *dst;
+    struct btree_config cfg;
+    struct stat before, after;
+    char *srcpath, *dstpath;
+    int fill = 100;
+
+    if (argc == 5 && !strcmp(argv[1],"-f")) {
+        fill = atoi(argv[2]);
+        argv += 2;
+    } else if (argc != 3) {
+        usage();
+    }
+    srcpath = argv[1];
+    dstpath = argv[2];
+    if (access(dstpath,F_OK) == 0) {
+        fprintf(stderr,"%s already exists\n", dstpath);
+        exit(1);
+    }
+
+    if ((src = btree_open(NULL,srcpath,0)) == NULL) {
+        perror("Opening the source btree");
+        exit(1);
+    }
+    btree_get_config(src,&cfg);
+    if ((dst = btree_open_with_config(NULL,dstpath,BTREE_CREAT,&cfg)) == NULL) {
+        perror("Creating the target btree");
+        exit(1);
+    }
+    /* We sync only once at the end: if we crash the copy is useless anyway. */
+    btree_clear_flags(dst,BTREE_FLAG_USE_WRITE_BARRIER);
+    if (btree_rewrite(src,dst,fill) == -1) {
+        perror("Copying the btree");
+        btree_close(dst);
+        unlink(dstpath);
+        exit(1);
+    }
+    dst->vfs->sync(dst->vfs_handle);
+    btree_close(dst);
+    btree_close(src);
+
+    if (stat(srcpath,&before) == 0 && stat(dstpath,&after) == 0) {
+        printf("%s: %lld bytes, %s: %lld bytes\n",
+            srcpath, (long long) before.st_size,
+            dstpath, (long long) after.st_size);
+    }
+    return 0;
+}
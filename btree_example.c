@@ -41,6 +41,31 @@
 #define OP_WALK 4
 #define OP_FILL 5
 #define OP_FIND 6
+#define OP_LOAD 7
+#define OP_SCAN 8
+#define OP_DEL 9
+#define OP_EMPTY 10
+
+/* Bulk load callback: generates 'count' sorted keys. */
+struct load_state {
+    int next, count;
+    char val[64];
+};
+
+int load_next(void *privdata, unsigned char *key, const unsigned char **val,
+              size_t *vlen)
+{
+    struct load_state *ls = privdata;
+
+    if (ls->next == ls->count) return 0;
+    memset(key,0,16);
+    snprintf((char*)key,16,"k%014d",ls->next);
+    snprintf(ls->val,64,"val:%d",ls->next);
+    *val = (unsigned char*)ls->val;
+    *vlen = strlen(ls->val);
+    ls->next++;
+    return 1;
+}
 
 int main(int argc, char **argv) {
     struct btree *bt;
@@ -67,6 +92,14 @@ int main(int argc, char **argv) {
         op = OP_FILL;
     } else if (!strcasecmp(argv[1],"find")) {
         op = OP_FIND;
+    } else if (!strcasecmp(argv[1],"load")) {
+        op = OP_LOAD;
+    } else if (!strcasecmp(argv[1],"scan")) {
+        op = OP_SCAN;
+    } else if (!strcasecmp(argv[1],"del")) {
+        op = OP_DEL;
+    } else if (!strcasecmp(argv[1],"empty")) {
+        op = OP_EMPTY;
     } else {
         printf("not supported op %s\n", argv[1]);
         exit(1);
@@ -123,15 +156,58 @@ int main(int argc, char **argv) {
                 goto err;
             }
         }
+    } else if (op == OP_EMPTY) {
+        /* Add 'count' keys where every other value is empty, then read
+         * them back checking the values. */
+        for (j = 0; j < count*2; j++) {
+            int i = j % count;
+            char key[16];
+            const char *val = (i & 1) ? "val" : "";
+            unsigned char *data;
+            uint32_t datalen;
+
+            memset(key,0,16);
+            snprintf(key,16,"e%d",i);
+            if (j < count) {
+                if (btree_add(bt,(unsigned char*)key,(unsigned char*)val,
+                              strlen(val),1) == -1)
+                {
+                    printf("Error adding %s: %s\n", key, strerror(errno));
+                    goto err;
+                }
+                continue;
+            }
+            if (btree_get(bt,(unsigned char*)key,&data,&datalen) == -1) {
+                printf("Error reading %s: %s\n", key, strerror(errno));
+                goto err;
+            }
+            if (datalen != strlen(val) || memcmp(data,val,datalen)) {
+                printf("Wrong value for %s\n", key);
+                free(data);
+                goto err;
+            }
+            free(data);
+        }
+        printf("%d keys OK\n", count);
+    } else if (op == OP_LOAD) {
+        struct load_state ls;
+
+        /* Here arg is the fill factor, in percentage. */
+        ls.next = 0;
+        ls.count = count;
+        if (btree_bulk_load(bt,load_next,&ls,arg) == -1) {
+            printf("Error: %s\n", strerror(errno));
+            goto err;
+        }
     } else if (op == OP_FIND) {
         int retval;
-        char key[16], *data;
+        char key[16];
+        unsigned char *data;
+        uint32_t datalen;
         memset(key,0,16);
         strcpy(key,argv[2]);
-        uint64_t voff;
-        uint32_t datalen;
 
-        retval = btree_find(bt,(unsigned char*)key,&voff);
+        retval = btree_get(bt,(unsigned char*)key,&data,&datalen);
         if (retval == -1) {
             if (errno == ENOENT) {
                 printf("Key not found\n");
@@ -141,14 +217,46 @@ int main(int argc, char **argv) {
                 exit(1);
             }
         }
-        printf("Key found at %llu\n", voff);
-
-        btree_alloc_size(bt,&datalen,voff);
-        data = malloc(datalen+1);
-        btree_pread(bt,(unsigned char*)data,datalen,voff);
-        data[datalen] = '\0';
-        printf("Value: %s\n", data);
+        printf("Value: %.*s\n", (int)datalen, data);
         free(data);
+    } else if (op == OP_DEL) {
+        char key[16];
+
+        memset(key,0,16);
+        strcpy(key,argv[2]);
+        if (btree_delete(bt,(unsigned char*)key) == -1) {
+            if (errno == ENOENT) {
+                printf("Key not found\n");
+            } else {
+                perror("Error deleting the key");
+                goto err;
+            }
+        }
+    } else if (op == OP_SCAN) {
+        /* Print up to 'count' keys starting from the first key greater
+         * or equal to the specified one. */
+        struct btree_cursor *c;
+        char key[16];
+        int retval;
+
+        memset(key,0,16);
+        strcpy(key,argv[2]);
+        if ((c = btree_cursor_open(bt)) == NULL) {
+            perror("Allocating the cursor");
+            goto err;
+        }
+        retval = btree_cursor_seek(c,(unsigned char*)key);
+        for (j = 0; retval == 0 && j < count; j++) {
+            const unsigned char *val;
+            uint32_t vlen;
+
+            if (btree_cursor_value(c,&val,&vlen) == -1) break;
+            printf("%.16s -> %.*s\n", (char*)btree_cursor_key(c),
+                (int)vlen, (char*)val);
+            retval = btree_cursor_next(c);
+        }
+        if (retval == -1 && errno != ENOENT) perror("Scanning");
+        btree_cursor_close(c);
     }
     btree_close(bt);
     return 0;